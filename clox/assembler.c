@@ -0,0 +1,169 @@
+// MAP_ANONYMOUS is not POSIX, strict -std modes hide it.
+#define _DEFAULT_SOURCE
+
+#include <stdarg.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+
+#include "assembler.h"
+
+#ifdef JIT
+
+void emitByte(Assembler* as, uint8_t byte) {
+    if (as->count == as->capacity) {
+        as->capacity = as->capacity < 256 ? 256 : as->capacity * 2;
+        as->code = realloc(as->code, as->capacity);
+        if (as->code == NULL)
+            exit(1);
+    }
+    as->code[as->count++] = byte;
+}
+
+void emitBytes(Assembler* as, int count, ...) {
+    va_list args;
+    va_start(args, count);
+    for (int i = 0; i < count; i++)
+        emitByte(as, (uint8_t)va_arg(args, int));
+    va_end(args);
+}
+
+void emitImm32(Assembler* as, int32_t value) {
+    for (int i = 0; i < 4; i++)
+        emitByte(as, (uint8_t)(value >> (8 * i)));
+}
+
+static void emitImm64(Assembler* as, uint64_t value) {
+    for (int i = 0; i < 8; i++)
+        emitByte(as, (uint8_t)(value >> (8 * i)));
+}
+
+// REX.W prefix, extending the ModRM reg and rm fields.
+static void rex(Assembler* as, int reg, int rm) {
+    emitByte(as, 0x48 | ((reg & 8) ? 4 : 0) | ((rm & 8) ? 1 : 0));
+}
+
+// ModRM for [base + disp32]. rsp and r12 as base need a SIB byte.
+static void memOperand(Assembler* as, int reg, Register base, int32_t disp) {
+    emitByte(as, 0x80 | ((reg & 7) << 3) | (base & 7));
+    if ((base & 7) == RSP)
+        emitByte(as, 0x24);
+    emitImm32(as, disp);
+}
+
+void movImm(Assembler* as, Register dst, uint64_t value) {
+    emitByte(as, 0x48 | ((dst & 8) ? 1 : 0));
+    emitByte(as, 0xb8 + (dst & 7));
+    emitImm64(as, value);
+}
+
+void load(Assembler* as, Register dst, Register base, int32_t disp) {
+    rex(as, dst, base);
+    emitByte(as, 0x8b);
+    memOperand(as, dst, base, disp);
+}
+
+void store(Assembler* as, Register base, int32_t disp, Register src) {
+    rex(as, src, base);
+    emitByte(as, 0x89);
+    memOperand(as, src, base, disp);
+}
+
+void alu(Assembler* as, uint8_t opcode, Register dst, Register src) {
+    rex(as, src, dst);
+    emitByte(as, opcode);
+    emitByte(as, 0xc0 | ((src & 7) << 3) | (dst & 7));
+}
+
+void addImm(Assembler* as, Register dst, int32_t value) {
+    rex(as, 0, dst);
+    emitByte(as, 0x81);
+    emitByte(as, (value < 0 ? 0xe8 : 0xc0) | (dst & 7));
+    emitImm32(as, value < 0 ? -value : value);
+}
+
+void movqToXmm(Assembler* as, int xmm, Register src) {
+    emitByte(as, 0x66);
+    rex(as, xmm, src);
+    emitBytes(as, 3, 0x0f, 0x6e, 0xc0 | ((xmm & 7) << 3) | (src & 7));
+}
+
+void movqFromXmm(Assembler* as, Register dst, int xmm) {
+    emitByte(as, 0x66);
+    rex(as, xmm, dst);
+    emitBytes(as, 3, 0x0f, 0x7e, 0xc0 | ((xmm & 7) << 3) | (dst & 7));
+}
+
+void sse(Assembler* as, uint8_t prefix, uint8_t opcode, int dst, int src) {
+    emitByte(as, prefix);
+    if ((dst | src) & 8)
+        emitByte(as, 0x40 | ((dst & 8) ? 4 : 0) | ((src & 8) ? 1 : 0));
+    emitBytes(as, 3, 0x0f, opcode, 0xc0 | ((dst & 7) << 3) | (src & 7));
+}
+
+void setcc(Assembler* as, int cc) {
+    emitBytes(as, 3, 0x0f, 0x90 + cc, 0xc0); // setcc al
+    emitBytes(as, 3, 0x0f, 0xb6, 0xc0);      // movzx eax, al
+}
+
+void emitCall(Assembler* as, void* function) {
+    movImm(as, RAX, (uint64_t)(uintptr_t)function);
+    emitBytes(as, 2, 0xff, 0xd0); // call rax
+}
+
+int emitJump(Assembler* as, int cc) {
+    if (cc < 0) {
+        emitByte(as, 0xe9);
+    } else {
+        emitBytes(as, 2, 0x0f, 0x80 + cc);
+    }
+    emitImm32(as, 0);
+    return as->count - 4;
+}
+
+void patchJump(Assembler* as, int at, int target) {
+    int32_t offset = target - (at + 4);
+    memcpy(as->code + at, &offset, sizeof(offset));
+}
+
+static const Register savedRegisters[] = {RBX, R12, R13, R14, R15};
+#define SAVED_COUNT (int)(sizeof(savedRegisters) / sizeof(Register))
+
+void emitSaveRegisters(Assembler* as) {
+    for (int i = 0; i < SAVED_COUNT; i++) {
+        if (savedRegisters[i] & 8)
+            emitByte(as, 0x41);
+        emitByte(as, 0x50 + (savedRegisters[i] & 7)); // push
+    }
+}
+
+void emitRestoreRegisters(Assembler* as) {
+    for (int i = SAVED_COUNT - 1; i >= 0; i--) {
+        if (savedRegisters[i] & 8)
+            emitByte(as, 0x41);
+        emitByte(as, 0x58 + (savedRegisters[i] & 7)); // pop
+    }
+    emitByte(as, 0xc3); // ret
+}
+
+void* finishCode(Assembler* as, size_t* size) {
+    void* code = mmap(NULL, as->count, PROT_READ | PROT_WRITE,
+                      MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (code != MAP_FAILED) {
+        memcpy(code, as->code, as->count);
+        if (mprotect(code, as->count, PROT_READ | PROT_EXEC) != 0) {
+            munmap(code, as->count);
+            code = MAP_FAILED;
+        }
+    }
+
+    *size = as->count;
+    free(as->code);
+    as->code = NULL;
+    as->count = as->capacity = 0;
+    return code == MAP_FAILED ? NULL : code;
+}
+
+void freeCode(void* code, size_t size) { munmap(code, size); }
+
+#endif
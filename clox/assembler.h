@@ -0,0 +1,109 @@
+#ifndef clox_assembler_h
+#define clox_assembler_h
+
+#include "common.h"
+
+#ifdef JIT
+
+/**
+ * @enum Register
+ * @brief x86-64 general purpose registers, in encoding order.
+ */
+typedef enum {
+    RAX, RCX, RDX, RBX, RSP, RBP, RSI, RDI,
+    R8, R9, R10, R11, R12, R13, R14, R15,
+} Register;
+
+// Condition codes, added to the base opcode of jcc and setcc.
+#define CC_E 0x4
+#define CC_NE 0x5
+#define CC_BE 0x6
+#define CC_A 0x7
+
+// Opcodes of the register to register ALU instructions, see alu().
+#define ALU_ADD 0x01
+#define ALU_AND 0x21
+#define ALU_SUB 0x29
+#define ALU_CMP 0x39
+#define ALU_MOV 0x89
+
+// Scalar double instructions, see sse().
+#define SSE_MOVSD 0xf2, 0x10
+#define SSE_ADDSD 0xf2, 0x58
+#define SSE_SUBSD 0xf2, 0x5c
+#define SSE_MULSD 0xf2, 0x59
+#define SSE_DIVSD 0xf2, 0x5e
+#define SSE_UCOMISD 0x66, 0x2e
+
+/**
+ * @struct Assembler
+ * @brief Growable buffer of machine code being emitted.
+ */
+typedef struct {
+    uint8_t* code; /**< Bytes emitted so far */
+    int count;     /**< Number of bytes emitted */
+    int capacity;  /**< Allocated size of code */
+} Assembler;
+
+void emitByte(Assembler* as, uint8_t byte);
+void emitBytes(Assembler* as, int count, ...);
+void emitImm32(Assembler* as, int32_t value);
+
+/** @brief mov dst, imm64 */
+void movImm(Assembler* as, Register dst, uint64_t value);
+/** @brief mov dst, [base + disp] */
+void load(Assembler* as, Register dst, Register base, int32_t disp);
+/** @brief mov [base + disp], src */
+void store(Assembler* as, Register base, int32_t disp, Register src);
+/** @brief <opcode> dst, src on 64-bit registers, opcode is one of ALU_*. */
+void alu(Assembler* as, uint8_t opcode, Register dst, Register src);
+/** @brief add dst, value, or sub when value is negative. */
+void addImm(Assembler* as, Register dst, int32_t value);
+/** @brief movq xmm, src */
+void movqToXmm(Assembler* as, int xmm, Register src);
+/** @brief movq dst, xmm */
+void movqFromXmm(Assembler* as, Register dst, int xmm);
+/** @brief Scalar double instruction on two xmm registers, one of SSE_*. */
+void sse(Assembler* as, uint8_t prefix, uint8_t opcode, int dst, int src);
+/** @brief al = condition code cc, zero extended to rax. */
+void setcc(Assembler* as, int cc);
+/** @brief Calls a C function through rax. */
+void emitCall(Assembler* as, void* function);
+
+/**
+ * @brief Emits a jcc, or a jmp when cc is -1, with a zero displacement.
+ * @return Offset of the rel32 to give to patchJump().
+ */
+int emitJump(Assembler* as, int cc);
+
+/**
+ * @brief Points a jump emitted by emitJump() at target.
+ * @param at Offset returned by emitJump().
+ * @param target Offset in the code to jump to.
+ */
+void patchJump(Assembler* as, int at, int target);
+
+/**
+ * @brief Pushes the callee-saved registers compiled code pins. Five pushes
+ * after the return address leave rsp 16-byte aligned for calls.
+ */
+void emitSaveRegisters(Assembler* as);
+
+/** @brief Pops what emitSaveRegisters() pushed and returns. */
+void emitRestoreRegisters(Assembler* as);
+
+/**
+ * @brief Copies the code to a fresh executable mapping and frees the buffer.
+ * @param size Set to the size of the mapping.
+ * @return The executable code, or NULL if it couldn't be mapped.
+ */
+void* finishCode(Assembler* as, size_t* size);
+
+/**
+ * @brief Unmaps code returned by finishCode().
+ */
+void freeCode(void* code, size_t size);
+
+#endif
+
+#endif
@@ -0,0 +1,37 @@
+#include "cache.h"
+#include "memory.h"
+
+void cacheAdd(InlineCache* cache, CacheEntry entry) {
+    if (cache->megamorphic)
+        return;
+    if (cache->count == CACHE_ENTRIES) {
+        // Probing would only slow down the slow path from now on. The entries
+        // stay valid for instructions quickened while they were in use.
+        cache->megamorphic = true;
+        cache->count = 0;
+        return;
+    }
+    cache->entries[cache->count++] = entry;
+}
+
+void markCaches(VM* vm, Chunk* chunk) {
+    for (int i = 0; i < chunk->cacheCount; i++) {
+        InlineCache* cache = &chunk->caches[i];
+        int count = cache->megamorphic ? CACHE_ENTRIES : cache->count;
+        for (int j = 0; j < count; j++) {
+            markObject(vm, (Obj*)cache->entries[j].klass);
+            markObject(vm, (Obj*)cache->entries[j].method);
+        }
+    }
+}
+
+int cacheIndex(Chunk* chunk, int offset) {
+    switch (genericOp(chunk->code[offset])) {
+        case OP_GET_PROPERTY:
+        case OP_SET_PROPERTY:
+        case OP_INVOKE:
+        case OP_SUPER_INVOKE:
+            return (chunk->code[offset + 2] << 8) | chunk->code[offset + 3];
+        default: return -1;
+    }
+}
@@ -0,0 +1,77 @@
+#ifndef clox_cache_h
+#define clox_cache_h
+
+#include "chunk.h"
+#include "common.h"
+#include "object.h"
+#include "shape.h"
+
+// Receivers a call site remembers before it gives up and goes megamorphic.
+#define CACHE_ENTRIES 4
+
+/**
+ * @struct CacheEntry
+ * @brief What a property access resolved to for one kind of receiver.
+ *
+ * Entries are keyed on the receiver's shape and class. OP_SUPER_INVOKE has
+ * no receiver to look at and keys on the superclass alone, with a NULL shape.
+ */
+typedef struct {
+    Shape* shape;       /**< Shape of the receiver */
+    ObjClass* klass;    /**< Class of the receiver, or the superclass */
+    ObjClosure* method; /**< Method found in klass, NULL for a field */
+    Shape* transition;  /**< Shape after a store adding the field, or NULL */
+    int slot;           /**< Slot of the field in shape, or transition */
+} CacheEntry;
+
+/**
+ * @struct InlineCache
+ * @brief Cache of one OP_GET_PROPERTY, OP_SET_PROPERTY, OP_INVOKE or
+ * OP_SUPER_INVOKE instruction.
+ *
+ * The instruction finds its cache in chunk->caches through a 16-bit operand.
+ */
+struct InlineCache {
+    CacheEntry entries[CACHE_ENTRIES]; /**< Receivers seen so far */
+    int count;                         /**< Number of entries */
+    bool megamorphic;  /**< Saw too many receivers, no longer used */
+    uint64_t hits;     /**< Executions answered by an entry */
+    uint64_t misses;   /**< Executions that took the slow path */
+};
+
+/**
+ * @brief Finds the entry for a receiver, counting the hit or miss.
+ * @return The entry, or NULL if the receiver was not seen before.
+ */
+static inline CacheEntry* cacheLookup(InlineCache* cache, Shape* shape,
+                                      ObjClass* klass) {
+    for (int i = 0; i < cache->count; i++) {
+        CacheEntry* entry = &cache->entries[i];
+        if (entry->shape == shape && entry->klass == klass) {
+            cache->hits++;
+            return entry;
+        }
+    }
+    cache->misses++;
+    return NULL;
+}
+
+/**
+ * @brief Remembers what the slow path found for a receiver.
+ *
+ * A cache that is already full goes megamorphic and stops looking at its
+ * entries.
+ */
+void cacheAdd(InlineCache* cache, CacheEntry entry);
+
+/**
+ * @brief Marks the classes and methods held by the caches of a chunk.
+ */
+void markCaches(VM* vm, Chunk* chunk);
+
+/**
+ * @brief Index of the cache used by the instruction at offset, or -1.
+ */
+int cacheIndex(Chunk* chunk, int offset);
+
+#endif
@@ -1,6 +1,8 @@
 #include <stdlib.h>
 #include <stdio.h>
+#include <string.h>
 
+#include "cache.h"
 #include "chunk.h"
 #include "object.h"
 #include "vm.h"
@@ -14,6 +16,9 @@ initChunk(Chunk* chunk)
     chunk->lines = NULL;
     chunk->maxLines = 0;
     chunk->currentLine = 0;
+    chunk->caches = NULL;
+    chunk->cacheCount = 0;
+    chunk->cacheCapacity = 0;
     initValueArray(&chunk->constants);
 }
 
@@ -41,12 +46,13 @@ getLine(Chunk* chunk, int index)
  * @param chunk Pointer to the Chunk to ensure capacity for.
  * @param capacity The required capacity.
  */
-void ensureCapacity(Chunk* chunk, int capacity)
+void ensureCapacity(VM* vm, Chunk* chunk, int capacity)
 {
     if (chunk->capacity < capacity) {
         int oldCapacity = chunk->capacity;
         chunk->capacity = GROW_CAPACITY(oldCapacity);
-        chunk->code = GROW_ARRAY(uint8_t, chunk->code, oldCapacity, chunk->capacity);
+        chunk->code = GROW_ARRAY(vm, uint8_t, chunk->code, oldCapacity,
+                                 chunk->capacity);
     }
 }
 
@@ -60,18 +66,20 @@ void ensureCapacity(Chunk* chunk, int capacity)
  * @param chunk Pointer to the Chunk to ensure line capacity for.
  * @param line The line number to be added.
  */
-void ensureLinesCapacity(Chunk* chunk, int line)
+void ensureLinesCapacity(VM* vm, Chunk* chunk, int line)
 {
     if (chunk->maxLines == 0 || line != chunk->lines[chunk->currentLine]) {
         if (chunk->maxLines == 0) {
             chunk->maxLines = GROW_CAPACITY(0);
-            chunk->lines = GROW_ARRAY(int, chunk->lines, 0, chunk->maxLines);
+            chunk->lines =
+                GROW_ARRAY(vm, int, chunk->lines, 0, chunk->maxLines);
         } else {
             chunk->currentLine += 2;
             if (chunk->currentLine >= chunk->maxLines) {
                 int oldCapacity = chunk->maxLines;
                 chunk->maxLines = GROW_CAPACITY(oldCapacity);
-                chunk->lines = GROW_ARRAY(int, chunk->lines, oldCapacity, chunk->maxLines);
+                chunk->lines = GROW_ARRAY(vm, int, chunk->lines, oldCapacity,
+                                          chunk->maxLines);
             }
         }
         chunk->lines[chunk->currentLine] = line;
@@ -93,10 +101,10 @@ void incrementLineCount(Chunk* chunk)
 }
 
 void
-writeChunk(Chunk* chunk, uint8_t byte, int line)
+writeChunk(VM* vm, Chunk* chunk, uint8_t byte, int line)
 {
-    ensureCapacity(chunk, chunk->count + 1);
-    ensureLinesCapacity(chunk, line);
+    ensureCapacity(vm, chunk, chunk->count + 1);
+    ensureLinesCapacity(vm, chunk, line);
 
     chunk->code[chunk->count] = byte;
     chunk->count++;
@@ -104,28 +112,88 @@ writeChunk(Chunk* chunk, uint8_t byte, int line)
 }
 
 int
-addConstant(Chunk* chunk, Value value)
+addConstant(VM* vm, Chunk* chunk, Value value)
 {
-    push(value);
-    writeValueArray(&chunk->constants, value);
-    pop();
+    push(vm, value);
+    writeValueArray(vm, &chunk->constants, value);
+    pop(vm);
     return chunk->constants.count - 1;
 }
 
-void writeConstant(Chunk* chunk, Value value, int line) {
-    int constant = addConstant(chunk, value);
+void writeConstant(VM* vm, Chunk* chunk, Value value, int line) {
+    int constant = addConstant(vm, chunk, value);
     OpCode op = OP_CONSTANT;
     if (chunk->constants.count >= 256) op = OP_CONSTANT_LONG;
-    writeChunk(chunk, op, line);
-    writeChunk(chunk, constant, line);
+    writeChunk(vm, chunk, op, line);
+    writeChunk(vm, chunk, constant, line);
+}
+
+int addCache(VM* vm, Chunk* chunk) {
+    if (chunk->cacheCapacity < chunk->cacheCount + 1) {
+        int oldCapacity = chunk->cacheCapacity;
+        chunk->cacheCapacity = GROW_CAPACITY(oldCapacity);
+        chunk->caches = GROW_ARRAY(vm, InlineCache, chunk->caches, oldCapacity,
+                                   chunk->cacheCapacity);
+    }
+    memset(&chunk->caches[chunk->cacheCount], 0, sizeof(InlineCache));
+    return chunk->cacheCount++;
+}
+
+int instructionLength(Chunk* chunk, int offset) {
+    switch (chunk->code[offset]) {
+        case OP_CONSTANT:
+        case OP_CONSTANT_LONG:
+        case OP_GET_LOCAL:
+        case OP_SET_LOCAL:
+        case OP_GET_UPVALUE:
+        case OP_SET_UPVALUE:
+        case OP_CALL:
+        case OP_TAIL_CALL:
+        case OP_CLASS:
+        case OP_METHOD:
+        case OP_GET_SUPER: return 2;
+        case OP_DEFINE_GLOBAL:
+        case OP_GET_GLOBAL:
+        case OP_SET_GLOBAL:
+        case OP_JUMP:
+        case OP_JUMP_IF_FALSE:
+        case OP_LOOP:
+        case OP_ADD_LOCALS:
+        case OP_LESS_JUMP_IF_FALSE:
+        case OP_INCREMENT_LOCAL:
+        case OP_R_MOVE: return 3;
+        case OP_GET_PROPERTY:
+        case OP_SET_PROPERTY:
+        case OP_GET_PROPERTY_SLOT:
+        case OP_SET_PROPERTY_SLOT:
+        case OP_R_ADD:
+        case OP_R_SUBTRACT:
+        case OP_R_MULTIPLY:
+        case OP_R_DIVIDE:
+        case OP_R_EQUAL:
+        case OP_R_GREATER:
+        case OP_R_LESS: return 4;
+        case OP_INVOKE:
+        case OP_SUPER_INVOKE:
+        case OP_INVOKE_METHOD:
+        case OP_R_LESS_JUMP_IF_FALSE:
+        case OP_R_GREATER_JUMP_IF_FALSE: return 5;
+        case OP_CLOSURE: {
+            ObjFunction* function =
+                AS_FUNCTION(chunk->constants.values[chunk->code[offset + 1]]);
+            return 2 + 2 * function->upvalueCount;
+        }
+        default: return 1;
+    }
 }
 
 void
-freeChunk(Chunk* chunk)
+freeChunk(VM* vm, Chunk* chunk)
 {
-    FREE_ARRAY(uint8_t, chunk->code, chunk->capacity);
-    FREE_ARRAY(uint8_t, chunk->lines, chunk->capacity);
-    freeValueArray(&chunk->constants);
+    FREE_ARRAY(vm, uint8_t, chunk->code, chunk->capacity);
+    FREE_ARRAY(vm, uint8_t, chunk->lines, chunk->capacity);
+    FREE_ARRAY(vm, InlineCache, chunk->caches, chunk->cacheCapacity);
+    freeValueArray(vm, &chunk->constants);
     initChunk(chunk);
 }
 
@@ -154,10 +222,50 @@ char* opCodeToString(OpCode code) {
         case OP_SET_GLOBAL: return "OP_SET_GLOBAL";
         case OP_GET_LOCAL: return "OP_GET_LOCAL";
         case OP_SET_LOCAL: return "OP_SET_LOCAL";
+        case OP_GET_UPVALUE: return "OP_GET_UPVALUE";
+        case OP_SET_UPVALUE: return "OP_SET_UPVALUE";
         case OP_JUMP: return "OP_JUMP";
         case OP_JUMP_IF_FALSE: return "OP_JUMP_IF_FALSE";
         case OP_LOOP: return "OP_LOOP";
         case OP_CALL: return "OP_CALL";
+        case OP_TAIL_CALL: return "OP_TAIL_CALL";
+        case OP_CLOSURE: return "OP_CLOSURE";
+        case OP_CLOSE_UPVALUE: return "OP_CLOSE_UPVALUE";
+        case OP_CLASS: return "OP_CLASS";
+        case OP_GET_PROPERTY: return "OP_GET_PROPERTY";
+        case OP_SET_PROPERTY: return "OP_SET_PROPERTY";
+        case OP_METHOD: return "OP_METHOD";
+        case OP_INVOKE: return "OP_INVOKE";
+        case OP_INHERIT: return "OP_INHERIT";
+        case OP_GET_SUPER: return "OP_GET_SUPER";
+        case OP_SUPER_INVOKE: return "OP_SUPER_INVOKE";
+        case OP_ADD_LOCALS: return "OP_ADD_LOCALS";
+        case OP_LESS_JUMP_IF_FALSE: return "OP_LESS_JUMP_IF_FALSE";
+        case OP_INCREMENT_LOCAL: return "OP_INCREMENT_LOCAL";
+        case OP_R_MOVE: return "OP_R_MOVE";
+        case OP_R_ADD: return "OP_R_ADD";
+        case OP_R_SUBTRACT: return "OP_R_SUBTRACT";
+        case OP_R_MULTIPLY: return "OP_R_MULTIPLY";
+        case OP_R_DIVIDE: return "OP_R_DIVIDE";
+        case OP_R_EQUAL: return "OP_R_EQUAL";
+        case OP_R_GREATER: return "OP_R_GREATER";
+        case OP_R_LESS: return "OP_R_LESS";
+        case OP_R_LESS_JUMP_IF_FALSE: return "OP_R_LESS_JUMP_IF_FALSE";
+        case OP_R_GREATER_JUMP_IF_FALSE: return "OP_R_GREATER_JUMP_IF_FALSE";
+        case OP_ADD_NUM: return "OP_ADD_NUM";
+        case OP_GET_PROPERTY_SLOT: return "OP_GET_PROPERTY_SLOT";
+        case OP_SET_PROPERTY_SLOT: return "OP_SET_PROPERTY_SLOT";
+        case OP_INVOKE_METHOD: return "OP_INVOKE_METHOD";
         default: return "UNKNOWN";
     }
 }
+
+OpCode genericOp(OpCode code) {
+    switch (code) {
+        case OP_ADD_NUM: return OP_ADD;
+        case OP_GET_PROPERTY_SLOT: return OP_GET_PROPERTY;
+        case OP_SET_PROPERTY_SLOT: return OP_SET_PROPERTY;
+        case OP_INVOKE_METHOD: return OP_INVOKE;
+        default: return code;
+    }
+}
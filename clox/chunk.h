@@ -34,6 +34,7 @@ typedef enum {
     OP_JUMP_IF_FALSE,
     OP_LOOP,
     OP_CALL,
+    OP_TAIL_CALL,
     OP_CLOSURE,
     OP_CLOSE_UPVALUE,
     OP_CLASS,
@@ -43,11 +44,52 @@ typedef enum {
     OP_INVOKE,
     OP_INHERIT,
     OP_GET_SUPER,
-    OP_SUPER_INVOKE
+    OP_SUPER_INVOKE,
+    // Superinstructions, only produced by the peephole pass in optimizer.c.
+    OP_ADD_LOCALS,
+    OP_LESS_JUMP_IF_FALSE,
+    OP_INCREMENT_LOCAL,
+    // Three-address register instructions, only produced by the register
+    // backend (registerizeChunk() in optimizer.c). Operands are RK encoded.
+    OP_R_MOVE,
+    OP_R_ADD,
+    OP_R_SUBTRACT,
+    OP_R_MULTIPLY,
+    OP_R_DIVIDE,
+    OP_R_EQUAL,
+    OP_R_GREATER,
+    OP_R_LESS,
+    OP_R_LESS_JUMP_IF_FALSE,
+    OP_R_GREATER_JUMP_IF_FALSE,
+    // Quickened forms, only written by run() over a generic instruction once
+    // it has seen the types involved. Same operands as the generic form.
+    OP_ADD_NUM,
+    OP_GET_PROPERTY_SLOT,
+    OP_SET_PROPERTY_SLOT,
+    OP_INVOKE_METHOD
 } OpCode;
 
+// Source operands of the OP_R_* instructions address frame->slots directly,
+// or the constant pool when RK_CONSTANT is set. A destination of R_STACK
+// pushes the result instead of storing it in a slot.
+#define RK_CONSTANT 0x80
+#define R_STACK 0xff
+
 char* opCodeToString(OpCode code);
 
+/**
+ * @brief Generic form of a quickened instruction.
+ *
+ * Everything but run() and the disassembler treats quickened instructions as
+ * their generic form.
+ *
+ * @param code Opcode to look at.
+ * @return The generic opcode, or code itself if it is not quickened.
+ */
+OpCode genericOp(OpCode code);
+
+typedef struct InlineCache InlineCache;
+
 typedef struct {
     // Dynamic array
     int count;
@@ -60,6 +102,11 @@ typedef struct {
     int* lines;
     int maxLines;
     int currentLine;
+
+    // Inline caches of the property and method instructions, see cache.h.
+    InlineCache* caches;
+    int cacheCount;
+    int cacheCapacity;
 } Chunk;
 
 #include "memory.h"
@@ -100,7 +147,7 @@ int getLine(Chunk* chunk, int index);
  * @param byte The byte of code to write.
  * @param line The line number of the source code this byte corresponds to.
  */
-void writeChunk(Chunk* chunk, uint8_t byte, int line);
+void writeChunk(VM* vm, Chunk* chunk, uint8_t byte, int line);
 
 /**
  * @brief Adds a constant to the chunk's constant pool.
@@ -112,19 +159,39 @@ void writeChunk(Chunk* chunk, uint8_t byte, int line);
  * @param value The Value to add as a constant.
  * @return The index of the newly added constant in the constant pool.
  */
-int addConstant(Chunk* chunk, Value value);
+int addConstant(VM* vm, Chunk* chunk, Value value);
+
+void writeConstant(VM* vm, Chunk* chunk, Value value, int line);
 
-void writeConstant(Chunk* chunk, Value value, int line);
+/**
+ * @brief Adds an empty inline cache to the chunk.
+ *
+ * @param chunk Pointer to the Chunk to add the cache to.
+ * @return The index of the new cache, for the instruction's cache operand.
+ */
+int addCache(VM* vm, Chunk* chunk);
+
+/**
+ * @brief Computes the size in bytes of the instruction at the given offset.
+ *
+ * Operands are included. OP_CLOSURE is variable-length, so the chunk is
+ * needed to look up the upvalue count of the function it wraps.
+ *
+ * @param chunk Pointer to the Chunk containing the instruction.
+ * @param offset The offset of the instruction's opcode.
+ * @return The number of bytes the instruction occupies.
+ */
+int instructionLength(Chunk* chunk, int offset);
 
 /**
  * @brief Frees the memory associated with a Chunk.
  *
  * This function deallocates all memory used by the Chunk, including its
- * code array, lines array, and constant pool. It then reinitializes the
- * Chunk to a clean state.
+ * code array, lines array, constant pool and inline caches. It then
+ * reinitializes the Chunk to a clean state.
  *
  * @param chunk Pointer to the Chunk to be freed.
  */
-void freeChunk(Chunk* chunk);
+void freeChunk(VM* vm, Chunk* chunk);
 
 #endif
\ No newline at end of file
@@ -7,12 +7,28 @@
 
 // #define DEBUG_TRACE_EXECUTION
 // #define DEBUG_PRINT_CODE
-// #define DEBUG_PROFILE_CODE
 
 // #define DEBUG_STRESS_GC
 // #define DEBUG_LOG_GC
 
+// #define DEBUG_LOG_TRACE
+
 #define NAN_BOXING
+
+// Threaded dispatch in run() through GCC's labels-as-values. Build with
+// -DNO_COMPUTED_GOTO to fall back to the plain switch.
+#if defined(__GNUC__) && !defined(NO_COMPUTED_GOTO)
+#define COMPUTED_GOTO
+#endif
+
+// Baseline JIT compiling hot functions to x86-64 machine code, see jit.h,
+// and tracing JIT for hot loops, see trace.h. Both rely on the NaN-boxed
+// value layout. Build with -DNO_JIT to disable.
+#if defined(__x86_64__) && defined(__linux__) && defined(NAN_BOXING) &&      \
+    !defined(NO_JIT)
+#define JIT
+#endif
+
 #define UINT8_COUNT (UINT8_MAX + 1)
 
 #endif
\ No newline at end of file
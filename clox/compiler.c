@@ -5,7 +5,9 @@
 #include "common.h"
 #include "compiler.h"
 #include "memory.h"
+#include "optimizer.h"
 #include "scanner.h"
+#include "vm.h"
 
 #ifdef DEBUG_PRINT_CODE
 #include "debug.h"
@@ -28,7 +30,7 @@ typedef enum {
     PREC_PRIMARY
 } Precedence;
 
-typedef void (*ParseFn)(bool);
+typedef void (*ParseFn)(Parser*, bool);
 
 typedef struct {
     ParseFn prefix;
@@ -62,6 +64,7 @@ struct Compiler {
 
     int localCount;
     int scopeDepth;
+    int lastCall; // Offset of the last OP_CALL emitted, -1 before any.
     Local locals[UINT8_COUNT];
     Upvalue upvalues[UINT8_COUNT];
 };
@@ -78,32 +81,37 @@ typedef struct ClassCompiler ClassCompiler;
 
 // === Raw parsing ===
 
-typedef struct {
+// Everything a compilation needs, passed to every parsing function so that
+// VMs on different threads can compile at the same time.
+struct Parser {
+    VM* vm;
+    Scanner scanner;
     Token current;
     Token previous;
     bool hadError;
     bool panicMode;
-} Parser;
-
-Parser parser;
-Compiler* current = NULL;
-ClassCompiler* currentClass = NULL;
+    Compiler* compiler;          // Function being compiled, innermost first.
+    ClassCompiler* currentClass; // Innermost class being compiled, or NULL.
+};
 
-static void initCompiler(Compiler* compiler, FunctionType type) {
-    compiler->enclosing = current;
+static void initCompiler(Parser* parser, Compiler* compiler,
+                         FunctionType type) {
+    compiler->enclosing = parser->compiler;
     compiler->function = NULL;
     compiler->type = type;
     compiler->localCount = 0;
     compiler->scopeDepth = 0;
-    compiler->function = newFunction();
-    current = compiler;
+    compiler->lastCall = -1;
+    compiler->function = newFunction(parser->vm);
+    parser->compiler = compiler;
 
     if (type != TYPE_SCRIPT) {
-        current->function->name =
-            copyString(parser.previous.start, parser.previous.length);
+        parser->compiler->function->name =
+            copyString(parser->vm, parser->previous.start,
+                       parser->previous.length);
     }
 
-    Local* local = &current->locals[current->localCount++];
+    Local* local = &parser->compiler->locals[parser->compiler->localCount++];
     local->depth = 0;
     local->isConst = true;
     local->isCaptured = false;
@@ -116,66 +124,73 @@ static void initCompiler(Compiler* compiler, FunctionType type) {
     }
 }
 
-static inline Chunk* currentChunk() { return &current->function->chunk; }
+static inline Chunk* currentChunk(Parser* parser) {
+    return &parser->compiler->function->chunk;
+}
 
-static void errorAt(Token* token, const char* message) {
-    if (parser.panicMode)
+static void errorAt(Parser* parser, Token* token, const char* message) {
+    if (parser->panicMode)
         return;
-    parser.panicMode = true;
+    parser->panicMode = true;
 
-    fprintf(stderr, "[line %d] Error", token->line);
+    FILE* err = parser->vm->err;
+    fprintf(err, "[line %d] Error", token->line);
     if (token->type == TOKEN_EOF) {
-        fprintf(stderr, " at end");
+        fprintf(err, " at end");
     } else if (token->type == TOKEN_ERROR) {
         // Nothing.
     } else {
-        fprintf(stderr, " at '%.*s'", token->length, token->start);
+        fprintf(err, " at '%.*s'", token->length, token->start);
     }
-    fprintf(stderr, ": %s\n", message);
-    parser.hadError = true;
+    fprintf(err, ": %s\n", message);
+    parser->hadError = true;
 }
 
-static void error(const char* message) { errorAt(&parser.previous, message); }
+static void error(Parser* parser, const char* message) {
+    errorAt(parser, &parser->previous, message);
+}
 
-static void errorAtCurrent(const char* message) {
-    errorAt(&parser.current, message);
+static void errorAtCurrent(Parser* parser, const char* message) {
+    errorAt(parser, &parser->current, message);
 }
 
-static void advance() {
-    parser.previous = parser.current;
+static void advance(Parser* parser) {
+    parser->previous = parser->current;
 
     for (;;) {
-        parser.current = scanToken();
-        if (parser.current.type != TOKEN_ERROR)
+        parser->current = scanToken(&parser->scanner);
+        if (parser->current.type != TOKEN_ERROR)
             break;
-        errorAtCurrent(parser.current.start);
+        errorAtCurrent(parser, parser->current.start);
     }
 }
 
-static void consume(TokenType type, const char* message) {
-    if (parser.current.type == type) {
-        advance();
+static void consume(Parser* parser, TokenType type, const char* message) {
+    if (parser->current.type == type) {
+        advance(parser);
         return;
     }
-    errorAtCurrent(message);
+    errorAtCurrent(parser, message);
 }
 
-static inline bool check(TokenType type) { return parser.current.type == type; }
+static inline bool check(Parser* parser, TokenType type) {
+    return parser->current.type == type;
+}
 
-static bool match(TokenType type) {
-    if (!check(type))
+static bool match(Parser* parser, TokenType type) {
+    if (!check(parser, type))
         return false;
-    advance();
+    advance(parser);
     return true;
 }
 
-static void synchronize() {
-    parser.panicMode = false;
+static void synchronize(Parser* parser) {
+    parser->panicMode = false;
 
-    while (parser.current.type != TOKEN_EOF) {
-        if (parser.previous.type == TOKEN_SEMICOLON)
+    while (parser->current.type != TOKEN_EOF) {
+        if (parser->previous.type == TOKEN_SEMICOLON)
             return;
-        switch (parser.current.type) {
+        switch (parser->current.type) {
             case TOKEN_CLASS:
             case TOKEN_FUN:
             case TOKEN_VAR:
@@ -188,61 +203,67 @@ static void synchronize() {
                 // Do nothing.
                 ;
         }
-        advance();
+        advance(parser);
     }
 }
 
-static void emitByte(uint8_t byte) {
-    writeChunk(currentChunk(), byte, parser.previous.line);
+static void emitByte(Parser* parser, uint8_t byte) {
+    writeChunk(parser->vm, currentChunk(parser), byte, parser->previous.line);
+}
+
+static void emitBytes(Parser* parser, uint8_t byte1, uint8_t byte2) {
+    emitByte(parser, byte1);
+    emitByte(parser, byte2);
 }
 
-static void emitBytes(uint8_t byte1, uint8_t byte2) {
-    emitByte(byte1);
-    emitByte(byte2);
+static void emitGlobal(Parser* parser, OpCode op, uint16_t slot) {
+    emitByte(parser, op);
+    emitBytes(parser, (slot >> 8) & 0xff, slot & 0xff);
 }
 
-static void emitConstant(Value value) {
-    writeConstant(currentChunk(), value, parser.previous.line);
+static void emitConstant(Parser* parser, Value value) {
+    writeConstant(parser->vm, currentChunk(parser), value,
+                  parser->previous.line);
 }
 
-static void patchJump(int offset) {
-    int jump = currentChunk()->count - offset - 2;
+static void patchJump(Parser* parser, int offset) {
+    int jump = currentChunk(parser)->count - offset - 2;
 
-    if (jump > UINT8_MAX) {
-        error("Too much code to jump over.");
+    if (jump > UINT16_MAX) {
+        error(parser, "Too much code to jump over.");
     }
 
-    currentChunk()->code[offset] = (jump >> 8) & 0xff;
-    currentChunk()->code[offset + 1] = jump & 0xff;
+    currentChunk(parser)->code[offset] = (jump >> 8) & 0xff;
+    currentChunk(parser)->code[offset + 1] = jump & 0xff;
 }
 
-static int emitJump(uint8_t instruction) {
-    emitByte(instruction);
-    emitByte(0xff); // placeholders
-    emitByte(0xff);
-    return currentChunk()->count - 2;
+static int emitJump(Parser* parser, uint8_t instruction) {
+    emitByte(parser, instruction);
+    emitByte(parser, 0xff); // placeholders
+    emitByte(parser, 0xff);
+    return currentChunk(parser)->count - 2;
 }
 
-static void emitLoop(int loopStart) {
-    emitByte(OP_LOOP);
-    int offset = currentChunk()->count - loopStart + 2;
+static void emitLoop(Parser* parser, int loopStart) {
+    emitByte(parser, OP_LOOP);
+    int offset = currentChunk(parser)->count - loopStart + 2;
     if (offset > UINT16_MAX)
-        error("Loop body too large.");
-    emitByte((offset >> 8) & 0xff);
-    emitByte(offset & 0xff);
+        error(parser, "Loop body too large.");
+    emitByte(parser, (offset >> 8) & 0xff);
+    emitByte(parser, offset & 0xff);
 }
 
-static void emitReturn() {
-    if (current->type == TYPE_INITIALIZER) {
-        emitBytes(OP_GET_LOCAL, 0);
+static void emitReturn(Parser* parser) {
+    if (parser->compiler->type == TYPE_INITIALIZER) {
+        emitBytes(parser, OP_GET_LOCAL, 0);
     } else {
-        emitByte(OP_NIL);
+        emitByte(parser, OP_NIL);
     }
-    emitByte(OP_RETURN);
+    emitByte(parser, OP_RETURN);
 }
 
-static uint8_t makeConstant(Value value) {
-    int constant = addConstant(currentChunk(), value);
+static uint8_t makeConstant(Parser* parser, Value value) {
+    int constant = addConstant(parser->vm, currentChunk(parser), value);
     // Handled by OP_CONSTANT_LONG
     // if (constant > UINT8_MAX) {
     //     error("Too many constants in one chunk.");
@@ -251,76 +272,113 @@ static uint8_t makeConstant(Value value) {
     return (uint8_t)constant;
 }
 
-static void markInitialized() {
-    if (current->scopeDepth == 0)
+// Gives the instruction just emitted a cache slot of its own.
+static void emitCache(Parser* parser) {
+    int cache = addCache(parser->vm, currentChunk(parser));
+    if (cache > UINT16_MAX) {
+        error(parser, "Too many property accesses in one function.");
         return;
-    current->locals[current->localCount - 1].depth = current->scopeDepth;
+    }
+    emitBytes(parser, (cache >> 8) & 0xff, cache & 0xff);
 }
 
-static void defineVariable(uint8_t global) {
-    if (current->scopeDepth > 0) {
-        markInitialized();
+static void markInitialized(Parser* parser) {
+    Compiler* compiler = parser->compiler;
+    if (compiler->scopeDepth == 0)
+        return;
+    compiler->locals[compiler->localCount - 1].depth = compiler->scopeDepth;
+}
+
+static void defineVariable(Parser* parser, uint16_t global) {
+    if (parser->compiler->scopeDepth > 0) {
+        markInitialized(parser);
         return;
     }
-    emitBytes(OP_DEFINE_GLOBAL, global);
+    emitGlobal(parser, OP_DEFINE_GLOBAL, global);
 }
 
-static ObjFunction* endCompiler() {
-    emitReturn();
-    ObjFunction* function = current->function;
-    current = current->enclosing;
+static ObjFunction* endCompiler(Parser* parser) {
+    emitReturn(parser);
+    ObjFunction* function = parser->compiler->function;
+    // Still a compiler root here, the rewrite allocates.
+    if (!parser->hadError) {
+        if (parser->vm->backend == BACKEND_REGISTER) {
+            registerizeChunk(parser->vm, &function->chunk);
+        } else {
+            optimizeChunk(parser->vm, &function->chunk);
+        }
+        function->maxSlots =
+            maxStackSlots(parser->vm, &function->chunk, function->arity);
+    }
+    // No longer a compiler root, the constants it got without write barriers
+    // are traced with the remembered set instead.
+    writeBarrierAll(parser->vm, (Obj*)function);
+    parser->compiler = parser->compiler->enclosing;
 
 #ifdef DEBUG_PRINT_CODE
-    if (!parser.hadError && current != NULL)
-        disassembleChunk(currentChunk(), function->name != NULL
-                                             ? function->name->chars
-                                             : "<script>");
+    if (!parser->hadError && parser->compiler != NULL)
+        disassembleChunk(parser->vm, currentChunk(parser),
+                         function->name != NULL ? function->name->chars
+                                                : "<script>");
 #endif
     return function;
 }
 
-static void beginScope() { current->scopeDepth++; }
+static void beginScope(Parser* parser) { parser->compiler->scopeDepth++; }
 
-static void endScope() {
-    while (current->localCount > 0 &&
-           current->locals[current->localCount - 1].depth ==
-               current->scopeDepth) {
-        if (current->locals[current->localCount - 1].isCaptured)
-            emitByte(OP_CLOSE_UPVALUE);
+static void endScope(Parser* parser) {
+    Compiler* compiler = parser->compiler;
+    while (compiler->localCount > 0 &&
+           compiler->locals[compiler->localCount - 1].depth ==
+               compiler->scopeDepth) {
+        if (compiler->locals[compiler->localCount - 1].isCaptured)
+            emitByte(parser, OP_CLOSE_UPVALUE);
         else
-            emitByte(OP_POP);
-        current->localCount--;
+            emitByte(parser, OP_POP);
+        compiler->localCount--;
     }
-    current->scopeDepth--;
+    compiler->scopeDepth--;
 }
 
 static ParseRule* getRule(TokenType type);
 
-static void parsePrecedence(Precedence precedence) {
-    advance();
-    ParseFn prefixRule = getRule(parser.previous.type)->prefix;
+static void parsePrecedence(Parser* parser, Precedence precedence) {
+    advance(parser);
+    ParseFn prefixRule = getRule(parser->previous.type)->prefix;
 
     if (prefixRule == NULL) {
-        error("Expect expression.");
+        error(parser, "Expect expression.");
         return;
     }
 
     bool canAssign = precedence <= PREC_ASSIGNMENT;
-    prefixRule(canAssign);
+    prefixRule(parser, canAssign);
 
-    while (precedence <= getRule(parser.current.type)->precedence) {
-        advance();
-        ParseFn infixRule = getRule(parser.previous.type)->infix;
-        infixRule(canAssign);
+    while (precedence <= getRule(parser->current.type)->precedence) {
+        advance(parser);
+        ParseFn infixRule = getRule(parser->previous.type)->infix;
+        infixRule(parser, canAssign);
     }
 
-    if (canAssign && match(TOKEN_EQUAL)) {
-        error("Invalid assignment target.");
+    if (canAssign && match(parser, TOKEN_EQUAL)) {
+        error(parser, "Invalid assignment target.");
     }
 }
 
-static uint8_t identifierConstant(Token* name) {
-    return makeConstant(OBJ_VAL(copyString(name->start, name->length)));
+static uint8_t identifierConstant(Parser* parser, Token* name) {
+    ObjString* string = copyString(parser->vm, name->start, name->length);
+    return makeConstant(parser, OBJ_VAL(string));
+}
+
+// Globals live in VM slots shared by all chunks, found by name only here.
+static uint16_t globalVariable(Parser* parser, Token* name) {
+    ObjString* string = copyString(parser->vm, name->start, name->length);
+    int slot = globalSlot(parser->vm, string);
+    if (slot > UINT16_MAX) {
+        error(parser, "Too many global variables.");
+        return 0;
+    }
+    return (uint16_t)slot;
 }
 
 static bool identifiersEqual(Token* a, Token* b) {
@@ -328,13 +386,14 @@ static bool identifiersEqual(Token* a, Token* b) {
             (memcmp(a->start, b->start, a->length) == 0));
 }
 
-static int resolveLocal(Compiler* compiler, Token* name) {
+static int resolveLocal(Parser* parser, Compiler* compiler, Token* name) {
     Local* local;
     for (int i = compiler->localCount - 1; i >= 0; i--) {
         local = &compiler->locals[i];
         if (identifiersEqual(name, &local->name)) {
             if (local->depth == -1)
-                error("Can't use a local variable in its own initialized.");
+                error(parser,
+                      "Can't use a local variable in its own initialized.");
             return i;
         }
     }
@@ -342,7 +401,8 @@ static int resolveLocal(Compiler* compiler, Token* name) {
     return -1;
 }
 
-static int addUpvalue(Compiler* compiler, uint8_t index, bool isLocal) {
+static int addUpvalue(Parser* parser, Compiler* compiler, uint8_t index,
+                      bool isLocal) {
     int upvalueCount = compiler->function->upvalueCount;
 
     for (int i = 0; i < upvalueCount; i++) {
@@ -351,7 +411,7 @@ static int addUpvalue(Compiler* compiler, uint8_t index, bool isLocal) {
             return i;
         }
         if (upvalueCount == UINT8_COUNT) {
-            error("Too many closure variables in function.");
+            error(parser, "Too many closure variables in function.");
             return 0;
         }
     }
@@ -361,508 +421,531 @@ static int addUpvalue(Compiler* compiler, uint8_t index, bool isLocal) {
     return compiler->function->upvalueCount++;
 }
 
-static int resolveUpvalue(Compiler* compiler, Token* name) {
+static int resolveUpvalue(Parser* parser, Compiler* compiler, Token* name) {
     if (compiler->enclosing == NULL)
         return -1;
 
-    int local = resolveLocal(compiler->enclosing, name);
+    int local = resolveLocal(parser, compiler->enclosing, name);
     if (local != -1) {
         compiler->enclosing->locals[local].isCaptured = true;
-        return addUpvalue(compiler, (uint8_t)local, true);
+        return addUpvalue(parser, compiler, (uint8_t)local, true);
     }
 
-    int upvalue = resolveUpvalue(compiler->enclosing, name);
+    int upvalue = resolveUpvalue(parser, compiler->enclosing, name);
     if (upvalue != -1) {
-        return addUpvalue(compiler, (uint8_t)upvalue, false);
+        return addUpvalue(parser, compiler, (uint8_t)upvalue, false);
     }
     return -1;
 }
 
-static void addLocal(Token name) {
-    if (current->localCount == UINT8_COUNT) {
-        error("Too many local variables in function.");
+static void addLocal(Parser* parser, Token name) {
+    if (parser->compiler->localCount == UINT8_COUNT) {
+        error(parser, "Too many local variables in function.");
         return;
     }
 
-    Local* local = &current->locals[current->localCount++];
+    Local* local = &parser->compiler->locals[parser->compiler->localCount++];
     local->name = name;
     local->depth = -1;
     local->isConst = false;
     local->isCaptured = false;
 }
 
-static void declareVariable() {
-    if (current->scopeDepth == 0)
+static void declareVariable(Parser* parser) {
+    if (parser->compiler->scopeDepth == 0)
         return;
 
-    for (int i = current->localCount - 1; i >= 0; i--) {
-        Local* local = &current->locals[i];
-        if (local->depth != -1 && local->depth < current->scopeDepth)
+    for (int i = parser->compiler->localCount - 1; i >= 0; i--) {
+        Local* local = &parser->compiler->locals[i];
+        if (local->depth != -1 && local->depth < parser->compiler->scopeDepth)
             break;
 
-        if (identifiersEqual(&parser.previous, &local->name)) {
-            error("A variable with that name already exist in this scope.");
+        if (identifiersEqual(&parser->previous, &local->name)) {
+            error(parser,
+                  "A variable with that name already exist in this scope.");
         }
     }
 
-    addLocal(parser.previous);
+    addLocal(parser, parser->previous);
 }
 
-static uint8_t parseVariable() {
-    consume(TOKEN_IDENTIFIER, "Expect variable name.");
+static uint16_t parseVariable(Parser* parser) {
+    consume(parser, TOKEN_IDENTIFIER, "Expect variable name.");
 
-    declareVariable();
-    if (current->scopeDepth > 0)
+    declareVariable(parser);
+    if (parser->compiler->scopeDepth > 0)
         return 0;
 
-    return identifierConstant(&parser.previous);
+    return globalVariable(parser, &parser->previous);
 }
 
-static void and_(bool) {
-    int endJump = emitJump(OP_JUMP_IF_FALSE);
-    emitByte(OP_POP);
-    parsePrecedence(PREC_AND);
-    patchJump(endJump);
+static void and_(Parser* parser, bool) {
+    int endJump = emitJump(parser, OP_JUMP_IF_FALSE);
+    emitByte(parser, OP_POP);
+    parsePrecedence(parser, PREC_AND);
+    patchJump(parser, endJump);
 }
 
-static void or_(bool) {
-    int elseJump = emitJump(OP_JUMP_IF_FALSE);
-    int endJump = emitJump(OP_JUMP);
+static void or_(Parser* parser, bool) {
+    int elseJump = emitJump(parser, OP_JUMP_IF_FALSE);
+    int endJump = emitJump(parser, OP_JUMP);
 
     // if right operand is false, pop it and evaluate left operand ; it will be
     // the result
-    patchJump(elseJump);
-    emitByte(OP_POP);
+    patchJump(parser, elseJump);
+    emitByte(parser, OP_POP);
 
-    parsePrecedence(PREC_OR);
+    parsePrecedence(parser, PREC_OR);
     // Otherwise *don't pop* and jump to the end, left operand is already the
     // result
-    patchJump(endJump);
+    patchJump(parser, endJump);
 }
 
-static void expression() { parsePrecedence(PREC_ASSIGNMENT); }
+static void expression(Parser* parser) {
+    parsePrecedence(parser, PREC_ASSIGNMENT);
+}
 // === Node builders ===
 
 // fy C
-static void block();
-static void method();
-static void statement();
-static void function(FunctionType);
-static void variable(bool);
-static void namedVariable(Token name, bool canAssign);
+static void block(Parser* parser);
+static void method(Parser* parser);
+static void statement(Parser* parser);
+static void function(Parser* parser, FunctionType);
+static void variable(Parser* parser, bool);
+static void namedVariable(Parser* parser, Token name, bool canAssign);
 static Token syntheticToken(const char*);
 
-static uint8_t argumentList() {
+static uint8_t argumentList(Parser* parser) {
     uint8_t argCount = 0;
 
-    if (!check(TOKEN_RIGHT_PAREN)) {
+    if (!check(parser, TOKEN_RIGHT_PAREN)) {
         do {
-            expression();
+            expression(parser);
             argCount++;
-        } while (match(TOKEN_COMMA));
+        } while (match(parser, TOKEN_COMMA));
     }
 
-    consume(TOKEN_RIGHT_PAREN, "Expect ')' after argument list.");
+    consume(parser, TOKEN_RIGHT_PAREN, "Expect ')' after argument list.");
     return argCount;
 }
 
-static void printStatement() {
-    expression();
-    consume(TOKEN_SEMICOLON, "Expect ';' after print statement.");
-    emitByte(OP_PRINT);
+static void printStatement(Parser* parser) {
+    expression(parser);
+    consume(parser, TOKEN_SEMICOLON, "Expect ';' after print statement.");
+    emitByte(parser, OP_PRINT);
 }
 
-static void assertStatement() {
-    expression();
-    consume(TOKEN_SEMICOLON, "Expect ';' after assert statement.");
-    emitByte(OP_ASSERT);
+static void assertStatement(Parser* parser) {
+    expression(parser);
+    consume(parser, TOKEN_SEMICOLON, "Expect ';' after assert statement.");
+    emitByte(parser, OP_ASSERT);
 }
 
-static void returnStatement() {
-    if (current->type == TYPE_SCRIPT) {
-        error("Can't return from top-level code.");
+static void returnStatement(Parser* parser) {
+    if (parser->compiler->type == TYPE_SCRIPT) {
+        error(parser, "Can't return from top-level code.");
     }
 
-    if (match(TOKEN_SEMICOLON)) {
-        emitReturn();
+    if (match(parser, TOKEN_SEMICOLON)) {
+        emitReturn(parser);
     } else {
-        if (current->type == TYPE_INITIALIZER) {
-            error("Can't return a value from an initializer.");
+        if (parser->compiler->type == TYPE_INITIALIZER) {
+            error(parser, "Can't return a value from an initializer.");
         }
-        expression();
-        consume(TOKEN_SEMICOLON, "Expect ';' after return statement.");
-        emitByte(OP_RETURN);
+        expression(parser);
+        consume(parser, TOKEN_SEMICOLON, "Expect ';' after return statement.");
+        // The function has nothing left to do with its frame once a call it
+        // returns the result of starts. Invokes of this.m() and super.m()
+        // are not OP_CALLs and keep their frame.
+        Chunk* chunk = currentChunk(parser);
+        if (parser->compiler->lastCall == chunk->count - 2)
+            chunk->code[parser->compiler->lastCall] = OP_TAIL_CALL;
+        emitByte(parser, OP_RETURN);
     }
 }
 
-static void expressionStatement() {
-    expression();
-    consume(TOKEN_SEMICOLON, "Expect ';' after expression statement.");
-    emitByte(OP_POP);
+static void expressionStatement(Parser* parser) {
+    expression(parser);
+    consume(parser, TOKEN_SEMICOLON, "Expect ';' after expression statement.");
+    emitByte(parser, OP_POP);
 }
 
-static void funDeclaration() {
-    uint8_t global = parseVariable();
+static void funDeclaration(Parser* parser) {
+    uint16_t global = parseVariable(parser);
 
-    markInitialized();
-    function(TYPE_FUNCTION);
-    defineVariable(global);
+    markInitialized(parser);
+    function(parser, TYPE_FUNCTION);
+    defineVariable(parser, global);
 }
 
-static void varDeclaration() {
-    uint8_t global = parseVariable();
+static void varDeclaration(Parser* parser) {
+    uint16_t global = parseVariable(parser);
 
-    if (match(TOKEN_EQUAL)) {
-        expression();
+    if (match(parser, TOKEN_EQUAL)) {
+        expression(parser);
     } else {
-        emitByte(OP_NIL);
+        emitByte(parser, OP_NIL);
     }
 
-    consume(TOKEN_SEMICOLON, "Expect ';' after variable declaration.");
+    consume(parser, TOKEN_SEMICOLON, "Expect ';' after variable declaration.");
 
-    defineVariable(global);
+    defineVariable(parser, global);
 }
 
-static void classDeclaration() {
-    consume(TOKEN_IDENTIFIER, "Expect class name.");
-    Token className = parser.previous;
+static void classDeclaration(Parser* parser) {
+    consume(parser, TOKEN_IDENTIFIER, "Expect class name.");
+    Token className = parser->previous;
 
-    uint8_t nameConstant = identifierConstant(&parser.previous);
-    declareVariable();
+    uint8_t nameConstant = identifierConstant(parser, &parser->previous);
+    declareVariable(parser);
+    uint16_t global = parser->compiler->scopeDepth > 0
+                          ? 0
+                          : globalVariable(parser, &parser->previous);
 
-    emitBytes(OP_CLASS, nameConstant);
-    defineVariable(nameConstant);
+    emitBytes(parser, OP_CLASS, nameConstant);
+    defineVariable(parser, global);
 
     ClassCompiler classCompiler;
     classCompiler.name = className;
-    classCompiler.enclosing = currentClass;
+    classCompiler.enclosing = parser->currentClass;
     classCompiler.hasSuperclass = false;
-    currentClass = &classCompiler;
+    parser->currentClass = &classCompiler;
 
-    if (match(TOKEN_LESS)) {
-        consume(TOKEN_IDENTIFIER, "Expect superclass name.");
-        variable(false);
+    if (match(parser, TOKEN_LESS)) {
+        consume(parser, TOKEN_IDENTIFIER, "Expect superclass name.");
+        variable(parser, false);
 
-        if (identifiersEqual(&className, &parser.previous)) {
-            error("A class can't inherit from itself.");
+        if (identifiersEqual(&className, &parser->previous)) {
+            error(parser, "A class can't inherit from itself.");
         }
         classCompiler.hasSuperclass = true;
 
-        beginScope();
-        addLocal(syntheticToken("super"));
-        defineVariable(0);
+        beginScope(parser);
+        addLocal(parser, syntheticToken("super"));
+        defineVariable(parser, 0);
 
-        namedVariable(className, false);
-        emitByte(OP_INHERIT);
+        namedVariable(parser, className, false);
+        emitByte(parser, OP_INHERIT);
     }
 
-    namedVariable(className, false);
+    namedVariable(parser, className, false);
 
-    consume(TOKEN_LEFT_BRACE, "Expect '{' before class body.");
-    while (!check(TOKEN_RIGHT_BRACE) && !check(TOKEN_EOF)) {
-        method();
+    consume(parser, TOKEN_LEFT_BRACE, "Expect '{' before class body.");
+    while (!check(parser, TOKEN_RIGHT_BRACE) && !check(parser, TOKEN_EOF)) {
+        method(parser);
     }
-    consume(TOKEN_RIGHT_BRACE, "Expect '}' after class body.");
-    emitByte(OP_POP);
+    consume(parser, TOKEN_RIGHT_BRACE, "Expect '}' after class body.");
+    emitByte(parser, OP_POP);
 
     if (classCompiler.hasSuperclass) {
-        endScope();
+        endScope(parser);
     }
 
-    currentClass = currentClass->enclosing;
+    parser->currentClass = parser->currentClass->enclosing;
 }
 
-static void ifStatement() {
-    consume(TOKEN_LEFT_PAREN, "Expect parenthesis after 'if'");
-    expression();
-    consume(TOKEN_RIGHT_PAREN, "Expect closing parenthesis after condition");
+static void ifStatement(Parser* parser) {
+    consume(parser, TOKEN_LEFT_PAREN, "Expect parenthesis after 'if'");
+    expression(parser);
+    consume(parser, TOKEN_RIGHT_PAREN,
+            "Expect closing parenthesis after condition");
 
-    int thenJump = emitJump(OP_JUMP_IF_FALSE);
-    emitByte(OP_POP);
-    statement();
+    int thenJump = emitJump(parser, OP_JUMP_IF_FALSE);
+    emitByte(parser, OP_POP);
+    statement(parser);
 
-    int elseJump = emitJump(OP_JUMP);
+    int elseJump = emitJump(parser, OP_JUMP);
 
-    patchJump(thenJump);
-    emitByte(OP_POP);
+    patchJump(parser, thenJump);
+    emitByte(parser, OP_POP);
 
-    if (match(TOKEN_ELSE))
-        statement();
-    patchJump(elseJump);
+    if (match(parser, TOKEN_ELSE))
+        statement(parser);
+    patchJump(parser, elseJump);
 }
 
-static void whileStatement() {
-    int loopStart = currentChunk()->count;
+static void whileStatement(Parser* parser) {
+    int loopStart = currentChunk(parser)->count;
 
-    consume(TOKEN_LEFT_PAREN, "Expect parenthesis after 'while'");
-    expression();
-    consume(TOKEN_RIGHT_PAREN, "Expect closing parenthesis after condition");
+    consume(parser, TOKEN_LEFT_PAREN, "Expect parenthesis after 'while'");
+    expression(parser);
+    consume(parser, TOKEN_RIGHT_PAREN,
+            "Expect closing parenthesis after condition");
 
-    int exitJump = emitJump(OP_JUMP_IF_FALSE);
+    int exitJump = emitJump(parser, OP_JUMP_IF_FALSE);
 
-    emitByte(OP_POP);
-    statement();
+    emitByte(parser, OP_POP);
+    statement(parser);
 
-    emitLoop(loopStart);
+    emitLoop(parser, loopStart);
 
-    patchJump(exitJump);
-    emitByte(OP_POP);
+    patchJump(parser, exitJump);
+    emitByte(parser, OP_POP);
 }
 
-static void forStatement() {
-    beginScope();
-    consume(TOKEN_LEFT_PAREN, "Expect '(' after 'for'.");
+static void forStatement(Parser* parser) {
+    beginScope(parser);
+    consume(parser, TOKEN_LEFT_PAREN, "Expect '(' after 'for'.");
 
     // initializer
-    if (match(TOKEN_SEMICOLON)) {
+    if (match(parser, TOKEN_SEMICOLON)) {
         // No initializer.
-    } else if (match(TOKEN_VAR)) {
-        varDeclaration();
+    } else if (match(parser, TOKEN_VAR)) {
+        varDeclaration(parser);
     } else {
-        expressionStatement();
+        expressionStatement(parser);
     }
 
     // condition
-    int loopStart = currentChunk()->count;
+    int loopStart = currentChunk(parser)->count;
     int exitJump = -1;
-    if (!match(TOKEN_SEMICOLON)) {
-        expression();
-        consume(TOKEN_SEMICOLON, "Expect ';' after loop condition.");
+    if (!match(parser, TOKEN_SEMICOLON)) {
+        expression(parser);
+        consume(parser, TOKEN_SEMICOLON, "Expect ';' after loop condition.");
         // Jump out of the loop if the condition is false.
-        exitJump = emitJump(OP_JUMP_IF_FALSE);
-        emitByte(OP_POP); // Condition.
+        exitJump = emitJump(parser, OP_JUMP_IF_FALSE);
+        emitByte(parser, OP_POP); // Condition.
     }
 
     // increment
-    if (!match(TOKEN_RIGHT_PAREN)) {
+    if (!match(parser, TOKEN_RIGHT_PAREN)) {
         // Jump to body before doing anything
-        int bodyJump = emitJump(OP_JUMP);
-        int incrementStart = currentChunk()->count;
+        int bodyJump = emitJump(parser, OP_JUMP);
+        int incrementStart = currentChunk(parser)->count;
 
         // parse increment expression
-        expression();
+        expression(parser);
 
-        emitByte(OP_POP); // we don't care about the value
-        consume(TOKEN_RIGHT_PAREN, "Expect ')' after for clauses.");
+        emitByte(parser, OP_POP); // we don't care about the value
+        consume(parser, TOKEN_RIGHT_PAREN, "Expect ')' after for clauses.");
 
         // Go to body
-        emitLoop(loopStart);
+        emitLoop(parser, loopStart);
         // And change final jump to go to increment instead of body
         loopStart = incrementStart;
 
-        patchJump(bodyJump);
+        patchJump(parser, bodyJump);
     }
 
-    statement();
+    statement(parser);
 
-    emitLoop(loopStart);
+    emitLoop(parser, loopStart);
 
     if (exitJump != -1) {
-        patchJump(exitJump);
-        emitByte(OP_POP); // Condition.
-    }
-
-    endScope();
-}
-
-static void statement() {
-    if (match(TOKEN_PRINT)) {
-        printStatement();
-    } else if (match(TOKEN_ASSERT)) {
-        assertStatement();
-    } else if (match(TOKEN_LEFT_BRACE)) {
-        beginScope();
-        block();
-        endScope();
-    } else if (match(TOKEN_IF)) {
-        ifStatement();
-    } else if (match(TOKEN_WHILE)) {
-        whileStatement();
-    } else if (match(TOKEN_FOR)) {
-        forStatement();
-    } else if (match(TOKEN_RETURN)) {
-        returnStatement();
+        patchJump(parser, exitJump);
+        emitByte(parser, OP_POP); // Condition.
+    }
+
+    endScope(parser);
+}
+
+static void statement(Parser* parser) {
+    if (match(parser, TOKEN_PRINT)) {
+        printStatement(parser);
+    } else if (match(parser, TOKEN_ASSERT)) {
+        assertStatement(parser);
+    } else if (match(parser, TOKEN_LEFT_BRACE)) {
+        beginScope(parser);
+        block(parser);
+        endScope(parser);
+    } else if (match(parser, TOKEN_IF)) {
+        ifStatement(parser);
+    } else if (match(parser, TOKEN_WHILE)) {
+        whileStatement(parser);
+    } else if (match(parser, TOKEN_FOR)) {
+        forStatement(parser);
+    } else if (match(parser, TOKEN_RETURN)) {
+        returnStatement(parser);
     } else {
-        expressionStatement();
+        expressionStatement(parser);
     }
 }
 
-static void declaration() {
-    if (match(TOKEN_FUN)) {
-        funDeclaration();
-    } else if (match(TOKEN_VAR)) {
-        varDeclaration();
-    } else if (match(TOKEN_CLASS)) {
-        classDeclaration();
+static void declaration(Parser* parser) {
+    if (match(parser, TOKEN_FUN)) {
+        funDeclaration(parser);
+    } else if (match(parser, TOKEN_VAR)) {
+        varDeclaration(parser);
+    } else if (match(parser, TOKEN_CLASS)) {
+        classDeclaration(parser);
     } else {
-        statement();
+        statement(parser);
     }
-    if (parser.panicMode)
-        synchronize();
+    if (parser->panicMode)
+        synchronize(parser);
 }
 
-static void block() {
-    while (!check(TOKEN_RIGHT_BRACE) && !check(TOKEN_EOF)) {
-        declaration();
+static void block(Parser* parser) {
+    while (!check(parser, TOKEN_RIGHT_BRACE) && !check(parser, TOKEN_EOF)) {
+        declaration(parser);
     }
-    consume(TOKEN_RIGHT_BRACE, "Expect '}' after block.");
+    consume(parser, TOKEN_RIGHT_BRACE, "Expect '}' after block.");
 }
 
-static void function(FunctionType type) {
+static void function(Parser* parser, FunctionType type) {
     Compiler compiler;
-    initCompiler(&compiler, type);
-    beginScope();
+    initCompiler(parser, &compiler, type);
+    beginScope(parser);
     // Compile the parameter list.
-    consume(TOKEN_LEFT_PAREN, "Expect '(' after function name.");
+    consume(parser, TOKEN_LEFT_PAREN, "Expect '(' after function name.");
 
-    if (!check(TOKEN_RIGHT_PAREN)) {
+    if (!check(parser, TOKEN_RIGHT_PAREN)) {
         do {
-            current->function->arity++;
-            if (current->function->arity > 255) {
-                errorAtCurrent("Can't have more than 255 parameters.");
+            parser->compiler->function->arity++;
+            if (parser->compiler->function->arity > 255) {
+                errorAtCurrent(parser, "Can't have more than 255 parameters.");
             }
-            uint8_t paramConstant = parseVariable();
-            defineVariable(paramConstant);
-        } while (match(TOKEN_COMMA));
+            uint16_t paramConstant = parseVariable(parser);
+            defineVariable(parser, paramConstant);
+        } while (match(parser, TOKEN_COMMA));
     }
 
-    consume(TOKEN_RIGHT_PAREN, "Expect ')' after parameters.");
+    consume(parser, TOKEN_RIGHT_PAREN, "Expect ')' after parameters.");
     // The body.
-    consume(TOKEN_LEFT_BRACE, "Expect '{' before function body.");
-    block();
+    consume(parser, TOKEN_LEFT_BRACE, "Expect '{' before function body.");
+    block(parser);
     // Create the function object.
-    ObjFunction* function = endCompiler();
-    emitBytes(OP_CLOSURE, makeConstant(OBJ_VAL(function)));
+    ObjFunction* function = endCompiler(parser);
+    emitBytes(parser, OP_CLOSURE, makeConstant(parser, OBJ_VAL(function)));
 
     for (int i = 0; i < function->upvalueCount; i++) {
-        emitByte(compiler.upvalues[i].isLocal ? 1 : 0);
-        emitByte(compiler.upvalues[i].index);
+        emitByte(parser, compiler.upvalues[i].isLocal ? 1 : 0);
+        emitByte(parser, compiler.upvalues[i].index);
     }
 }
 
-static void method() {
-    consume(TOKEN_IDENTIFIER, "Expect method name.");
+static void method(Parser* parser) {
+    consume(parser, TOKEN_IDENTIFIER, "Expect method name.");
 
-    uint8_t constant = identifierConstant(&parser.previous);
+    uint8_t constant = identifierConstant(parser, &parser->previous);
 
     FunctionType type = TYPE_METHOD;
-    if (parser.previous.length == 4 &&
-        memcmp(parser.previous.start, "init", 4) == 0) {
+    if (parser->previous.length == 4 &&
+        memcmp(parser->previous.start, "init", 4) == 0) {
         type = TYPE_INITIALIZER;
     }
-    function(type);
+    function(parser, type);
 
-    emitBytes(OP_METHOD, constant);
+    emitBytes(parser, OP_METHOD, constant);
 }
 
-static void grouping(bool) {
-    expression();
-    consume(TOKEN_RIGHT_PAREN, "Expect ')' after expression.");
+static void grouping(Parser* parser, bool) {
+    expression(parser);
+    consume(parser, TOKEN_RIGHT_PAREN, "Expect ')' after expression.");
 }
 
-static void ternary(bool) {
-    int jumpFalse = emitJump(OP_JUMP_IF_FALSE);
-    emitByte(OP_POP);
-    expression();
-    int jumpEnd = emitJump(OP_JUMP);
+static void ternary(Parser* parser, bool) {
+    int jumpFalse = emitJump(parser, OP_JUMP_IF_FALSE);
+    emitByte(parser, OP_POP);
+    expression(parser);
+    int jumpEnd = emitJump(parser, OP_JUMP);
 
-    consume(TOKEN_COLON, "Expect ':' in ternary operator");
+    consume(parser, TOKEN_COLON, "Expect ':' in ternary operator");
 
-    patchJump(jumpFalse);
-    emitByte(OP_POP);
-    expression();
-    patchJump(jumpEnd);
+    patchJump(parser, jumpFalse);
+    emitByte(parser, OP_POP);
+    expression(parser);
+    patchJump(parser, jumpEnd);
 }
 
-static void binary(bool) {
-    TokenType operatorType = parser.previous.type;
+static void binary(Parser* parser, bool) {
+    TokenType operatorType = parser->previous.type;
 
     ParseRule* rule = getRule(operatorType);
-    parsePrecedence((Precedence)(rule->precedence + 1));
+    parsePrecedence(parser, (Precedence)(rule->precedence + 1));
 
     switch (operatorType) {
-        case TOKEN_PLUS: emitByte(OP_ADD); break;
-        case TOKEN_MINUS: emitByte(OP_SUBTRACT); break;
-        case TOKEN_STAR: emitByte(OP_MULTIPLY); break;
-        case TOKEN_SLASH: emitByte(OP_DIVIDE); break;
-        case TOKEN_EQUAL_EQUAL: emitByte(OP_EQUAL); break;
-        case TOKEN_BANG_EQUAL: emitBytes(OP_EQUAL, OP_NOT); break;
-        case TOKEN_GREATER: emitByte(OP_GREATER); break;
-        case TOKEN_GREATER_EQUAL: emitBytes(OP_LESS, OP_NOT); break;
-        case TOKEN_LESS: emitByte(OP_LESS); break;
-        case TOKEN_LESS_EQUAL: emitBytes(OP_GREATER, OP_NOT); break;
+        case TOKEN_PLUS: emitByte(parser, OP_ADD); break;
+        case TOKEN_MINUS: emitByte(parser, OP_SUBTRACT); break;
+        case TOKEN_STAR: emitByte(parser, OP_MULTIPLY); break;
+        case TOKEN_SLASH: emitByte(parser, OP_DIVIDE); break;
+        case TOKEN_EQUAL_EQUAL: emitByte(parser, OP_EQUAL); break;
+        case TOKEN_BANG_EQUAL: emitBytes(parser, OP_EQUAL, OP_NOT); break;
+        case TOKEN_GREATER: emitByte(parser, OP_GREATER); break;
+        case TOKEN_GREATER_EQUAL: emitBytes(parser, OP_LESS, OP_NOT); break;
+        case TOKEN_LESS: emitByte(parser, OP_LESS); break;
+        case TOKEN_LESS_EQUAL: emitBytes(parser, OP_GREATER, OP_NOT); break;
         default: return;
     }
 }
 
-static void call(bool) {
-    uint8_t argCount = argumentList();
-    emitBytes(OP_CALL, argCount);
+static void call(Parser* parser, bool) {
+    uint8_t argCount = argumentList(parser);
+    parser->compiler->lastCall = currentChunk(parser)->count;
+    emitBytes(parser, OP_CALL, argCount);
 }
 
-static void dot(bool canAssign) {
-    consume(TOKEN_IDENTIFIER, "Expect property name after '.'.");
-    uint8_t name = identifierConstant(&parser.previous);
-    if (canAssign && match(TOKEN_EQUAL)) {
-        expression();
-        emitBytes(OP_SET_PROPERTY, name);
-    } else if (match(TOKEN_LEFT_PAREN)) {
-        uint8_t argCount = argumentList();
-        emitBytes(OP_INVOKE, name);
-        emitByte(argCount);
+static void dot(Parser* parser, bool canAssign) {
+    consume(parser, TOKEN_IDENTIFIER, "Expect property name after '.'.");
+    uint8_t name = identifierConstant(parser, &parser->previous);
+    if (canAssign && match(parser, TOKEN_EQUAL)) {
+        expression(parser);
+        emitBytes(parser, OP_SET_PROPERTY, name);
+        emitCache(parser);
+    } else if (match(parser, TOKEN_LEFT_PAREN)) {
+        uint8_t argCount = argumentList(parser);
+        emitBytes(parser, OP_INVOKE, name);
+        emitCache(parser);
+        emitByte(parser, argCount);
     } else {
-        emitBytes(OP_GET_PROPERTY, name);
+        emitBytes(parser, OP_GET_PROPERTY, name);
+        emitCache(parser);
     }
 }
 
-static void unary(bool) {
-    TokenType operatorType = parser.previous.type;
+static void unary(Parser* parser, bool) {
+    TokenType operatorType = parser->previous.type;
 
-    parsePrecedence(PREC_UNARY);
+    parsePrecedence(parser, PREC_UNARY);
 
     switch (operatorType) {
-        case TOKEN_MINUS: emitByte(OP_NEGATE); break;
-        case TOKEN_BANG: emitByte(OP_NOT); break;
+        case TOKEN_MINUS: emitByte(parser, OP_NEGATE); break;
+        case TOKEN_BANG: emitByte(parser, OP_NOT); break;
         default: return;
     }
 }
 
-static void number(bool) {
-    double value = strtod(parser.previous.start, NULL);
-    emitConstant(NUMBER_VAL(value));
+static void number(Parser* parser, bool) {
+    double value = strtod(parser->previous.start, NULL);
+    emitConstant(parser, NUMBER_VAL(value));
 }
 
-static void string(bool) {
-    emitConstant(OBJ_VAL(
-        copyString(parser.previous.start + 1, parser.previous.length - 2)));
+static void string(Parser* parser, bool) {
+    emitConstant(parser, OBJ_VAL(copyString(parser->vm,
+                                            parser->previous.start + 1,
+                                            parser->previous.length - 2)));
 }
 
-static void namedVariable(Token name, bool canAssign) {
+static void namedVariable(Parser* parser, Token name, bool canAssign) {
     uint8_t getOp, setOp;
-    int arg = resolveLocal(current, &name);
+    int arg = resolveLocal(parser, parser->compiler, &name);
 
     if (arg != -1) {
         getOp = OP_GET_LOCAL;
         setOp = OP_SET_LOCAL;
-    } else if ((arg = resolveUpvalue(current, &name)) != -1) {
+    } else if ((arg = resolveUpvalue(parser, parser->compiler, &name)) != -1) {
         getOp = OP_GET_UPVALUE;
         setOp = OP_SET_UPVALUE;
     } else {
-        arg = identifierConstant(&name);
+        arg = globalVariable(parser, &name);
         getOp = OP_GET_GLOBAL;
         setOp = OP_SET_GLOBAL;
     }
 
-    if (canAssign && match(TOKEN_EQUAL)) {
-        expression();
-        emitBytes(setOp, arg);
+    uint8_t op = getOp;
+    if (canAssign && match(parser, TOKEN_EQUAL)) {
+        expression(parser);
+        op = setOp;
+    }
+    if (getOp == OP_GET_GLOBAL) {
+        emitGlobal(parser, op, arg);
     } else {
-        emitBytes(getOp, arg);
+        emitBytes(parser, op, arg);
     }
 }
 
-static void variable(bool canAssign) {
-    namedVariable(parser.previous, canAssign);
+static void variable(Parser* parser, bool canAssign) {
+    namedVariable(parser, parser->previous, canAssign);
 }
 
 static Token syntheticToken(const char* text) {
@@ -872,42 +955,43 @@ static Token syntheticToken(const char* text) {
     return token;
 }
 
-static void super_(bool) {
-    if (currentClass == NULL) {
-        error("Can't use 'super' outside of a class.");
-    } else if (!currentClass->hasSuperclass) {
-        error("Can't use 'super' in a class with no superclass.");
+static void super_(Parser* parser, bool) {
+    if (parser->currentClass == NULL) {
+        error(parser, "Can't use 'super' outside of a class.");
+    } else if (!parser->currentClass->hasSuperclass) {
+        error(parser, "Can't use 'super' in a class with no superclass.");
     }
 
-    consume(TOKEN_DOT, "Expect '.' after 'super'.");
-    consume(TOKEN_IDENTIFIER, "Expect superclass method name.");
-    uint8_t name = identifierConstant(&parser.previous);
-
-    namedVariable(syntheticToken("this"), false);
-    if (match(TOKEN_LEFT_PAREN)) {
-        uint8_t argCount = argumentList();
-        namedVariable(syntheticToken("super"), false);
-        emitBytes(OP_SUPER_INVOKE, name);
-        emitByte(argCount);
+    consume(parser, TOKEN_DOT, "Expect '.' after 'super'.");
+    consume(parser, TOKEN_IDENTIFIER, "Expect superclass method name.");
+    uint8_t name = identifierConstant(parser, &parser->previous);
+
+    namedVariable(parser, syntheticToken("this"), false);
+    if (match(parser, TOKEN_LEFT_PAREN)) {
+        uint8_t argCount = argumentList(parser);
+        namedVariable(parser, syntheticToken("super"), false);
+        emitBytes(parser, OP_SUPER_INVOKE, name);
+        emitCache(parser);
+        emitByte(parser, argCount);
     } else {
-        namedVariable(syntheticToken("super"), false);
-        emitBytes(OP_GET_SUPER, name);
+        namedVariable(parser, syntheticToken("super"), false);
+        emitBytes(parser, OP_GET_SUPER, name);
     }
 }
 
-static void this_(bool) {
-    if (currentClass == NULL) {
-        error("Can't use 'this' outside of a class.");
+static void this_(Parser* parser, bool) {
+    if (parser->currentClass == NULL) {
+        error(parser, "Can't use 'this' outside of a class.");
         return;
     }
-    variable(false);
+    variable(parser, false);
 }
 
-static void literal(bool) {
-    switch (parser.previous.type) {
-        case TOKEN_FALSE: emitByte(OP_FALSE); break;
-        case TOKEN_TRUE: emitByte(OP_TRUE); break;
-        case TOKEN_NIL: emitByte(OP_NIL); break;
+static void literal(Parser* parser, bool) {
+    switch (parser->previous.type) {
+        case TOKEN_FALSE: emitByte(parser, OP_FALSE); break;
+        case TOKEN_TRUE: emitByte(parser, OP_TRUE); break;
+        case TOKEN_NIL: emitByte(parser, OP_NIL); break;
         default: return;
     }
 }
@@ -963,28 +1047,31 @@ static ParseRule* getRule(TokenType type) { return &rules[type]; }
 
 // === Main function ===
 
-ObjFunction* compile(const char* source) {
-    initScanner(source);
+ObjFunction* compile(VM* vm, const char* source) {
+    Parser parser = {.vm = vm};
+    initScanner(&parser.scanner, source);
+    vm->parser = &parser;
 
     Compiler compiler;
-    initCompiler(&compiler, TYPE_SCRIPT);
+    initCompiler(&parser, &compiler, TYPE_SCRIPT);
 
-    parser.hadError = false;
-    parser.panicMode = false;
-
-    advance();
-    while (!match(TOKEN_EOF)) {
-        declaration();
+    advance(&parser);
+    while (!match(&parser, TOKEN_EOF)) {
+        declaration(&parser);
     }
 
-    ObjFunction* function = endCompiler();
+    ObjFunction* function = endCompiler(&parser);
+    vm->parser = NULL;
     return parser.hadError ? NULL : function;
 }
 
-void markCompilerRoots() {
-    Compiler* compiler = current;
+void markCompilerRoots(VM* vm) {
+    if (vm->parser == NULL)
+        return;
+    Compiler* compiler = vm->parser->compiler;
     while (compiler != NULL) {
-        markObject((Obj*)compiler->function);
+        // Constants go into it without write barriers.
+        markMutable(vm, (Obj*)compiler->function);
         compiler = compiler->enclosing;
     }
-}
\ No newline at end of file
+}
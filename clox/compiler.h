@@ -4,7 +4,7 @@
 #include "chunk.h"
 #include "object.h"
 
-ObjFunction* compile(const char* source);
-void markCompilerRoots();
+ObjFunction* compile(VM* vm, const char* source);
+void markCompilerRoots(VM* vm);
 
 #endif
\ No newline at end of file
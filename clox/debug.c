@@ -2,9 +2,11 @@
 #include <stdlib.h>
 #include <string.h>
 
+#include "cache.h"
 #include "debug.h"
 #include "object.h"
 #include "value.h"
+#include "vm.h"
 
 static int simpleInstruction(const char name[], int offset) {
     printf("%s\n", name);
@@ -31,6 +33,16 @@ static int byteInstruction(const char* name, Chunk* chunk, int offset) {
     return offset + 2;
 }
 
+static int globalInstruction(VM* vm, const char* name, Chunk* chunk,
+                             int offset) {
+    uint16_t slot = (uint16_t)((chunk->code[offset + 1] << 8) |
+                               chunk->code[offset + 2]);
+    printf("%-16s %4d '", name, slot);
+    printValue(vm->globalNames.values[slot]);
+    printf("'\n");
+    return offset + 3;
+}
+
 static int jumpInstruction(const char* name, int sign, Chunk* chunk,
                            int offset) {
     uint16_t jump = (uint16_t)(chunk->code[offset + 1] << 8);
@@ -39,23 +51,91 @@ static int jumpInstruction(const char* name, int sign, Chunk* chunk,
     return offset + 3;
 }
 
+static int propertyInstruction(const char* name, Chunk* chunk, int offset) {
+    uint8_t constant = chunk->code[offset + 1];
+    printf("%-16s %4d '", name, constant);
+    printValue(chunk->constants.values[constant]);
+    printf("' ic %d\n", cacheIndex(chunk, offset));
+    return offset + 4;
+}
+
 static int invokeInstruction(const char* name, Chunk* chunk, int offset) {
     uint8_t constant = chunk->code[offset + 1];
-    uint8_t argCount = chunk->code[offset + 2];
+    uint8_t argCount = chunk->code[offset + 4];
     printf("%-16s (%d args) %4d '", name, argCount, constant);
     printValue(chunk->constants.values[constant]);
+    printf("' ic %d\n", cacheIndex(chunk, offset));
+    return offset + 5;
+}
+
+static int localsInstruction(const char* name, Chunk* chunk, int offset) {
+    uint8_t a = chunk->code[offset + 1];
+    uint8_t b = chunk->code[offset + 2];
+    printf("%-16s %4d %4d\n", name, a, b);
+    return offset + 3;
+}
+
+static int localConstantInstruction(const char* name, Chunk* chunk,
+                                    int offset) {
+    uint8_t slot = chunk->code[offset + 1];
+    uint8_t constant = chunk->code[offset + 2];
+    printf("%-16s %4d %4d '", name, slot, constant);
+    printValue(chunk->constants.values[constant]);
     printf("'\n");
     return offset + 3;
 }
 
-void disassembleChunk(Chunk* chunk, const char* name) {
+static void printRegister(Chunk* chunk, uint8_t operand) {
+    if (operand & RK_CONSTANT) {
+        printf(" k%d'", operand & ~RK_CONSTANT);
+        printValue(chunk->constants.values[operand & ~RK_CONSTANT]);
+        printf("'");
+    } else {
+        printf(" r%d", operand);
+    }
+}
+
+static int registerInstruction(const char* name, Chunk* chunk, int offset) {
+    uint8_t dst = chunk->code[offset + 1];
+    printf("%-16s", name);
+    if (dst == R_STACK) {
+        printf(" push");
+    } else {
+        printf(" r%d", dst);
+    }
+    printRegister(chunk, chunk->code[offset + 2]);
+    printRegister(chunk, chunk->code[offset + 3]);
+    printf("\n");
+    return offset + 4;
+}
+
+static int registerMoveInstruction(const char* name, Chunk* chunk,
+                                   int offset) {
+    printf("%-16s r%d", name, chunk->code[offset + 1]);
+    printRegister(chunk, chunk->code[offset + 2]);
+    printf("\n");
+    return offset + 3;
+}
+
+static int registerJumpInstruction(const char* name, Chunk* chunk,
+                                   int offset) {
+    uint16_t jump = (uint16_t)(chunk->code[offset + 3] << 8);
+    jump |= chunk->code[offset + 4];
+    printf("%-16s", name);
+    printRegister(chunk, chunk->code[offset + 1]);
+    printRegister(chunk, chunk->code[offset + 2]);
+    printf(" %4d -> %d\n", offset, offset + 5 + jump);
+    return offset + 5;
+}
+
+void disassembleChunk(VM* vm, Chunk* chunk, const char* name) {
     printf("== %s ==\n", name);
     for (int offset = 0; offset < chunk->count;) {
-        offset = disassembleInstruction(chunk, offset);
+        offset = disassembleInstruction(vm, chunk, offset);
     }
 }
 
-int disassembleInstruction(Chunk* chunk, int offset) {
+int disassembleInstruction(VM* vm, Chunk* chunk, int offset) {
     printf("%04d ", offset);
     if (offset > 0 && getLine(chunk, offset) == getLine(chunk, offset - 1)) {
         printf(" | ");
@@ -86,11 +166,11 @@ int disassembleInstruction(Chunk* chunk, int offset) {
         case OP_ASSERT: return simpleInstruction("OP_ASSERT", offset);
         case OP_POP: return simpleInstruction("OP_POP", offset);
         case OP_DEFINE_GLOBAL:
-            return constantInstruction("OP_DEFINE_GLOBAL", chunk, offset, 1);
+            return globalInstruction(vm, "OP_DEFINE_GLOBAL", chunk, offset);
         case OP_GET_GLOBAL:
-            return constantInstruction("OP_GET_GLOBAL", chunk, offset, 1);
+            return globalInstruction(vm, "OP_GET_GLOBAL", chunk, offset);
         case OP_SET_GLOBAL:
-            return constantInstruction("OP_SET_GLOBAL", chunk, offset, 1);
+            return globalInstruction(vm, "OP_SET_GLOBAL", chunk, offset);
         case OP_GET_LOCAL:
             return byteInstruction("OP_GET_LOCAL", chunk, offset);
         case OP_SET_LOCAL:
@@ -100,6 +180,8 @@ int disassembleInstruction(Chunk* chunk, int offset) {
             return jumpInstruction("OP_JUMP_IF_FALSE", 1, chunk, offset);
         case OP_LOOP: return jumpInstruction("OP_LOOP", -1, chunk, offset);
         case OP_CALL: return byteInstruction("OP_CALL", chunk, offset);
+        case OP_TAIL_CALL:
+            return byteInstruction("OP_TAIL_CALL", chunk, offset);
         case OP_CLOSURE: {
             offset++;
             uint8_t constant = chunk->code[offset++];
@@ -125,9 +207,9 @@ int disassembleInstruction(Chunk* chunk, int offset) {
             return simpleInstruction("OP_CLOSE_UPVALUE", offset);
         case OP_CLASS: return constantInstruction("OP_CLASS", chunk, offset, 1);
         case OP_GET_PROPERTY:
-            return constantInstruction("OP_GET_PROPERTY", chunk, offset, 1);
+            return propertyInstruction("OP_GET_PROPERTY", chunk, offset);
         case OP_SET_PROPERTY:
-            return constantInstruction("OP_SET_PROPERTY", chunk, offset, 1);
+            return propertyInstruction("OP_SET_PROPERTY", chunk, offset);
         case OP_METHOD:
             return constantInstruction("OP_METHOD", chunk, offset, 1);
         case OP_INVOKE: return invokeInstruction("OP_INVOKE", chunk, offset);
@@ -136,6 +218,222 @@ int disassembleInstruction(Chunk* chunk, int offset) {
             return constantInstruction("OP_GET_SUPER", chunk, offset, 1);
         case OP_SUPER_INVOKE:
             return invokeInstruction("OP_SUPER_INVOKE", chunk, offset);
+        case OP_ADD_LOCALS:
+            return localsInstruction("OP_ADD_LOCALS", chunk, offset);
+        case OP_LESS_JUMP_IF_FALSE:
+            return jumpInstruction("OP_LESS_JUMP_IF_FALSE", 1, chunk, offset);
+        case OP_INCREMENT_LOCAL:
+            return localConstantInstruction("OP_INCREMENT_LOCAL", chunk,
+                                            offset);
+        case OP_R_MOVE:
+            return registerMoveInstruction("OP_R_MOVE", chunk, offset);
+        case OP_R_ADD: return registerInstruction("OP_R_ADD", chunk, offset);
+        case OP_R_SUBTRACT:
+            return registerInstruction("OP_R_SUBTRACT", chunk, offset);
+        case OP_R_MULTIPLY:
+            return registerInstruction("OP_R_MULTIPLY", chunk, offset);
+        case OP_R_DIVIDE:
+            return registerInstruction("OP_R_DIVIDE", chunk, offset);
+        case OP_R_EQUAL:
+            return registerInstruction("OP_R_EQUAL", chunk, offset);
+        case OP_R_GREATER:
+            return registerInstruction("OP_R_GREATER", chunk, offset);
+        case OP_R_LESS: return registerInstruction("OP_R_LESS", chunk, offset);
+        case OP_R_LESS_JUMP_IF_FALSE:
+            return registerJumpInstruction("OP_R_LESS_JUMP_IF_FALSE", chunk,
+                                           offset);
+        case OP_R_GREATER_JUMP_IF_FALSE:
+            return registerJumpInstruction("OP_R_GREATER_JUMP_IF_FALSE", chunk,
+                                           offset);
+        case OP_ADD_NUM: return simpleInstruction("OP_ADD_NUM", offset);
+        case OP_GET_PROPERTY_SLOT:
+            return propertyInstruction("OP_GET_PROPERTY_SLOT", chunk, offset);
+        case OP_SET_PROPERTY_SLOT:
+            return propertyInstruction("OP_SET_PROPERTY_SLOT", chunk, offset);
+        case OP_INVOKE_METHOD:
+            return invokeInstruction("OP_INVOKE_METHOD", chunk, offset);
         default: printf("Unknown opcode %d\n", instruction); return offset + 1;
     }
 }
+
+static const char* cacheState(InlineCache* cache) {
+    if (cache->megamorphic)
+        return "megamorphic";
+    switch (cache->count) {
+        case 0: return "uninitialized";
+        case 1: return "monomorphic";
+        default: return "polymorphic";
+    }
+}
+
+void printCacheStats(VM* vm, FILE* out) {
+    uint64_t hits = 0;
+    uint64_t misses = 0;
+
+    fprintf(out, "== inline caches ==\n");
+    for (Obj* object = nextObject(&vm->heap, NULL); object != NULL;
+         object = nextObject(&vm->heap, object)) {
+        if (object->type != OBJ_FUNCTION)
+            continue;
+        ObjFunction* function = (ObjFunction*)object;
+        Chunk* chunk = &function->chunk;
+        for (int offset = 0; offset < chunk->count;
+             offset += instructionLength(chunk, offset)) {
+            int index = cacheIndex(chunk, offset);
+            if (index < 0)
+                continue;
+            InlineCache* cache = &chunk->caches[index];
+            if (cache->hits + cache->misses == 0)
+                continue;
+            ObjString* name = AS_STRING(
+                chunk->constants.values[chunk->code[offset + 1]]);
+            fprintf(out, "%s:%d %s '%s' hits %llu misses %llu %s\n",
+                    function->name == NULL ? "script" : function->name->chars,
+                    getLine(chunk, offset),
+                    opCodeToString(chunk->code[offset]), name->chars,
+                    (unsigned long long)cache->hits,
+                    (unsigned long long)cache->misses, cacheState(cache));
+            hits += cache->hits;
+            misses += cache->misses;
+        }
+    }
+    fprintf(out, "total hits %llu misses %llu\n", (unsigned long long)hits,
+            (unsigned long long)misses);
+}
+
+static const char* objTypeNames[OBJ_TYPE_COUNT] = {
+    [OBJ_STRING] = "string",     [OBJ_FUNCTION] = "function",
+    [OBJ_NATIVE] = "native",     [OBJ_CLOSURE] = "closure",
+    [OBJ_UPVALUE] = "upvalue",   [OBJ_CLASS] = "class",
+    [OBJ_INSTANCE] = "instance", [OBJ_BOUND_METHOD] = "bound method",
+    [OBJ_FIBER] = "fiber",
+};
+
+void printGCStats(VM* vm, FILE* out) {
+    GCStats* stats = &vm->gcStats;
+    fprintf(out, "== gc ==\n");
+    fprintf(out, "collections %d (%d minor) steps %d promoted %llu objects\n",
+            stats->collections, stats->minorCollections, stats->steps,
+            (unsigned long long)stats->promoted);
+    fprintf(out, "pause total %.3f ms max %.3f ms p50 %.3f ms p99 %.3f ms\n",
+            stats->totalPause / 1e6, stats->maxPause / 1e6,
+            gcPausePercentile(vm, 0.5) / 1e6,
+            gcPausePercentile(vm, 0.99) / 1e6);
+    fprintf(out, "heap %zu bytes, last collection %zu -> %zu, next at %zu\n",
+            vm->bytesAllocated, stats->bytesBefore, stats->bytesAfter,
+            vm->nextGC);
+    fprintf(out, "gray stack peak %d, interned strings %d of %d\n",
+            stats->maxGrayPeak, stats->strings, stats->stringCapacity);
+
+    for (int bucket = 0; bucket < GC_PAUSE_BUCKETS; bucket++) {
+        if (stats->pauses[bucket] == 0)
+            continue;
+        if (bucket == GC_PAUSE_BUCKETS - 1)
+            fprintf(out, "pauses >= %llu us", 1ull << (bucket - 1));
+        else
+            fprintf(out, "pauses < %llu us", 1ull << bucket);
+        fprintf(out, " %llu\n", (unsigned long long)stats->pauses[bucket]);
+    }
+    for (int type = 0; type < OBJ_TYPE_COUNT; type++) {
+        if (stats->freed[type] > 0)
+            fprintf(out, "freed %s %llu\n", objTypeNames[type],
+                    (unsigned long long)stats->freed[type]);
+    }
+}
+
+// An opcode, an opcode pair or a function with how often it ran, sorted by
+// writeOpcodeStats().
+typedef struct {
+    int first;
+    int second;
+    ObjFunction* function;
+    uint64_t count;
+} Counted;
+
+static int compareCounted(const void* a, const void* b) {
+    const Counted* left = a;
+    const Counted* right = b;
+    if (left->count != right->count)
+        return left->count < right->count ? 1 : -1;
+    if (left->first != right->first)
+        return left->first - right->first;
+    return left->second - right->second;
+}
+
+void writeOpcodeStats(VM* vm, FILE* out) {
+    OpcodeStats* stats = vm->opcodeStats;
+    Counted* counted = malloc(sizeof(Counted) * UINT8_COUNT * UINT8_COUNT);
+    if (counted == NULL)
+        return;
+
+    uint64_t total = 0;
+    int count = 0;
+    for (int op = 0; op < UINT8_COUNT; op++) {
+        total += stats->counts[op];
+        if (stats->counts[op] > 0)
+            counted[count++] = (Counted){op, 0, NULL, stats->counts[op]};
+    }
+    qsort(counted, count, sizeof(Counted), compareCounted);
+    fprintf(out, "{\n  \"total\": %llu,\n  \"opcodes\": [",
+            (unsigned long long)total);
+    for (int i = 0; i < count; i++) {
+        fprintf(out, "%s\n    {\"opcode\": \"%s\", \"count\": %llu}",
+                i == 0 ? "" : ",", opCodeToString(counted[i].first),
+                (unsigned long long)counted[i].count);
+    }
+
+    count = 0;
+    for (int first = 0; first < UINT8_COUNT; first++) {
+        for (int second = 0; second < UINT8_COUNT; second++) {
+            uint64_t pair = stats->pairs[first][second];
+            if (pair > 0)
+                counted[count++] = (Counted){first, second, NULL, pair};
+        }
+    }
+    qsort(counted, count, sizeof(Counted), compareCounted);
+    fprintf(out, "\n  ],\n  \"pairs\": [");
+    for (int i = 0; i < count; i++) {
+        fprintf(out,
+                "%s\n    {\"first\": \"%s\", \"second\": \"%s\", "
+                "\"count\": %llu}",
+                i == 0 ? "" : ",", opCodeToString(counted[i].first),
+                opCodeToString(counted[i].second),
+                (unsigned long long)counted[i].count);
+    }
+    free(counted);
+
+    // Functions numbered in heap order, so equal counts keep that order.
+    count = 0;
+    for (Obj* object = nextObject(&vm->heap, NULL); object != NULL;
+         object = nextObject(&vm->heap, object)) {
+        if (object->type == OBJ_FUNCTION &&
+            ((ObjFunction*)object)->executed > 0)
+            count++;
+    }
+    counted = malloc(sizeof(Counted) * (count > 0 ? count : 1));
+    if (counted == NULL)
+        return;
+    count = 0;
+    for (Obj* object = nextObject(&vm->heap, NULL); object != NULL;
+         object = nextObject(&vm->heap, object)) {
+        ObjFunction* function = (ObjFunction*)object;
+        if (object->type != OBJ_FUNCTION || function->executed == 0)
+            continue;
+        counted[count] = (Counted){count, 0, function, function->executed};
+        count++;
+    }
+    qsort(counted, count, sizeof(Counted), compareCounted);
+    fprintf(out, "\n  ],\n  \"functions\": [");
+    for (int i = 0; i < count; i++) {
+        ObjFunction* function = counted[i].function;
+        fprintf(out,
+                "%s\n    {\"name\": \"%s\", \"line\": %d, "
+                "\"instructions\": %llu}",
+                i == 0 ? "" : ",",
+                function->name == NULL ? "script" : function->name->chars,
+                getLine(&function->chunk, 0),
+                (unsigned long long)counted[i].count);
+    }
+    fprintf(out, "\n  ]\n}\n");
+    free(counted);
+}
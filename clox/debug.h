@@ -1,9 +1,60 @@
 #ifndef clox_debug_h
 #define clox_debug_h
 
+#include <stdio.h>
+
 #include "chunk.h"
+#include "vm.h"
+
+void disassembleChunk(VM* vm, Chunk* chunk, const char* name);
+int disassembleInstruction(VM* vm, Chunk* chunk, int offset);
+
+/**
+ * @brief Prints the hits and misses of every inline cache that ran.
+ *
+ * Caches live in the chunks of functions that are still allocated, so sites
+ * of functions the GC already freed are not reported.
+ */
+void printCacheStats(VM* vm, FILE* out);
+
+/**
+ * @brief Prints a summary of vm->gcStats: pauses, their histogram, the heap
+ * and what was freed.
+ */
+void printGCStats(VM* vm, FILE* out);
+
+/**
+ * @struct OpcodeStats
+ * @brief Instructions counted by run() for --opcode-stats.
+ *
+ * Compiled code doesn't go through run(), so the JIT stays off while the
+ * VM counts. Counts are of the instructions as run, quickened forms
+ * included.
+ */
+struct OpcodeStats {
+    uint64_t counts[UINT8_COUNT];             /**< Runs of each opcode */
+    uint64_t pairs[UINT8_COUNT][UINT8_COUNT]; /**< Opcode after another */
+    int previous; /**< Opcode run last, or -1 before the first */
+};
+
+/**
+ * @brief Counts an instruction about to run in function.
+ */
+static inline void countInstruction(OpcodeStats* stats, ObjFunction* function,
+                                    uint8_t instruction) {
+    stats->counts[instruction]++;
+    if (stats->previous >= 0)
+        stats->pairs[stats->previous][instruction]++;
+    stats->previous = instruction;
+    function->executed++;
+}
 
-void disassembleChunk(Chunk* chunk, const char* name);
-int disassembleInstruction(Chunk* chunk, int offset);
+/**
+ * @brief Writes the counts of vm->opcodeStats as JSON.
+ *
+ * Opcodes, pairs and functions come in decreasing order of count. Like
+ * printCacheStats(), functions the GC already freed are not reported.
+ */
+void writeOpcodeStats(VM* vm, FILE* out);
 
 #endif
@@ -0,0 +1,298 @@
+#include <stdlib.h>
+#include <string.h>
+
+#include "heap.h"
+#include "memory.h"
+#include "object.h"
+#include "vm.h"
+
+// Offset of the first cell of a page, past its header.
+#define CELLS_OFFSET                                                           \
+    ((sizeof(Page) + HEAP_GRANULE - 1) / HEAP_GRANULE * HEAP_GRANULE)
+
+void initHeap(Heap* heap) {
+    for (int i = 0; i <= HEAP_LARGE; i++) {
+        heap->pages[i] = NULL;
+        heap->sweeping[i] = NULL;
+    }
+    for (int i = 0; i < HEAP_SIZE_CLASSES; i++)
+        heap->free[i] = NULL;
+    heap->young = NULL;
+    heap->youngCount = 0;
+    heap->youngCapacity = 0;
+}
+
+static Obj* cellAt(Page* page, size_t granule) {
+    return (Obj*)((char*)page + granule * HEAP_GRANULE);
+}
+
+static Page* newPage(Heap* heap, int sizeClass, size_t cellSize) {
+    size_t bytes = HEAP_PAGE_SIZE;
+    if (sizeClass == HEAP_LARGE)
+        bytes = (CELLS_OFFSET + cellSize + HEAP_PAGE_SIZE - 1) /
+                HEAP_PAGE_SIZE * HEAP_PAGE_SIZE;
+    Page* page = aligned_alloc(HEAP_PAGE_SIZE, bytes);
+    if (page == NULL)
+        exit(1);
+    memset(page, 0, sizeof(Page));
+    page->cellSize = (uint32_t)cellSize;
+    page->cellCount = sizeClass == HEAP_LARGE
+                          ? 1
+                          : (uint32_t)((HEAP_PAGE_SIZE - CELLS_OFFSET) /
+                                       cellSize);
+    page->sizeClass = (uint8_t)sizeClass;
+    // Linked so that cells are taken in address order.
+    char* cells = (char*)page + CELLS_OFFSET;
+    for (uint32_t i = page->cellCount; i-- > 0;) {
+        void** cell = (void**)(cells + i * cellSize);
+        *cell = page->freeCells;
+        page->freeCells = cell;
+    }
+
+    // Ahead of the sweep in progress, if any: it has nothing to free.
+    page->next = heap->pages[sizeClass];
+    if (page->next != NULL)
+        page->next->previous = page;
+    heap->pages[sizeClass] = page;
+    return page;
+}
+
+static void freePage(Heap* heap, Page* page) {
+    if (page->previous != NULL) {
+        page->previous->next = page->next;
+    } else {
+        heap->pages[page->sizeClass] = page->next;
+    }
+    if (page->next != NULL)
+        page->next->previous = page->previous;
+    free(page);
+}
+
+// Lists a page in heap->free once it has free cells.
+static void listFree(Heap* heap, Page* page) {
+    if (page->listed || page->freeCells == NULL ||
+        page->sizeClass == HEAP_LARGE)
+        return;
+    page->listed = true;
+    page->nextFree = heap->free[page->sizeClass];
+    heap->free[page->sizeClass] = page;
+}
+
+static void addYoung(Heap* heap, Page* page) {
+    if (heap->youngCapacity < heap->youngCount + 1) {
+        heap->youngCapacity = GROW_CAPACITY(heap->youngCapacity);
+        heap->young = realloc(heap->young, sizeof(Page*) * heap->youngCapacity);
+        if (heap->young == NULL)
+            exit(1);
+    }
+    page->young = true;
+    heap->young[heap->youngCount++] = page;
+}
+
+static void forgetYoung(Heap* heap) {
+    for (int i = 0; i < heap->youngCount; i++)
+        heap->young[i]->young = false;
+    heap->youngCount = 0;
+}
+
+// Frees the object starting at granule, giving its cell back to the page.
+static void freeCell(VM* vm, Page* page, size_t granule) {
+    Obj* object = cellAt(page, granule);
+    vm->gcStats.freed[object->type]++;
+    freeObject(vm, object);
+    vm->bytesAllocated -= page->cellSize;
+    page->live[granule / 64] &= ~((uint64_t)1 << (granule % 64));
+    page->liveCount--;
+    *(void**)object = page->freeCells;
+    page->freeCells = object;
+}
+
+// Keeps a marked object, old from now on. Its header is only written to if
+// that changes it, pages of old objects stay clean.
+static void promote(VM* vm, Obj* object) {
+    if (atomic_load_explicit(&object->scan, memory_order_relaxed) !=
+        SCAN_NONE)
+        atomic_store_explicit(&object->scan, SCAN_NONE, memory_order_relaxed);
+    if (!object->old) {
+        object->old = true;
+        vm->gcStats.promoted++;
+    }
+}
+
+// Sweeps a page for a full collection, freeing it if none of its objects
+// are left, unless no other page of its size class has free cells: the
+// allocations would need a new one then. Returns how many cells it has.
+static int sweepPage(VM* vm, Page* page) {
+    Heap* heap = &vm->heap;
+    int cells = (int)page->cellCount;
+    for (int word = 0; word < HEAP_BITMAP_WORDS; word++) {
+        uint64_t live = page->live[word];
+        uint64_t marks = page->marks[word];
+        for (uint64_t bits = live; bits != 0; bits &= bits - 1) {
+            int bit = __builtin_ctzll(bits);
+            if ((marks >> bit) & 1) {
+                promote(vm, cellAt(page, word * 64 + bit));
+            } else {
+                freeCell(vm, page, word * 64 + bit);
+            }
+        }
+    }
+    memset(page->marks, 0, sizeof(page->marks));
+    bool spare = page->sizeClass != HEAP_LARGE &&
+                 heap->free[page->sizeClass] == NULL;
+    if (page->liveCount == 0 && !spare) {
+        freePage(heap, page);
+    } else {
+        listFree(heap, page);
+    }
+    return cells;
+}
+
+// A page of sizeClass with a free cell. The pages the sweep in progress did
+// not reach yet are swept until one has, before a new page is allocated.
+static Page* pageWithFreeCell(VM* vm, int sizeClass, size_t cellSize) {
+    Heap* heap = &vm->heap;
+    while (heap->free[sizeClass] == NULL &&
+           heap->sweeping[sizeClass] != NULL) {
+        Page* page = heap->sweeping[sizeClass];
+        heap->sweeping[sizeClass] = page->next;
+        sweepPage(vm, page);
+    }
+    if (heap->free[sizeClass] == NULL)
+        listFree(heap, newPage(heap, sizeClass, cellSize));
+    return heap->free[sizeClass];
+}
+
+Obj* allocateCell(VM* vm, size_t size) {
+    Heap* heap = &vm->heap;
+    size_t granules = (size + HEAP_GRANULE - 1) / HEAP_GRANULE;
+    int sizeClass =
+        granules <= HEAP_SIZE_CLASSES ? (int)granules - 1 : HEAP_LARGE;
+    size_t cellSize = granules * HEAP_GRANULE;
+    // May sweep, or collect young objects, before the cell is taken.
+    countAllocation(vm, 0, cellSize);
+
+    Page* page = sizeClass == HEAP_LARGE
+                     ? newPage(heap, HEAP_LARGE, cellSize)
+                     : pageWithFreeCell(vm, sizeClass, cellSize);
+    Obj* object = page->freeCells;
+    page->freeCells = *(void**)object;
+    if (page->freeCells == NULL && page->listed) {
+        heap->free[sizeClass] = page->nextFree;
+        page->listed = false;
+    }
+    size_t granule = granuleOf(object);
+    page->live[granule / 64] |= (uint64_t)1 << (granule % 64);
+    page->liveCount++;
+    if (!page->young)
+        addYoung(heap, page);
+    return object;
+}
+
+void startSweep(Heap* heap) {
+    // Free cells are only taken from swept pages, the others hold marks.
+    for (int i = 0; i < HEAP_SIZE_CLASSES; i++) {
+        for (Page* page = heap->free[i]; page != NULL; page = page->nextFree)
+            page->listed = false;
+        heap->free[i] = NULL;
+    }
+    for (int i = 0; i <= HEAP_LARGE; i++)
+        heap->sweeping[i] = heap->pages[i];
+    // Their objects are all swept, those allocated from now on are young.
+    forgetYoung(heap);
+}
+
+bool sweepPages(VM* vm, int budget) {
+    Heap* heap = &vm->heap;
+    int swept = 0;
+    for (int i = 0; i <= HEAP_LARGE; i++) {
+        while (heap->sweeping[i] != NULL) {
+            if (budget >= 0 && swept > 0 && swept >= budget)
+                return false;
+            Page* page = heap->sweeping[i];
+            heap->sweeping[i] = page->next;
+            swept += sweepPage(vm, page);
+        }
+    }
+    return true;
+}
+
+void sweepYoung(VM* vm) {
+    Heap* heap = &vm->heap;
+    for (int i = 0; i < heap->youngCount; i++) {
+        Page* page = heap->young[i];
+        page->young = false;
+        for (int word = 0; word < HEAP_BITMAP_WORDS; word++) {
+            uint64_t marks = page->marks[word];
+            for (uint64_t bits = page->live[word]; bits != 0;
+                 bits &= bits - 1) {
+                int bit = __builtin_ctzll(bits);
+                Obj* object = cellAt(page, word * 64 + bit);
+                if (object->old)
+                    continue;
+                if ((marks >> bit) & 1) {
+                    promote(vm, object);
+                } else {
+                    freeCell(vm, page, word * 64 + bit);
+                }
+            }
+            // Only young objects were marked.
+            page->marks[word] = 0;
+        }
+        if (page->liveCount == 0 && page->sizeClass == HEAP_LARGE) {
+            freePage(heap, page);
+        } else {
+            listFree(heap, page);
+        }
+    }
+    heap->youngCount = 0;
+}
+
+Obj* nextObject(Heap* heap, Obj* previous) {
+    int sizeClass = 0;
+    Page* page = heap->pages[0];
+    size_t granule = 0;
+    if (previous != NULL) {
+        page = pageOf(previous);
+        sizeClass = page->sizeClass;
+        granule = granuleOf(previous) + 1;
+    }
+    for (;;) {
+        while (page == NULL) {
+            if (++sizeClass > HEAP_LARGE)
+                return NULL;
+            page = heap->pages[sizeClass];
+            granule = 0;
+        }
+        for (size_t word = granule / 64; word < HEAP_BITMAP_WORDS; word++) {
+            uint64_t bits = page->live[word];
+            if (word == granule / 64)
+                bits &= ~(uint64_t)0 << (granule % 64);
+            if (bits != 0)
+                return cellAt(page, word * 64 + __builtin_ctzll(bits));
+        }
+        page = page->next;
+        granule = 0;
+    }
+}
+
+void freeHeap(VM* vm) {
+    Heap* heap = &vm->heap;
+    for (int i = 0; i <= HEAP_LARGE; i++) {
+        Page* page = heap->pages[i];
+        while (page != NULL) {
+            Page* next = page->next;
+            for (int word = 0; word < HEAP_BITMAP_WORDS; word++) {
+                for (uint64_t bits = page->live[word]; bits != 0;
+                     bits &= bits - 1)
+                    freeObject(vm, cellAt(page, word * 64 +
+                                                    __builtin_ctzll(bits)));
+            }
+            free(page);
+            page = next;
+        }
+        heap->pages[i] = NULL;
+    }
+    free(heap->young);
+    initHeap(heap);
+}
@@ -0,0 +1,163 @@
+#ifndef clox_heap_h
+#define clox_heap_h
+
+#include "common.h"
+#include "value.h"
+
+/**
+ * @brief Bytes of a heap page, which is aligned on its size.
+ *
+ * The page of an object is its address rounded down, see pageOf().
+ */
+#define HEAP_PAGE_SIZE (64 * 1024)
+
+/**
+ * @brief Alignment of the cells in a page, and their sizes' unit.
+ *
+ * The bitmaps of a page have a bit per granule, set for the granule an
+ * object starts at.
+ */
+#define HEAP_GRANULE 16
+
+/**
+ * @brief Size classes of the cells, by granule from 16 to 512 bytes.
+ *
+ * Larger objects get pages of their own, in the list after those.
+ */
+#define HEAP_SIZE_CLASSES 32
+
+#define HEAP_LARGE HEAP_SIZE_CLASSES
+
+#define HEAP_BITMAP_WORDS (HEAP_PAGE_SIZE / HEAP_GRANULE / 64)
+
+typedef struct Page Page;
+
+/**
+ * @struct Page
+ * @brief Header of a heap page, its cells following.
+ *
+ * Collections mark objects in the page's bitmap rather than in their
+ * headers, so that marking writes to few cache lines and leaves the cells
+ * of old objects clean. A page of the large list holds one object only, of
+ * any size.
+ */
+struct Page {
+    Page* next;        /**< In its list of vm->heap.pages */
+    Page* previous;
+    Page* nextFree;    /**< In its list of vm->heap.free */
+    void* freeCells;   /**< Linked through their first word */
+    uint32_t cellSize; /**< Bytes, counted in vm->bytesAllocated */
+    uint32_t cellCount;
+    uint32_t liveCount; /**< Cells allocated and not freed yet */
+    uint8_t sizeClass;  /**< HEAP_LARGE for a page of its own */
+    bool listed;        /**< In vm->heap.free */
+    bool young;         /**< In vm->heap.young */
+    uint64_t marks[HEAP_BITMAP_WORDS]; /**< Reached by the collection */
+    uint64_t live[HEAP_BITMAP_WORDS];  /**< Allocated */
+};
+
+/**
+ * @struct Heap
+ * @brief The pages objects are allocated in.
+ *
+ * Full collections sweep lazily: once done marking, every page is left to
+ * sweep, and a page is only allocated from again once swept. Allocations
+ * sweep the pages of their size class as they run out of free cells, and
+ * the steps of the collection the rest, see sweepPages().
+ */
+typedef struct {
+    Page* pages[HEAP_SIZE_CLASSES + 1]; /**< Every page, by size class */
+    Page* sweeping[HEAP_SIZE_CLASSES + 1]; /**< First page left to sweep */
+    Page* free[HEAP_SIZE_CLASSES]; /**< Swept pages with free cells */
+    Page** young; /**< Pages allocated from since the last collection */
+    int youngCount;
+    int youngCapacity;
+} Heap;
+
+static inline Page* pageOf(Obj* object) {
+    return (Page*)((uintptr_t)object & ~(uintptr_t)(HEAP_PAGE_SIZE - 1));
+}
+
+static inline size_t granuleOf(Obj* object) {
+    return ((uintptr_t)object & (HEAP_PAGE_SIZE - 1)) / HEAP_GRANULE;
+}
+
+/**
+ * @brief Whether object has its mark bit set.
+ *
+ * Read relaxed, threads marking set the bits of a word concurrently.
+ */
+static inline bool objectMarked(Obj* object) {
+    size_t granule = granuleOf(object);
+    uint64_t word = __atomic_load_n(&pageOf(object)->marks[granule / 64],
+                                    __ATOMIC_RELAXED);
+    return (word >> (granule % 64)) & 1;
+}
+
+/**
+ * @brief Sets the mark bit of object.
+ *
+ * @param shared Whether other threads may mark objects of the page at the
+ * same time, the bit is set atomically then.
+ * @return Whether it was set already.
+ */
+static inline bool setMarked(Obj* object, bool shared) {
+    size_t granule = granuleOf(object);
+    uint64_t* word = &pageOf(object)->marks[granule / 64];
+    uint64_t bit = (uint64_t)1 << (granule % 64);
+    if (shared)
+        return __atomic_fetch_or(word, bit, __ATOMIC_RELAXED) & bit;
+    uint64_t old = __atomic_load_n(word, __ATOMIC_RELAXED);
+    __atomic_store_n(word, old | bit, __ATOMIC_RELAXED);
+    return old & bit;
+}
+
+void initHeap(Heap* heap);
+
+/**
+ * @brief Allocates a cell of at least size bytes, counted in
+ * vm->bytesAllocated.
+ *
+ * Runs a step of the collection in progress or starts one first, as
+ * reallocate() does. While a full collection sweeps, the pages of the cell's
+ * size class are swept until one has a free cell, before a new one is
+ * allocated.
+ */
+Obj* allocateCell(VM* vm, size_t size);
+
+/**
+ * @brief Leaves every page to sweep, once a full collection is done
+ * marking.
+ */
+void startSweep(Heap* heap);
+
+/**
+ * @brief Sweeps pages left to sweep until budget cells were, all of them if
+ * budget is negative, at least one page otherwise.
+ *
+ * Frees unmarked objects and promotes the marked ones.
+ * @return Whether no page is left to sweep.
+ */
+bool sweepPages(VM* vm, int budget);
+
+/**
+ * @brief Sweeps the pages allocated from since the last collection, once a
+ * minor collection is done marking.
+ */
+void sweepYoung(VM* vm);
+
+/**
+ * @brief The object after previous in the heap, the first if previous is
+ * NULL, or NULL past the last.
+ *
+ * In no particular order. Objects the sweep in progress did not reach yet
+ * are among them, whether reachable or not.
+ */
+Obj* nextObject(Heap* heap, Obj* previous);
+
+/**
+ * @brief Frees every object, then the pages.
+ */
+void freeHeap(VM* vm);
+
+#endif
@@ -0,0 +1,576 @@
+#include <stdlib.h>
+
+#include "assembler.h"
+#include "cache.h"
+#include "jit.h"
+#include "profile.h"
+
+#ifdef JIT
+
+// Registers pinned for the whole function, all callee-saved so the VM
+// helpers preserve them.
+#define STACK_TOP RBX    // Cached vm->stackTop, written back around helpers.
+#define SLOTS R12        // frame->slots.
+#define FRAME_OFFSET R13 // FRAME - vm->frames, to find it when frames move.
+#define FRAME R14        // The CallFrame* of the function.
+#define VM_BASE R15      // The VM running the code.
+
+#define XMM0 0
+#define XMM1 1
+
+// Where an operand of a numeric template comes from.
+typedef enum {
+    OPERAND_STACK,
+    OPERAND_LOCAL,
+    OPERAND_CONSTANT,
+} OperandKind;
+
+typedef struct {
+    OperandKind kind;
+    int slot;
+    Value constant;
+} Operand;
+
+// A rel32 to patch once every instruction has a native address.
+typedef struct {
+    int at;     // Offset of the rel32 in the native code.
+    int target; // Bytecode offset, or -1 for the error exit.
+} Fixup;
+
+typedef struct {
+    Assembler as;
+    ObjFunction* function;
+    int* labels; // Bytecode offset -> native offset.
+    Fixup* fixups;
+    int fixupCount;
+    int fixupCapacity;
+} JitCompiler;
+
+// Pushes a register on the VM stack.
+static void pushValue(JitCompiler* jc, Register src) {
+    store(&jc->as, STACK_TOP, 0, src);
+    addImm(&jc->as, STACK_TOP, sizeof(Value));
+}
+
+// Pops the VM stack into a register.
+static void popValue(JitCompiler* jc, Register dst) {
+    addImm(&jc->as, STACK_TOP, -(int)sizeof(Value));
+    load(&jc->as, dst, STACK_TOP, 0);
+}
+
+// Jump to the start of the native code of a bytecode instruction, or to the
+// error exit when target is -1.
+static void jumpTo(JitCompiler* jc, int cc, int target) {
+    Assembler* as = &jc->as;
+    int at = emitJump(as, cc);
+    if (jc->fixupCount == jc->fixupCapacity) {
+        jc->fixupCapacity = jc->fixupCapacity < 16 ? 16 : jc->fixupCapacity * 2;
+        jc->fixups = realloc(jc->fixups, sizeof(Fixup) * jc->fixupCapacity);
+        if (jc->fixups == NULL)
+            exit(1);
+    }
+    jc->fixups[jc->fixupCount++] = (Fixup){at, target};
+}
+
+// Records the bytecode position for runtime errors raised by a helper.
+static void saveIp(JitCompiler* jc, uint8_t* ip) {
+    Assembler* as = &jc->as;
+    movImm(as, RAX, (uint64_t)(uintptr_t)ip);
+    store(as, FRAME, offsetof(CallFrame, ip), RAX);
+}
+
+// Calls a VM helper with the stack in sync, passing the VM in rdi. Other
+// arguments are already in rsi, rdx and rcx. When the helper can fail, a
+// false result leaves through the error exit. Calls made by the helper may
+// have moved the frames and the stack.
+static void callHelper(JitCompiler* jc, void* helper, bool canFail) {
+    Assembler* as = &jc->as;
+    store(as, VM_BASE, offsetof(VM, stackTop), STACK_TOP);
+    alu(as, ALU_MOV, RDI, VM_BASE);
+    emitCall(as, helper);
+    load(as, STACK_TOP, VM_BASE, offsetof(VM, stackTop));
+    load(as, FRAME, VM_BASE, offsetof(VM, frames));
+    alu(as, ALU_ADD, FRAME, FRAME_OFFSET);
+    load(as, SLOTS, FRAME, offsetof(CallFrame, slots));
+    if (canFail) {
+        emitBytes(as, 2, 0x84, 0xc0); // test al, al
+        jumpTo(jc, CC_E, -1);
+    }
+}
+
+// Jumps out, to a slow path patched later, when the value in reg isn't a
+// number. Clobbers rcx and rsi.
+static void guardNumber(JitCompiler* jc, Register reg, int* fixups,
+                        int* fixupCount) {
+    Assembler* as = &jc->as;
+    movImm(as, RCX, QNAN);
+    alu(as, ALU_MOV, RSI, reg);
+    alu(as, ALU_AND, RSI, RCX);
+    alu(as, ALU_CMP, RSI, RCX);
+    fixups[(*fixupCount)++] = emitJump(as, CC_E);
+}
+
+static Operand stackOperand() { return (Operand){OPERAND_STACK, 0, NIL_VAL}; }
+
+static Operand localOperand(int slot) {
+    return (Operand){OPERAND_LOCAL, slot, NIL_VAL};
+}
+
+// Decodes an RK operand of the register instructions.
+static Operand registerOperand(JitCompiler* jc, uint8_t operand) {
+    if (operand & RK_CONSTANT) {
+        Value constant =
+            jc->function->chunk.constants.values[operand & ~RK_CONSTANT];
+        return (Operand){OPERAND_CONSTANT, 0, constant};
+    }
+    return localOperand(operand);
+}
+
+static Operand registerDestination(uint8_t operand) {
+    return operand == R_STACK ? stackOperand() : localOperand(operand);
+}
+
+// Loads both operands in rax and rdx. Two stack operands are popped.
+static void loadOperands(JitCompiler* jc, Operand a, Operand b) {
+    Assembler* as = &jc->as;
+    if (a.kind == OPERAND_STACK) {
+        load(as, RAX, STACK_TOP, -2 * (int)sizeof(Value));
+        load(as, RDX, STACK_TOP, -(int)sizeof(Value));
+        addImm(as, STACK_TOP, -2 * (int)sizeof(Value));
+        return;
+    }
+
+    Register registers[] = {RAX, RDX};
+    Operand operands[] = {a, b};
+    for (int i = 0; i < 2; i++) {
+        if (operands[i].kind == OPERAND_LOCAL) {
+            load(as, registers[i], SLOTS, operands[i].slot * sizeof(Value));
+        } else {
+            movImm(as, registers[i], operands[i].constant);
+        }
+    }
+}
+
+static void storeResult(JitCompiler* jc, Operand destination) {
+    Assembler* as = &jc->as;
+    if (destination.kind == OPERAND_STACK) {
+        pushValue(jc, RAX);
+    } else {
+        store(as, SLOTS, destination.slot * sizeof(Value), RAX);
+    }
+}
+
+// rax = BOOL_VAL(condition code cc)
+static void boolFromFlags(JitCompiler* jc, int cc) {
+    Assembler* as = &jc->as;
+    setcc(as, cc);
+    movImm(as, RCX, FALSE_VAL);
+    alu(as, ALU_ADD, RAX, RCX);
+}
+
+// Arithmetic and comparison templates, for the stack instructions as well as
+// the superinstructions and register instructions. Numbers are computed
+// inline, anything else goes through jitAdd() or reports an error.
+static void emitBinary(JitCompiler* jc, OpCode op, Operand a, Operand b,
+                       Operand destination, uint8_t* next) {
+    Assembler* as = &jc->as;
+    int slowPaths[2];
+    int slowCount = 0;
+
+    loadOperands(jc, a, b);
+    if (op != OP_EQUAL) {
+        guardNumber(jc, RAX, slowPaths, &slowCount);
+        guardNumber(jc, RDX, slowPaths, &slowCount);
+        movqToXmm(as, XMM0, RAX);
+        movqToXmm(as, XMM1, RDX);
+    }
+
+    switch (op) {
+        case OP_ADD: sse(as, SSE_ADDSD, XMM0, XMM1); break;
+        case OP_SUBTRACT: sse(as, SSE_SUBSD, XMM0, XMM1); break;
+        case OP_MULTIPLY: sse(as, SSE_MULSD, XMM0, XMM1); break;
+        case OP_DIVIDE: sse(as, SSE_DIVSD, XMM0, XMM1); break;
+        case OP_LESS:
+            // b above a, unordered clears it.
+            sse(as, SSE_UCOMISD, XMM1, XMM0);
+            boolFromFlags(jc, CC_A);
+            break;
+        case OP_GREATER:
+            sse(as, SSE_UCOMISD, XMM0, XMM1);
+            boolFromFlags(jc, CC_A);
+            break;
+        case OP_EQUAL:
+            alu(as, ALU_CMP, RAX, RDX);
+            boolFromFlags(jc, CC_E);
+            break;
+        default: break;
+    }
+    if (op == OP_ADD || op == OP_SUBTRACT || op == OP_MULTIPLY ||
+        op == OP_DIVIDE) {
+        movqFromXmm(as, RAX, XMM0);
+    }
+    storeResult(jc, destination);
+    if (op == OP_EQUAL)
+        return;
+
+    int done = emitJump(as, -1);
+    for (int i = 0; i < slowCount; i++)
+        patchJump(as, slowPaths[i], as->count);
+    if (op == OP_ADD) {
+        pushValue(jc, RAX);
+        pushValue(jc, RDX);
+        saveIp(jc, next);
+        callHelper(jc, jitAdd, true);
+        if (destination.kind == OPERAND_LOCAL) {
+            popValue(jc, RAX);
+            storeResult(jc, destination);
+        }
+    } else {
+        saveIp(jc, next);
+        callHelper(jc, jitNumberError, true);
+    }
+    patchJump(as, done, as->count);
+}
+
+// Fused comparison and OP_JUMP_IF_FALSE. As in the interpreter, the jump
+// leaves false on the stack for the OP_POP at its target.
+static void emitCompareJump(JitCompiler* jc, OpCode op, Operand a, Operand b,
+                            int target, uint8_t* next) {
+    Assembler* as = &jc->as;
+    int slowPaths[2];
+    int slowCount = 0;
+
+    loadOperands(jc, a, b);
+    guardNumber(jc, RAX, slowPaths, &slowCount);
+    guardNumber(jc, RDX, slowPaths, &slowCount);
+    movqToXmm(as, XMM0, RAX);
+    movqToXmm(as, XMM1, RDX);
+    if (op == OP_LESS) {
+        sse(as, SSE_UCOMISD, XMM1, XMM0);
+    } else {
+        sse(as, SSE_UCOMISD, XMM0, XMM1);
+    }
+    int taken = emitJump(as, CC_A);
+    movImm(as, RAX, FALSE_VAL);
+    pushValue(jc, RAX);
+    jumpTo(jc, -1, target);
+
+    for (int i = 0; i < slowCount; i++)
+        patchJump(as, slowPaths[i], as->count);
+    saveIp(jc, next);
+    callHelper(jc, jitNumberError, true);
+    patchJump(as, taken, as->count);
+}
+
+// Sets al to whether the value in rax is falsey, clobbers rcx and rdx.
+static void testFalsey(JitCompiler* jc) {
+    Assembler* as = &jc->as;
+    movImm(as, RCX, NIL_VAL);
+    alu(as, ALU_CMP, RAX, RCX);
+    emitBytes(as, 3, 0x0f, 0x94, 0xc2); // sete dl
+    movImm(as, RCX, FALSE_VAL);
+    alu(as, ALU_CMP, RAX, RCX);
+    emitBytes(as, 3, 0x0f, 0x94, 0xc0); // sete al
+    emitBytes(as, 2, 0x08, 0xd0);       // or al, dl
+}
+
+static void emitPrologue(JitCompiler* jc) {
+    Assembler* as = &jc->as;
+    emitSaveRegisters(as);
+    alu(as, ALU_MOV, VM_BASE, RDI);
+    alu(as, ALU_MOV, FRAME, RSI);
+    load(as, RAX, VM_BASE, offsetof(VM, frames));
+    alu(as, ALU_MOV, FRAME_OFFSET, FRAME);
+    alu(as, ALU_SUB, FRAME_OFFSET, RAX);
+    load(as, STACK_TOP, VM_BASE, offsetof(VM, stackTop));
+    load(as, SLOTS, FRAME, offsetof(CallFrame, slots));
+}
+
+// The error exit returns false, OP_RETURN jumps to the epilogue with true.
+static void emitEpilogue(JitCompiler* jc, int* errorExit, int* epilogue) {
+    Assembler* as = &jc->as;
+    *errorExit = as->count;
+    emitBytes(as, 2, 0x31, 0xc0); // xor eax, eax
+    *epilogue = as->count;
+    emitRestoreRegisters(as);
+}
+
+static uint16_t readShort(uint8_t* operand) {
+    return (uint16_t)((operand[0] << 8) | operand[1]);
+}
+
+static void emitInstruction(JitCompiler* jc, int offset, int* returns,
+                            int* returnCount) {
+    Assembler* as = &jc->as;
+    Chunk* chunk = &jc->function->chunk;
+    uint8_t* ip = chunk->code + offset;
+    uint8_t* next = ip + instructionLength(chunk, offset);
+    Value* constants = chunk->constants.values;
+
+    OpCode op = genericOp(*ip);
+
+    switch (op) {
+        case OP_CONSTANT:
+        case OP_CONSTANT_LONG:
+            movImm(as, RAX, constants[ip[1]]);
+            pushValue(jc, RAX);
+            break;
+        case OP_NIL:
+        case OP_TRUE:
+        case OP_FALSE:
+            movImm(as, RAX,
+                   op == OP_NIL ? NIL_VAL : BOOL_VAL(op == OP_TRUE));
+            pushValue(jc, RAX);
+            break;
+        case OP_NEGATE:
+            // Same as the interpreter: flips the sign bit, unchecked.
+            load(as, RAX, STACK_TOP, -(int)sizeof(Value));
+            emitBytes(as, 5, 0x48, 0x0f, 0xba, 0xf8, 63); // btc rax, 63
+            store(as, STACK_TOP, -(int)sizeof(Value), RAX);
+            break;
+        case OP_ADD:
+        case OP_SUBTRACT:
+        case OP_MULTIPLY:
+        case OP_DIVIDE:
+        case OP_EQUAL:
+        case OP_GREATER:
+        case OP_LESS:
+            emitBinary(jc, op, stackOperand(), stackOperand(),
+                       stackOperand(), next);
+            break;
+        case OP_NOT:
+            load(as, RAX, STACK_TOP, -(int)sizeof(Value));
+            testFalsey(jc);
+            emitBytes(as, 3, 0x0f, 0xb6, 0xc0); // movzx eax, al
+            movImm(as, RCX, FALSE_VAL);
+            alu(as, ALU_ADD, RAX, RCX);
+            store(as, STACK_TOP, -(int)sizeof(Value), RAX);
+            break;
+        case OP_PRINT: callHelper(jc, jitPrint, false); break;
+        case OP_ASSERT:
+            saveIp(jc, next);
+            callHelper(jc, jitAssert, true);
+            break;
+        case OP_POP: addImm(as, STACK_TOP, -(int)sizeof(Value)); break;
+        case OP_DEFINE_GLOBAL:
+        case OP_GET_GLOBAL:
+        case OP_SET_GLOBAL: {
+            void* helpers[] = {
+                [OP_DEFINE_GLOBAL] = jitDefineGlobal,
+                [OP_GET_GLOBAL] = jitGetGlobal,
+                [OP_SET_GLOBAL] = jitSetGlobal,
+            };
+            saveIp(jc, next);
+            movImm(as, RSI, readShort(ip + 1));
+            callHelper(jc, helpers[op], op != OP_DEFINE_GLOBAL);
+            break;
+        }
+        case OP_CLASS:
+        case OP_METHOD:
+        case OP_GET_SUPER: {
+            void* helpers[] = {
+                [OP_CLASS] = jitClass,
+                [OP_METHOD] = jitMethod,
+                [OP_GET_SUPER] = jitGetSuper,
+            };
+            bool canFail = op != OP_CLASS && op != OP_METHOD;
+            saveIp(jc, next);
+            movImm(as, RSI, (uint64_t)(uintptr_t)AS_STRING(constants[ip[1]]));
+            callHelper(jc, helpers[op], canFail);
+            break;
+        }
+        case OP_GET_PROPERTY:
+        case OP_SET_PROPERTY: {
+            InlineCache* cache = &chunk->caches[readShort(ip + 2)];
+            saveIp(jc, next);
+            movImm(as, RSI, (uint64_t)(uintptr_t)AS_STRING(constants[ip[1]]));
+            movImm(as, RDX, (uint64_t)(uintptr_t)cache);
+            callHelper(jc, op == OP_GET_PROPERTY ? (void*)jitGetProperty
+                                                  : (void*)jitSetProperty,
+                       true);
+            break;
+        }
+        case OP_GET_LOCAL:
+            load(as, RAX, SLOTS, ip[1] * sizeof(Value));
+            pushValue(jc, RAX);
+            break;
+        case OP_SET_LOCAL:
+            load(as, RAX, STACK_TOP, -(int)sizeof(Value));
+            store(as, SLOTS, ip[1] * sizeof(Value), RAX);
+            break;
+        case OP_GET_UPVALUE:
+        case OP_SET_UPVALUE:
+            alu(as, ALU_MOV, RSI, FRAME);
+            movImm(as, RDX, ip[1]);
+            callHelper(jc, op == OP_GET_UPVALUE ? (void*)jitGetUpvalue
+                                                 : (void*)jitSetUpvalue,
+                       false);
+            break;
+        case OP_JUMP: jumpTo(jc, -1, (int)(next - chunk->code) +
+                                         readShort(ip + 1));
+            break;
+        case OP_JUMP_IF_FALSE:
+            load(as, RAX, STACK_TOP, -(int)sizeof(Value));
+            testFalsey(jc);
+            emitBytes(as, 2, 0x84, 0xc0); // test al, al
+            jumpTo(jc, CC_NE, (int)(next - chunk->code) + readShort(ip + 1));
+            break;
+        case OP_LOOP: {
+            // Polls --profile, see profile.h, on every back-edge.
+            movImm(as, RAX, (uint64_t)(uintptr_t)&profilePending);
+            load(as, RAX, RAX, 0);
+            emitBytes(as, 2, 0x85, 0xc0); // test eax, eax
+            int polled = emitJump(as, CC_E);
+            saveIp(jc, next);
+            callHelper(jc, profileSample, false);
+            patchJump(as, polled, as->count);
+            jumpTo(jc, -1, (int)(next - chunk->code) - readShort(ip + 1));
+            break;
+        }
+        case OP_CALL:
+            saveIp(jc, next);
+            movImm(as, RSI, ip[1]);
+            callHelper(jc, jitCall, true);
+            break;
+        case OP_TAIL_CALL:
+            saveIp(jc, next);
+            alu(as, ALU_MOV, RSI, FRAME);
+            movImm(as, RDX, ip[1]);
+            callHelper(jc, jitTailCall, true);
+            // Self recursion loops back in the same native frame, another
+            // callee is run by the interpreter once this code has returned.
+            // TAIL_CALLED falls through to the OP_RETURN.
+            emitBytes(as, 3, 0x83, 0xf8, TAIL_REENTER); // cmp eax, imm8
+            jumpTo(jc, CC_E, 0);
+            emitBytes(as, 3, 0x83, 0xf8, TAIL_HANDOFF); // cmp eax, imm8
+            returns[(*returnCount)++] = emitJump(as, CC_E);
+            break;
+        case OP_CLOSURE:
+            alu(as, ALU_MOV, RSI, FRAME);
+            movImm(as, RDX, (uint64_t)(uintptr_t)(ip + 1));
+            callHelper(jc, jitClosure, false);
+            break;
+        case OP_CLOSE_UPVALUE: callHelper(jc, jitCloseUpvalue, false); break;
+        case OP_INVOKE:
+        case OP_SUPER_INVOKE: {
+            InlineCache* cache = &chunk->caches[readShort(ip + 2)];
+            saveIp(jc, next);
+            movImm(as, RSI, (uint64_t)(uintptr_t)AS_STRING(constants[ip[1]]));
+            movImm(as, RDX, ip[4]);
+            movImm(as, RCX, (uint64_t)(uintptr_t)cache);
+            callHelper(jc, op == OP_INVOKE ? (void*)jitInvoke
+                                            : (void*)jitSuperInvoke,
+                       true);
+            break;
+        }
+        case OP_INHERIT:
+            saveIp(jc, next);
+            callHelper(jc, jitInherit, true);
+            break;
+        case OP_ADD_LOCALS:
+            emitBinary(jc, OP_ADD, localOperand(ip[1]), localOperand(ip[2]),
+                       stackOperand(), next);
+            break;
+        case OP_LESS_JUMP_IF_FALSE:
+            emitCompareJump(jc, OP_LESS, stackOperand(), stackOperand(),
+                            (int)(next - chunk->code) + readShort(ip + 1),
+                            next);
+            break;
+        case OP_INCREMENT_LOCAL:
+            emitBinary(jc, OP_ADD, localOperand(ip[1]),
+                       (Operand){OPERAND_CONSTANT, 0, constants[ip[2]]},
+                       localOperand(ip[1]), next);
+            break;
+        case OP_R_MOVE: {
+            Operand source = registerOperand(jc, ip[2]);
+            if (source.kind == OPERAND_LOCAL) {
+                load(as, RAX, SLOTS, source.slot * sizeof(Value));
+            } else {
+                movImm(as, RAX, source.constant);
+            }
+            store(as, SLOTS, ip[1] * sizeof(Value), RAX);
+            break;
+        }
+        case OP_R_ADD:
+        case OP_R_SUBTRACT:
+        case OP_R_MULTIPLY:
+        case OP_R_DIVIDE:
+        case OP_R_EQUAL:
+        case OP_R_GREATER:
+        case OP_R_LESS: {
+            OpCode ops[] = {
+                [OP_R_ADD] = OP_ADD,         [OP_R_SUBTRACT] = OP_SUBTRACT,
+                [OP_R_MULTIPLY] = OP_MULTIPLY, [OP_R_DIVIDE] = OP_DIVIDE,
+                [OP_R_EQUAL] = OP_EQUAL,     [OP_R_GREATER] = OP_GREATER,
+                [OP_R_LESS] = OP_LESS,
+            };
+            emitBinary(jc, ops[op], registerOperand(jc, ip[2]),
+                       registerOperand(jc, ip[3]), registerDestination(ip[1]),
+                       next);
+            break;
+        }
+        case OP_R_LESS_JUMP_IF_FALSE:
+        case OP_R_GREATER_JUMP_IF_FALSE:
+            emitCompareJump(
+                jc, op == OP_R_LESS_JUMP_IF_FALSE ? OP_LESS : OP_GREATER,
+                registerOperand(jc, ip[1]), registerOperand(jc, ip[2]),
+                (int)(next - chunk->code) + readShort(ip + 3), next);
+            break;
+        case OP_RETURN:
+            alu(as, ALU_MOV, RSI, FRAME);
+            callHelper(jc, jitReturn, false);
+            movImm(as, RAX, 1);
+            returns[(*returnCount)++] = emitJump(as, -1);
+            break;
+        case OP_ADD_NUM:
+        case OP_GET_PROPERTY_SLOT:
+        case OP_SET_PROPERTY_SLOT:
+        case OP_INVOKE_METHOD:
+            // Compiled as their generic forms, op never holds these.
+            break;
+    }
+}
+
+void jitCompile(ObjFunction* function) {
+    // The script body runs once, and its return is special-cased by run().
+    if (function->name == NULL)
+        return;
+
+    Chunk* chunk = &function->chunk;
+    JitCompiler jc = {.function = function};
+    jc.labels = malloc(sizeof(int) * (chunk->count + 1));
+    int* returns = malloc(sizeof(int) * (chunk->count + 1));
+    int returnCount = 0;
+    if (jc.labels == NULL || returns == NULL)
+        exit(1);
+
+    emitPrologue(&jc);
+    for (int offset = 0; offset < chunk->count;
+         offset += instructionLength(chunk, offset)) {
+        jc.labels[offset] = jc.as.count;
+        emitInstruction(&jc, offset, returns, &returnCount);
+    }
+
+    int errorExit, epilogue;
+    emitEpilogue(&jc, &errorExit, &epilogue);
+    for (int i = 0; i < returnCount; i++)
+        patchJump(&jc.as, returns[i], epilogue);
+    for (int i = 0; i < jc.fixupCount; i++) {
+        Fixup* fixup = &jc.fixups[i];
+        patchJump(&jc.as, fixup->at,
+                  fixup->target < 0 ? errorExit : jc.labels[fixup->target]);
+    }
+
+    function->native = finishCode(&jc.as, &function->nativeSize);
+    free(jc.labels);
+    free(jc.fixups);
+    free(returns);
+}
+
+void jitFree(ObjFunction* function) {
+    if (function->native != NULL)
+        freeCode(function->native, function->nativeSize);
+    function->native = NULL;
+}
+
+#endif
@@ -0,0 +1,90 @@
+#ifndef clox_jit_h
+#define clox_jit_h
+
+#include "common.h"
+#include "object.h"
+#include "vm.h"
+
+#ifdef JIT
+
+// Calls after which a function is compiled to machine code.
+#ifndef JIT_THRESHOLD
+#define JIT_THRESHOLD 1000
+#endif
+
+/**
+ * @brief Entry point of a compiled function.
+ *
+ * Runs the body of the function whose frame was just pushed by call(), up to
+ * and including its OP_RETURN: the frame is popped and the result pushed, as
+ * the interpreter would have done. A tail call to another function returns
+ * early instead, leaving the frame on top for the interpreter to run the
+ * callee in.
+ *
+ * @param vm The VM running the function.
+ * @param frame The frame of the call, on top of vm->frames.
+ * @return false if a runtime error was reported.
+ */
+typedef bool (*JitFn)(VM* vm, CallFrame* frame);
+
+/**
+ * @enum TailCall
+ * @brief How compiled code goes on after jitTailCall().
+ *
+ * TAIL_ERROR and TAIL_HANDOFF are what the compiled function itself returns.
+ */
+typedef enum {
+    TAIL_ERROR = 0,   /**< A runtime error was reported */
+    TAIL_HANDOFF = 1, /**< The frame now belongs to another function */
+    TAIL_CALLED,      /**< An ordinary call, its result is on the stack */
+    TAIL_REENTER,     /**< The frame runs this function again from the top */
+} TailCall;
+
+/**
+ * @brief Translates the chunk of a function to x86-64 machine code.
+ *
+ * Each instruction is expanded from a template: numeric instructions run
+ * inline behind a type guard, everything else calls back into the VM. On
+ * success function->native points to executable memory.
+ *
+ * @param function The function to compile.
+ */
+void jitCompile(ObjFunction* function);
+
+/**
+ * @brief Releases the machine code of a function, if any.
+ * @param function The function being freed.
+ */
+void jitFree(ObjFunction* function);
+
+// Slow paths called from compiled code, defined in vm.c. vm->stackTop is in
+// sync when they are called, and the frame's ip points past the instruction
+// so that runtime errors report the right line. The ones returning bool
+// return false after reporting a runtime error.
+bool jitAdd(VM* vm);
+bool jitNumberError(VM* vm);
+void jitPrint(VM* vm);
+bool jitAssert(VM* vm);
+void jitDefineGlobal(VM* vm, int slot);
+bool jitGetGlobal(VM* vm, int slot);
+bool jitSetGlobal(VM* vm, int slot);
+void jitGetUpvalue(VM* vm, CallFrame* frame, int slot);
+void jitSetUpvalue(VM* vm, CallFrame* frame, int slot);
+bool jitCall(VM* vm, int argCount);
+TailCall jitTailCall(VM* vm, CallFrame* frame, int argCount);
+void jitClosure(VM* vm, CallFrame* frame, uint8_t* ip);
+void jitCloseUpvalue(VM* vm);
+void jitClass(VM* vm, ObjString* name);
+bool jitGetProperty(VM* vm, ObjString* name, InlineCache* cache);
+bool jitSetProperty(VM* vm, ObjString* name, InlineCache* cache);
+void jitMethod(VM* vm, ObjString* name);
+bool jitInvoke(VM* vm, ObjString* name, int argCount, InlineCache* cache);
+bool jitInherit(VM* vm);
+bool jitGetSuper(VM* vm, ObjString* name);
+bool jitSuperInvoke(VM* vm, ObjString* name, int argCount,
+                    InlineCache* cache);
+void jitReturn(VM* vm, CallFrame* frame);
+
+#endif
+
+#endif
@@ -1,13 +1,37 @@
+// open_memstream and the directory functions are POSIX, strict -std modes
+// hide them.
+#define _DEFAULT_SOURCE
+
+#include <dirent.h>
+#include <pthread.h>
+#include <stdatomic.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
 
 #include "chunk.h"
 #include "common.h"
 #include "debug.h"
+#include "profile.h"
 #include "vm.h"
 
-static void repl() {
+// Set by --cache-stats, reports inline cache behaviour on stderr at exit.
+static bool cacheStats = false;
+// Set by --gc-stats, reports what the collector did on stderr at exit.
+static bool gcStats = false;
+// Set by --gc-step, objects each step of a full collection traces or sweeps,
+// 0 to mark at once and sweep a page a step. Negative keeps the VM's default.
+static int gcStep = -1;
+// Set by --gc-concurrent, full collections mark on a thread of their own.
+static bool gcConcurrent = false;
+// Set by --gc-threads, threads marking full collections at once. 0 keeps the
+// VM's default.
+static int gcThreads = 0;
+
+static void repl(VM* vm) {
     char line[1024];
     for (;;) {
         printf("> ");
@@ -15,74 +39,391 @@ static void repl() {
             printf("\n");
             break;
         }
-        interpret(line, false);
+        interpret(vm, line, false);
     }
 }
 
-static char* readFile(const char* path) {
+// Reads a whole file, or reports why it couldn't on err and returns NULL.
+static char* readSource(const char* path, FILE* err) {
     FILE* file = fopen(path, "rb");
     if (file == NULL) {
-        fprintf(stderr, "Could not open file \"%s\".\n", path);
-        exit(74);
+        fprintf(err, "Could not open file \"%s\".\n", path);
+        return NULL;
     }
     fseek(file, 0L, SEEK_END);
     size_t fileSize = ftell(file);
     rewind(file);
     char* buffer = (char*)malloc(fileSize + 1);
     if (buffer == NULL) {
-        fprintf(stderr, "Not enough memory to read \"%s\".\n", path);
-        exit(74);
+        fprintf(err, "Not enough memory to read \"%s\".\n", path);
+        fclose(file);
+        return NULL;
     }
     size_t bytesRead = fread(buffer, sizeof(char), fileSize, file);
+    fclose(file);
     if (bytesRead < fileSize) {
-        fprintf(stderr, "Could not read file \"%s\".\n", path);
-        exit(74);
+        fprintf(err, "Could not read file \"%s\".\n", path);
+        free(buffer);
+        return NULL;
     }
     buffer[bytesRead] = '\0';
-    fclose(file);
     return buffer;
 }
 
-static void runFile(const char* path, bool saveCode) {
+static char* readFile(const char* path) {
+    char* source = readSource(path, stderr);
+    if (source == NULL)
+        exit(74);
+    return source;
+}
+
+// Exit status of a process that ran a script with the given result.
+static int exitStatus(InterpretResult result) {
+    switch (result) {
+        case INTERPRET_COMPILE_ERROR: return 65;
+        case INTERPRET_RUNTIME_ERROR: return 70;
+        default: return 0;
+    }
+}
+
+static int runFile(VM* vm, const char* path, bool saveCode) {
     char* source = readFile(path);
-    InterpretResult result = interpret(source, saveCode);
+    InterpretResult result = interpret(vm, source, saveCode);
     free(source);
-    if (result == INTERPRET_COMPILE_ERROR)
-        exit(65);
-    if (result == INTERPRET_RUNTIME_ERROR)
-        exit(70);
+    if (cacheStats)
+        printCacheStats(vm, stderr);
+    if (gcStats)
+        printGCStats(vm, stderr);
+    return exitStatus(result);
 }
 
-static void runChunkFile(const char* path) {
-    ObjFunction* main = readFunctionFromFile(path);
+static int runChunkFile(VM* vm, const char* path) {
+    ObjFunction* main = readFunctionFromFile(vm, path);
     if (main == NULL) {
         fprintf(stderr, "Could not read chunk file \"%s\".\n", path);
         exit(74);
     }
-    push(OBJ_VAL(main));
-    callValue(OBJ_VAL(main), 0);
+    push(vm, OBJ_VAL(main));
+    ObjClosure* closure = newClosure(vm, main);
+    pop(vm);
+    push(vm, OBJ_VAL(closure));
+    callValue(vm, OBJ_VAL(closure), 0);
     printf("Main arity = %d\n", main->arity);
-    InterpretResult result = run();
-    if (result == INTERPRET_RUNTIME_ERROR)
-        exit(70);
+    InterpretResult result = run(vm);
+    if (cacheStats)
+        printCacheStats(vm, stderr);
+    if (gcStats)
+        printGCStats(vm, stderr);
+    return exitStatus(result);
+}
+
+// Native stack of each batch worker. Calls between compiled functions nest
+// on it, so it gets as much as the main thread usually has.
+#define BATCH_STACK_SIZE (8 * 1024 * 1024)
+
+// A script run by --batch. What it prints is kept until every job before it
+// has been reported, so a batch reports in the order it was given.
+typedef struct {
+    char* path;
+    int status;    // Exit status the script would have had as a process
+    double millis; // From reading the file to freeing the VM
+    bool done;
+    char* output; // What the script printed
+    size_t outputSize;
+    char* errors; // Compile and runtime errors
+    size_t errorsSize;
+} Job;
+
+typedef struct {
+    Job* jobs;
+    int count;
+    int capacity;
+    atomic_int next; // First job no worker has taken yet
+    int reported;    // Jobs written out so far, guarded by lock
+    pthread_mutex_t lock;
+    Backend backend;
+} Batch;
+
+static void addJob(Batch* batch, char* path) {
+    if (batch->count == batch->capacity) {
+        batch->capacity = batch->capacity < 8 ? 8 : batch->capacity * 2;
+        batch->jobs = realloc(batch->jobs, sizeof(Job) * batch->capacity);
+        if (batch->jobs == NULL) {
+            fprintf(stderr, "Not enough memory for the batch.\n");
+            exit(74);
+        }
+    }
+    batch->jobs[batch->count++] = (Job){.path = path};
+}
+
+static int isScript(const struct dirent* entry) {
+    size_t length = strlen(entry->d_name);
+    return length > 4 && strcmp(entry->d_name + length - 4, ".lox") == 0;
+}
+
+// Adds the .lox files of a directory in name order, or the path itself.
+static void addJobs(Batch* batch, const char* path) {
+    struct stat info;
+    struct dirent** entries;
+    int count;
+    if (stat(path, &info) != 0 || !S_ISDIR(info.st_mode) ||
+        (count = scandir(path, &entries, isScript, alphasort)) < 0) {
+        // Paths that can't be read fail as jobs of their own.
+        addJob(batch, strdup(path));
+        return;
+    }
+    for (int i = 0; i < count; i++) {
+        size_t length = strlen(path) + strlen(entries[i]->d_name) + 2;
+        char* file = malloc(length);
+        snprintf(file, length, "%s/%s", path, entries[i]->d_name);
+        addJob(batch, file);
+        free(entries[i]);
+    }
+    free(entries);
+}
+
+static double millisSince(struct timespec* start) {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (now.tv_sec - start->tv_sec) * 1e3 +
+           (now.tv_nsec - start->tv_nsec) / 1e6;
+}
+
+// Runs a job on the worker's VM, set up afresh so that nothing an earlier
+// script defined is visible.
+static void runJob(Batch* batch, VM* vm, Job* job) {
+    struct timespec start;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    FILE* out = open_memstream(&job->output, &job->outputSize);
+    FILE* err = open_memstream(&job->errors, &job->errorsSize);
+    char* source = readSource(job->path, err);
+    if (source == NULL) {
+        job->status = 74;
+    } else {
+        initVM(vm);
+        vm->backend = batch->backend;
+        if (gcStep >= 0)
+            vm->gcStepSize = gcStep;
+        vm->gcConcurrent = gcConcurrent;
+        if (gcThreads > 0)
+            vm->gcThreads = gcThreads;
+        vm->out = out;
+        vm->err = err;
+        job->status = exitStatus(interpret(vm, source, false));
+        if (cacheStats)
+            printCacheStats(vm, err);
+        if (gcStats)
+            printGCStats(vm, err);
+        freeVM(vm);
+        free(source);
+    }
+    fclose(out);
+    fclose(err);
+    job->millis = millisSince(&start);
+}
+
+// Writes out the finished jobs no earlier job is still holding back. Called
+// with the lock held.
+static void reportJobs(Batch* batch) {
+    while (batch->reported < batch->count &&
+           batch->jobs[batch->reported].done) {
+        Job* job = &batch->jobs[batch->reported++];
+        fwrite(job->output, 1, job->outputSize, stdout);
+        fflush(stdout);
+        fwrite(job->errors, 1, job->errorsSize, stderr);
+        fprintf(stderr, "%s: exit %d, %.3f ms\n", job->path, job->status,
+                job->millis);
+        free(job->output);
+        free(job->errors);
+    }
+}
+
+static void* batchWorker(void* arg) {
+    Batch* batch = arg;
+    VM vm;
+    for (;;) {
+        int index = atomic_fetch_add(&batch->next, 1);
+        if (index >= batch->count)
+            return NULL;
+        Job* job = &batch->jobs[index];
+        runJob(batch, &vm, job);
+
+        pthread_mutex_lock(&batch->lock);
+        job->done = true;
+        reportJobs(batch);
+        pthread_mutex_unlock(&batch->lock);
+    }
+}
+
+// Runs the scripts on a pool of threads, each with a VM of its own, and
+// returns the worst exit status among them.
+static int runBatch(int threads, Backend backend, int pathCount,
+                    const char* paths[]) {
+    Batch batch = {.backend = backend};
+    pthread_mutex_init(&batch.lock, NULL);
+    for (int i = 0; i < pathCount; i++)
+        addJobs(&batch, paths[i]);
+    if (threads > batch.count)
+        threads = batch.count;
+
+    struct timespec start;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    pthread_attr_t attr;
+    pthread_attr_init(&attr);
+    pthread_attr_setstacksize(&attr, BATCH_STACK_SIZE);
+    pthread_t* pool = malloc(sizeof(pthread_t) * (threads > 0 ? threads : 1));
+    for (int i = 0; i < threads; i++) {
+        if (pthread_create(&pool[i], &attr, batchWorker, &batch) != 0) {
+            fprintf(stderr, "Could not start a batch thread.\n");
+            exit(71);
+        }
+    }
+    for (int i = 0; i < threads; i++)
+        pthread_join(pool[i], NULL);
+    pthread_attr_destroy(&attr);
+
+    int status = 0;
+    int failed = 0;
+    for (int i = 0; i < batch.count; i++) {
+        if (batch.jobs[i].status != 0)
+            failed++;
+        if (batch.jobs[i].status > status)
+            status = batch.jobs[i].status;
+        free(batch.jobs[i].path);
+    }
+    fprintf(stderr, "%d jobs, %d failed, %.3f ms on %d threads\n",
+            batch.count, failed, millisSince(&start), threads);
+
+    free(pool);
+    free(batch.jobs);
+    pthread_mutex_destroy(&batch.lock);
+    return status;
+}
+
+static void usage() {
+    fprintf(stderr, "Usage: clox [--save | --load] [--registers] "
+                    "[--cache-stats] [--gc-stats] [--gc-step=N]\n"
+                    "            [--gc-concurrent] [--gc-threads=N] "
+                    "[--profile=out.folded] [--opcode-stats=out.json]\n"
+                    "            [--call-profile=out.csv] [path]\n"
+                    "       clox --batch [--jobs=N] [--registers] "
+                    "[--cache-stats] [--gc-stats] [--gc-step=N]\n"
+                    "            [--gc-concurrent] [--gc-threads=N] path...\n");
+    exit(64);
 }
 
 int main(int argc, const char* argv[]) {
-    initVM();
-    if (argc == 1) {
-        repl();
-    } else if (argc == 2 || (argc == 3 && (strcmp(argv[1], "--save") == 0 || strcmp(argv[1], "--load") == 0))) {
-        if (argc == 3 && strcmp(argv[1], "--save") == 0) {
-            runFile(argv[2], true);
-        } else if (argc == 3 && strcmp(argv[1], "--load") == 0) {
-            runChunkFile(argv[2]);
+    VM vm;
+    initVM(&vm);
+    bool saveCode = false;
+    bool loadCode = false;
+    bool batch = false;
+    const char* profilePath = NULL;
+    const char* statsPath = NULL;
+    const char* callsPath = NULL;
+    int jobs = (int)sysconf(_SC_NPROCESSORS_ONLN);
+
+    int arg = 1;
+    for (; arg < argc && strncmp(argv[arg], "--", 2) == 0; arg++) {
+        if (strcmp(argv[arg], "--save") == 0) {
+            saveCode = true;
+        } else if (strcmp(argv[arg], "--load") == 0) {
+            loadCode = true;
+        } else if (strcmp(argv[arg], "--registers") == 0) {
+            vm.backend = BACKEND_REGISTER;
+        } else if (strcmp(argv[arg], "--cache-stats") == 0) {
+            cacheStats = true;
+        } else if (strcmp(argv[arg], "--gc-stats") == 0) {
+            gcStats = true;
+        } else if (strncmp(argv[arg], "--gc-step=", 10) == 0) {
+            gcStep = atoi(argv[arg] + 10);
+            if (gcStep < 0)
+                usage();
+            vm.gcStepSize = gcStep;
+        } else if (strcmp(argv[arg], "--gc-concurrent") == 0) {
+            gcConcurrent = true;
+            vm.gcConcurrent = true;
+        } else if (strncmp(argv[arg], "--gc-threads=", 13) == 0) {
+            gcThreads = atoi(argv[arg] + 13);
+            if (gcThreads < 1)
+                usage();
+            vm.gcThreads = gcThreads;
+        } else if (strncmp(argv[arg], "--profile=", 10) == 0) {
+            profilePath = argv[arg] + 10;
+            if (*profilePath == '\0')
+                usage();
+        } else if (strncmp(argv[arg], "--opcode-stats=", 15) == 0) {
+            statsPath = argv[arg] + 15;
+            if (*statsPath == '\0')
+                usage();
+        } else if (strncmp(argv[arg], "--call-profile=", 15) == 0) {
+            callsPath = argv[arg] + 15;
+            if (*callsPath == '\0')
+                usage();
+        } else if (strcmp(argv[arg], "--batch") == 0) {
+            batch = true;
+        } else if (strncmp(argv[arg], "--jobs=", 7) == 0) {
+            jobs = atoi(argv[arg] + 7);
+            if (jobs < 1)
+                usage();
         } else {
-            runFile(argv[1], false);
+            usage();
         }
+    }
+
+    if (batch) {
+        // The profiling timer is per process, it can't tell the jobs apart,
+        // and neither can a single stats or profile file.
+        if (arg == argc || saveCode || loadCode || profilePath != NULL ||
+            statsPath != NULL || callsPath != NULL)
+            usage();
+        int status = runBatch(jobs, vm.backend, argc - arg, &argv[arg]);
+        freeVM(&vm);
+        return status;
+    }
+    bool interactive = arg == argc && !saveCode && !loadCode;
+    if (!interactive && (arg != argc - 1 || (saveCode && loadCode)))
+        usage();
+
+    if (profilePath != NULL && !startProfiler(&vm)) {
+        fprintf(stderr, "Could not start the profiler.\n");
+        exit(71);
+    }
+    if (statsPath != NULL) {
+        vm.opcodeStats = calloc(1, sizeof(OpcodeStats));
+        if (vm.opcodeStats == NULL)
+            exit(1);
+        vm.opcodeStats->previous = -1;
+    }
+    if (callsPath != NULL && !startCallProfiler(&vm))
+        exit(1);
+    int status = 0;
+    if (interactive) {
+        repl(&vm);
+    } else if (loadCode) {
+        status = runChunkFile(&vm, argv[arg]);
     } else {
-        fprintf(stderr, "Usage: clox [--save | --load] [path]\n");
-        exit(64);
+        status = runFile(&vm, argv[arg], saveCode);
+    }
+    if (profilePath != NULL && !stopProfiler(&vm, profilePath)) {
+        fprintf(stderr, "Could not write profile \"%s\".\n", profilePath);
+        status = 74;
     }
-    freeVM();
-    return 0;
-}
\ No newline at end of file
+    if (callsPath != NULL && !stopCallProfiler(&vm, stderr, callsPath)) {
+        fprintf(stderr, "Could not write call profile \"%s\".\n", callsPath);
+        status = 74;
+    }
+    if (statsPath != NULL) {
+        FILE* file = fopen(statsPath, "w");
+        if (file != NULL)
+            writeOpcodeStats(&vm, file);
+        if (file == NULL || fclose(file) != 0) {
+            fprintf(stderr, "Could not write opcode stats \"%s\".\n",
+                    statsPath);
+            status = 74;
+        }
+        free(vm.opcodeStats);
+    }
+    freeVM(&vm);
+    return status;
+}
@@ -1,7 +1,19 @@
+// clock_gettime is POSIX, strict -std modes hide it.
+#define _DEFAULT_SOURCE
+
+#include <pthread.h>
+#include <sched.h>
 #include <stdlib.h>
+#include <string.h>
+#include <time.h>
 
+#include "cache.h"
 #include "compiler.h"
+#include "heap.h"
+#include "jit.h"
 #include "memory.h"
+#include "shape.h"
+#include "trace.h"
 #include "vm.h"
 
 #ifdef DEBUG_LOG_GC
@@ -9,17 +21,111 @@
 #include <stdio.h>
 #endif
 
-void* reallocate(void* pointer, size_t oldSize, size_t newSize) {
-    vm.bytesAllocated += newSize - oldSize;
+// Objects the VM logs for the marker thread, handed over this many at once.
+#define MARKER_LOG_SIZE 256
+
+// The thread marking full collections while the VM runs, if gcConcurrent is
+// set. Its gray stack is the VM's, which it owns while busy. The VM logs what
+// the objects it changes pointed to before, see scanObject(), and hands the
+// log over in batches.
+struct Marker {
+    pthread_t thread;
+    pthread_mutex_t lock;
+    pthread_cond_t wake; // Work was handed over, or stop was set.
+    pthread_cond_t idle; // busy was cleared.
+    atomic_bool busy;    // Marking, set by the VM and cleared by the thread.
+    atomic_bool stop;
+    Obj** queue;         // Handed over and not yet taken, under lock.
+    int queueCount;
+    int queueCapacity;
+    Obj** taken;         // The thread's own, swapped with the queue.
+    int takenCapacity;
+    Obj* log[MARKER_LOG_SIZE]; // The VM's own.
+    int logCount;
+};
+
+// Set on the marker thread, whose markObject() marks rather than logs.
+static _Thread_local bool onMarker = false;
+
+// Arrays of values or table entries longer than this are split into slices
+// of as many when marking in parallel, for the other threads to share.
+#define MARK_SLICE_SIZE 1024
+
+// Initial capacity of a marking thread's deque.
+#define GRAY_DEQUE_SIZE 1024
+
+// Storage of a GrayDeque, replaced by a twice larger one once full.
+typedef struct GrayArray {
+    long capacity;
+    struct GrayArray* previous; // Outgrown, freed once the trace is over.
+    _Atomic(Obj*) items[];
+} GrayArray;
+
+// Work-stealing deque of gray objects (Chase and Lev's, with the orderings
+// of Le et al., "Correct and Efficient Work-Stealing for Weak Memory
+// Models"). Its thread pushes and takes at the bottom, the others steal at
+// the top.
+typedef struct {
+    atomic_long top;
+    atomic_long bottom;
+    _Atomic(GrayArray*) array;
+} GrayDeque;
+
+// Values or table entries shared out by a marking thread, see markRun().
+typedef struct {
+    Value* values;
+    Entry* entries;
+    int count;
+} MarkSlice;
+
+typedef struct {
+    GrayDeque deque;
+    pthread_t thread;
+    VM* vm;
+    int grayPeak;
+} MarkWorker;
+
+// Threads marking full collections along with the VM's, if gcThreads is
+// above 1, see traceInParallel().
+struct MarkPool {
+    int count;              // Workers, the first of them the VM's thread.
+    MarkWorker* workers;
+    pthread_mutex_t lock;
+    pthread_cond_t start;   // A trace began, or stop was set.
+    pthread_cond_t done;    // A worker finished its part of it.
+    long traces;            // Begun so far, under lock.
+    int finished;           // Workers done with the last one, under lock.
+    bool stop;              // Under lock.
+    atomic_int idle;        // Out of work, the trace is over once all are.
+    pthread_mutex_t sliceLock;
+    MarkSlice* slices;      // Under sliceLock.
+    atomic_int sliceCount;  // Changed under sliceLock.
+    int sliceCapacity;
+};
+
+// Set on the threads marking in parallel, whose markObject() goes through
+// their deques.
+static _Thread_local MarkWorker* markWorker = NULL;
+
+static void gcStep(VM* vm);
+static bool traceInParallel(VM* vm);
+static void stopMarkPool(VM* vm);
+
+void countAllocation(VM* vm, size_t oldSize, size_t newSize) {
+    vm->bytesAllocated += newSize - oldSize;
     if (newSize > oldSize) {
-#ifdef DEBUG_STRESS_GC
-        collectGarbage();
-#else
-        if (vm.bytesAllocated > vm.nextGC) {
-            collectGarbage();
+        // Concurrent collections start with objects, see startMarking().
+        if (vm->gcPhase != GC_IDLE ||
+            (vm->bytesAllocated > vm->nextGC && !vm->gcConcurrent)) {
+            gcStep(vm);
+        } else if (vm->bytesAllocated > vm->nextMinorGC) {
+            collectYoung(vm);
         }
-#endif
     }
+}
+
+void* reallocate(VM* vm, void* pointer, size_t oldSize, size_t newSize) {
+    countAllocation(vm, oldSize, newSize);
     if (newSize == 0) {
         free(pointer);
         return NULL;
@@ -31,89 +137,346 @@ void* reallocate(void* pointer, size_t oldSize, size_t newSize) {
     return result;
 }
 
-static void freeObject(Obj* object) {
+void freeObject(VM* vm, Obj* object) {
     #ifdef DEBUG_LOG_GC
         printf("%p free type %d\n", (void*)object, object->type);
     #endif
     switch (object->type) {
-        case OBJ_STRING: {
-            FREE(ObjString, object);
-            break;
-        }
+        case OBJ_STRING:
+        case OBJ_NATIVE:
+        case OBJ_UPVALUE:
+        case OBJ_BOUND_METHOD: break;
         case OBJ_FUNCTION: {
             ObjFunction* function = (ObjFunction*)object;
-            freeChunk(&function->chunk);
-            FREE(ObjFunction, object);
-            break;
-        }
-        case OBJ_NATIVE: {
-            FREE(ObjNative, object);
+            freeChunk(vm, &function->chunk);
+#ifdef JIT
+            jitFree(function);
+            traceFree(vm, function);
+#endif
             break;
         }
         case OBJ_CLOSURE: {
             ObjClosure* closure = (ObjClosure*)object;
-            FREE_ARRAY(ObjUpvalue*, closure->upvalues, closure->upvalueCount);
-            FREE(ObjClosure, object);
-            break;
-        }
-        case OBJ_UPVALUE: {
-            FREE(ObjUpvalue, object);
+            FREE_ARRAY(vm, ObjUpvalue*, closure->upvalues,
+                       closure->upvalueCount);
             break;
         }
         case OBJ_CLASS: {
             ObjClass* klass = (ObjClass*)object;
-            freeTable(&klass->methods);
-            FREE(ObjClass, object);
+            freeTable(vm, &klass->methods);
             break;
         }
         case OBJ_INSTANCE: {
             ObjInstance* instance = (ObjInstance*)object;
-            freeTable(&instance->fields);
-            FREE(ObjInstance, object);
+            if (instance->shape == NULL) {
+                freeTable(vm, instance->dictionary);
+                FREE(vm, Table, instance->dictionary);
+            } else {
+                FREE_ARRAY(vm, Value, instance->overflow,
+                           instance->overflowCapacity);
+            }
+            break;
+        }
+        case OBJ_FIBER: {
+            ObjFiber* fiber = (ObjFiber*)object;
+            FREE_ARRAY(vm, CallFrame, fiber->frames, fiber->frameCapacity);
+            FREE_ARRAY(vm, Value, fiber->stack, fiber->stackCapacity);
             break;
         }
-        case OBJ_BOUND_METHOD: FREE(ObjBoundMethod, object); break;
     }
 }
 
-bool isOld(Obj* object) {
-    return object->lastCollect < (vm.currentGC - GC_WAVE_DELAY);
+bool isMarked(VM* vm, Obj* object) {
+    return (vm->minorGC && object->old) || objectMarked(object);
+}
+
+// Hands what the VM logged over to the marker thread, waking it if idle.
+static void handOver(VM* vm) {
+    Marker* marker = vm->marker;
+    pthread_mutex_lock(&marker->lock);
+    if (marker->queueCapacity < marker->queueCount + marker->logCount) {
+        marker->queueCapacity =
+            GROW_CAPACITY(marker->queueCapacity) + MARKER_LOG_SIZE;
+        marker->queue =
+            realloc(marker->queue, sizeof(Obj*) * marker->queueCapacity);
+        if (marker->queue == NULL)
+            exit(1);
+    }
+    memcpy(marker->queue + marker->queueCount, marker->log,
+           sizeof(Obj*) * marker->logCount);
+    marker->queueCount += marker->logCount;
+    marker->logCount = 0;
+    if (!atomic_load(&marker->busy)) {
+        atomic_store(&marker->busy, true);
+        pthread_cond_signal(&marker->wake);
+    }
+    pthread_mutex_unlock(&marker->lock);
+}
+
+static GrayArray* newGrayArray(long capacity) {
+    GrayArray* array =
+        malloc(sizeof(GrayArray) + sizeof(_Atomic(Obj*)) * capacity);
+    if (array == NULL)
+        exit(1);
+    array->capacity = capacity;
+    array->previous = NULL;
+    return array;
+}
+
+// Returns how many objects the deque holds now.
+static long dequePush(GrayDeque* deque, Obj* object) {
+    long bottom = atomic_load_explicit(&deque->bottom, memory_order_relaxed);
+    long top = atomic_load_explicit(&deque->top, memory_order_acquire);
+    GrayArray* array =
+        atomic_load_explicit(&deque->array, memory_order_relaxed);
+    if (bottom - top > array->capacity - 1) {
+        GrayArray* grown = newGrayArray(array->capacity * 2);
+        for (long i = top; i < bottom; i++) {
+            Obj* item = atomic_load_explicit(&array->items[i % array->capacity],
+                                             memory_order_relaxed);
+            atomic_store_explicit(&grown->items[i % grown->capacity], item,
+                                  memory_order_relaxed);
+        }
+        // Thieves may still read the old one.
+        grown->previous = array;
+        atomic_store_explicit(&deque->array, grown, memory_order_release);
+        array = grown;
+    }
+    atomic_store_explicit(&array->items[bottom % array->capacity], object,
+                          memory_order_relaxed);
+    atomic_thread_fence(memory_order_release);
+    atomic_store_explicit(&deque->bottom, bottom + 1, memory_order_relaxed);
+    return bottom + 1 - top;
+}
+
+static Obj* dequeTake(GrayDeque* deque) {
+    long bottom =
+        atomic_load_explicit(&deque->bottom, memory_order_relaxed) - 1;
+    GrayArray* array =
+        atomic_load_explicit(&deque->array, memory_order_relaxed);
+    atomic_store_explicit(&deque->bottom, bottom, memory_order_relaxed);
+    atomic_thread_fence(memory_order_seq_cst);
+    long top = atomic_load_explicit(&deque->top, memory_order_relaxed);
+    if (top > bottom) {
+        atomic_store_explicit(&deque->bottom, bottom + 1, memory_order_relaxed);
+        return NULL;
+    }
+    Obj* object = atomic_load_explicit(&array->items[bottom % array->capacity],
+                                       memory_order_relaxed);
+    if (top == bottom) {
+        // The last one, a thief may be taking it too.
+        if (!atomic_compare_exchange_strong_explicit(
+                &deque->top, &top, top + 1, memory_order_seq_cst,
+                memory_order_relaxed))
+            object = NULL;
+        atomic_store_explicit(&deque->bottom, bottom + 1, memory_order_relaxed);
+    }
+    return object;
+}
+
+// Returns NULL if empty, or if another thread took the object first.
+static Obj* dequeSteal(GrayDeque* deque) {
+    long top = atomic_load_explicit(&deque->top, memory_order_acquire);
+    atomic_thread_fence(memory_order_seq_cst);
+    long bottom = atomic_load_explicit(&deque->bottom, memory_order_acquire);
+    if (top >= bottom)
+        return NULL;
+    GrayArray* array =
+        atomic_load_explicit(&deque->array, memory_order_acquire);
+    Obj* object = atomic_load_explicit(&array->items[top % array->capacity],
+                                       memory_order_relaxed);
+    if (!atomic_compare_exchange_strong_explicit(&deque->top, &top, top + 1,
+                                                 memory_order_seq_cst,
+                                                 memory_order_relaxed))
+        return NULL;
+    return object;
+}
+
+static bool dequeEmpty(GrayDeque* deque) {
+    return atomic_load_explicit(&deque->top, memory_order_relaxed) >=
+           atomic_load_explicit(&deque->bottom, memory_order_relaxed);
 }
 
-void markObject(Obj* object) {
-    if (object == NULL || !isOld(object))
+// markObject() on a thread marking in parallel. The others may race it to
+// the object, or to others of its page, so the mark is set atomically.
+static void markShared(MarkWorker* worker, Obj* object) {
+    if (objectMarked(object) || setMarked(object, true))
         return;
-    if (IS_STRING(OBJ_VAL(object)) || IS_NATIVE(OBJ_VAL(object))) {
-        object->lastCollect = vm.currentGC;
+    if (object->type == OBJ_STRING || object->type == OBJ_NATIVE)
+        return;
+    long count = dequePush(&worker->deque, object);
+    if (count > worker->grayPeak)
+        worker->grayPeak = (int)count;
+}
+
+void markObject(VM* vm, Obj* object) {
+    if (object == NULL)
+        return;
+    if (markWorker != NULL) {
+        markShared(markWorker, object);
         return;
     }
+    // The marks are the marker thread's while it runs, the VM logs for it.
+    if (vm->gcPhase == GC_CONCURRENT && !onMarker) {
+        Marker* marker = vm->marker;
+        marker->log[marker->logCount++] = object;
+        if (marker->logCount == MARKER_LOG_SIZE)
+            handOver(vm);
+        return;
+    }
+    if (isMarked(vm, object))
+        return;
+    // The VM allocates black meanwhile, see allocateObject() in object.c.
+    setMarked(object, onMarker);
+    if (object->type == OBJ_STRING || object->type == OBJ_NATIVE)
+        return;
 #ifdef DEBUG_LOG_GC
     printf("%p mark ", (void*)object);
     printValue(OBJ_VAL(object));
     printf("\n");
 #endif
-    object->lastCollect = vm.currentGC;
-    if (vm.grayCapacity < vm.grayCount + 1) {
-        vm.grayCapacity = GROW_CAPACITY(vm.grayCapacity);
-        vm.grayStack = realloc(vm.grayStack, sizeof(Obj*) * vm.grayCapacity);
-        if (vm.grayStack == NULL)
+    if (vm->grayCapacity < vm->grayCount + 1) {
+        vm->grayCapacity = GROW_CAPACITY(vm->grayCapacity);
+        vm->grayStack = realloc(vm->grayStack, sizeof(Obj*) * vm->grayCapacity);
+        if (vm->grayStack == NULL)
             exit(1);
     }
-    vm.grayStack[vm.grayCount++] = object;
+    vm->grayStack[vm->grayCount++] = object;
+    if (vm->grayCount > vm->gcStats.grayPeak)
+        vm->gcStats.grayPeak = vm->grayCount;
 }
 
-void markValue(Value value) {
+void markValue(VM* vm, Value value) {
     if (IS_OBJ(value))
-        markObject(AS_OBJ(value));
+        markObject(vm, AS_OBJ(value));
+}
+
+void rememberObject(VM* vm, Obj* object) {
+    if (vm->rememberedCapacity < vm->rememberedCount + 1) {
+        vm->rememberedCapacity = GROW_CAPACITY(vm->rememberedCapacity);
+        vm->remembered =
+            realloc(vm->remembered, sizeof(Obj*) * vm->rememberedCapacity);
+        if (vm->remembered == NULL)
+            exit(1);
+    }
+    object->remembered = true;
+    vm->remembered[vm->rememberedCount++] = object;
+}
+
+void recordWrite(VM* vm, Obj* object, Obj* target) {
+    // Dijkstra's barrier: while marking, marked objects never point at
+    // unmarked ones. The marker thread's marks are not read meanwhile.
+    bool marked = barrierMarked(vm, object);
+    if (vm->gcPhase == GC_MARK && marked)
+        markObject(vm, target);
+    // Marked objects are promoted once swept.
+    if ((object->old || marked) && !object->remembered && !target->old)
+        rememberObject(vm, object);
+}
+
+static void blackenObject(VM* vm, Obj* object);
+
+void scanObject(VM* vm, Obj* object) {
+    ScanState unscanned = SCAN_NONE;
+    if (atomic_compare_exchange_strong_explicit(&object->scan, &unscanned,
+                                                SCAN_BUSY, memory_order_acquire,
+                                                memory_order_acquire)) {
+        // Logs what it points to, the marker thread marks that.
+        blackenObject(vm, object);
+        atomic_store_explicit(&object->scan, SCAN_DONE, memory_order_release);
+        return;
+    }
+    // The marker thread is tracing it, which takes as long as one object.
+    while (atomic_load_explicit(&object->scan, memory_order_acquire) !=
+           SCAN_DONE)
+        ;
+}
+
+void markMutable(VM* vm, Obj* object) {
+    if (object == NULL)
+        return;
+    markObject(vm, object);
+    // Traced with the remembered set, once the roots are marked.
+    if ((object->old || objectMarked(object)) && !object->remembered)
+        rememberObject(vm, object);
+    // And right away if the marker thread is to trace the rest, it must not
+    // read an object changing under it.
+    if (vm->gcConcurrent && !vm->minorGC &&
+        atomic_load_explicit(&object->scan, memory_order_relaxed) ==
+            SCAN_NONE) {
+        atomic_store_explicit(&object->scan, SCAN_DONE, memory_order_relaxed);
+        blackenObject(vm, object);
+    }
 }
 
-static void markArray(ValueArray* array) {
+static void markArray(VM* vm, ValueArray* array) {
     for (int i = 0; i < array->count; i++) {
-        markValue(array->values[i]);
+        markValue(vm, array->values[i]);
     }
 }
 
-static void blackenObject(Obj* object) {
+static void markSlice(VM* vm, MarkSlice slice) {
+    if (slice.values != NULL) {
+        for (int i = 0; i < slice.count; i++)
+            markValue(vm, slice.values[i]);
+    } else {
+        for (int i = 0; i < slice.count; i++) {
+            markObject(vm, (Obj*)slice.entries[i].key);
+            markValue(vm, slice.entries[i].value);
+        }
+    }
+}
+
+// Marks count values, or table entries if values is NULL. Marking in
+// parallel, a long array is split: the thread marks the first slice, and
+// leaves the others to whichever threads take them.
+static void markRun(VM* vm, Value* values, Entry* entries, int count) {
+    if (markWorker != NULL && count > MARK_SLICE_SIZE) {
+        MarkPool* pool = vm->markPool;
+        pthread_mutex_lock(&pool->sliceLock);
+        int slices = atomic_load_explicit(&pool->sliceCount,
+                                          memory_order_relaxed);
+        for (int from = MARK_SLICE_SIZE; from < count;
+             from += MARK_SLICE_SIZE) {
+            if (pool->sliceCapacity < slices + 1) {
+                pool->sliceCapacity = GROW_CAPACITY(pool->sliceCapacity);
+                pool->slices = realloc(pool->slices, sizeof(MarkSlice) *
+                                                         pool->sliceCapacity);
+                if (pool->slices == NULL)
+                    exit(1);
+            }
+            int length = count - from < MARK_SLICE_SIZE ? count - from
+                                                        : MARK_SLICE_SIZE;
+            pool->slices[slices++] =
+                (MarkSlice){values != NULL ? values + from : NULL,
+                            values != NULL ? NULL : entries + from, length};
+        }
+        atomic_store_explicit(&pool->sliceCount, slices, memory_order_relaxed);
+        pthread_mutex_unlock(&pool->sliceLock);
+        count = MARK_SLICE_SIZE;
+    }
+    markSlice(vm, (MarkSlice){values, entries, count});
+}
+
+// Marks the stacks of the VM, or those a fiber holds.
+static void markStacks(VM* vm, Value* stack, Value* stackTop,
+                       CallFrame* frames, int frameCount,
+                       ObjUpvalue* openUpvalues) {
+    for (Value* slot = stack; slot < stackTop; slot++) {
+        markValue(vm, *slot);
+    }
+
+    for (int i = 0; i < frameCount; i++) {
+        markObject(vm, (Obj*)frames[i].closure);
+    }
+
+    for (ObjUpvalue* upvalue = openUpvalues; upvalue != NULL;
+         upvalue = upvalue->next) {
+        markObject(vm, (Obj*)upvalue);
+    }
+}
+
+static void blackenObject(VM* vm, Obj* object) {
 #ifdef DEBUG_LOG_GC
     printf("%p blacken ", (void*)object);
     printValue(OBJ_VAL(object));
@@ -122,116 +485,645 @@ static void blackenObject(Obj* object) {
     switch (object->type) {
         case OBJ_NATIVE:
         case OBJ_STRING: break;
-        case OBJ_UPVALUE: markValue(((ObjUpvalue*)object)->closed); break;
+        case OBJ_UPVALUE: {
+            ObjUpvalue* upvalue = (ObjUpvalue*)object;
+            markValue(vm, upvalue->closed);
+            // Keeps the stack an open upvalue points into alive.
+            if (upvalue->location != &upvalue->closed)
+                markObject(vm, (Obj*)upvalue->fiber);
+            break;
+        }
         case OBJ_FUNCTION: {
             ObjFunction* function = (ObjFunction*)object;
-            markObject((Obj*)function->name);
-            markArray(&function->chunk.constants);
+            markObject(vm, (Obj*)function->name);
+            markRun(vm, function->chunk.constants.values, NULL,
+                    function->chunk.constants.count);
+            markCaches(vm, &function->chunk);
             break;
         }
         case OBJ_CLOSURE: {
             ObjClosure* closure = (ObjClosure*)object;
-            markObject((Obj*)closure->function);
+            markObject(vm, (Obj*)closure->function);
             for (int i = 0; i < closure->upvalueCount; i++) {
-                markObject((Obj*)closure->upvalues[i]);
+                markObject(vm, (Obj*)closure->upvalues[i]);
             }
             break;
         }
         case OBJ_CLASS: {
             ObjClass* klass = (ObjClass*)object;
-            markObject((Obj*)klass->name);
-            markTable(&klass->methods);
+            markObject(vm, (Obj*)klass->name);
+            markTable(vm, &klass->methods);
             break;
         }
         case OBJ_INSTANCE: {
             ObjInstance* instance = (ObjInstance*)object;
-            markObject((Obj*)instance->klass);
-            markTable(&instance->fields);
+            markObject(vm, (Obj*)instance->klass);
+            if (instance->shape == NULL) {
+                markRun(vm, NULL, instance->dictionary->entries,
+                        instance->dictionary->capacity + 1);
+            } else {
+                int slots = instance->shape->slotCount;
+                for (int i = 0; i < slots && i < INSTANCE_INLINE_SLOTS; i++)
+                    markValue(vm, instance->fields[i]);
+                if (slots > INSTANCE_INLINE_SLOTS)
+                    markRun(vm, instance->overflow, NULL,
+                            slots - INSTANCE_INLINE_SLOTS);
+            }
             break;
         }
         case OBJ_BOUND_METHOD: {
             ObjBoundMethod* bound = (ObjBoundMethod*)object;
-            markValue(bound->receiver);
-            markObject((Obj*)bound->method);
+            markValue(vm, bound->receiver);
+            markObject(vm, (Obj*)bound->method);
             break;
         }
+        case OBJ_FIBER: {
+            ObjFiber* fiber = (ObjFiber*)object;
+            markObject(vm, (Obj*)fiber->closure);
+            markObject(vm, (Obj*)fiber->caller);
+            markStacks(vm, fiber->stack, fiber->stackTop, fiber->frames,
+                       fiber->frameCount, fiber->openUpvalues);
+            break;
+        }
+    }
+}
+
+static void markRoots(VM* vm) {
+    markStacks(vm, vm->stack, vm->stackTop, vm->frames, vm->frameCount,
+               vm->openUpvalues);
+    // Running fibers hold the stacks of their resumers, which change as
+    // roots until they are swapped back.
+    for (ObjFiber* fiber = vm->fiber; fiber != NULL; fiber = fiber->caller)
+        markMutable(vm, (Obj*)fiber);
+
+    markTable(vm, &vm->globalSlots);
+    markArray(vm, &vm->globalNames);
+    markArray(vm, &vm->globalValues);
+    markCompilerRoots(vm);
+    markObject(vm, (Obj*)vm->initString);
+    markShape(vm, vm->rootShape);
+}
+
+// Traces the objects in the remembered set again: the old ones a minor
+// collection leaves alone, or those written without barriers while a full
+// one was marking.
+static void traceRemembered(VM* vm) {
+    for (int i = 0; i < vm->rememberedCount; i++) {
+        if (isMarked(vm, vm->remembered[i]))
+            blackenObject(vm, vm->remembered[i]);
+    }
+}
+
+static void forgetRemembered(VM* vm) {
+    for (int i = 0; i < vm->rememberedCount; i++)
+        vm->remembered[i]->remembered = false;
+    vm->rememberedCount = 0;
+}
+
+// Blackens up to budget gray objects, all of them if budget is negative.
+// Returns whether none are left.
+static bool traceReferences(VM* vm, int budget) {
+    if (budget < 0 && vm->gcThreads > 1 && !vm->minorGC &&
+        vm->grayCount > 0 && traceInParallel(vm))
+        return true;
+    for (int traced = 0; vm->grayCount > 0; traced++) {
+        if (traced == budget)
+            return false;
+        Obj* object = vm->grayStack[--vm->grayCount];
+        blackenObject(vm, object);
+    }
+    return true;
+}
+
+// Sweeps pages until budget cells were, all of them if budget is negative.
+// A minor collection sweeps the pages of the young objects at once. Returns
+// whether the sweep is over.
+static bool sweep(VM* vm, int budget) {
+    if (!vm->minorGC)
+        return sweepPages(vm, budget);
+    sweepYoung(vm);
+    return true;
+}
+
+static uint64_t nanoseconds() {
+    struct timespec time;
+    clock_gettime(CLOCK_MONOTONIC, &time);
+    return (uint64_t)time.tv_sec * 1000000000u + (uint64_t)time.tv_nsec;
+}
+
+// Adds a pause of the mutator to vm->gcStats.
+static void recordPause(VM* vm, uint64_t pause) {
+    GCStats* stats = &vm->gcStats;
+    stats->totalPause += pause;
+    stats->lastPause = pause;
+    if (pause > stats->maxPause)
+        stats->maxPause = pause;
+
+    int bucket = 0;
+    for (uint64_t micros = pause / 1000; micros > 0; micros >>= 1)
+        bucket++;
+    stats->pauses[bucket < GC_PAUSE_BUCKETS ? bucket : GC_PAUSE_BUCKETS - 1]++;
+}
+
+// Adds a collection to vm->gcStats once it is over.
+static void recordCollection(VM* vm) {
+    GCStats* stats = &vm->gcStats;
+    stats->collections++;
+    if (vm->minorGC)
+        stats->minorCollections++;
+    stats->bytesAfter = vm->bytesAllocated;
+    if (stats->grayPeak > stats->maxGrayPeak)
+        stats->maxGrayPeak = stats->grayPeak;
+    stats->strings = vm->strings.count;
+    stats->stringCapacity = vm->strings.capacity;
+}
+
+uint64_t gcPausePercentile(VM* vm, double fraction) {
+    GCStats* stats = &vm->gcStats;
+    uint64_t count = 0;
+    for (int bucket = 0; bucket < GC_PAUSE_BUCKETS; bucket++)
+        count += stats->pauses[bucket];
+    uint64_t seen = 0;
+    for (int bucket = 0; bucket < GC_PAUSE_BUCKETS; bucket++) {
+        seen += stats->pauses[bucket];
+        if (seen > 0 && seen >= fraction * count) {
+            // Never above the longest pause, the last bucket has no bound.
+            uint64_t bound = (uint64_t)1000 << bucket;
+            return bound < stats->maxPause ? bound : stats->maxPause;
+        }
+    }
+    return stats->maxPause;
+}
+
+// Blackens the gray objects the VM did not scan already, see scanObject().
+static void traceConcurrently(VM* vm) {
+    Marker* marker = vm->marker;
+    while (vm->grayCount > 0 &&
+           !atomic_load_explicit(&marker->stop, memory_order_relaxed)) {
+        Obj* object = vm->grayStack[--vm->grayCount];
+        ScanState unscanned = SCAN_NONE;
+        if (atomic_compare_exchange_strong_explicit(
+                &object->scan, &unscanned, SCAN_BUSY, memory_order_acquire,
+                memory_order_relaxed)) {
+            blackenObject(vm, object);
+            atomic_store_explicit(&object->scan, SCAN_DONE,
+                                  memory_order_release);
+        }
     }
 }
 
-static void markRoots() {
-    for (Value* slot = vm.stack; slot < vm.stackTop; slot++) {
-        markValue(*slot);
+// Main of the marker thread: marks what is handed over and traces from the
+// gray stack until out of both, then sleeps until woken again.
+static void* runMarker(void* argument) {
+    VM* vm = argument;
+    Marker* marker = vm->marker;
+    onMarker = true;
+    pthread_mutex_lock(&marker->lock);
+    while (!atomic_load(&marker->stop)) {
+        if (!atomic_load(&marker->busy)) {
+            pthread_cond_wait(&marker->wake, &marker->lock);
+            continue;
+        }
+        // Taken as a whole, the VM hands over the next batch meanwhile.
+        Obj** queue = marker->queue;
+        int count = marker->queueCount;
+        int capacity = marker->queueCapacity;
+        marker->queue = marker->taken;
+        marker->queueCapacity = marker->takenCapacity;
+        marker->queueCount = 0;
+        marker->taken = queue;
+        marker->takenCapacity = capacity;
+        pthread_mutex_unlock(&marker->lock);
+
+        for (int i = 0; i < count; i++)
+            markObject(vm, queue[i]);
+        traceConcurrently(vm);
+
+        pthread_mutex_lock(&marker->lock);
+        if (marker->queueCount == 0) {
+            atomic_store(&marker->busy, false);
+            pthread_cond_broadcast(&marker->idle);
+        }
     }
+    pthread_mutex_unlock(&marker->lock);
+    return NULL;
+}
 
-    for (int i = 0; i < vm.frameCount; i++) {
-        markObject((Obj*)vm.frames[i].closure);
+// Hands the marking to the marker thread, starting it the first time. Marks
+// the VM's way if it can't be started.
+static void startMarker(VM* vm) {
+    if (vm->marker == NULL) {
+        Marker* marker = malloc(sizeof(Marker));
+        if (marker == NULL)
+            exit(1);
+        pthread_mutex_init(&marker->lock, NULL);
+        pthread_cond_init(&marker->wake, NULL);
+        pthread_cond_init(&marker->idle, NULL);
+        atomic_init(&marker->busy, false);
+        atomic_init(&marker->stop, false);
+        marker->queue = NULL;
+        marker->queueCount = 0;
+        marker->queueCapacity = 0;
+        marker->taken = NULL;
+        marker->takenCapacity = 0;
+        marker->logCount = 0;
+        vm->marker = marker;
+        if (pthread_create(&marker->thread, NULL, runMarker, vm) != 0) {
+            vm->marker = NULL;
+            free(marker);
+            vm->gcConcurrent = false;
+            return;
+        }
     }
+    Marker* marker = vm->marker;
+    pthread_mutex_lock(&marker->lock);
+    vm->gcPhase = GC_CONCURRENT;
+    atomic_store(&marker->busy, true);
+    pthread_cond_signal(&marker->wake);
+    pthread_mutex_unlock(&marker->lock);
+}
 
-    for (ObjUpvalue* upvalue = vm.openUpvalues; upvalue != NULL;
-         upvalue = upvalue->next) {
-        markObject((Obj*)upvalue);
+// Whether the marker thread ran out of work, handing it what the VM logged
+// if not. Once it has, the marks and the gray stack are the VM's again.
+static bool markerDone(VM* vm) {
+    Marker* marker = vm->marker;
+    if (atomic_load_explicit(&marker->busy, memory_order_acquire))
+        return false;
+    if (marker->logCount > 0) {
+        handOver(vm);
+        return false;
     }
+    return true;
+}
 
-    markTable(&vm.globals);
-    markCompilerRoots();
-    markObject((Obj*)vm.initString);
+// Waits for markerDone().
+static void awaitMarker(VM* vm) {
+    Marker* marker = vm->marker;
+    if (marker->logCount > 0)
+        handOver(vm);
+    pthread_mutex_lock(&marker->lock);
+    while (atomic_load(&marker->busy))
+        pthread_cond_wait(&marker->idle, &marker->lock);
+    pthread_mutex_unlock(&marker->lock);
 }
 
-void traceReferences() {
-    while (vm.grayCount > 0) {
-        Obj* object = vm.grayStack[--vm.grayCount];
-        blackenObject(object);
+static void stopMarker(VM* vm) {
+    Marker* marker = vm->marker;
+    if (marker == NULL)
+        return;
+    pthread_mutex_lock(&marker->lock);
+    atomic_store(&marker->stop, true);
+    pthread_cond_signal(&marker->wake);
+    pthread_mutex_unlock(&marker->lock);
+    pthread_join(marker->thread, NULL);
+
+    pthread_mutex_destroy(&marker->lock);
+    pthread_cond_destroy(&marker->wake);
+    pthread_cond_destroy(&marker->idle);
+    free(marker->queue);
+    free(marker->taken);
+    free(marker);
+    vm->marker = NULL;
+}
+
+// Takes a slice another thread shared out, if any, and marks it.
+static bool markSharedSlice(VM* vm, MarkPool* pool) {
+    if (atomic_load_explicit(&pool->sliceCount, memory_order_relaxed) == 0)
+        return false;
+    pthread_mutex_lock(&pool->sliceLock);
+    int count = atomic_load_explicit(&pool->sliceCount, memory_order_relaxed);
+    MarkSlice slice = {NULL, NULL, 0};
+    if (count > 0) {
+        slice = pool->slices[count - 1];
+        atomic_store_explicit(&pool->sliceCount, count - 1,
+                              memory_order_relaxed);
     }
+    pthread_mutex_unlock(&pool->sliceLock);
+    if (count == 0)
+        return false;
+    markSlice(vm, slice);
+    return true;
 }
 
-static void sweep() {
-    Obj* previous = NULL;
-    Obj* object = vm.objects;
-    while (object != NULL) {
-        if (!isOld(object)) {
-            previous = object;
-            object = object->next;
-        } else {
-            Obj* unreached = object;
-            object = object->next;
-            if (previous != NULL) {
-                previous->next = object;
-            } else {
-                vm.objects = object;
+static Obj* stealGray(MarkPool* pool, MarkWorker* thief) {
+    int self = (int)(thief - pool->workers);
+    for (int i = 1; i < pool->count; i++) {
+        MarkWorker* victim = &pool->workers[(self + i) % pool->count];
+        Obj* object = dequeSteal(&victim->deque);
+        if (object != NULL)
+            return object;
+    }
+    return NULL;
+}
+
+static bool workLeft(MarkPool* pool) {
+    if (atomic_load_explicit(&pool->sliceCount, memory_order_relaxed) > 0)
+        return true;
+    for (int i = 0; i < pool->count; i++) {
+        if (!dequeEmpty(&pool->workers[i].deque))
+            return true;
+    }
+    return false;
+}
+
+// A worker's part of traceInParallel(): blackens what its deque holds, then
+// what it takes from the others, until all of them are out of work. Those
+// out of work only ever gain some by taking it, so once all of them are,
+// the trace is over.
+static void traceShared(VM* vm, MarkWorker* worker) {
+    MarkPool* pool = vm->markPool;
+    markWorker = worker;
+    for (;;) {
+        Obj* object;
+        while ((object = dequeTake(&worker->deque)) != NULL)
+            blackenObject(vm, object);
+        if (markSharedSlice(vm, pool))
+            continue;
+        object = stealGray(pool, worker);
+        if (object != NULL) {
+            blackenObject(vm, object);
+            continue;
+        }
+
+        atomic_fetch_add(&pool->idle, 1);
+        while (!workLeft(pool)) {
+            if (atomic_load(&pool->idle) == pool->count) {
+                markWorker = NULL;
+                return;
             }
-            freeObject(unreached);
+            sched_yield();
         }
+        atomic_fetch_sub(&pool->idle, 1);
     }
 }
 
-void collectGarbage() {
+// Main of the other marking threads: a traceShared() per trace begun.
+static void* runMarkWorker(void* argument) {
+    MarkWorker* worker = argument;
+    MarkPool* pool = worker->vm->markPool;
+    long traces = 0;
+    pthread_mutex_lock(&pool->lock);
+    for (;;) {
+        while (!pool->stop && pool->traces == traces)
+            pthread_cond_wait(&pool->start, &pool->lock);
+        if (pool->stop)
+            break;
+        traces = pool->traces;
+        pthread_mutex_unlock(&pool->lock);
+
+        traceShared(worker->vm, worker);
+
+        pthread_mutex_lock(&pool->lock);
+        pool->finished++;
+        pthread_cond_signal(&pool->done);
+    }
+    pthread_mutex_unlock(&pool->lock);
+    return NULL;
+}
+
+// Starts the threads marking along with the VM's the first time. Returns
+// NULL if none could be, the VM marks on its own then.
+static MarkPool* startMarkPool(VM* vm) {
+    if (vm->markPool != NULL)
+        return vm->markPool;
+    MarkPool* pool = malloc(sizeof(MarkPool));
+    MarkWorker* workers = malloc(sizeof(MarkWorker) * vm->gcThreads);
+    if (pool == NULL || workers == NULL)
+        exit(1);
+    pool->count = vm->gcThreads;
+    pool->workers = workers;
+    pthread_mutex_init(&pool->lock, NULL);
+    pthread_cond_init(&pool->start, NULL);
+    pthread_cond_init(&pool->done, NULL);
+    pool->traces = 0;
+    pool->finished = 0;
+    pool->stop = false;
+    atomic_init(&pool->idle, 0);
+    pthread_mutex_init(&pool->sliceLock, NULL);
+    pool->slices = NULL;
+    atomic_init(&pool->sliceCount, 0);
+    pool->sliceCapacity = 0;
+    for (int i = 0; i < pool->count; i++) {
+        atomic_init(&workers[i].deque.top, 0);
+        atomic_init(&workers[i].deque.bottom, 0);
+        atomic_init(&workers[i].deque.array, newGrayArray(GRAY_DEQUE_SIZE));
+        workers[i].vm = vm;
+        workers[i].grayPeak = 0;
+    }
+    vm->markPool = pool;
+
+    // The workers wait for the first trace, which sees the final count.
+    for (int i = 1; i < pool->count; i++) {
+        if (pthread_create(&workers[i].thread, NULL, runMarkWorker,
+                           &workers[i]) != 0) {
+            for (int j = i; j < pool->count; j++)
+                free(atomic_load(&workers[j].deque.array));
+            pool->count = i;
+            break;
+        }
+    }
+    if (pool->count == 1) {
+        stopMarkPool(vm);
+        vm->gcThreads = 1;
+        return NULL;
+    }
+    return pool;
+}
+
+// Blackens every gray object on vm->gcThreads threads, the VM's among them.
+// Returns false if no thread could be started to help.
+static bool traceInParallel(VM* vm) {
+    MarkPool* pool = startMarkPool(vm);
+    if (pool == NULL)
+        return false;
+    // Dealt out while the others wait, only a deque's thread pushes to it.
+    for (int i = 0; i < vm->grayCount; i++)
+        dequePush(&pool->workers[i % pool->count].deque, vm->grayStack[i]);
+    vm->grayCount = 0;
+    atomic_store(&pool->idle, 0);
+
+    pthread_mutex_lock(&pool->lock);
+    pool->traces++;
+    pool->finished = 0;
+    pthread_cond_broadcast(&pool->start);
+    pthread_mutex_unlock(&pool->lock);
+    traceShared(vm, &pool->workers[0]);
+    pthread_mutex_lock(&pool->lock);
+    while (pool->finished < pool->count - 1)
+        pthread_cond_wait(&pool->done, &pool->lock);
+    pthread_mutex_unlock(&pool->lock);
+
+    for (int i = 0; i < pool->count; i++) {
+        MarkWorker* worker = &pool->workers[i];
+        GrayArray* array = atomic_load(&worker->deque.array);
+        while (array->previous != NULL) {
+            GrayArray* previous = array->previous;
+            array->previous = previous->previous;
+            free(previous);
+        }
+        if (worker->grayPeak > vm->gcStats.grayPeak)
+            vm->gcStats.grayPeak = worker->grayPeak;
+        worker->grayPeak = 0;
+    }
+    return true;
+}
+
+static void stopMarkPool(VM* vm) {
+    MarkPool* pool = vm->markPool;
+    if (pool == NULL)
+        return;
+    pthread_mutex_lock(&pool->lock);
+    pool->stop = true;
+    pthread_cond_broadcast(&pool->start);
+    pthread_mutex_unlock(&pool->lock);
+    for (int i = 1; i < pool->count; i++)
+        pthread_join(pool->workers[i].thread, NULL);
+
+    for (int i = 0; i < pool->count; i++) {
+        GrayArray* array = atomic_load(&pool->workers[i].deque.array);
+        while (array != NULL) {
+            GrayArray* previous = array->previous;
+            free(array);
+            array = previous;
+        }
+    }
+    pthread_mutex_destroy(&pool->lock);
+    pthread_cond_destroy(&pool->start);
+    pthread_cond_destroy(&pool->done);
+    pthread_mutex_destroy(&pool->sliceLock);
+    free(pool->slices);
+    free(pool->workers);
+    free(pool);
+    vm->markPool = NULL;
+}
+
+void stopGCThreads(VM* vm) {
+    stopMarker(vm);
+    stopMarkPool(vm);
+}
+
+static void beginCollection(VM* vm, bool minor) {
 #ifdef DEBUG_LOG_GC
-    printf("-- gc begin vm collect wave %d\n", vm.currentGC);
-    size_t before = vm.bytesAllocated;
+    printf("-- %s gc begin\n", minor ? "minor" : "full");
 #endif
+    vm->gcStats.bytesBefore = vm->bytesAllocated;
+    vm->gcStats.grayPeak = 0;
+    vm->minorGC = minor;
+    vm->gcPhase = GC_MARK;
+    markRoots(vm);
+    if (minor)
+        traceRemembered(vm);
+}
 
-    vm.currentGC++;
-
-    markRoots();
-    traceReferences();
-    tableRemoveWhites(&vm.strings);
-    sweep();
+// Marks what is left. The roots and the objects written without barriers
+// are traced again, since they changed while the marking was incremental.
+static void finishMarking(VM* vm) {
+    if (!vm->minorGC) {
+        markRoots(vm);
+        traceRemembered(vm);
+    }
+    traceReferences(vm, -1);
+    tableRemoveWhites(vm, &vm->strings);
+    // Every survivor is old once swept, none of them points at a young
+    // object. Forgotten first, the sweep may free remembered ones.
+    forgetRemembered(vm);
+    vm->gcPhase = GC_SWEEP;
+    if (!vm->minorGC)
+        startSweep(&vm->heap);
+}
 
-    vm.nextGC = vm.bytesAllocated * GC_HEAP_GROW_FACTOR;
+static void endCollection(VM* vm) {
+    vm->nextMinorGC = vm->bytesAllocated + NURSERY_SIZE;
+    if (!vm->minorGC) {
+        vm->nextGC = vm->bytesAllocated * GC_HEAP_GROW_FACTOR;
+        // A heap smaller than the nursery would reach nextGC first, and run
+        // full collections where minor ones would do.
+        if (vm->nextGC < vm->nextMinorGC + NURSERY_SIZE)
+            vm->nextGC = vm->nextMinorGC + NURSERY_SIZE;
+    }
+    recordCollection(vm);
+    vm->gcPhase = GC_IDLE;
+    vm->minorGC = false;
 
 #ifdef DEBUG_LOG_GC
     printf("-- gc end\n");
     printf(" collected %ld bytes (from %ld to %ld) next at %ld\n",
-           before - vm.bytesAllocated, before, vm.bytesAllocated, vm.nextGC);
+           vm->gcStats.bytesBefore - vm->bytesAllocated,
+           vm->gcStats.bytesBefore, vm->bytesAllocated, vm->nextGC);
 #endif
 }
 
-void freeObjects() {
-    Obj* object = vm.objects;
-    while (object != NULL) {
-        Obj* next = object->next;
-        freeObject(object);
-        object = next;
+// Runs the rest of the collection in progress at once.
+static void finishCollection(VM* vm) {
+    if (vm->gcPhase == GC_CONCURRENT) {
+        awaitMarker(vm);
+        vm->gcPhase = GC_MARK;
     }
-    free(vm.grayStack);
+    if (vm->gcPhase == GC_MARK)
+        finishMarking(vm);
+    sweep(vm, -1);
+    endCollection(vm);
+}
+
+// Advances the full collection by vm->gcStepSize objects, starting one if
+// none is in progress. The mutator runs between steps, so stores into marked
+// objects go through writeBarrier(). Steps sweep whole pages, one at least,
+// and allocations sweep those they take cells from. With vm->gcConcurrent
+// set, the marker thread marks from the roots the first step marks, and the
+// steps wait for it to be done: the end of the marking is left then, as for
+// incremental ones, the roots marked again and what they reach since.
+static void gcStep(VM* vm) {
+    // The marker thread works while the VM runs, that is no pause.
+    if (vm->gcPhase == GC_CONCURRENT && !markerDone(vm))
+        return;
+    uint64_t start = nanoseconds();
+    if (vm->gcPhase == GC_IDLE) {
+        beginCollection(vm, false);
+        if (vm->gcConcurrent)
+            startMarker(vm);
+    } else if (vm->gcPhase == GC_CONCURRENT) {
+        vm->gcPhase = GC_MARK;
+    }
+    if (vm->gcPhase == GC_CONCURRENT) {
+        // Just handed to the marker thread.
+    } else if (vm->gcPhase == GC_MARK) {
+        // Marked at once by all the threads if several, or with no step size.
+        bool atOnce = vm->gcThreads > 1 || vm->gcStepSize <= 0;
+        if (traceReferences(vm, atOnce ? -1 : vm->gcStepSize))
+            finishMarking(vm);
+    } else if (sweep(vm, vm->gcStepSize)) {
+        endCollection(vm);
+    }
+    vm->gcStats.steps++;
+    recordPause(vm, nanoseconds() - start);
+}
+
+static void collect(VM* vm, bool minor) {
+    uint64_t start = nanoseconds();
+    if (vm->gcPhase != GC_IDLE) {
+        finishCollection(vm);
+        if (minor) {
+            recordPause(vm, nanoseconds() - start);
+            return;
+        }
+    }
+    beginCollection(vm, minor);
+    finishCollection(vm);
+    recordPause(vm, nanoseconds() - start);
+}
+
+void startMarking(VM* vm) {
+    if (vm->gcConcurrent && vm->gcPhase == GC_IDLE &&
+        vm->bytesAllocated > vm->nextGC)
+        gcStep(vm);
+}
+
+void collectGarbage(VM* vm) { collect(vm, false); }
+
+void collectYoung(VM* vm) { collect(vm, true); }
+
+void freeObjects(VM* vm) {
+    freeHeap(vm);
+    free(vm->grayStack);
+    free(vm->remembered);
 }
\ No newline at end of file
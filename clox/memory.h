@@ -6,22 +6,110 @@
 #include "value.h"
 
 #define GC_HEAP_GROW_FACTOR 2
-#define GC_WAVE_DELAY 100
+
+// Bytes allocated between minor collections. Under DEBUG_STRESS_GC every
+// allocation runs one.
+#ifdef DEBUG_STRESS_GC
+#define NURSERY_SIZE 0
+#else
+#define NURSERY_SIZE (256 * 1024)
+#endif
+
+// Objects a step of a full collection traces or sweeps, once per allocation
+// until the collection is over. The default of vm->gcStepSize. Sweeping goes
+// by whole pages.
+#ifndef GC_STEP_SIZE
+#define GC_STEP_SIZE 1000
+#endif
 
 #define GROW_CAPACITY(capacity) ((capacity) < 8 ? 8 : (capacity) * 2)
-#define GROW_ARRAY(type, pointer, oldCount, newCount)                          \
-    (type*)reallocate(pointer, sizeof(type) * (oldCount),                      \
+#define GROW_ARRAY(vm, type, pointer, oldCount, newCount)                      \
+    (type*)reallocate(vm, pointer, sizeof(type) * (oldCount),                  \
                       sizeof(type) * (newCount))
-#define FREE_ARRAY(type, pointer, oldCount)                                    \
-    reallocate(pointer, sizeof(type) * oldCount, 0)
-#define ALLOCATE(type, count) (type*)reallocate(NULL, 0, sizeof(type) * (count))
-#define FREE(type, pointer) reallocate(pointer, sizeof(type), 0)
-
-void* reallocate(void* pointer, size_t oldSize, size_t newSize);
-bool isOld(Obj* object);
-void markObject(Obj* object);
-void markValue(Value value);
-void collectGarbage();
-void freeObjects();
+#define FREE_ARRAY(vm, type, pointer, oldCount)                                \
+    reallocate(vm, pointer, sizeof(type) * oldCount, 0)
+#define ALLOCATE(vm, type, count)                                              \
+    (type*)reallocate(vm, NULL, 0, sizeof(type) * (count))
+#define FREE(vm, type, pointer) reallocate(vm, pointer, sizeof(type), 0)
+
+void* reallocate(VM* vm, void* pointer, size_t oldSize, size_t newSize);
+
+/**
+ * @brief Counts an allocation resized from oldSize to newSize bytes.
+ *
+ * A growing one runs a step of the collection in progress first, or starts
+ * a collection once the heap is large enough. reallocate() and
+ * allocateCell() count theirs here.
+ */
+void countAllocation(VM* vm, size_t oldSize, size_t newSize);
+
+/**
+ * @brief Frees what object holds outside its cell, see freeCell() in heap.c.
+ */
+void freeObject(VM* vm, Obj* object);
+
+/**
+ * @brief Whether the collection in progress reached object.
+ *
+ * Minor collections leave old objects alone, they count as reached.
+ */
+bool isMarked(VM* vm, Obj* object);
+
+void markObject(VM* vm, Obj* object);
+void markValue(VM* vm, Value value);
+
+/**
+ * @brief Marks an object the VM writes to without write barriers.
+ *
+ * Such as a function being compiled or a fiber holding a stack. Minor
+ * collections trace it even when it is old, and full ones trace it again
+ * once done marking. Those marking on the marker thread trace it at once,
+ * the thread must not read it while it changes.
+ */
+void markMutable(VM* vm, Obj* object);
+
+/**
+ * @brief Starts a full collection on the marker thread, if vm->gcConcurrent
+ * is set and the heap grew past vm->nextGC.
+ *
+ * Called as an object is about to be allocated: unlike the allocations of
+ * arrays, none happens halfway through changing another object, see
+ * snapshotBarrier().
+ */
+void startMarking(VM* vm);
+
+/**
+ * @brief Stops the marker thread and the threads marking in parallel, if
+ * any, dropping the marking in progress.
+ *
+ * freeVM() stops them before freeing anything they may read.
+ */
+void stopGCThreads(VM* vm);
+
+/**
+ * @brief Collects the whole heap at once.
+ *
+ * Finishes the incremental collection in progress first, if any.
+ */
+void collectGarbage(VM* vm);
+
+/**
+ * @brief Collects the objects allocated since the last collection.
+ *
+ * Survivors are promoted to the old generation. While an incremental full
+ * collection is in progress, finishes that one instead.
+ */
+void collectYoung(VM* vm);
+
+/**
+ * @brief Pause below which a fraction of the pauses so far finished.
+ *
+ * Read from the histogram in vm->gcStats, so only as precise as its power
+ * of two buckets: the result is the upper bound of a bucket.
+ * @param fraction Between 0 and 1, 0.99 for the 99th percentile.
+ * @return Nanoseconds, 0 before the first collection.
+ */
+uint64_t gcPausePercentile(VM* vm, double fraction);
+void freeObjects(VM* vm);
 
 #endif
\ No newline at end of file
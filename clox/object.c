@@ -3,93 +3,202 @@
 #include <stdlib.h>
 #include <string.h>
 
+#include "cache.h"
+#include "heap.h"
 #include "memory.h"
 #include "object.h"
+#include "optimizer.h"
+#include "shape.h"
 #include "value.h"
 #include "vm.h"
 
-#define ALLOCATE_OBJ(type, objectType)                                         \
-    (type*)allocateObject(sizeof(type), objectType)
+#define ALLOCATE_OBJ(vm, type, objectType)                                     \
+    (type*)allocateObject(vm, sizeof(type), objectType)
 
-static Obj* allocateObject(size_t size, ObjType type) {
-    Obj* object = (Obj*)reallocate(NULL, 0, size);
+static Obj* allocateObject(VM* vm, size_t size, ObjType type) {
+    startMarking(vm);
+    Obj* object = allocateCell(vm, size);
     object->type = type;
-    object->next = vm.objects;
-    object->lastCollect = vm.currentGC;
-    vm.objects = object;
+    // Allocated black while the marker thread runs, which only traces what
+    // was reachable as it started.
+    bool black = vm->gcPhase == GC_CONCURRENT;
+    if (black)
+        setMarked(object, true);
+    object->old = false;
+    object->remembered = false;
+    atomic_init(&object->scan, black ? SCAN_DONE : SCAN_NONE);
     #ifdef DEBUG_LOG_GC
         printf("%p allocate %ld for %d\n", (void*)object, size, type);
     #endif
     return object;
 }
 
-ObjFunction* newFunction() {
-    ObjFunction* function = ALLOCATE_OBJ(ObjFunction, OBJ_FUNCTION);
+ObjFunction* newFunction(VM* vm) {
+    ObjFunction* function = ALLOCATE_OBJ(vm, ObjFunction, OBJ_FUNCTION);
 
     function->arity = 0;
+    function->maxSlots = 0;
     function->name = NULL;
     function->upvalueCount = 0;
+    function->calls = 0;
+    function->native = NULL;
+    function->nativeSize = 0;
+    function->traces = NULL;
+    function->deopts = 0;
+    function->executed = 0;
+    function->callRecord = -1;
     initChunk(&function->chunk);
     return function;
 }
 
-ObjNative* newNative(NativeFn function) {
-    ObjNative* native = ALLOCATE_OBJ(ObjNative, OBJ_NATIVE);
+ObjNative* newNative(VM* vm, const char* name, NativeFn function) {
+    ObjNative* native = ALLOCATE_OBJ(vm, ObjNative, OBJ_NATIVE);
     native->function = function;
+    native->name = name;
+    native->callRecord = -1;
     return native;
 }
 
-ObjClosure* newClosure(ObjFunction* function) {
-    ObjUpvalue** upvalues = ALLOCATE(ObjUpvalue*, function->upvalueCount);
+ObjClosure* newClosure(VM* vm, ObjFunction* function) {
+    ObjUpvalue** upvalues = ALLOCATE(vm, ObjUpvalue*, function->upvalueCount);
     memset(upvalues, 0, sizeof(ObjUpvalue*) * function->upvalueCount);
 
-    ObjClosure* closure = ALLOCATE_OBJ(ObjClosure, OBJ_CLOSURE);
+    ObjClosure* closure = ALLOCATE_OBJ(vm, ObjClosure, OBJ_CLOSURE);
     closure->function = function;
     closure->upvalues = upvalues;
     closure->upvalueCount = function->upvalueCount;
     return closure;
 }
 
-ObjUpvalue* newUpvalue(Value* slot) {
-    ObjUpvalue* upvalue = ALLOCATE_OBJ(ObjUpvalue, OBJ_UPVALUE);
+ObjUpvalue* newUpvalue(VM* vm, Value* slot) {
+    ObjUpvalue* upvalue = ALLOCATE_OBJ(vm, ObjUpvalue, OBJ_UPVALUE);
     upvalue->location = slot;
     upvalue->next = NULL;
     upvalue->closed = NIL_VAL;
+    upvalue->fiber = vm->fiber;
     return upvalue;
 }
 
-ObjClass* newClass(ObjString* name) {
-    ObjClass* klass = ALLOCATE_OBJ(ObjClass, OBJ_CLASS);
+ObjClass* newClass(VM* vm, ObjString* name) {
+    ObjClass* klass = ALLOCATE_OBJ(vm, ObjClass, OBJ_CLASS);
     klass->name = name;
     initTable(&klass->methods);
     return klass;
 }
 
-ObjInstance* newInstance(ObjClass* klass) {
-    ObjInstance* instance = ALLOCATE_OBJ(ObjInstance, OBJ_INSTANCE);
+ObjInstance* newInstance(VM* vm, ObjClass* klass) {
+    ObjInstance* instance = ALLOCATE_OBJ(vm, ObjInstance, OBJ_INSTANCE);
     instance->klass = klass;
-    initTable(&instance->fields);
+    instance->shape = vm->rootShape;
+    instance->overflow = NULL;
+    instance->overflowCapacity = 0;
     return instance;
 }
 
-ObjBoundMethod* newBoundMethod(Value receiver, ObjClosure* method) {
-    ObjBoundMethod* bound = ALLOCATE_OBJ(ObjBoundMethod, OBJ_BOUND_METHOD);
+bool getField(ObjInstance* instance, ObjString* name, Value* value) {
+    if (instance->shape == NULL)
+        return tableGet(instance->dictionary, name, value);
+
+    int slot = shapeFind(instance->shape, name);
+    if (slot < 0)
+        return false;
+    *value = *instanceSlot(instance, slot);
+    return true;
+}
+
+// Moves the fields to a hash table. Until the switch at the end everything
+// the table holds is still reachable through the slots.
+static void toDictionary(VM* vm, ObjInstance* instance) {
+    Table* dictionary = ALLOCATE(vm, Table, 1);
+    initTable(dictionary);
+    for (Shape* shape = instance->shape; shape->parent != NULL;
+         shape = shape->parent) {
+        tableSet(vm, dictionary, shape->name,
+                 *instanceSlot(instance, shape->slotCount - 1));
+    }
+
+    FREE_ARRAY(vm, Value, instance->overflow, instance->overflowCapacity);
+    instance->overflowCapacity = 0;
+    instance->shape = NULL;
+    instance->dictionary = dictionary;
+}
+
+void ensureSlots(VM* vm, ObjInstance* instance, int slotCount) {
+    int overflow = slotCount - INSTANCE_INLINE_SLOTS;
+    if (overflow > instance->overflowCapacity) {
+        int oldCapacity = instance->overflowCapacity;
+        instance->overflowCapacity = oldCapacity < 4 ? 4 : oldCapacity * 2;
+        instance->overflow =
+            GROW_ARRAY(vm, Value, instance->overflow, oldCapacity,
+                       instance->overflowCapacity);
+    }
+}
+
+void setField(VM* vm, ObjInstance* instance, ObjString* name, Value value) {
+    snapshotBarrier(vm, &instance->obj);
+    if (instance->shape != NULL) {
+        int slot = shapeFind(instance->shape, name);
+        if (slot >= 0) {
+            *instanceSlot(instance, slot) = value;
+            writeBarrier(vm, &instance->obj, value);
+            return;
+        }
+        if (instance->shape->slotCount == SHAPE_MAX_SLOTS)
+            toDictionary(vm, instance);
+    }
+    if (instance->shape == NULL) {
+        tableSet(vm, instance->dictionary, name, value);
+        writeBarrier(vm, &instance->obj, value);
+        return;
+    }
+
+    Shape* shape = shapeTransition(vm, instance->shape, name);
+    ensureSlots(vm, instance, shape->slotCount);
+    // The GC only looks at slots of the current shape, fill the new one
+    // before switching.
+    *instanceSlot(instance, shape->slotCount - 1) = value;
+    writeBarrier(vm, &instance->obj, value);
+    instance->shape = shape;
+}
+
+ObjBoundMethod* newBoundMethod(VM* vm, Value receiver, ObjClosure* method) {
+    ObjBoundMethod* bound = ALLOCATE_OBJ(vm, ObjBoundMethod, OBJ_BOUND_METHOD);
     bound->receiver = receiver;
     bound->method = method;
     return bound;
 }
 
-static void printFunction(ObjFunction* function) {
+static void printFunction(FILE* file, ObjFunction* function) {
     if (function->name == NULL) {
-        printf("<script>");
+        fputs("<script>", file);
         return;
     }
-    printf("<fn %s>", function->name->chars);
+    fprintf(file, "<fn %s>", function->name->chars);
+}
+
+ObjFiber* newFiber(VM* vm, ObjClosure* closure) {
+    // The stacks come first, the fiber is not written to once allocated.
+    // Once swapped into the VM they grow like its own, and the VM counts
+    // their growth.
+    CallFrame* frames = ALLOCATE(vm, CallFrame, FRAMES_INITIAL);
+    Value* stack = ALLOCATE(vm, Value, STACK_INITIAL);
+    ObjFiber* fiber = ALLOCATE_OBJ(vm, ObjFiber, OBJ_FIBER);
+    fiber->closure = closure;
+    fiber->state = FIBER_NEW;
+    fiber->caller = NULL;
+    fiber->frames = frames;
+    fiber->frameCount = 0;
+    fiber->frameCapacity = FRAMES_INITIAL;
+    fiber->stack = stack;
+    fiber->stackTop = stack;
+    fiber->stackCapacity = STACK_INITIAL;
+    fiber->openUpvalues = NULL;
+    return fiber;
 }
 
 // Special case because of the use of Flexible Array Members
-static ObjString* allocateString(int length) {
-    ObjString* string = (ObjString*)allocateObject(
+static ObjString* allocateString(VM* vm, int length) {
+    ObjString* string = (ObjString*)allocateObject(vm,
         sizeof(ObjString) + sizeof(char) * length + 1, OBJ_STRING);
     string->length = length;
     return string;
@@ -105,15 +214,26 @@ static uint32_t hashString(const char* key, int length) {
     return hash;
 }
 
-ObjString* takeString(const char* chars, int length) {
+// The interned string, if any. Marking on the marker thread started from a
+// snapshot, which may not reach the string any more: it must see the string
+// once it's in use again.
+static ObjString* findString(VM* vm, const char* chars, int length,
+                             uint32_t hash) {
+    ObjString* interned = tableFindString(&vm->strings, chars, length, hash);
+    if (interned != NULL && vm->gcPhase == GC_CONCURRENT)
+        markObject(vm, &interned->obj);
+    return interned;
+}
+
+ObjString* takeString(VM* vm, const char* chars, int length) {
     // Avoid using this function as it makes an additional memcpy
     uint32_t hash = hashString(chars, length);
 
-    ObjString* interned = tableFindString(&vm.strings, chars, length, hash);
+    ObjString* interned = findString(vm, chars, length, hash);
     if (interned != NULL)
         return interned;
 
-    ObjString* string = allocateString(length);
+    ObjString* string = allocateString(vm, length);
     memcpy(string->chars, chars, length * sizeof(char));
     string->chars[length] = '\0';
     string->hash = hash;
@@ -121,21 +241,21 @@ ObjString* takeString(const char* chars, int length) {
     return string;
 }
 
-ObjString* copyString(const char* chars, int length) {
+ObjString* copyString(VM* vm, const char* chars, int length) {
     uint32_t hash = hashString(chars, length);
 
-    ObjString* interned = tableFindString(&vm.strings, chars, length, hash);
+    ObjString* interned = findString(vm, chars, length, hash);
     if (interned != NULL)
         return interned;
 
-    ObjString* string = allocateString(length);
+    ObjString* string = allocateString(vm, length);
     memcpy(string->chars, chars, length + 1);
     string->chars[length] = '\0';
     string->hash = hash;
 
-    push(OBJ_VAL(string));
-    tableSet(&vm.strings, string, NIL_VAL);
-    pop();
+    push(vm, OBJ_VAL(string));
+    tableSet(vm, &vm->strings, string, NIL_VAL);
+    pop(vm);
 
     return string;
 }
@@ -145,38 +265,51 @@ bool stringsEqual(ObjString* a, ObjString* b) {
             !memcmp(a->chars, b->chars, a->length));
 }
 
-void printObject(Value value) {
+void printObject(FILE* file, Value value) {
     if (!IS_OBJ(value)) {
     }
     switch (OBJ_TYPE(value)) {
-        case OBJ_STRING: printf("%s", AS_CSTRING(value)); break;
-        case OBJ_FUNCTION: printFunction(AS_FUNCTION(value)); break;
-        case OBJ_NATIVE: printf("<native fn>"); break;
-        case OBJ_CLOSURE: printFunction(AS_CLOSURE(value)->function); break;
-        case OBJ_UPVALUE: printf("upvalue"); break;
+        case OBJ_STRING: fputs(AS_CSTRING(value), file); break;
+        case OBJ_FUNCTION: printFunction(file, AS_FUNCTION(value)); break;
+        case OBJ_NATIVE: fputs("<native fn>", file); break;
+        case OBJ_CLOSURE:
+            printFunction(file, AS_CLOSURE(value)->function);
+            break;
+        case OBJ_UPVALUE: fputs("upvalue", file); break;
         case OBJ_CLASS:
-            printf("<class %s>", AS_CLASS(value)->name->chars);
+            fprintf(file, "<class %s>", AS_CLASS(value)->name->chars);
             break;
         case OBJ_INSTANCE:
-            printf("<%s instance>", AS_INSTANCE(value)->klass->name->chars);
+            fprintf(file, "<%s instance>",
+                    AS_INSTANCE(value)->klass->name->chars);
             break;
         case OBJ_BOUND_METHOD:
-            printFunction(AS_BOUND_METHOD(value)->method->function);
+            printFunction(file, AS_BOUND_METHOD(value)->method->function);
             break;
+        case OBJ_FIBER: fputs("<fiber>", file); break;
     }
 }
 
+// What follows each constant in a chunk file. Objects are written out, a
+// pointer means nothing to the process loading the file.
+typedef enum {
+    CONSTANT_VALUE,    // The Value itself
+    CONSTANT_STRING,   // Length, then the characters
+    CONSTANT_FUNCTION, // See writeObjFunctionToFile()
+} ConstantTag;
+
 void writeChunkToFile(Chunk* chunk, FILE* file);
 
 void writeObjFunctionToFile(ObjFunction* function, FILE* file) {
-    #ifndef NAN_BOXING
-    Obj fakeObj = {.type = OBJ_FUNCTION, .lastCollect = 0};
-    Value fakeVal = {.type = VAL_OBJ, .as = {.obj = &fakeObj}};
-    fwrite(&fakeVal, sizeof(Value), 1, file);
-    #endif
-
-    // Write the arity
+    // Write the arity and upvalue count, OP_CLOSURE's length depends on it
     fwrite(&function->arity, sizeof(int), 1, file);
+    fwrite(&function->upvalueCount, sizeof(int), 1, file);
+
+    // Write the name, a length of -1 for the script
+    int nameLength = function->name != NULL ? function->name->length : -1;
+    fwrite(&nameLength, sizeof(int), 1, file);
+    if (function->name != NULL)
+        fwrite(function->name->chars, sizeof(char), nameLength, file);
 
     // Write the chunk
     writeChunkToFile(&function->chunk, file);
@@ -187,27 +320,44 @@ void writeChunkToFile(Chunk* chunk, FILE* file) {
     fwrite(&chunk->count, sizeof(int), 1, file);
     fwrite(&chunk->capacity, sizeof(int), 1, file);
 
-    // Write the code
-    fwrite(chunk->code, sizeof(uint8_t), chunk->count, file);
+    // Write the code, with quickened instructions turned back into their
+    // generic forms since what they were specialized on is gone next run
+    uint8_t* code = malloc(chunk->count);
+    memcpy(code, chunk->code, chunk->count);
+    for (int offset = 0; offset < chunk->count;
+         offset += instructionLength(chunk, offset))
+        code[offset] = genericOp(code[offset]);
+    fwrite(code, sizeof(uint8_t), chunk->count, file);
+    free(code);
 
     // Write the constants
     int constantsCount = chunk->constants.count;
     fwrite(&constantsCount, sizeof(int), 1, file);
     for (int i = 0; i < constantsCount; i++) {
         Value constant = chunk->constants.values[i];
-        if (IS_FUNCTION(constant)) {
-            ObjFunction* func = AS_FUNCTION(constant);
-            writeObjFunctionToFile(func, file);
+        uint8_t tag = IS_FUNCTION(constant) ? CONSTANT_FUNCTION
+                      : IS_STRING(constant) ? CONSTANT_STRING
+                                            : CONSTANT_VALUE;
+        fwrite(&tag, sizeof(uint8_t), 1, file);
+        if (tag == CONSTANT_FUNCTION) {
+            writeObjFunctionToFile(AS_FUNCTION(constant), file);
+        } else if (tag == CONSTANT_STRING) {
+            ObjString* string = AS_STRING(constant);
+            fwrite(&string->length, sizeof(int), 1, file);
+            fwrite(string->chars, sizeof(char), string->length, file);
         } else {
             fwrite(&constant, sizeof(Value), 1, file);
         }
     }
 
-    // Write the lines
-    fwrite(chunk->lines, sizeof(int), chunk->currentLine, file);
+    // Write the lines, a (line, count) pair up to the current one
+    int linesCount = chunk->currentLine + 2;
+    fwrite(&linesCount, sizeof(int), 1, file);
+    fwrite(chunk->lines, sizeof(int), linesCount, file);
 }
 
-void writeFunctionToFile(ObjFunction* function, const char* filename) {
+void writeFunctionToFile(VM* vm, ObjFunction* function,
+                         const char* filename) {
     FILE* file = fopen(filename, "wb");
     if (file == NULL) {
         fprintf(stderr, "Could not open file \"%s\" for writing.\n", filename);
@@ -216,28 +366,54 @@ void writeFunctionToFile(ObjFunction* function, const char* filename) {
 
     writeObjFunctionToFile(function, file);
 
+    // Global operands are slots of this VM, the names tell the one loading
+    // the code which of its own slots they are
+    fwrite(&vm->globalNames.count, sizeof(int), 1, file);
+    for (int i = 0; i < vm->globalNames.count; i++) {
+        ObjString* name = AS_STRING(vm->globalNames.values[i]);
+        fwrite(&name->length, sizeof(int), 1, file);
+        fwrite(name->chars, sizeof(char), name->length, file);
+    }
+
     fclose(file);
 }
 
-void readChunkFromFile(Chunk* chunk, FILE* file);
+void readChunkFromFile(VM* vm, Chunk* chunk, FILE* file);
 
-ObjFunction* readObjFunctionFromFile(FILE* file) {
-    // Read the arity
-    int arity;
+ObjFunction* readObjFunctionFromFile(VM* vm, FILE* file) {
+    // Read the arity and upvalue count
+    int arity = 0;
+    int upvalueCount = 0;
     fread(&arity, sizeof(int), 1, file);
+    fread(&upvalueCount, sizeof(int), 1, file);
+
+    // Read the name
+    int nameLength = -1;
+    ObjString* name = NULL;
+    fread(&nameLength, sizeof(int), 1, file);
+    if (nameLength >= 0) {
+        char* chars = malloc(nameLength + 1);
+        nameLength = (int)fread(chars, sizeof(char), nameLength, file);
+        name = copyString(vm, chars, nameLength);
+        free(chars);
+    }
 
     // Read the chunk
     Chunk chunk;
-    readChunkFromFile(&chunk, file);
+    readChunkFromFile(vm, &chunk, file);
+    int maxSlots = maxStackSlots(vm, &chunk, arity);
 
-    ObjFunction* function = newFunction();
+    ObjFunction* function = newFunction(vm);
     function->arity = arity;
+    function->upvalueCount = upvalueCount;
+    function->name = name;
+    function->maxSlots = maxSlots;
     function->chunk = chunk;
 
     return function;
 }
 
-void readChunkFromFile(Chunk* chunk, FILE* file) {
+void readChunkFromFile(VM* vm, Chunk* chunk, FILE* file) {
     // Read the count and capacity
     fread(&chunk->count, sizeof(int), 1, file);
     fread(&chunk->capacity, sizeof(int), 1, file);
@@ -251,35 +427,119 @@ void readChunkFromFile(Chunk* chunk, FILE* file) {
     fread(&constantsCount, sizeof(int), 1, file);
     initValueArray(&chunk->constants);
     for (int i = 0; i < constantsCount; i++) {
-        Value constant;
-        fread(&constant, sizeof(Value), 1, file);
-        if (IS_FUNCTION(constant)) {
-            ObjFunction* func = readObjFunctionFromFile(file);
-            constant = OBJ_VAL(func);
+        uint8_t tag = CONSTANT_VALUE;
+        fread(&tag, sizeof(uint8_t), 1, file);
+        Value constant = NIL_VAL;
+        if (tag == CONSTANT_FUNCTION) {
+            constant = OBJ_VAL(readObjFunctionFromFile(vm, file));
+        } else if (tag == CONSTANT_STRING) {
+            int length = 0;
+            fread(&length, sizeof(int), 1, file);
+            char* chars = malloc(length + 1);
+            length = (int)fread(chars, sizeof(char), length, file);
+            constant = OBJ_VAL(copyString(vm, chars, length));
+            free(chars);
+        } else {
+            fread(&constant, sizeof(Value), 1, file);
         }
-        writeValueArray(&chunk->constants, constant);
+        writeValueArray(vm, &chunk->constants, constant);
     }
 
     // Read the lines
-    chunk->lines = (int*)malloc(chunk->count * sizeof(int));
-    fread(chunk->lines, sizeof(int), chunk->count, file);
+    int linesCount;
+    fread(&linesCount, sizeof(int), 1, file);
+    chunk->lines = (int*)malloc(linesCount * sizeof(int));
+    fread(chunk->lines, sizeof(int), linesCount, file);
+    chunk->maxLines = linesCount;
+    chunk->currentLine = linesCount - 2;
+
+    // Caches are not saved, give every instruction using one an empty cache
+    chunk->caches = NULL;
+    chunk->cacheCount = 0;
+    chunk->cacheCapacity = 0;
+    for (int offset = 0; offset < chunk->count;
+         offset += instructionLength(chunk, offset)) {
+        int index = cacheIndex(chunk, offset);
+        while (chunk->cacheCount <= index)
+            addCache(vm, chunk);
+    }
 }
 
-ObjFunction* readFunctionFromFile(const char* filename) {
+// Rewrites the global operands of function and the functions it defines
+// from the slots of the VM that wrote them to those of this one. False if
+// an operand names no slot the file has a name for.
+static bool resolveGlobals(ObjFunction* function, int* slots, int count) {
+    Chunk* chunk = &function->chunk;
+    for (int offset = 0; offset < chunk->count;
+         offset += instructionLength(chunk, offset)) {
+        uint8_t* code = &chunk->code[offset];
+        if (*code != OP_DEFINE_GLOBAL && *code != OP_GET_GLOBAL &&
+            *code != OP_SET_GLOBAL)
+            continue;
+        int slot = (code[1] << 8) | code[2];
+        if (slot >= count)
+            return false;
+        code[1] = (slots[slot] >> 8) & 0xff;
+        code[2] = slots[slot] & 0xff;
+    }
+    for (int i = 0; i < chunk->constants.count; i++) {
+        Value constant = chunk->constants.values[i];
+        if (IS_FUNCTION(constant) &&
+            !resolveGlobals(AS_FUNCTION(constant), slots, count))
+            return false;
+    }
+    return true;
+}
+
+// Reads the global names writeFunctionToFile() saved, and resolves the
+// global operands of function with them.
+static bool readGlobals(VM* vm, ObjFunction* function, FILE* file) {
+    int count;
+    if (fread(&count, sizeof(int), 1, file) != 1 || count < 0 ||
+        count > UINT16_MAX + 1)
+        return false;
+    int* slots = malloc(sizeof(int) * (count > 0 ? count : 1));
+    bool ok = true;
+    for (int i = 0; ok && i < count; i++) {
+        int length;
+        ok = fread(&length, sizeof(int), 1, file) == 1 && length >= 0;
+        char* name = ok ? malloc(length + 1) : NULL;
+        ok = ok && fread(name, sizeof(char), length, file) == (size_t)length;
+        if (ok) {
+            slots[i] = globalSlot(vm, copyString(vm, name, length));
+            ok = slots[i] <= UINT16_MAX;
+        }
+        free(name);
+    }
+    ok = ok && resolveGlobals(function, slots, count);
+    free(slots);
+    return ok;
+}
+
+ObjFunction* readFunctionFromFile(VM* vm, const char* filename) {
     FILE* file = fopen(filename, "rb");
     if (file == NULL) {
         fprintf(stderr, "Could not open file \"%s\" for reading.\n", filename);
         return NULL;
     }
 
-    // Hack since main and other functions are slightly different
-    Value v;
-    fread(&v, sizeof(Value), 1, file);
-    (void)v;
-
-    ObjFunction* function = readObjFunctionFromFile(file);
+    // Nothing read is reachable before the whole file is, so no collection
+    // starts meanwhile
+    size_t nextGC = vm->nextGC;
+    size_t nextMinorGC = vm->nextMinorGC;
+    vm->nextGC = SIZE_MAX;
+    vm->nextMinorGC = SIZE_MAX;
+    ObjFunction* function = readObjFunctionFromFile(vm, file);
+    bool resolved = readGlobals(vm, function, file);
+    vm->nextGC = nextGC;
+    vm->nextMinorGC = nextMinorGC;
 
     fclose(file);
 
+    if (!resolved) {
+        fprintf(stderr, "Unknown global variable slots in \"%s\".\n",
+                filename);
+        return NULL;
+    }
     return function;
 }
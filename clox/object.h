@@ -1,6 +1,8 @@
 #ifndef clox_object_h
 #define clox_object_h
 
+#include <stdatomic.h>
+
 #include "chunk.h"
 #include "common.h"
 #include "table.h"
@@ -19,16 +21,31 @@ typedef enum : char {
     OBJ_CLASS,          /**< Class object */
     OBJ_INSTANCE,       /**< Instance object */
     OBJ_BOUND_METHOD,   /**< Bound method object */
+    OBJ_FIBER,          /**< Fiber object */
 } ObjType;
 
+#define OBJ_TYPE_COUNT (OBJ_FIBER + 1)
+
+/**
+ * @enum ScanState
+ * @brief Whether the fields of an object were traced by the concurrent
+ * marking in progress, see snapshotBarrier().
+ */
+typedef enum : char {
+    SCAN_NONE,
+    SCAN_BUSY, /**< Being traced, changes wait until it is done */
+    SCAN_DONE,
+} ScanState;
+
 /**
  * @struct Obj
  * @brief Base structure for all object types.
  */
 struct Obj {
     ObjType type;       /**< Type of the object */
-    short lastCollect;  /**< Last garbage collection cycle this object was marked in */
-    Obj* next;          /**< Next object in the intrusive list for garbage collection */
+    bool old;           /**< Survived a collection, minor ones skip it */
+    bool remembered;    /**< In vm->remembered, see writeBarrier() */
+    _Atomic(ScanState) scan; /**< See snapshotBarrier() */
 };
 
 /**
@@ -38,16 +55,24 @@ struct Obj {
 typedef struct {
     Obj obj;            /**< Base object */
     int arity;          /**< Number of parameters the function expects */
+    int maxSlots;       /**< Stack slots its frames use, see maxStackSlots() */
     Chunk chunk;        /**< Chunk of bytecode for the function */
     ObjString* name;    /**< Name of the function */
     int upvalueCount;   /**< Number of upvalues the function closes over */
+    int calls;          /**< Number of calls so far, compiled once hot */
+    void* native;       /**< Machine code compiled from the chunk, or NULL */
+    size_t nativeSize;  /**< Size of the executable mapping holding native */
+    struct Trace* traces; /**< Traces compiled for loops of the function */
+    int deopts;         /**< Quickened instructions reverted to generic ones */
+    uint64_t executed;  /**< Instructions run, counted by --opcode-stats */
+    int callRecord;     /**< Its entry in the --call-profile, or -1 */
 } ObjFunction;
 
 /**
  * @typedef NativeFn
  * @brief Function pointer type for native functions.
  */
-typedef Value (*NativeFn)(int argCount, Value* args);
+typedef Value (*NativeFn)(VM* vm, int argCount, Value* args);
 
 /**
  * @struct ObjNative
@@ -56,8 +81,12 @@ typedef Value (*NativeFn)(int argCount, Value* args);
 typedef struct {
     Obj obj;            /**< Base object */
     NativeFn function;  /**< Pointer to the native function */
+    const char* name;   /**< Name it is defined under, a static string */
+    int callRecord;     /**< Its entry in the --call-profile, or -1 */
 } ObjNative;
 
+typedef struct ObjFiber ObjFiber;
+
 /**
  * @struct ObjUpvalue
  * @brief Represents an upvalue object.
@@ -67,6 +96,7 @@ struct ObjUpvalue {
     Value* location;    /**< Pointer to the variable this upvalue closes over */
     Value closed;       /**< Closed-over value (used when the upvalue is closed) */
     struct ObjUpvalue* next; /**< Next upvalue in the list */
+    ObjFiber* fiber;    /**< Fiber whose stack it points into, or NULL */
 };
 
 typedef struct ObjUpvalue ObjUpvalue;
@@ -103,14 +133,27 @@ typedef struct {
     Table methods;      /**< Table of methods */
 } ObjClass;
 
+typedef struct Shape Shape;
+
+// Fields stored in the instance itself, the others go to its overflow array.
+#define INSTANCE_INLINE_SLOTS 4
+
 /**
  * @struct ObjInstance
  * @brief Represents an instance of a class.
+ *
+ * Field values live in slots laid out by the instance's shape, see shape.h.
  */
 typedef struct {
     Obj obj;            /**< Base object */
     ObjClass* klass;    /**< Class of this instance */
-    Table fields;       /**< Table of fields */
+    Shape* shape;       /**< Layout of the fields, NULL in dictionary mode */
+    union {
+        Value* overflow;   /**< Slots from INSTANCE_INLINE_SLOTS on */
+        Table* dictionary; /**< Fields once the shape would grow too long */
+    };
+    int overflowCapacity; /**< Allocated size of overflow */
+    Value fields[INSTANCE_INLINE_SLOTS]; /**< First slots */
 } ObjInstance;
 
 /**
@@ -123,46 +166,113 @@ typedef struct {
     ObjClosure* method; /**< The method closure */
 } ObjBoundMethod;
 
+/**
+ * @struct CallFrame
+ * @brief A call in progress, in the frames of the VM or of a fiber.
+ */
+typedef struct {
+    ObjClosure* closure; /**< Function being run */
+    uint8_t* ip;         /**< Next instruction, saved while calling out */
+    Value* slots;        /**< First stack slot of the frame, the callee */
+    uint64_t entered;    /**< Clock at the call, with --call-profile */
+    uint64_t children;   /**< Time spent in callees, with --call-profile */
+} CallFrame;
+
+/**
+ * @enum FiberState
+ * @brief Where a fiber is in its life.
+ */
+typedef enum {
+    FIBER_NEW,       /**< Its function hasn't been called yet */
+    FIBER_SUSPENDED, /**< Stopped in yield(), waiting to be resumed */
+    FIBER_RUNNING,   /**< Running, or resuming another fiber */
+    FIBER_DONE,      /**< Its function returned or failed */
+} FiberState;
+
+/**
+ * @struct ObjFiber
+ * @brief A coroutine with a call stack of its own.
+ *
+ * The stack fields mirror those of the VM. resume() swaps them with the VM's
+ * so the interpreter runs on the fiber's stacks unchanged, and the fiber
+ * holds its resumer's stacks until it yields or returns.
+ */
+struct ObjFiber {
+    Obj obj;                 /**< Base object */
+    ObjClosure* closure;     /**< Function the fiber runs */
+    FiberState state;
+    ObjFiber* caller;        /**< Fiber that resumed it, while running */
+    CallFrame* frames;
+    int frameCount;
+    int frameCapacity;
+    Value* stack;
+    Value* stackTop;
+    int stackCapacity;
+    ObjUpvalue* openUpvalues;
+};
+
 /**
  * @brief Creates a new function object.
  * @return Pointer to the new ObjFunction.
  */
-ObjFunction* newFunction();
+ObjFunction* newFunction(VM* vm);
 
 /**
  * @brief Creates a new native function object.
+ * @param name Name of the native, which must outlive the object.
  * @param function Pointer to the native function.
  * @return Pointer to the new ObjNative.
  */
-ObjNative* newNative(NativeFn function);
+ObjNative* newNative(VM* vm, const char* name, NativeFn function);
 
 /**
  * @brief Creates a new closure object.
  * @param function The function to create a closure for.
  * @return Pointer to the new ObjClosure.
  */
-ObjClosure* newClosure(ObjFunction* function);
+ObjClosure* newClosure(VM* vm, ObjFunction* function);
 
 /**
  * @brief Creates a new upvalue object.
  * @param slot Pointer to the Value this upvalue closes over.
  * @return Pointer to the new ObjUpvalue.
  */
-ObjUpvalue* newUpvalue(Value* slot);
+ObjUpvalue* newUpvalue(VM* vm, Value* slot);
 
 /**
  * @brief Creates a new class object.
  * @param name The name of the class.
  * @return Pointer to the new ObjClass.
  */
-ObjClass* newClass(ObjString* name);
+ObjClass* newClass(VM* vm, ObjString* name);
 
 /**
  * @brief Creates a new instance object.
  * @param klass The class to instantiate.
  * @return Pointer to the new ObjInstance.
  */
-ObjInstance* newInstance(ObjClass* klass);
+ObjInstance* newInstance(VM* vm, ObjClass* klass);
+
+/**
+ * @brief Looks up a field of an instance.
+ * @param value Set to the field's value if found.
+ * @return true if the instance has the field.
+ */
+bool getField(ObjInstance* instance, ObjString* name, Value* value);
+
+/**
+ * @brief Sets a field of an instance, adding it if needed.
+ *
+ * value must be reachable by the GC, adding a field may allocate.
+ */
+void setField(VM* vm, ObjInstance* instance, ObjString* name, Value value);
+
+/**
+ * @brief Makes room for slotCount slots, before switching to a larger shape.
+ *
+ * May allocate, the instance must be reachable by the GC.
+ */
+void ensureSlots(VM* vm, ObjInstance* instance, int slotCount);
 
 /**
  * @brief Creates a new bound method object.
@@ -170,7 +280,14 @@ ObjInstance* newInstance(ObjClass* klass);
  * @param method The method closure.
  * @return Pointer to the new ObjBoundMethod.
  */
-ObjBoundMethod* newBoundMethod(Value receiver, ObjClosure* method);
+ObjBoundMethod* newBoundMethod(VM* vm, Value receiver, ObjClosure* method);
+
+/**
+ * @brief Creates a new fiber that will call closure when first resumed.
+ * @param closure Function taking at most one argument.
+ * @return Pointer to the new ObjFiber.
+ */
+ObjFiber* newFiber(VM* vm, ObjClosure* closure);
 
 /**
  * @brief Creates a new string object, taking ownership of the given char array.
@@ -178,7 +295,7 @@ ObjBoundMethod* newBoundMethod(Value receiver, ObjClosure* method);
  * @param length The length of the string.
  * @return Pointer to the new ObjString.
  */
-ObjString* takeString(const char* chars, int length);
+ObjString* takeString(VM* vm, const char* chars, int length);
 
 /**
  * @brief Creates a new string object, copying the given char array.
@@ -186,7 +303,7 @@ ObjString* takeString(const char* chars, int length);
  * @param length The length of the string.
  * @return Pointer to the new ObjString.
  */
-ObjString* copyString(const char* chars, int length);
+ObjString* copyString(VM* vm, const char* chars, int length);
 
 /**
  * @brief Compares two string objects for equality.
@@ -197,24 +314,31 @@ ObjString* copyString(const char* chars, int length);
 bool stringsEqual(ObjString* a, ObjString* b);
 
 /**
- * @brief Prints a representation of the object to stdout.
+ * @brief Prints a representation of the object.
+ * @param file Where to print it.
  * @param value The Value containing the object to print.
  */
-void printObject(Value value);
+void printObject(FILE* file, Value value);
 
 /**
  * @brief Writes a function object to a file.
+ *
+ * The names of vm's global variables follow it, so that its global
+ * operands can be resolved to the slots of the VM loading it.
  * @param function The function to write.
  * @param filename The name of the file to write to.
  */
-void writeFunctionToFile(ObjFunction* function, const char* filename);
+void writeFunctionToFile(VM* vm, ObjFunction* function, const char* filename);
 
 /**
  * @brief Reads a function object from a file.
+ *
+ * Its global operands are rewritten to vm's slots for the same names.
  * @param filename The name of the file to read from.
- * @return Pointer to the read ObjFunction, or NULL if reading failed.
+ * @return Pointer to the read ObjFunction, or NULL if reading failed or an
+ * operand names a global slot the file has no name for.
  */
-ObjFunction* readFunctionFromFile(const char* filename);
+ObjFunction* readFunctionFromFile(VM* vm, const char* filename);
 
 /**
  * @brief Checks if a Value is of a specific ObjType.
@@ -226,6 +350,15 @@ static inline bool isObjType(Value value, ObjType type) {
     return IS_OBJ(value) && AS_OBJ(value)->type == type;
 }
 
+/**
+ * @brief Storage of a slot of an instance in shape mode.
+ */
+static inline Value* instanceSlot(ObjInstance* instance, int slot) {
+    if (slot < INSTANCE_INLINE_SLOTS)
+        return &instance->fields[slot];
+    return &instance->overflow[slot - INSTANCE_INLINE_SLOTS];
+}
+
 #define OBJ_TYPE(value) (AS_OBJ(value)->type)
 
 #define IS_STRING(value) (isObjType(value, OBJ_STRING))
@@ -235,6 +368,7 @@ static inline bool isObjType(Value value, ObjType type) {
 #define IS_CLASS(value) isObjType(value, OBJ_CLASS)
 #define IS_INSTANCE(value) isObjType(value, OBJ_INSTANCE)
 #define IS_BOUND_METHOD(value) isObjType(value, OBJ_BOUND_METHOD)
+#define IS_FIBER(value) isObjType(value, OBJ_FIBER)
 
 #define AS_STRING(value) ((ObjString*)AS_OBJ(value))
 #define AS_CSTRING(value) (((ObjString*)AS_OBJ(value))->chars)
@@ -244,5 +378,6 @@ static inline bool isObjType(Value value, ObjType type) {
 #define AS_CLASS(value) ((ObjClass*)AS_OBJ(value))
 #define AS_INSTANCE(value) ((ObjInstance*)AS_OBJ(value))
 #define AS_BOUND_METHOD(value) ((ObjBoundMethod*)AS_OBJ(value))
+#define AS_FIBER(value) ((ObjFiber*)AS_OBJ(value))
 
 #endif
\ No newline at end of file
@@ -0,0 +1,511 @@
+#include <string.h>
+
+#include "memory.h"
+#include "optimizer.h"
+
+// A jump in the rewritten code whose operand still has to be patched once
+// every instruction has its final offset.
+typedef struct {
+    int operand;   // New offset of the 16-bit operand.
+    int from;      // New offset the jump is relative to (end of instruction).
+    int target;    // Old offset of the target instruction.
+    bool backward; // OP_LOOP jumps backward.
+} JumpFixup;
+
+typedef struct {
+    VM* vm;       // Owner of the chunk, allocations are counted there.
+    Chunk* chunk; // Chunk being rewritten, left untouched until the end.
+    Chunk out;
+
+    bool* isTarget;  // Old offsets some jump lands on.
+    int* newOffsets; // Old instruction offset -> new instruction offset.
+
+    JumpFixup* jumps;
+    int jumpCount;
+    int jumpCapacity;
+} Rewriter;
+
+static bool isJump(uint8_t instruction) {
+    switch (instruction) {
+        case OP_JUMP:
+        case OP_JUMP_IF_FALSE:
+        case OP_LOOP:
+        case OP_LESS_JUMP_IF_FALSE:
+        case OP_R_LESS_JUMP_IF_FALSE:
+        case OP_R_GREATER_JUMP_IF_FALSE: return true;
+        default: return false;
+    }
+}
+
+// Jumps keep their 16-bit offset in the last two bytes of the instruction,
+// relative to the end of the instruction.
+static int jumpTarget(Chunk* chunk, int offset) {
+    int end = offset + instructionLength(chunk, offset);
+    uint16_t jump = (uint16_t)((chunk->code[end - 2] << 8) | chunk->code[end - 1]);
+    if (chunk->code[offset] == OP_LOOP)
+        return end - jump;
+    return end + jump;
+}
+
+static void initRewriter(Rewriter* rewriter, VM* vm, Chunk* chunk) {
+    rewriter->vm = vm;
+    rewriter->chunk = chunk;
+    initChunk(&rewriter->out);
+    rewriter->jumps = NULL;
+    rewriter->jumpCount = 0;
+    rewriter->jumpCapacity = 0;
+
+    rewriter->isTarget = ALLOCATE(vm, bool, chunk->count + 1);
+    rewriter->newOffsets = ALLOCATE(vm, int, chunk->count + 1);
+    memset(rewriter->isTarget, 0, sizeof(bool) * (chunk->count + 1));
+
+    for (int offset = 0; offset < chunk->count;
+         offset += instructionLength(chunk, offset)) {
+        if (isJump(chunk->code[offset])) {
+            rewriter->isTarget[jumpTarget(chunk, offset)] = true;
+        }
+    }
+}
+
+// True if the instructions in [offset, offset + length) can be replaced as a
+// unit: nothing jumps into the middle of them.
+static bool isStraightLine(Rewriter* rewriter, int offset, int length) {
+    if (offset + length > rewriter->chunk->count)
+        return false;
+    for (int i = offset + 1; i < offset + length; i++) {
+        if (rewriter->isTarget[i])
+            return false;
+    }
+    return true;
+}
+
+static void emit(Rewriter* rewriter, uint8_t byte, int line) {
+    writeChunk(rewriter->vm, &rewriter->out, byte, line);
+}
+
+// Maps every instruction in [offset, offset + length) of the old code to the
+// instruction about to be emitted.
+static void beginInstruction(Rewriter* rewriter, int offset, int length) {
+    for (int i = offset; i < offset + length; i++) {
+        rewriter->newOffsets[i] = rewriter->out.count;
+    }
+}
+
+// Emits the 16-bit offset closing a jump instruction, to be patched once
+// the old target has its new offset.
+static void emitJumpOperand(Rewriter* rewriter, int target, bool backward,
+                            int line) {
+    if (rewriter->jumpCapacity < rewriter->jumpCount + 1) {
+        int oldCapacity = rewriter->jumpCapacity;
+        rewriter->jumpCapacity = GROW_CAPACITY(oldCapacity);
+        rewriter->jumps = GROW_ARRAY(rewriter->vm, JumpFixup, rewriter->jumps,
+                                     oldCapacity, rewriter->jumpCapacity);
+    }
+    JumpFixup* fixup = &rewriter->jumps[rewriter->jumpCount++];
+    fixup->operand = rewriter->out.count;
+    fixup->from = rewriter->out.count + 2;
+    fixup->target = target;
+    fixup->backward = backward;
+    emit(rewriter, 0xff, line);
+    emit(rewriter, 0xff, line);
+}
+
+static void copyInstruction(Rewriter* rewriter, int offset) {
+    Chunk* chunk = rewriter->chunk;
+    int length = instructionLength(chunk, offset);
+    int line = getLine(chunk, offset);
+    uint8_t instruction = chunk->code[offset];
+
+    beginInstruction(rewriter, offset, length);
+    if (isJump(instruction)) {
+        for (int i = 0; i < length - 2; i++) {
+            emit(rewriter, chunk->code[offset + i], line);
+        }
+        emitJumpOperand(rewriter, jumpTarget(chunk, offset),
+                        instruction == OP_LOOP, line);
+        return;
+    }
+    for (int i = 0; i < length; i++) {
+        emit(rewriter, chunk->code[offset + i], line);
+    }
+}
+
+// Tries to fuse the sequence starting at offset. Returns the number of old
+// bytes consumed, or 0 if nothing matched.
+static int fuseSuperinstruction(Rewriter* rewriter, int offset) {
+    uint8_t* code = rewriter->chunk->code;
+    int line = getLine(rewriter->chunk, offset);
+
+    switch (code[offset]) {
+        case OP_GET_LOCAL: {
+            if (isStraightLine(rewriter, offset, 8) &&
+                code[offset + 2] == OP_CONSTANT && code[offset + 4] == OP_ADD &&
+                code[offset + 5] == OP_SET_LOCAL &&
+                code[offset + 6] == code[offset + 1] &&
+                code[offset + 7] == OP_POP) {
+                beginInstruction(rewriter, offset, 8);
+                emit(rewriter, OP_INCREMENT_LOCAL, line);
+                emit(rewriter, code[offset + 1], line);
+                emit(rewriter, code[offset + 3], line);
+                return 8;
+            }
+            if (isStraightLine(rewriter, offset, 5) &&
+                code[offset + 2] == OP_GET_LOCAL && code[offset + 4] == OP_ADD) {
+                beginInstruction(rewriter, offset, 5);
+                emit(rewriter, OP_ADD_LOCALS, line);
+                emit(rewriter, code[offset + 1], line);
+                emit(rewriter, code[offset + 3], line);
+                return 5;
+            }
+            return 0;
+        }
+        case OP_LESS: {
+            if (isStraightLine(rewriter, offset, 5) &&
+                code[offset + 1] == OP_JUMP_IF_FALSE &&
+                code[offset + 4] == OP_POP) {
+                beginInstruction(rewriter, offset, 5);
+                emit(rewriter, OP_LESS_JUMP_IF_FALSE, line);
+                emitJumpOperand(rewriter, jumpTarget(rewriter->chunk, offset + 1),
+                                false, line);
+                return 5;
+            }
+            return 0;
+        }
+        default: return 0;
+    }
+}
+
+static void patchJumps(Rewriter* rewriter) {
+    for (int i = 0; i < rewriter->jumpCount; i++) {
+        JumpFixup* fixup = &rewriter->jumps[i];
+        int target = rewriter->newOffsets[fixup->target];
+        int jump = fixup->backward ? fixup->from - target : target - fixup->from;
+        // Fusing only ever shrinks the code, so the jump still fits.
+        rewriter->out.code[fixup->operand] = (jump >> 8) & 0xff;
+        rewriter->out.code[fixup->operand + 1] = jump & 0xff;
+    }
+}
+
+// Swaps the rewritten code and lines into the original chunk. The constant
+// pool is shared and stays where it is.
+static void finishRewrite(Rewriter* rewriter) {
+    VM* vm = rewriter->vm;
+    Chunk* chunk = rewriter->chunk;
+    int oldCount = chunk->count;
+
+    patchJumps(rewriter);
+
+    FREE_ARRAY(vm, uint8_t, chunk->code, chunk->capacity);
+    FREE_ARRAY(vm, int, chunk->lines, chunk->maxLines);
+    chunk->code = rewriter->out.code;
+    chunk->count = rewriter->out.count;
+    chunk->capacity = rewriter->out.capacity;
+    chunk->lines = rewriter->out.lines;
+    chunk->maxLines = rewriter->out.maxLines;
+    chunk->currentLine = rewriter->out.currentLine;
+
+    FREE_ARRAY(vm, JumpFixup, rewriter->jumps, rewriter->jumpCapacity);
+    FREE_ARRAY(vm, bool, rewriter->isTarget, oldCount + 1);
+    FREE_ARRAY(vm, int, rewriter->newOffsets, oldCount + 1);
+}
+
+void optimizeChunk(VM* vm, Chunk* chunk) {
+    Rewriter rewriter;
+    initRewriter(&rewriter, vm, chunk);
+
+    for (int offset = 0; offset < chunk->count;) {
+        int fused = fuseSuperinstruction(&rewriter, offset);
+        if (fused > 0) {
+            offset += fused;
+        } else {
+            copyInstruction(&rewriter, offset);
+            offset += instructionLength(chunk, offset);
+        }
+    }
+    rewriter.newOffsets[chunk->count] = rewriter.out.count;
+
+    finishRewrite(&rewriter);
+}
+
+// === Register backend ===
+
+// Reads of locals and constants the register backend has not pushed yet.
+// Conceptually they sit, in order, on top of the real stack.
+typedef struct {
+    uint8_t operands[UINT8_COUNT];
+    int lines[UINT8_COUNT];
+    int count;
+} PendingStack;
+
+static void pushPending(PendingStack* pending, uint8_t operand, int line) {
+    pending->operands[pending->count] = operand;
+    pending->lines[pending->count] = line;
+    pending->count++;
+}
+
+static uint8_t popPending(PendingStack* pending) {
+    return pending->operands[--pending->count];
+}
+
+// Materializes the pending reads as regular stack pushes, keeping their order.
+static void flushPending(Rewriter* rewriter, PendingStack* pending) {
+    for (int i = 0; i < pending->count; i++) {
+        uint8_t operand = pending->operands[i];
+        if (operand & RK_CONSTANT) {
+            emit(rewriter, OP_CONSTANT, pending->lines[i]);
+        } else {
+            emit(rewriter, OP_GET_LOCAL, pending->lines[i]);
+        }
+        emit(rewriter, operand & ~RK_CONSTANT, pending->lines[i]);
+    }
+    pending->count = 0;
+}
+
+static uint8_t registerOpFor(uint8_t instruction) {
+    switch (instruction) {
+        case OP_ADD: return OP_R_ADD;
+        case OP_SUBTRACT: return OP_R_SUBTRACT;
+        case OP_MULTIPLY: return OP_R_MULTIPLY;
+        case OP_DIVIDE: return OP_R_DIVIDE;
+        case OP_EQUAL: return OP_R_EQUAL;
+        case OP_GREATER: return OP_R_GREATER;
+        case OP_LESS: return OP_R_LESS;
+        default: return 0;
+    }
+}
+
+// Emits a binary instruction whose two operands are pending. Stores straight
+// into a local when the result is assigned and discarded, fuses with the
+// conditional jump of a loop or if condition, or pushes the result. Returns
+// the number of old bytes consumed.
+static int emitRegisterBinary(Rewriter* rewriter, PendingStack* pending,
+                              int offset) {
+    Chunk* chunk = rewriter->chunk;
+    uint8_t* code = chunk->code;
+    int line = getLine(chunk, offset);
+    uint8_t op = registerOpFor(code[offset]);
+    uint8_t b = popPending(pending);
+    uint8_t a = popPending(pending);
+
+    // Whatever is still pending was read before this instruction runs, and
+    // must reach the stack before a slot it names can be overwritten.
+    flushPending(rewriter, pending);
+
+    if (isStraightLine(rewriter, offset, 4) &&
+        code[offset + 1] == OP_SET_LOCAL && code[offset + 2] < RK_CONSTANT &&
+        code[offset + 3] == OP_POP) {
+        beginInstruction(rewriter, offset, 4);
+        emit(rewriter, op, line);
+        emit(rewriter, code[offset + 2], line);
+        emit(rewriter, a, line);
+        emit(rewriter, b, line);
+        return 4;
+    }
+
+    if ((op == OP_R_LESS || op == OP_R_GREATER) &&
+        isStraightLine(rewriter, offset, 5) &&
+        code[offset + 1] == OP_JUMP_IF_FALSE && code[offset + 4] == OP_POP) {
+        beginInstruction(rewriter, offset, 5);
+        emit(rewriter,
+             op == OP_R_LESS ? OP_R_LESS_JUMP_IF_FALSE
+                             : OP_R_GREATER_JUMP_IF_FALSE,
+             line);
+        emit(rewriter, a, line);
+        emit(rewriter, b, line);
+        emitJumpOperand(rewriter, jumpTarget(chunk, offset + 1), false, line);
+        return 5;
+    }
+
+    beginInstruction(rewriter, offset, 1);
+    emit(rewriter, op, line);
+    emit(rewriter, R_STACK, line);
+    emit(rewriter, a, line);
+    emit(rewriter, b, line);
+    return 1;
+}
+
+void registerizeChunk(VM* vm, Chunk* chunk) {
+    Rewriter rewriter;
+    initRewriter(&rewriter, vm, chunk);
+    PendingStack pending;
+    pending.count = 0;
+    uint8_t* code = chunk->code;
+
+    for (int offset = 0; offset < chunk->count;) {
+        int length = instructionLength(chunk, offset);
+        int line = getLine(chunk, offset);
+
+        // Jumps always leave with nothing pending, so every path reaching a
+        // target must agree on that.
+        if (rewriter.isTarget[offset] || pending.count == UINT8_COUNT)
+            flushPending(&rewriter, &pending);
+        beginInstruction(&rewriter, offset, length);
+
+        switch (code[offset]) {
+            case OP_GET_LOCAL:
+                if (code[offset + 1] < RK_CONSTANT) {
+                    pushPending(&pending, code[offset + 1], line);
+                    offset += length;
+                    continue;
+                }
+                break;
+            case OP_CONSTANT:
+                if (code[offset + 1] < RK_CONSTANT) {
+                    pushPending(&pending, RK_CONSTANT | code[offset + 1], line);
+                    offset += length;
+                    continue;
+                }
+                break;
+            case OP_ADD:
+            case OP_SUBTRACT:
+            case OP_MULTIPLY:
+            case OP_DIVIDE:
+            case OP_EQUAL:
+            case OP_GREATER:
+            case OP_LESS:
+                if (pending.count >= 2) {
+                    offset += emitRegisterBinary(&rewriter, &pending, offset);
+                    continue;
+                }
+                break;
+            case OP_SET_LOCAL:
+                if (pending.count >= 1 && code[offset + 1] < RK_CONSTANT &&
+                    isStraightLine(&rewriter, offset, 3) &&
+                    code[offset + 2] == OP_POP) {
+                    uint8_t source = popPending(&pending);
+                    flushPending(&rewriter, &pending);
+                    beginInstruction(&rewriter, offset, 3);
+                    emit(&rewriter, OP_R_MOVE, line);
+                    emit(&rewriter, code[offset + 1], line);
+                    emit(&rewriter, source, line);
+                    offset += 3;
+                    continue;
+                }
+                break;
+            case OP_POP:
+                if (pending.count >= 1) {
+                    pending.count--;
+                    offset += length;
+                    continue;
+                }
+                break;
+        }
+
+        flushPending(&rewriter, &pending);
+        copyInstruction(&rewriter, offset);
+        offset += length;
+    }
+    rewriter.newOffsets[chunk->count] = rewriter.out.count;
+
+    finishRewrite(&rewriter);
+}
+
+// === Stack depth ===
+
+// Change in stack depth an instruction makes when it falls through to the
+// next one. Jumps taken by the fused comparisons leave the condition behind,
+// see jumpEffect().
+static int stackEffect(Chunk* chunk, int offset) {
+    uint8_t* code = chunk->code;
+    switch (code[offset]) {
+        case OP_CONSTANT:
+        case OP_CONSTANT_LONG:
+        case OP_NIL:
+        case OP_TRUE:
+        case OP_FALSE:
+        case OP_GET_GLOBAL:
+        case OP_GET_LOCAL:
+        case OP_GET_UPVALUE:
+        case OP_CLOSURE:
+        case OP_CLASS:
+        case OP_ADD_LOCALS: return 1;
+        case OP_ADD:
+        case OP_ADD_NUM:
+        case OP_SUBTRACT:
+        case OP_MULTIPLY:
+        case OP_DIVIDE:
+        case OP_EQUAL:
+        case OP_GREATER:
+        case OP_LESS:
+        case OP_PRINT:
+        case OP_ASSERT:
+        case OP_POP:
+        case OP_DEFINE_GLOBAL:
+        case OP_CLOSE_UPVALUE:
+        case OP_SET_PROPERTY:
+        case OP_SET_PROPERTY_SLOT:
+        case OP_METHOD:
+        case OP_INHERIT:
+        case OP_GET_SUPER: return -1;
+        case OP_LESS_JUMP_IF_FALSE: return -2;
+        case OP_CALL:
+        case OP_TAIL_CALL: return -code[offset + 1];
+        case OP_INVOKE:
+        case OP_INVOKE_METHOD: return -code[offset + 4];
+        case OP_SUPER_INVOKE: return -code[offset + 4] - 1;
+        case OP_R_ADD:
+        case OP_R_SUBTRACT:
+        case OP_R_MULTIPLY:
+        case OP_R_DIVIDE:
+        case OP_R_EQUAL:
+        case OP_R_GREATER:
+        case OP_R_LESS: return code[offset + 1] == R_STACK ? 1 : 0;
+        default: return 0;
+    }
+}
+
+// Change in stack depth on the taken branch of a jump.
+static int jumpEffect(uint8_t instruction) {
+    switch (instruction) {
+        case OP_LESS_JUMP_IF_FALSE: return -1;
+        case OP_R_LESS_JUMP_IF_FALSE:
+        case OP_R_GREATER_JUMP_IF_FALSE: return 1;
+        default: return 0;
+    }
+}
+
+int maxStackSlots(VM* vm, Chunk* chunk, int arity) {
+    if (chunk->count == 0)
+        return arity + 1;
+    // Depth before each instruction reached so far, -1 for the others. The
+    // compiler leaves the same depth on every path to an instruction, so the
+    // first one found is kept.
+    int* depths = ALLOCATE(vm, int, chunk->count);
+    int* pending = ALLOCATE(vm, int, chunk->count);
+    for (int i = 0; i < chunk->count; i++)
+        depths[i] = -1;
+    int pendingCount = 0;
+    int max = arity + 1;
+    depths[0] = max;
+    pending[pendingCount++] = 0;
+
+#define REACH(target, depth)                                                   \
+    do {                                                                       \
+        int reached = (target);                                                \
+        if (reached >= 0 && reached < chunk->count &&                          \
+            depths[reached] < 0) {                                             \
+            depths[reached] = (depth);                                         \
+            pending[pendingCount++] = reached;                                 \
+        }                                                                      \
+    } while (false)
+
+    while (pendingCount > 0) {
+        int offset = pending[--pendingCount];
+        int depth = depths[offset];
+        if (depth > max)
+            max = depth;
+        uint8_t instruction = chunk->code[offset];
+        if (isJump(instruction))
+            REACH(jumpTarget(chunk, offset), depth + jumpEffect(instruction));
+        if (instruction == OP_RETURN || instruction == OP_JUMP ||
+            instruction == OP_LOOP)
+            continue;
+        depth += stackEffect(chunk, offset);
+        REACH(offset + instructionLength(chunk, offset), depth);
+    }
+#undef REACH
+
+    FREE_ARRAY(vm, int, depths, chunk->count);
+    FREE_ARRAY(vm, int, pending, chunk->count);
+    return max;
+}
@@ -0,0 +1,64 @@
+#ifndef clox_optimizer_h
+#define clox_optimizer_h
+
+#include "chunk.h"
+
+/**
+ * @brief Peephole pass fusing common instruction sequences.
+ *
+ * Rewrites, in place, the sequences the single-pass compiler emits for
+ * numeric code into superinstructions:
+ *
+ *   OP_GET_LOCAL a; OP_GET_LOCAL b; OP_ADD         -> OP_ADD_LOCALS a b
+ *   OP_LESS; OP_JUMP_IF_FALSE; OP_POP              -> OP_LESS_JUMP_IF_FALSE
+ *   OP_GET_LOCAL a; OP_CONSTANT k; OP_ADD;
+ *   OP_SET_LOCAL a; OP_POP                         -> OP_INCREMENT_LOCAL a k
+ *
+ * A sequence is only fused when no jump lands inside it. Jump offsets and
+ * line information are rebuilt for the shorter code.
+ *
+ * The chunk must stay reachable by the GC while this runs, it allocates.
+ *
+ * @param chunk Pointer to the Chunk to optimize.
+ */
+void optimizeChunk(VM* vm, Chunk* chunk);
+
+/**
+ * @brief Register backend: rewrites stack code into three-address form.
+ *
+ * Within each basic block, pushes of locals and constants are deferred and
+ * folded into the arithmetic and comparison that consumes them, which then
+ * addresses frame->slots and the constant pool directly:
+ *
+ *   OP_GET_LOCAL i; OP_CONSTANT k; OP_ADD; OP_SET_LOCAL i; OP_POP
+ *                                           -> OP_R_ADD i i k
+ *   OP_GET_LOCAL i; OP_GET_LOCAL n; OP_LESS; OP_JUMP_IF_FALSE; OP_POP
+ *                                           -> OP_R_LESS_JUMP_IF_FALSE i n
+ *
+ * Anything else falls back to the stack instructions, after materializing
+ * the deferred pushes in order. Only slots and constants below RK_CONSTANT
+ * can be register operands.
+ *
+ * Used instead of optimizeChunk() when the VM runs with BACKEND_REGISTER.
+ * Same GC caveat: the chunk must stay reachable while this runs.
+ *
+ * @param chunk Pointer to the Chunk to rewrite.
+ */
+void registerizeChunk(VM* vm, Chunk* chunk);
+
+/**
+ * @brief Stack slots a frame running the chunk uses at most.
+ *
+ * Follows every path through the code from the entry, where the callee and
+ * its arguments are on the stack, counting from the frame's slot zero. The
+ * values an instruction only pushes for a moment, and those natives push,
+ * are not included, see STACK_HEADROOM.
+ *
+ * Same GC caveat as optimizeChunk().
+ *
+ * @param chunk Pointer to the Chunk of the function.
+ * @param arity Number of parameters of the function.
+ */
+int maxStackSlots(VM* vm, Chunk* chunk, int arity);
+
+#endif
@@ -0,0 +1,388 @@
+// sigaction, setitimer and strdup are POSIX, strict -std modes hide them.
+#define _DEFAULT_SOURCE
+
+#include <stdlib.h>
+#include <string.h>
+#include <sys/time.h>
+#include <time.h>
+
+#include "object.h"
+#include "profile.h"
+
+_Alignas(8) volatile sig_atomic_t profilePending = 0;
+
+// Folded stack and the samples charged to it.
+typedef struct {
+    char* stack;
+    uint32_t hash;
+    long count;
+} StackCount;
+
+struct Profiler {
+    // Open addressing, capacity is a power of two.
+    StackCount* entries;
+    int count;
+    int capacity;
+    // Stack being folded by profileSample().
+    char* buffer;
+    size_t bufferSize;
+    // SIGPROF handler to put back once done.
+    struct sigaction previous;
+};
+
+static void onTick(int signal) {
+    (void)signal;
+    profilePending++;
+}
+
+bool startProfiler(VM* vm) {
+    Profiler* profiler = calloc(1, sizeof(Profiler));
+    if (profiler == NULL)
+        return false;
+
+    struct sigaction action;
+    memset(&action, 0, sizeof(action));
+    action.sa_handler = onTick;
+    action.sa_flags = SA_RESTART;
+    sigemptyset(&action.sa_mask);
+    struct itimerval timer = {
+        .it_interval = {0, 1000000 / PROFILE_HZ},
+        .it_value = {0, 1000000 / PROFILE_HZ},
+    };
+    if (sigaction(SIGPROF, &action, &profiler->previous) != 0) {
+        free(profiler);
+        return false;
+    }
+    if (setitimer(ITIMER_PROF, &timer, NULL) != 0) {
+        sigaction(SIGPROF, &profiler->previous, NULL);
+        free(profiler);
+        return false;
+    }
+    vm->profiler = profiler;
+    return true;
+}
+
+static uint32_t hashStack(const char* stack, size_t length) {
+    uint32_t hash = 2166136261u;
+    for (size_t i = 0; i < length; i++) {
+        hash ^= (uint8_t)stack[i];
+        hash *= 16777619;
+    }
+    return hash;
+}
+
+static StackCount* findStack(StackCount* entries, int capacity,
+                             const char* stack, uint32_t hash) {
+    uint32_t index = hash & (capacity - 1);
+    for (;;) {
+        StackCount* entry = &entries[index];
+        if (entry->stack == NULL ||
+            (entry->hash == hash && strcmp(entry->stack, stack) == 0))
+            return entry;
+        index = (index + 1) & (capacity - 1);
+    }
+}
+
+static bool growEntries(Profiler* profiler) {
+    int capacity = profiler->capacity < 64 ? 64 : profiler->capacity * 2;
+    StackCount* entries = calloc(capacity, sizeof(StackCount));
+    if (entries == NULL)
+        return false;
+    for (int i = 0; i < profiler->capacity; i++) {
+        StackCount* entry = &profiler->entries[i];
+        if (entry->stack != NULL)
+            *findStack(entries, capacity, entry->stack, entry->hash) = *entry;
+    }
+    free(profiler->entries);
+    profiler->entries = entries;
+    profiler->capacity = capacity;
+    return true;
+}
+
+// Appends text to the stack being folded, growing the buffer as needed.
+static bool append(Profiler* profiler, size_t* length, const char* text) {
+    size_t size = strlen(text);
+    if (*length + size + 1 > profiler->bufferSize) {
+        size_t bufferSize = profiler->bufferSize < 256
+                                ? 256
+                                : profiler->bufferSize;
+        while (*length + size + 1 > bufferSize)
+            bufferSize *= 2;
+        char* buffer = realloc(profiler->buffer, bufferSize);
+        if (buffer == NULL)
+            return false;
+        profiler->buffer = buffer;
+        profiler->bufferSize = bufferSize;
+    }
+    memcpy(profiler->buffer + *length, text, size + 1);
+    *length += size;
+    return true;
+}
+
+void profileSample(VM* vm) {
+    // The counter is shared by the process, ticks meant for another VM's
+    // profiler are dropped.
+    int ticks = profilePending;
+    profilePending = 0;
+    Profiler* profiler = vm->profiler;
+    if (profiler == NULL || ticks <= 0 || vm->frameCount == 0)
+        return;
+
+    size_t length = 0;
+    for (int i = 0; i < vm->frameCount; i++) {
+        CallFrame* frame = &vm->frames[i];
+        ObjFunction* function = frame->closure->function;
+        // The ip sits past the instruction being run, except on entry.
+        int offset = (int)(frame->ip - function->chunk.code) - 1;
+        char frameName[64];
+        snprintf(frameName, sizeof(frameName), "%s%.40s:%d",
+                 i == 0 ? "" : ";",
+                 function->name == NULL ? "script" : function->name->chars,
+                 getLine(&function->chunk, offset < 0 ? 0 : offset));
+        if (!append(profiler, &length, frameName))
+            return;
+    }
+
+    if ((profiler->count + 1) * 4 > profiler->capacity * 3 &&
+        !growEntries(profiler))
+        return;
+    uint32_t hash = hashStack(profiler->buffer, length);
+    StackCount* entry = findStack(profiler->entries, profiler->capacity,
+                                  profiler->buffer, hash);
+    if (entry->stack == NULL) {
+        entry->stack = strdup(profiler->buffer);
+        if (entry->stack == NULL)
+            return;
+        entry->hash = hash;
+        profiler->count++;
+    }
+    entry->count += ticks;
+}
+
+static int compareStacks(const void* a, const void* b) {
+    return strcmp(((const StackCount*)a)->stack,
+                  ((const StackCount*)b)->stack);
+}
+
+bool stopProfiler(VM* vm, const char* path) {
+    Profiler* profiler = vm->profiler;
+    if (profiler == NULL)
+        return false;
+    struct itimerval off = {{0, 0}, {0, 0}};
+    setitimer(ITIMER_PROF, &off, NULL);
+    sigaction(SIGPROF, &profiler->previous, NULL);
+    vm->profiler = NULL;
+    profilePending = 0;
+
+    // Packs the entries to the front, sorted so profiles diff well.
+    int count = 0;
+    for (int i = 0; i < profiler->capacity; i++) {
+        if (profiler->entries[i].stack != NULL)
+            profiler->entries[count++] = profiler->entries[i];
+    }
+    if (count > 0)
+        qsort(profiler->entries, count, sizeof(StackCount), compareStacks);
+
+    FILE* file = fopen(path, "w");
+    bool written = file != NULL;
+    for (int i = 0; i < count; i++) {
+        if (written)
+            fprintf(file, "%s %ld\n", profiler->entries[i].stack,
+                    profiler->entries[i].count);
+        free(profiler->entries[i].stack);
+    }
+    if (file != NULL && fclose(file) != 0)
+        written = false;
+
+    free(profiler->entries);
+    free(profiler->buffer);
+    free(profiler);
+    return written;
+}
+
+// Calls of one function or native, and the time they took.
+typedef struct {
+    char* name;
+    int line;
+    bool native;
+    uint64_t calls;
+    uint64_t inclusive;
+    uint64_t exclusive;
+    int active; // Frames of the function not returned yet.
+} CallRecord;
+
+struct CallProfiler {
+    CallRecord* records;
+    int count;
+    int capacity;
+};
+
+static uint64_t now() {
+    struct timespec time;
+    clock_gettime(CLOCK_MONOTONIC, &time);
+    return (uint64_t)time.tv_sec * 1000000000u + (uint64_t)time.tv_nsec;
+}
+
+bool startCallProfiler(VM* vm) {
+    vm->callProfiler = calloc(1, sizeof(CallProfiler));
+    return vm->callProfiler != NULL;
+}
+
+// Index of a new record, or -1 if out of memory.
+static int addRecord(CallProfiler* profiler, const char* name, int line,
+                     bool native) {
+    if (profiler->count == profiler->capacity) {
+        int capacity = profiler->capacity < 16 ? 16 : profiler->capacity * 2;
+        CallRecord* records = realloc(profiler->records,
+                                      sizeof(CallRecord) * capacity);
+        if (records == NULL)
+            return -1;
+        profiler->records = records;
+        profiler->capacity = capacity;
+    }
+    char* copy = strdup(name);
+    if (copy == NULL)
+        return -1;
+    profiler->records[profiler->count] =
+        (CallRecord){copy, line, native, 0, 0, 0, 0};
+    return profiler->count++;
+}
+
+// Record of the function a frame runs, added on its first call. Records
+// keep a copy of the name so they outlive the function.
+static CallRecord* functionRecord(CallProfiler* profiler, CallFrame* frame) {
+    ObjFunction* function = frame->closure->function;
+    if (function->callRecord < 0) {
+        function->callRecord = addRecord(
+            profiler,
+            function->name == NULL ? "script" : function->name->chars,
+            getLine(&function->chunk, 0), false);
+        if (function->callRecord < 0)
+            return NULL;
+    }
+    return &profiler->records[function->callRecord];
+}
+
+void enterCall(VM* vm, CallFrame* frame) {
+    CallRecord* record = functionRecord(vm->callProfiler, frame);
+    if (record != NULL) {
+        record->calls++;
+        record->active++;
+    }
+    frame->children = 0;
+    frame->entered = now();
+}
+
+// Charges elapsed time to a record and to the caller's frame, if any.
+static void charge(VM* vm, CallRecord* record, uint64_t elapsed,
+                   uint64_t children, int caller) {
+    if (record != NULL) {
+        record->exclusive += elapsed - children;
+        if (--record->active == 0)
+            record->inclusive += elapsed;
+    }
+    if (caller >= 0)
+        vm->frames[caller].children += elapsed;
+}
+
+void exitCall(VM* vm) {
+    CallFrame* frame = &vm->frames[vm->frameCount - 1];
+    charge(vm, functionRecord(vm->callProfiler, frame), now() - frame->entered,
+           frame->children, vm->frameCount - 2);
+}
+
+void unwindCalls(VM* vm) {
+    for (int i = vm->frameCount - 1; i >= 0; i--) {
+        CallFrame* frame = &vm->frames[i];
+        charge(vm, functionRecord(vm->callProfiler, frame),
+               now() - frame->entered, frame->children, i - 1);
+    }
+}
+
+Value callNative(VM* vm, ObjNative* native, int argCount, Value* args) {
+    CallProfiler* profiler = vm->callProfiler;
+    if (native->callRecord < 0)
+        native->callRecord = addRecord(profiler, native->name, 0, true);
+    uint64_t entered = now();
+    Value result = native->function(vm, argCount, args);
+    uint64_t elapsed = now() - entered;
+
+    if (native->callRecord >= 0) {
+        CallRecord* record = &profiler->records[native->callRecord];
+        record->calls++;
+        record->inclusive += elapsed;
+        record->exclusive += elapsed;
+    }
+    // Its caller is on top again, unless an error dropped the frames.
+    if (vm->frameCount > 0)
+        vm->frames[vm->frameCount - 1].children += elapsed;
+    return result;
+}
+
+void suspendCalls(VM* vm) {
+    uint64_t time = now();
+    for (int i = 0; i < vm->frameCount; i++)
+        vm->frames[i].entered = time - vm->frames[i].entered;
+}
+
+void resumeCalls(VM* vm) {
+    // suspendCalls() left the time each frame had run so far.
+    suspendCalls(vm);
+}
+
+static int compareRecords(const void* a, const void* b) {
+    const CallRecord* left = a;
+    const CallRecord* right = b;
+    if (left->exclusive != right->exclusive)
+        return left->exclusive < right->exclusive ? 1 : -1;
+    return strcmp(left->name, right->name);
+}
+
+bool stopCallProfiler(VM* vm, FILE* out, const char* path) {
+    CallProfiler* profiler = vm->callProfiler;
+    if (profiler == NULL)
+        return false;
+    vm->callProfiler = NULL;
+    // Record indices mean nothing to the next profiler.
+    for (Obj* object = nextObject(&vm->heap, NULL); object != NULL;
+         object = nextObject(&vm->heap, object)) {
+        if (object->type == OBJ_FUNCTION)
+            ((ObjFunction*)object)->callRecord = -1;
+        else if (object->type == OBJ_NATIVE)
+            ((ObjNative*)object)->callRecord = -1;
+    }
+
+    if (profiler->count > 0)
+        qsort(profiler->records, profiler->count, sizeof(CallRecord),
+              compareRecords);
+    fprintf(out, "== calls ==\n%-24s %12s %12s %12s %12s\n", "function",
+            "calls", "incl ms", "excl ms", "excl ns/call");
+    FILE* file = fopen(path, "w");
+    if (file != NULL)
+        fprintf(file, "name,line,kind,calls,inclusive_ns,exclusive_ns\n");
+    for (int i = 0; i < profiler->count; i++) {
+        CallRecord* record = &profiler->records[i];
+        char name[64];
+        if (record->native)
+            snprintf(name, sizeof(name), "%s()", record->name);
+        else
+            snprintf(name, sizeof(name), "%s:%d", record->name, record->line);
+        fprintf(out, "%-24s %12llu %12.3f %12.3f %12.0f\n", name,
+                (unsigned long long)record->calls, record->inclusive / 1e6,
+                record->exclusive / 1e6,
+                record->calls == 0
+                    ? 0.0
+                    : (double)record->exclusive / record->calls);
+        if (file != NULL)
+            fprintf(file, "%s,%d,%s,%llu,%llu,%llu\n", record->name,
+                    record->line, record->native ? "native" : "function",
+                    (unsigned long long)record->calls,
+                    (unsigned long long)record->inclusive,
+                    (unsigned long long)record->exclusive);
+        free(record->name);
+    }
+    bool written = file != NULL && fclose(file) == 0;
+    free(profiler->records);
+    free(profiler);
+    return written;
+}
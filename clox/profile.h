@@ -0,0 +1,107 @@
+#ifndef clox_profile_h
+#define clox_profile_h
+
+#include <signal.h>
+#include <stdio.h>
+
+#include "common.h"
+#include "vm.h"
+
+// Samples taken per second of CPU time by --profile.
+#ifndef PROFILE_HZ
+#define PROFILE_HZ 1000
+#endif
+
+/**
+ * @brief SIGPROF ticks not yet charged to a stack.
+ *
+ * The signal handler only counts. The VM polls this at calls, loop back-edges
+ * and returns, where its frames are consistent, and calls profileSample().
+ * Kept on its own 8-byte line so compiled code can test it with a 64-bit
+ * load.
+ */
+extern _Alignas(8) volatile sig_atomic_t profilePending;
+
+/**
+ * @brief Starts sampling the stacks of vm on SIGPROF.
+ *
+ * Only one VM per process can be profiled, as the timer is per process.
+ * @return false if the timer could not be set up.
+ */
+bool startProfiler(VM* vm);
+
+/**
+ * @brief Charges the pending ticks to the current call stack of vm.
+ *
+ * Each frame's ip must be up to date, the top one included.
+ */
+void profileSample(VM* vm);
+
+/**
+ * @brief Stops the timer and writes the samples as folded stacks.
+ *
+ * Each line holds the frames from the outermost, as name:line separated by
+ * semicolons, then the number of samples, as flamegraph tools expect.
+ * @return false if the file could not be written.
+ */
+bool stopProfiler(VM* vm, const char* path);
+
+/**
+ * @brief Starts counting and timing every call made by vm.
+ *
+ * Compiled code returns without going through OP_RETURN, so the JIT stays
+ * off while calls are profiled.
+ * @return false if out of memory.
+ */
+bool startCallProfiler(VM* vm);
+
+/**
+ * @brief Counts the call of the frame just pushed and starts its clock.
+ */
+void enterCall(VM* vm, CallFrame* frame);
+
+/**
+ * @brief Charges the time of the frame on top, about to be popped.
+ *
+ * Its time goes to the function's exclusive time less what its callees
+ * took, and to the inclusive time unless the function is still active
+ * further down, so recursion is counted once.
+ */
+void exitCall(VM* vm);
+
+/**
+ * @brief Exits every frame, before a runtime error drops them.
+ */
+void unwindCalls(VM* vm);
+
+/**
+ * @brief Calls a native, counting and timing it apart from its caller.
+ *
+ * Natives are timed as a whole: resume() includes the fiber it runs.
+ */
+Value callNative(VM* vm, ObjNative* native, int argCount, Value* args);
+
+/**
+ * @brief Stops the clocks of a fiber's frames, which vm is running on.
+ *
+ * Time spent suspended is not charged to the frames of a fiber, until
+ * resumeCalls() starts their clocks again.
+ */
+void suspendCalls(VM* vm);
+
+/**
+ * @brief Restarts the clocks of a resumed fiber's frames.
+ */
+void resumeCalls(VM* vm);
+
+/**
+ * @brief Stops profiling calls, prints a report and writes a CSV.
+ *
+ * The report on out lists the functions taking the most exclusive time
+ * first. The CSV file holds a header then one row per function or native:
+ * name, line, kind, calls, inclusive and exclusive nanoseconds.
+ * @return false if the file could not be written.
+ */
+bool stopCallProfiler(VM* vm, FILE* out, const char* path);
+
+#endif
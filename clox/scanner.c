@@ -5,35 +5,27 @@
 
 #include "common.h"
 
-typedef struct {
-    const char* start;
-    const char* current;
-    int line;
-} Scanner;
-
-Scanner scanner;
-
-void initScanner(const char* source) {
-    scanner.start = source;
-    scanner.current = source;
-    scanner.line = 1;
+void initScanner(Scanner* scanner, const char* source) {
+    scanner->start = source;
+    scanner->current = source;
+    scanner->line = 1;
 }
 
-int isAtEnd() { return *scanner.current == '\0'; }
+int isAtEnd(Scanner* scanner) { return *scanner->current == '\0'; }
 
-static char peekNext() {
-    if (isAtEnd())
+static char peekNext(Scanner* scanner) {
+    if (isAtEnd(scanner))
         return '\0';
-    return scanner.current[1];
+    return scanner->current[1];
 }
 
-static char advance() { return *(scanner.current++); }
+static char advance(Scanner* scanner) { return *(scanner->current++); }
 
-static bool match(char c) {
-    if (isAtEnd())
+static bool match(Scanner* scanner, char c) {
+    if (isAtEnd(scanner))
         return false;
-    if (*scanner.current == c) {
-        advance();
+    if (*scanner->current == c) {
+        advance(scanner);
         return true;
     }
     return false;
@@ -45,21 +37,21 @@ static bool isAlpha(char c) {
     return (c >= 'a' && c <= 'z') || (c >= 'A' && c <= 'Z') || c == '_';
 }
 
-static void skipWhiteSpace() {
+static void skipWhiteSpace(Scanner* scanner) {
     for (;;) {
-        char c = *scanner.current;
+        char c = *scanner->current;
         switch (c) {
 #pragma GCC diagnostic push
 #pragma GCC diagnostic ignored "-Wimplicit-fallthrough"
-            case '\n': scanner.line++;
+            case '\n': scanner->line++;
 #pragma GCC diagnostic pop
             case ' ':
             case '\r':
-            case '\t': advance(); break;
+            case '\t': advance(scanner); break;
             case '/':
-                if (peekNext() == '/') {
-                    while (*scanner.current != '\n' && !isAtEnd())
-                        advance();
+                if (peekNext(scanner) == '/') {
+                    while (*scanner->current != '\n' && !isAtEnd(scanner))
+                        advance(scanner);
                 } else {
                     return;
                 }
@@ -69,19 +61,19 @@ static void skipWhiteSpace() {
     }
 }
 
-Token makeToken(TokenType type) {
-    Token token = {.start = scanner.start,
-                   .line = scanner.line,
-                   .length = (int)(scanner.current - scanner.start),
+Token makeToken(Scanner* scanner, TokenType type) {
+    Token token = {.start = scanner->start,
+                   .line = scanner->line,
+                   .length = (int)(scanner->current - scanner->start),
                    .type = type};
 
     return token;
 }
 
-Token errorToken(char* message) {
+Token errorToken(Scanner* scanner, char* message) {
     Token token = {
         .start = message,
-        .line = scanner.line,
+        .line = scanner->line,
         .length = (int)strlen(message),
         .type = TOKEN_ERROR,
     };
@@ -89,129 +81,143 @@ Token errorToken(char* message) {
     return token;
 }
 
-static Token string() {
-    while (*scanner.current != '"' && !isAtEnd()) {
-        if (*scanner.current == '\n')
-            scanner.line++;
-        advance();
+static Token string(Scanner* scanner) {
+    while (*scanner->current != '"' && !isAtEnd(scanner)) {
+        if (*scanner->current == '\n')
+            scanner->line++;
+        advance(scanner);
     }
 
-    if (isAtEnd())
-        return errorToken("Unterminated string.");
+    if (isAtEnd(scanner))
+        return errorToken(scanner, "Unterminated string.");
 
-    advance();
-    return makeToken(TOKEN_STRING);
+    advance(scanner);
+    return makeToken(scanner, TOKEN_STRING);
 }
 
-static Token number() {
-    while (isDigit(*scanner.current))
-        advance();
+static Token number(Scanner* scanner) {
+    while (isDigit(*scanner->current))
+        advance(scanner);
     // Look for a fractional part.
-    if (*scanner.current == '.' && isDigit(peekNext())) {
+    if (*scanner->current == '.' && isDigit(peekNext(scanner))) {
         // Consume the ".".
-        advance();
-        while (isDigit(*scanner.current))
-            advance();
+        advance(scanner);
+        while (isDigit(*scanner->current))
+            advance(scanner);
     }
-    return makeToken(TOKEN_NUMBER);
+    return makeToken(scanner, TOKEN_NUMBER);
 }
 
-static TokenType checkKeyword(int start, int length, const char* rest,
-                              TokenType type) {
-    if (scanner.current - scanner.start == start + length &&
-        memcmp(scanner.start + start, rest, length) == 0) {
+static TokenType checkKeyword(Scanner* scanner, int start, int length,
+                              const char* rest, TokenType type) {
+    if (scanner->current - scanner->start == start + length &&
+        memcmp(scanner->start + start, rest, length) == 0) {
         return type;
     }
     return TOKEN_IDENTIFIER;
 }
 
-static TokenType identifierType() {
-    switch (scanner.start[0]) {
+static TokenType identifierType(Scanner* scanner) {
+    switch (scanner->start[0]) {
         case 'a':
-            if (scanner.current - scanner.start > 1) {
-                switch (scanner.start[1]) {
-                    case 'n': return checkKeyword(2, 1, "d", TOKEN_AND);
-                    case 's': return checkKeyword(2, 4, "sert", TOKEN_ASSERT);
+            if (scanner->current - scanner->start > 1) {
+                switch (scanner->start[1]) {
+                    case 'n':
+                        return checkKeyword(scanner, 2, 1, "d", TOKEN_AND);
+                    case 's':
+                        return checkKeyword(scanner, 2, 4, "sert",
+                                            TOKEN_ASSERT);
                 }
             }
             break;
-        case 'c': return checkKeyword(1, 4, "lass", TOKEN_CLASS);
-        case 'e': return checkKeyword(1, 3, "lse", TOKEN_ELSE);
-        case 'i': return checkKeyword(1, 1, "f", TOKEN_IF);
+        case 'c': return checkKeyword(scanner, 1, 4, "lass", TOKEN_CLASS);
+        case 'e': return checkKeyword(scanner, 1, 3, "lse", TOKEN_ELSE);
+        case 'i': return checkKeyword(scanner, 1, 1, "f", TOKEN_IF);
         case 'f':
-            if (scanner.current - scanner.start > 1) {
-                switch (scanner.start[1]) {
-                    case 'a': return checkKeyword(2, 3, "lse", TOKEN_FALSE);
-                    case 'o': return checkKeyword(2, 1, "r", TOKEN_FOR);
-                    case 'u': return checkKeyword(2, 1, "n", TOKEN_FUN);
+            if (scanner->current - scanner->start > 1) {
+                switch (scanner->start[1]) {
+                    case 'a':
+                        return checkKeyword(scanner, 2, 3, "lse", TOKEN_FALSE);
+                    case 'o':
+                        return checkKeyword(scanner, 2, 1, "r", TOKEN_FOR);
+                    case 'u':
+                        return checkKeyword(scanner, 2, 1, "n", TOKEN_FUN);
                 }
             }
             break;
-        case 'n': return checkKeyword(1, 2, "il", TOKEN_NIL);
-        case 'o': return checkKeyword(1, 1, "r", TOKEN_OR);
-        case 'p': return checkKeyword(1, 4, "rint", TOKEN_PRINT);
-        case 'r': return checkKeyword(1, 5, "eturn", TOKEN_RETURN);
-        case 's': return checkKeyword(1, 4, "uper", TOKEN_SUPER);
+        case 'n': return checkKeyword(scanner, 1, 2, "il", TOKEN_NIL);
+        case 'o': return checkKeyword(scanner, 1, 1, "r", TOKEN_OR);
+        case 'p': return checkKeyword(scanner, 1, 4, "rint", TOKEN_PRINT);
+        case 'r': return checkKeyword(scanner, 1, 5, "eturn", TOKEN_RETURN);
+        case 's': return checkKeyword(scanner, 1, 4, "uper", TOKEN_SUPER);
         case 't':
-            if (scanner.current - scanner.start > 1) {
-                switch (scanner.start[1]) {
-                    case 'h': return checkKeyword(2, 2, "is", TOKEN_THIS);
-                    case 'r': return checkKeyword(2, 2, "ue", TOKEN_TRUE);
+            if (scanner->current - scanner->start > 1) {
+                switch (scanner->start[1]) {
+                    case 'h':
+                        return checkKeyword(scanner, 2, 2, "is", TOKEN_THIS);
+                    case 'r':
+                        return checkKeyword(scanner, 2, 2, "ue", TOKEN_TRUE);
                 }
             }
             break;
-        case 'v': return checkKeyword(1, 2, "ar", TOKEN_VAR);
-        case 'w': return checkKeyword(1, 4, "hile", TOKEN_WHILE);
+        case 'v': return checkKeyword(scanner, 1, 2, "ar", TOKEN_VAR);
+        case 'w': return checkKeyword(scanner, 1, 4, "hile", TOKEN_WHILE);
     }
     return TOKEN_IDENTIFIER;
 }
 
-static Token identifier() {
-    while (isAlpha(*scanner.current) || isDigit(*scanner.current))
-        advance();
-    return makeToken(identifierType());
+static Token identifier(Scanner* scanner) {
+    while (isAlpha(*scanner->current) || isDigit(*scanner->current))
+        advance(scanner);
+    return makeToken(scanner, identifierType(scanner));
 }
 
-Token scanToken() {
-    skipWhiteSpace();
-    scanner.start = scanner.current;
+Token scanToken(Scanner* scanner) {
+    skipWhiteSpace(scanner);
+    scanner->start = scanner->current;
 
-    if (isAtEnd())
-        return makeToken(TOKEN_EOF);
+    if (isAtEnd(scanner))
+        return makeToken(scanner, TOKEN_EOF);
 
-    char c = advance();
+    char c = advance(scanner);
 
     if (isAlpha(c))
-        return identifier();
+        return identifier(scanner);
     if (isDigit(c))
-        return number();
+        return number(scanner);
 
     switch (c) {
-        case '(': return makeToken(TOKEN_LEFT_PAREN);
-        case ')': return makeToken(TOKEN_RIGHT_PAREN);
-        case '{': return makeToken(TOKEN_LEFT_BRACE);
-        case '}': return makeToken(TOKEN_RIGHT_BRACE);
-        case ';': return makeToken(TOKEN_SEMICOLON);
-        case ',': return makeToken(TOKEN_COMMA);
-        case '.': return makeToken(TOKEN_DOT);
-        case '-': return makeToken(TOKEN_MINUS);
-        case '+': return makeToken(TOKEN_PLUS);
-        case '/': return makeToken(TOKEN_SLASH);
-        case '*': return makeToken(TOKEN_STAR);
-        case '?': return makeToken(TOKEN_QUESTION);
-        case ':': return makeToken(TOKEN_COLON);
-        case '!': return makeToken(match('=') ? TOKEN_BANG_EQUAL : TOKEN_BANG);
+        case '(': return makeToken(scanner, TOKEN_LEFT_PAREN);
+        case ')': return makeToken(scanner, TOKEN_RIGHT_PAREN);
+        case '{': return makeToken(scanner, TOKEN_LEFT_BRACE);
+        case '}': return makeToken(scanner, TOKEN_RIGHT_BRACE);
+        case ';': return makeToken(scanner, TOKEN_SEMICOLON);
+        case ',': return makeToken(scanner, TOKEN_COMMA);
+        case '.': return makeToken(scanner, TOKEN_DOT);
+        case '-': return makeToken(scanner, TOKEN_MINUS);
+        case '+': return makeToken(scanner, TOKEN_PLUS);
+        case '/': return makeToken(scanner, TOKEN_SLASH);
+        case '*': return makeToken(scanner, TOKEN_STAR);
+        case '?': return makeToken(scanner, TOKEN_QUESTION);
+        case ':': return makeToken(scanner, TOKEN_COLON);
+        case '!':
+            return makeToken(scanner, match(scanner, '=') ? TOKEN_BANG_EQUAL
+                                                          : TOKEN_BANG);
         case '=':
-            return makeToken(match('=') ? TOKEN_EQUAL_EQUAL : TOKEN_EQUAL);
-        case '<': return makeToken(match('=') ? TOKEN_LESS_EQUAL : TOKEN_LESS);
+            return makeToken(scanner, match(scanner, '=') ? TOKEN_EQUAL_EQUAL
+                                                          : TOKEN_EQUAL);
+        case '<':
+            return makeToken(scanner, match(scanner, '=') ? TOKEN_LESS_EQUAL
+                                                          : TOKEN_LESS);
         case '>':
-            return makeToken(match('=') ? TOKEN_GREATER_EQUAL : TOKEN_GREATER);
+            return makeToken(scanner, match(scanner, '=') ? TOKEN_GREATER_EQUAL
+                                                          : TOKEN_GREATER);
         case '\n':
-            scanner.line++;
-            advance();
+            scanner->line++;
+            advance(scanner);
             break;
-        case '"': return string();
+        case '"': return string(scanner);
     }
 
-    return errorToken("Unexpected character.");
+    return errorToken(scanner, "Unexpected character.");
 }
\ No newline at end of file
@@ -58,7 +58,17 @@ typedef struct {
     int line;
 } Token;
 
-void initScanner(const char* source);
-Token scanToken();
+/**
+ * @struct Scanner
+ * @brief Position of the scanner in the source being compiled.
+ */
+typedef struct {
+    const char* start;   /**< First character of the token being scanned */
+    const char* current; /**< Next character to look at */
+    int line;            /**< Line of current */
+} Scanner;
+
+void initScanner(Scanner* scanner, const char* source);
+Token scanToken(Scanner* scanner);
 
 #endif
\ No newline at end of file
@@ -0,0 +1,56 @@
+#include "memory.h"
+#include "shape.h"
+
+Shape* newShape(VM* vm, Shape* parent, ObjString* name) {
+    Shape* shape = ALLOCATE(vm, Shape, 1);
+    shape->parent = parent;
+    shape->name = name;
+    shape->slotCount = parent == NULL ? 0 : parent->slotCount + 1;
+    shape->transitions = NULL;
+    shape->transitionCount = 0;
+    shape->transitionCapacity = 0;
+    return shape;
+}
+
+int shapeFind(Shape* shape, ObjString* name) {
+    // Strings are interned, and chains are at most SHAPE_MAX_SLOTS long.
+    for (; shape->parent != NULL; shape = shape->parent) {
+        if (shape->name == name)
+            return shape->slotCount - 1;
+    }
+    return -1;
+}
+
+Shape* shapeTransition(VM* vm, Shape* shape, ObjString* name) {
+    for (int i = 0; i < shape->transitionCount; i++) {
+        if (shape->transitions[i]->name == name)
+            return shape->transitions[i];
+    }
+
+    Shape* next = newShape(vm, shape, name);
+    if (shape->transitionCount == shape->transitionCapacity) {
+        int oldCapacity = shape->transitionCapacity;
+        shape->transitionCapacity = GROW_CAPACITY(oldCapacity);
+        shape->transitions = GROW_ARRAY(vm, Shape*, shape->transitions,
+                                        oldCapacity, shape->transitionCapacity);
+    }
+    shape->transitions[shape->transitionCount++] = next;
+    return next;
+}
+
+void markShape(VM* vm, Shape* shape) {
+    if (shape == NULL)
+        return;
+    markObject(vm, (Obj*)shape->name);
+    for (int i = 0; i < shape->transitionCount; i++)
+        markShape(vm, shape->transitions[i]);
+}
+
+void freeShape(VM* vm, Shape* shape) {
+    if (shape == NULL)
+        return;
+    for (int i = 0; i < shape->transitionCount; i++)
+        freeShape(vm, shape->transitions[i]);
+    FREE_ARRAY(vm, Shape*, shape->transitions, shape->transitionCapacity);
+    FREE(vm, Shape, shape);
+}
@@ -0,0 +1,59 @@
+#ifndef clox_shape_h
+#define clox_shape_h
+
+#include "common.h"
+#include "object.h"
+
+// Fields an instance can get before it switches to a hash table. Keeps
+// instances used as dictionaries from growing long shape chains.
+#define SHAPE_MAX_SLOTS 64
+
+/**
+ * @struct Shape
+ * @brief Layout of the fields of an instance.
+ *
+ * Shapes form a tree rooted at vm->rootShape, each one adding a field to its
+ * parent. Instances given the same fields in the same order share a shape
+ * and keep each field at the same slot.
+ */
+struct Shape {
+    struct Shape* parent;       /**< Shape without the last field, or NULL */
+    ObjString* name;            /**< Field added to parent, in the last slot */
+    int slotCount;              /**< Number of fields */
+    struct Shape** transitions; /**< Shapes adding one field to this one */
+    int transitionCount;        /**< Number of transitions */
+    int transitionCapacity;     /**< Allocated size of transitions */
+};
+
+/**
+ * @brief Creates a shape adding a field to parent.
+ * @param parent Shape to extend, NULL for the empty root shape.
+ * @param name Field to add, NULL for the root.
+ * @return Pointer to the new Shape.
+ */
+Shape* newShape(VM* vm, Shape* parent, ObjString* name);
+
+/**
+ * @brief Finds the slot of a field.
+ * @return The slot, or -1 if the shape has no such field.
+ */
+int shapeFind(Shape* shape, ObjString* name);
+
+/**
+ * @brief Shape after adding a field, created on first use.
+ *
+ * name must be reachable by the GC, the new shape may allocate.
+ */
+Shape* shapeTransition(VM* vm, Shape* shape, ObjString* name);
+
+/**
+ * @brief Marks the field names of a shape and all its transitions.
+ */
+void markShape(VM* vm, Shape* shape);
+
+/**
+ * @brief Frees a shape and all its transitions.
+ */
+void freeShape(VM* vm, Shape* shape);
+
+#endif
@@ -15,8 +15,8 @@ void initTable(Table* table) {
     table->entries = NULL;
 }
 
-void freeTable(Table* table) {
-    FREE_ARRAY(Entry, table->entries, table->capacity + 1);
+void freeTable(VM* vm, Table* table) {
+    FREE_ARRAY(vm, Entry, table->entries, table->capacity + 1);
     initTable(table);
 }
 
@@ -44,8 +44,8 @@ static Entry* findEntry(Entry* entries, int capacity, ObjString* key) {
     }
 }
 
-static void adjustCapacity(Table* table, int capacity) {
-    Entry* entries = ALLOCATE(Entry, capacity + 1);
+static void adjustCapacity(VM* vm, Table* table, int capacity) {
+    Entry* entries = ALLOCATE(vm, Entry, capacity + 1);
     for (int i = 0; i <= capacity; i++) {
         entries[i].key = NULL;
         entries[i].value = NIL_VAL;
@@ -64,7 +64,7 @@ static void adjustCapacity(Table* table, int capacity) {
         table->count++;
     }
 
-    FREE_ARRAY(Entry, table->entries, table->capacity + 1);
+    FREE_ARRAY(vm, Entry, table->entries, table->capacity + 1);
     table->entries = entries;
     table->capacity = capacity;
 }
@@ -81,10 +81,10 @@ bool tableGet(Table* table, ObjString* key, Value* value) {
     return true;
 }
 
-bool tableSet(Table* table, ObjString* key, Value value) {
+bool tableSet(VM* vm, Table* table, ObjString* key, Value value) {
     if (table->count + 1 > (table->capacity + 1) * TABLE_MAX_LOAD) {
         int capacity = GROW_CAPACITY(table->capacity + 1) - 1;
-        adjustCapacity(table, capacity);
+        adjustCapacity(vm, table, capacity);
     }
 
     Entry* entry = findEntry(table->entries, table->capacity, key);
@@ -111,11 +111,11 @@ bool tableDelete(Table* table, ObjString* key) {
     return true;
 }
 
-void tableAddAll(Table* from, Table* to) {
+void tableAddAll(VM* vm, Table* from, Table* to) {
     for (int i = 0; i <= from->capacity; i++) {
         Entry* entry = &from->entries[i];
         if (entry->key != NULL) {
-            tableSet(to, entry->key, entry->value);
+            tableSet(vm, to, entry->key, entry->value);
         }
     }
 }
@@ -140,18 +140,18 @@ ObjString* tableFindString(Table* table, const char* chars, int length,
     }
 }
 
-void markTable(Table* table) {
+void markTable(VM* vm, Table* table) {
     for (int i = 0; i <= table->capacity; i++) {
         Entry* entry = &table->entries[i];
-        markObject((Obj*)entry->key);
-        markValue(entry->value);
+        markObject(vm, (Obj*)entry->key);
+        markValue(vm, entry->value);
     }
 }
 
-void tableRemoveWhites(Table* table) {
+void tableRemoveWhites(VM* vm, Table* table) {
     for (int i = 0; i <= table->capacity; i++) {
         Entry* entry = &table->entries[i];
-        if (entry->key != NULL && isOld(&entry->key->obj)) {
+        if (entry->key != NULL && !isMarked(vm, &entry->key->obj)) {
             tableDelete(table, entry->key);
         }
     }
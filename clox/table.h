@@ -40,7 +40,7 @@ void initTable(Table* table);
  * @brief Frees the memory allocated for the hash table.
  * @param table Pointer to the Table structure to free.
  */
-void freeTable(Table* table);
+void freeTable(VM* vm, Table* table);
 
 /**
  * @brief Retrieves a value from the hash table.
@@ -58,7 +58,7 @@ bool tableGet(Table* table, ObjString* key, Value* value);
  * @param value The value to associate with the key.
  * @return true if a new entry was added, false if an existing entry was updated.
  */
-bool tableSet(Table* table, ObjString* key, Value value);
+bool tableSet(VM* vm, Table* table, ObjString* key, Value value);
 
 /**
  * @brief Deletes a key-value pair from the hash table.
@@ -73,7 +73,7 @@ bool tableDelete(Table* table, ObjString* key);
  * @param from Pointer to the source Table.
  * @param to Pointer to the destination Table.
  */
-void tableAddAll(Table* from, Table* to);
+void tableAddAll(VM* vm, Table* from, Table* to);
 
 /**
  * @brief Finds a string in the table based on its contents and hash.
@@ -89,12 +89,12 @@ ObjString* tableFindString(Table* table, const char* chars, int length, uint32_t
  * @brief Marks all objects in the table for garbage collection.
  * @param table Pointer to the Table structure.
  */
-void markTable(Table* table);
+void markTable(VM* vm, Table* table);
 
 /**
  * @brief Removes all white (unmarked) objects from the table.
  * @param table Pointer to the Table structure.
  */
-void tableRemoveWhites(Table* table);
+void tableRemoveWhites(VM* vm, Table* table);
 
 #endif
\ No newline at end of file
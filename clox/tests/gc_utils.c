@@ -0,0 +1,45 @@
+#ifndef GC_UTILS_H
+#define GC_UTILS_H
+
+#include "../heap.h"
+#include "../memory.h"
+#include "test_utils.c"
+
+// Collections only where the tests run them: none is scheduled from now on.
+static inline void holdCollections(VM* vm) {
+    vm->nextGC = SIZE_MAX;
+    vm->nextMinorGC = SIZE_MAX;
+}
+
+// Collects at once, then leaves collections to the tests again.
+static inline void collect(VM* vm) {
+    collectGarbage(vm);
+    holdCollections(vm);
+}
+
+// Allocates garbage, one step of the collection in progress.
+static inline void allocate(VM* vm) {
+    // Not interned any more, the next call allocates again.
+    tableDelete(&vm->strings, copyString(vm, "garbage", 7));
+}
+
+// Whether object is still in the VM's heap, i.e. not freed.
+static inline bool inHeap(VM* vm, Obj* object) {
+    for (Obj* live = nextObject(&vm->heap, NULL); live != NULL;
+         live = nextObject(&vm->heap, live)) {
+        if (live == object)
+            return true;
+    }
+    return false;
+}
+
+// Whether the sweep left no page to sweep.
+static inline bool swept(VM* vm) {
+    for (int i = 0; i <= HEAP_LARGE; i++) {
+        if (vm->heap.sweeping[i] != NULL)
+            return false;
+    }
+    return true;
+}
+
+#endif // GC_UTILS_H
@@ -0,0 +1,130 @@
+#include <stdio.h>
+#include "../cache.h"
+#include "../object.h"
+#include "../vm.h"
+#include "test_utils.c"
+
+static VM vm;
+
+// First cache of a global function, the one of its first property access.
+static InlineCache* firstCache(const char* function) {
+    return &AS_CLOSURE(global(&vm, function))->function->chunk.caches[0];
+}
+
+TEST(monomorphicHit) {
+    const char* source = "class P { init() { this.x = 1; this.y = 2; } }"
+                         "fun getY(p) { return p.y; }"
+                         "var sum = 0;"
+                         "for (var i = 0; i < 10; i = i + 1)"
+                         "  sum = sum + getY(P());";
+    ASSERT_EQUAL(INTERPRET_OK, interpret(&vm, source, false));
+
+    InlineCache* cache = firstCache("getY");
+    ASSERT_EQUAL(1, cache->count);
+    ASSERT_EQUAL(9, (int)cache->hits);
+    ASSERT_EQUAL(1, (int)cache->misses);
+    ASSERT_EQUAL(1, cache->entries[0].slot);
+    ASSERT_EQUAL(20.0, AS_NUMBER(global(&vm, "sum")));
+}
+
+TEST(polymorphicSite) {
+    // Same class, three layouts.
+    const char* source = "class Q {}"
+                         "fun getA(q) { return q.a; }"
+                         "var q1 = Q(); q1.a = 1;"
+                         "var q2 = Q(); q2.b = 0; q2.a = 2;"
+                         "var q3 = Q(); q3.c = 0; q3.b = 0; q3.a = 3;"
+                         "var sum = 0;"
+                         "for (var i = 0; i < 4; i = i + 1)"
+                         "  sum = sum + getA(q1) + getA(q2) + getA(q3);";
+    ASSERT_EQUAL(INTERPRET_OK, interpret(&vm, source, false));
+
+    InlineCache* cache = firstCache("getA");
+    ASSERT_EQUAL(3, cache->count);
+    ASSERT(!cache->megamorphic);
+    ASSERT_EQUAL(9, (int)cache->hits);
+    ASSERT_EQUAL(24.0, AS_NUMBER(global(&vm, "sum")));
+}
+
+TEST(megamorphicAfterFourShapes) {
+    const char* source = "class R {}"
+                         "fun getZ(r) { return r.z; }"
+                         "var sum = 0;"
+                         "for (var i = 0; i < 5; i = i + 1) {"
+                         "  var r = R();"
+                         "  if (i > 0) r.p = 0;"
+                         "  if (i > 1) r.q = 0;"
+                         "  if (i > 2) r.s = 0;"
+                         "  if (i > 3) r.t = 0;"
+                         "  r.z = i;"
+                         "  sum = sum + getZ(r) + getZ(r);"
+                         "}";
+    ASSERT_EQUAL(INTERPRET_OK, interpret(&vm, source, false));
+
+    InlineCache* cache = firstCache("getZ");
+    ASSERT(cache->megamorphic);
+    ASSERT_EQUAL(0, cache->count);
+    ASSERT_EQUAL(4, (int)cache->hits);
+    ASSERT_EQUAL(6, (int)cache->misses);
+    ASSERT_EQUAL(20.0, AS_NUMBER(global(&vm, "sum")));
+}
+
+TEST(methodCached) {
+    const char* source = "class S { init() { this.n = 3; } twice() {"
+                         "  return this.n * 2; } }"
+                         "fun call(s) { return s.twice(); }"
+                         "var s = S();"
+                         "var a = call(s);"
+                         "var b = call(s);";
+    ASSERT_EQUAL(INTERPRET_OK, interpret(&vm, source, false));
+
+    InlineCache* cache = firstCache("call");
+    ASSERT_EQUAL(1, cache->count);
+    ASSERT(cache->entries[0].method != NULL);
+    ASSERT_EQUAL(1, (int)cache->hits);
+    ASSERT_EQUAL(6.0, AS_NUMBER(global(&vm, "b")));
+}
+
+TEST(storeTransition) {
+    const char* source = "class T {}"
+                         "fun make(v) { var t = T(); t.v = v; return t; }"
+                         "var t1 = make(1);"
+                         "var t2 = make(2);";
+    ASSERT_EQUAL(INTERPRET_OK, interpret(&vm, source, false));
+
+    InlineCache* cache = firstCache("make");
+    ASSERT_EQUAL(1, cache->count);
+    ASSERT(cache->entries[0].transition != NULL);
+    ASSERT_EQUAL(1, (int)cache->hits);
+
+    ObjInstance* t2 = AS_INSTANCE(global(&vm, "t2"));
+    ASSERT(t2->shape == AS_INSTANCE(global(&vm, "t1"))->shape);
+    ASSERT_EQUAL(2.0, AS_NUMBER(t2->fields[0]));
+}
+
+TEST(jumpsOverCachedAccesses) {
+    // Each access takes its cache operand, the body needs a 16-bit jump.
+    char source[2048];
+    int length = sprintf(source, "class C {} var c = C(); c.x = 1;"
+                                 "var total = 0; if (c.x) {");
+    for (int i = 0; i < 45; i++)
+        length += sprintf(source + length, " total = total + c.x;");
+    sprintf(source + length, " }");
+    ASSERT_EQUAL(INTERPRET_OK, interpret(&vm, source, false));
+
+    ASSERT_EQUAL(45.0, AS_NUMBER(global(&vm, "total")));
+}
+
+int main() {
+    initVM(&vm);
+
+    RUN_TEST(monomorphicHit);
+    RUN_TEST(polymorphicSite);
+    RUN_TEST(megamorphicAfterFourShapes);
+    RUN_TEST(methodCached);
+    RUN_TEST(storeTransition);
+    RUN_TEST(jumpsOverCachedAccesses);
+
+    freeVM(&vm);
+    return 0;
+}
@@ -0,0 +1,114 @@
+#include <stdio.h>
+#include "../profile.h"
+#include "../vm.h"
+#include "test_utils.c"
+
+#define CSV_PATH "build/tests/test_call_profile.csv"
+
+static VM vm;
+
+typedef struct {
+    long calls;
+    long long inclusive;
+    long long exclusive;
+} Row;
+
+// Reads back the row of a function or native from the CSV.
+static bool findRow(const char* name, Row* row) {
+    FILE* file = fopen(CSV_PATH, "r");
+    if (file == NULL)
+        return false;
+    char line[256];
+    bool found = false;
+    while (!found && fgets(line, sizeof(line), file) != NULL) {
+        char rowName[64];
+        char kind[16];
+        int lineNumber;
+        found = sscanf(line, "%63[^,],%d,%15[^,],%ld,%lld,%lld", rowName,
+                       &lineNumber, kind, &row->calls, &row->inclusive,
+                       &row->exclusive) == 6 &&
+                strcmp(rowName, name) == 0;
+    }
+    fclose(file);
+    return found;
+}
+
+static bool profile(const char* source, InterpretResult expected) {
+    FILE* report = fopen("/dev/null", "w");
+    bool ok = startCallProfiler(&vm) &&
+              interpret(&vm, source, false) == expected &&
+              stopCallProfiler(&vm, report, CSV_PATH);
+    fclose(report);
+    return ok;
+}
+
+TEST(countsEveryCall) {
+    // Far past JIT_THRESHOLD, compiled code would return unseen.
+    const char* source = "fun leaf() { return 1; }"
+                         "fun caller() { var t = 0;"
+                         "  for (var i = 0; i < 3000; i = i + 1)"
+                         "    t = t + leaf(); return t; }"
+                         "caller(); caller(); clock();";
+    ASSERT(profile(source, INTERPRET_OK));
+
+    Row leaf, caller, clock, script;
+    ASSERT(findRow("leaf", &leaf));
+    ASSERT(findRow("caller", &caller));
+    ASSERT(findRow("clock", &clock));
+    ASSERT(findRow("script", &script));
+    ASSERT_EQUAL(6000, leaf.calls);
+    ASSERT_EQUAL(2, caller.calls);
+    ASSERT_EQUAL(1, clock.calls);
+    ASSERT_EQUAL(1, script.calls);
+
+    // Callees are excluded from their caller's own time.
+    ASSERT(caller.inclusive >= caller.exclusive + leaf.inclusive);
+    ASSERT_EQUAL(leaf.inclusive, leaf.exclusive);
+    ASSERT(script.inclusive >= caller.inclusive);
+}
+
+TEST(recursionAndTailCalls) {
+    const char* source = "fun fib(n) { if (n < 2) return n;"
+                         "  return fib(n - 1) + fib(n - 2); }"
+                         "fun count(n) { if (n == 0) return 0;"
+                         "  return count(n - 1); }"
+                         "fib(15); count(500);";
+    ASSERT(profile(source, INTERPRET_OK));
+
+    Row fib, count;
+    ASSERT(findRow("fib", &fib));
+    ASSERT(findRow("count", &count));
+    ASSERT_EQUAL(1973, fib.calls);
+    ASSERT_EQUAL(501, count.calls);
+    // The outermost call holds the time of the nested ones.
+    ASSERT_EQUAL(fib.inclusive, fib.exclusive);
+}
+
+TEST(errorsUnwind) {
+    const char* source = "fun fails() { return nil + 1; }"
+                         "fun outer() { return 1 + fails(); }"
+                         "outer();";
+    ASSERT(profile(source, INTERPRET_RUNTIME_ERROR));
+
+    Row fails, outer;
+    ASSERT(findRow("fails", &fails));
+    ASSERT(findRow("outer", &outer));
+    ASSERT_EQUAL(1, fails.calls);
+    ASSERT(outer.inclusive >= fails.inclusive);
+    ASSERT(vm.callProfiler == NULL);
+}
+
+int main() {
+    initVM(&vm);
+    vm.err = fopen("/dev/null", "w");
+
+    RUN_TEST(countsEveryCall);
+    RUN_TEST(recursionAndTailCalls);
+    RUN_TEST(errorsUnwind);
+
+    fclose(vm.err);
+    vm.err = stderr;
+    remove(CSV_PATH);
+    freeVM(&vm);
+    return 0;
+}
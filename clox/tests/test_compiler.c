@@ -2,14 +2,17 @@
 #include <string.h>
 #include "../compiler.h"
 #include "../chunk.h"
+#include "../vm.h"
 #include "test_utils.c"
 
+static VM vm;
+
 TEST(compile_simple_expression) {
     const char* source = "2 + 3;";
     Chunk chunk;
     initChunk(&chunk);
 
-    bool result = compile(source, &chunk);
+    bool result = compile(&vm, source, &chunk);
 
     ASSERT(result);
     ASSERT_EQUAL(7, chunk.count);  // 2*2 for constants, 1 for OP_ADD, 1 for OP_RETURN, 1 for OP_POP
@@ -23,7 +26,7 @@ TEST(compile_simple_expression) {
     ASSERT_FLOAT_EQUAL(2.0, AS_NUMBER(chunk.constants.values[0]), 0.0001);
     ASSERT_FLOAT_EQUAL(3.0, AS_NUMBER(chunk.constants.values[1]), 0.0001);
 
-    freeChunk(&chunk);
+    freeChunk(&vm, &chunk);
 }
 
 TEST(compile_complex_expression) {
@@ -31,7 +34,7 @@ TEST(compile_complex_expression) {
     Chunk chunk;
     initChunk(&chunk);
 
-    bool result = compile(source, &chunk);
+    bool result = compile(&vm, source, &chunk);
 
     ASSERT(result);
     ASSERT_EQUAL(13, chunk.count);  // 4*2 constants, 3 operations, 1 return, 1 pop
@@ -51,7 +54,7 @@ TEST(compile_complex_expression) {
     ASSERT_FLOAT_EQUAL(4.0, AS_NUMBER(chunk.constants.values[2]), 0.0001);
     ASSERT_FLOAT_EQUAL(5.0, AS_NUMBER(chunk.constants.values[3]), 0.0001);
 
-    freeChunk(&chunk);
+    freeChunk(&vm, &chunk);
 }
 
 TEST(compile_invalid_expression) {
@@ -59,11 +62,11 @@ TEST(compile_invalid_expression) {
     Chunk chunk;
     initChunk(&chunk);
 
-    bool result = compile(source, &chunk);
+    bool result = compile(&vm, source, &chunk);
 
     ASSERT(!result);
 
-    freeChunk(&chunk);
+    freeChunk(&vm, &chunk);
 }
 
 int main() {
@@ -0,0 +1,166 @@
+#include <stdio.h>
+#include "../object.h"
+#include "../vm.h"
+#include "gc_utils.c"
+
+static VM vm;
+
+// How many strings in the heap hold chars.
+static int stringsHolding(const char* chars) {
+    int count = 0;
+    for (Obj* object = nextObject(&vm.heap, NULL); object != NULL;
+         object = nextObject(&vm.heap, object)) {
+        ObjString* string = (ObjString*)object;
+        if (object->type == OBJ_STRING &&
+            string->length == (int)strlen(chars) &&
+            memcmp(string->chars, chars, string->length) == 0)
+            count++;
+    }
+    return count;
+}
+
+// Starts a full collection on the next allocation, handed to the marker
+// thread. That may be done with it by the time the VM looks again, on a single
+// core above all, so the tests don't count on the phase that follows.
+static void startCollection() {
+    vm.nextGC = 0;
+    allocate(&vm);
+    holdCollections(&vm);
+}
+
+static void finishCollection() {
+    while (vm.gcPhase != GC_IDLE)
+        allocate(&vm);
+    // Ending it scheduled the next one.
+    holdCollections(&vm);
+}
+
+TEST(marksOnThread) {
+    // Kept, for the marker thread to trace in the tests that follow.
+    const char* source = "class Node {}"
+                         "var list = nil;"
+                         "for (var i = 0; i < 100000; i = i + 1) {"
+                         "  var node = Node(); node.next = list; list = node; }";
+    ASSERT_EQUAL(INTERPRET_OK, interpret(&vm, source, false));
+    int collections = vm.gcStats.collections;
+
+    startCollection();
+    ASSERT(vm.gcPhase != GC_IDLE);
+    ASSERT(vm.marker != NULL);
+    finishCollection();
+    ASSERT_EQUAL(collections + 1, vm.gcStats.collections);
+    ASSERT_EQUAL(INTERPRET_OK,
+                 interpret(&vm,
+                           "var length = 0;"
+                           "for (var node = list; node != nil;"
+                           "     node = node.next) length = length + 1;",
+                           false));
+    ASSERT_EQUAL(100000, (int)AS_NUMBER(global(&vm, "length")));
+    ASSERT(swept(&vm));
+    // Survivors are ready for the next snapshot.
+    ASSERT_EQUAL(SCAN_NONE, atomic_load(&AS_OBJ(global(&vm, "list"))->scan));
+}
+
+TEST(allocatesBlack) {
+    ASSERT_EQUAL(INTERPRET_OK, interpret(&vm, "class Box {}", false));
+    startCollection();
+    ObjInstance* fresh = newInstance(&vm, AS_CLASS(global(&vm, "Box")));
+    // The phase the allocation saw, only the VM's steps move it on.
+    bool concurrent = vm.gcPhase == GC_CONCURRENT;
+    ASSERT_EQUAL(concurrent, objectMarked(&fresh->obj));
+    ASSERT_EQUAL(concurrent ? SCAN_DONE : SCAN_NONE,
+                 atomic_load(&fresh->obj.scan));
+    finishCollection();
+    collect(&vm);
+    ASSERT(!inHeap(&vm, &fresh->obj));
+}
+
+TEST(barrierScansBeforeStores) {
+    ASSERT_EQUAL(INTERPRET_OK,
+                 interpret(&vm, "var box = Box(); box.old = Box();", false));
+    collect(&vm);
+    ObjInstance* box = AS_INSTANCE(global(&vm, "box"));
+    Value old = NIL_VAL;
+    ObjString* name = copyString(&vm, "old", 3);
+    getField(box, name, &old);
+
+    startCollection();
+    // Only reachable from the snapshot once the store drops it.
+    setField(&vm, box, name, NIL_VAL);
+    finishCollection();
+    ASSERT(inHeap(&vm, AS_OBJ(old)));
+    collect(&vm);
+    ASSERT(!inHeap(&vm, AS_OBJ(old)));
+}
+
+TEST(storesDuringMarking) {
+    const char* setup = "class Cell {} var a = Cell(); var b = Cell();"
+                        "a.x = Cell(); a.x.v = \"keep\"; b.x = nil;"
+                        "fun churn() { for (var i = 0; i < 2000; i = i + 1) {"
+                        "  var garbage = Cell();"
+                        "  b.x = a.x; a.x = nil;"
+                        "  garbage = Cell();"
+                        "  a.x = b.x; b.x = nil; } }";
+    ASSERT_EQUAL(INTERPRET_OK, interpret(&vm, setup, false));
+    collect(&vm);
+    Value cell = NIL_VAL;
+    getField(AS_INSTANCE(global(&vm, "a")), copyString(&vm, "x", 1), &cell);
+    for (int i = 0; i < 4; i++) {
+        startCollection();
+        ASSERT_EQUAL(INTERPRET_OK, interpret(&vm, "churn();", false));
+        finishCollection();
+    }
+    ASSERT_EQUAL(INTERPRET_OK, interpret(&vm, "var got = a.x.v;", false));
+
+    ASSERT(inHeap(&vm, AS_OBJ(cell)));
+    ASSERT(IS_STRING(global(&vm, "got")));
+    ASSERT_STRING_EQUAL("keep", AS_CSTRING(global(&vm, "got")));
+}
+
+TEST(revivesInternedStrings) {
+    ASSERT_EQUAL(INTERPRET_OK, interpret(&vm, "var holder = Box();", false));
+    ObjString* name = copyString(&vm, "revived", 7);
+    // Old, unreachable once popped.
+    push(&vm, OBJ_VAL(name));
+    collect(&vm);
+    pop(&vm);
+    ObjInstance* holder = AS_INSTANCE(global(&vm, "holder"));
+    ObjString* field = copyString(&vm, "s", 1);
+    setField(&vm, holder, field, NIL_VAL);
+
+    startCollection();
+    // Scanned, so the string stored next is not traced through the holder.
+    snapshotBarrier(&vm, &holder->obj);
+    // Unreachable when the collection started, interned still unless the
+    // marking is over already.
+    ObjString* found = copyString(&vm, "revived", 7);
+    setField(&vm, holder, field, OBJ_VAL(found));
+    finishCollection();
+    ASSERT(inHeap(&vm, &found->obj));
+    // The old one is freed unless revived, its cell may be reused since.
+    ASSERT_EQUAL(1, stringsHolding("revived"));
+}
+
+TEST(minorFinishesConcurrentCollection) {
+    startCollection();
+    ASSERT(vm.gcPhase != GC_IDLE);
+    collectYoung(&vm);
+    ASSERT_EQUAL(GC_IDLE, vm.gcPhase);
+    ASSERT_EQUAL(0, vm.rememberedCount);
+}
+
+int main() {
+    initVM(&vm);
+    vm.gcConcurrent = true;
+    holdCollections(&vm);
+
+    RUN_TEST(marksOnThread);
+    RUN_TEST(allocatesBlack);
+    RUN_TEST(barrierScansBeforeStores);
+    RUN_TEST(storesDuringMarking);
+    RUN_TEST(revivesInternedStrings);
+    RUN_TEST(minorFinishesConcurrentCollection);
+
+    freeVM(&vm);
+    return 0;
+}
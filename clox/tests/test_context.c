@@ -0,0 +1,134 @@
+#include <pthread.h>
+#include <stdio.h>
+#include "../object.h"
+#include "../vm.h"
+#include "test_utils.c"
+
+TEST(separateGlobals) {
+    VM first, second;
+    initVM(&first);
+    initVM(&second);
+
+    ASSERT_EQUAL(INTERPRET_OK, interpret(&first, "var x = 1;", false));
+    ASSERT_EQUAL(INTERPRET_OK, interpret(&second, "var x = \"two\";", false));
+    ASSERT_EQUAL(INTERPRET_OK, interpret(&first, "x = x + 1;", false));
+
+    ASSERT_EQUAL(2.0, AS_NUMBER(global(&first, "x")));
+    ASSERT_STRING_EQUAL("two", AS_CSTRING(global(&second, "x")));
+
+    freeVM(&first);
+    freeVM(&second);
+}
+
+TEST(compileErrorStaysLocal) {
+    VM broken, fine;
+    initVM(&broken);
+    initVM(&fine);
+
+    ASSERT_EQUAL(INTERPRET_COMPILE_ERROR, interpret(&broken, "var = ;", false));
+    ASSERT_EQUAL(INTERPRET_OK, interpret(&fine, "var y = 3;", false));
+    ASSERT(broken.parser == NULL);
+    ASSERT_EQUAL(3.0, AS_NUMBER(global(&fine, "y")));
+
+    freeVM(&broken);
+    freeVM(&fine);
+}
+
+TEST(loadedCodeFindsItsGlobals) {
+    VM saving, loading;
+    initVM(&saving);
+    initVM(&loading);
+
+    // Slots other than those of the VM that saved the code.
+    ASSERT_EQUAL(INTERPRET_OK,
+                 interpret(&loading, "var other = 1; var more = 2;", false));
+    ASSERT_EQUAL(INTERPRET_OK,
+                 interpret(&saving,
+                           "var x = 40; fun add(n) { return x + n; }"
+                           "var y = add(2);",
+                           true));
+    ObjFunction* function = readFunctionFromFile(&loading, "out.x7");
+    remove("out.x7");
+    ASSERT(function != NULL);
+    push(&loading, OBJ_VAL(function));
+    ObjClosure* closure = newClosure(&loading, function);
+    pop(&loading);
+    push(&loading, OBJ_VAL(closure));
+    ASSERT(callValue(&loading, OBJ_VAL(closure), 0));
+    ASSERT_EQUAL(INTERPRET_OK, run(&loading));
+
+    ASSERT_EQUAL(42.0, AS_NUMBER(global(&loading, "y")));
+    ASSERT_EQUAL(1.0, AS_NUMBER(global(&loading, "other")));
+    ASSERT_EQUAL(2.0, AS_NUMBER(global(&loading, "more")));
+
+    freeVM(&saving);
+    freeVM(&loading);
+}
+
+TEST(unknownOpcode) {
+    VM vm;
+    initVM(&vm);
+    // A byte no opcode has, as corrupt bytecode from a file would hold.
+    ObjFunction* function = newFunction(&vm);
+    push(&vm, OBJ_VAL(function));
+    writeChunk(&vm, &function->chunk, UINT8_MAX, 1);
+    writeChunk(&vm, &function->chunk, OP_RETURN, 1);
+    ObjClosure* closure = newClosure(&vm, function);
+    pop(&vm);
+    push(&vm, OBJ_VAL(closure));
+    ASSERT(callValue(&vm, OBJ_VAL(closure), 0));
+    ASSERT_EQUAL(INTERPRET_RUNTIME_ERROR, run(&vm));
+
+    freeVM(&vm);
+}
+
+typedef struct {
+    VM vm;
+    int seed;
+    InterpretResult result;
+    double total;
+} Worker;
+
+static void* work(void* arg) {
+    Worker* worker = arg;
+    char source[256];
+    // Allocates enough strings and instances to collect several times.
+    snprintf(source, sizeof(source),
+             "class Box { init(n) { this.n = n; } }"
+             "var total = 0;"
+             "for (var i = 0; i < 20000; i = i + 1) {"
+             "  var box = Box(i + %d); var s = \"s\" + \"t\";"
+             "  total = total + box.n;"
+             "}",
+             worker->seed);
+    initVM(&worker->vm);
+    worker->result = interpret(&worker->vm, source, false);
+    worker->total = AS_NUMBER(global(&worker->vm, "total"));
+    freeVM(&worker->vm);
+    return NULL;
+}
+
+TEST(threads) {
+    Worker workers[4];
+    pthread_t threads[4];
+    for (int i = 0; i < 4; i++) {
+        workers[i].seed = i;
+        pthread_create(&threads[i], NULL, work, &workers[i]);
+    }
+    for (int i = 0; i < 4; i++)
+        pthread_join(threads[i], NULL);
+
+    for (int i = 0; i < 4; i++) {
+        ASSERT_EQUAL(INTERPRET_OK, workers[i].result);
+        ASSERT_EQUAL(199990000.0 + 20000.0 * i, workers[i].total);
+    }
+}
+
+int main() {
+    RUN_TEST(separateGlobals);
+    RUN_TEST(compileErrorStaysLocal);
+    RUN_TEST(loadedCodeFindsItsGlobals);
+    RUN_TEST(unknownOpcode);
+    RUN_TEST(threads);
+    return 0;
+}
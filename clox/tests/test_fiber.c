@@ -0,0 +1,122 @@
+#include <stdio.h>
+#include "../object.h"
+#include "../vm.h"
+#include "gc_utils.c"
+
+static VM vm;
+
+TEST(generator) {
+    const char* source = "fun count() { for (var i = 0; i < 3; i = i + 1)"
+                         "  yield(i); return \"end\"; }"
+                         "var f = fiber(count);"
+                         "var a = resume(f); var b = resume(f);"
+                         "var c = resume(f); var d = resume(f);";
+    ASSERT_EQUAL(INTERPRET_OK, interpret(&vm, source, false));
+
+    ASSERT_EQUAL(0.0, AS_NUMBER(global(&vm, "a")));
+    ASSERT_EQUAL(2.0, AS_NUMBER(global(&vm, "c")));
+    ASSERT_STRING_EQUAL("end", AS_CSTRING(global(&vm, "d")));
+    ASSERT_EQUAL(FIBER_DONE, AS_FIBER(global(&vm, "f"))->state);
+    ASSERT(vm.fiber == NULL);
+}
+
+TEST(valuesBothWays) {
+    // The first resume() passes the argument, later ones what yield()
+    // returns.
+    const char* source = "fun doubler(x) { while (true) x = yield(x * 2); }"
+                         "var g = fiber(doubler);"
+                         "var first = resume(g, 1); var second = resume(g, 5);";
+    ASSERT_EQUAL(INTERPRET_OK, interpret(&vm, source, false));
+
+    ASSERT_EQUAL(2.0, AS_NUMBER(global(&vm, "first")));
+    ASSERT_EQUAL(10.0, AS_NUMBER(global(&vm, "second")));
+    ASSERT_EQUAL(FIBER_SUSPENDED, AS_FIBER(global(&vm, "g"))->state);
+}
+
+TEST(upvaluesStayWithTheirFiber) {
+    // A closure reads a local of a suspended fiber, then the fiber's stack
+    // is collected only once the closure is gone.
+    const char* source = "var getter;"
+                         "fun holder() { var local = 1;"
+                         "  fun get() { return local; } getter = get;"
+                         "  yield(); local = 42; yield(); }"
+                         "var h = fiber(holder); resume(h);"
+                         "var before = getter(); resume(h);"
+                         "var after = getter(); h = nil;";
+    ASSERT_EQUAL(INTERPRET_OK, interpret(&vm, source, false));
+    collectYoung(&vm);
+    collectGarbage(&vm);
+    ASSERT_EQUAL(INTERPRET_OK,
+                 interpret(&vm, "var late = getter();", false));
+
+    ASSERT_EQUAL(1.0, AS_NUMBER(global(&vm, "before")));
+    ASSERT_EQUAL(42.0, AS_NUMBER(global(&vm, "after")));
+    ASSERT_EQUAL(42.0, AS_NUMBER(global(&vm, "late")));
+}
+
+TEST(stacksGrowPerFiber) {
+    const char* source = "fun depth(n) { if (n == 0) { yield(0); return 0; }"
+                         "  return 1 + depth(n - 1); }"
+                         "fun deep() { var result = depth(2000);"
+                         "  return result; }"
+                         "var d = fiber(deep); resume(d);";
+    ASSERT_EQUAL(INTERPRET_OK, interpret(&vm, source, false));
+
+    ObjFiber* fiber = AS_FIBER(global(&vm, "d"));
+    ASSERT(fiber->frameCapacity > 2000);
+    ASSERT_EQUAL(2002, fiber->frameCount);
+    ASSERT(vm.frameCapacity < 2000);
+
+    ASSERT_EQUAL(INTERPRET_OK,
+                 interpret(&vm, "var depthResult = resume(d);", false));
+    ASSERT_EQUAL(2000.0, AS_NUMBER(global(&vm, "depthResult")));
+}
+
+TEST(stackGrowthCounted) {
+    holdCollections(&vm);
+    size_t before = vm.bytesAllocated;
+    ASSERT_EQUAL(INTERPRET_OK,
+                 interpret(&vm, "var g = fiber(deep); resume(g);", false));
+    ObjFiber* fiber = AS_FIBER(global(&vm, "g"));
+    size_t stacks = sizeof(CallFrame) * fiber->frameCapacity +
+                    sizeof(Value) * fiber->stackCapacity;
+    ASSERT(vm.bytesAllocated - before >= stacks);
+
+    ASSERT_EQUAL(INTERPRET_OK, interpret(&vm, "g = nil;", false));
+    size_t held = vm.bytesAllocated;
+    collect(&vm);
+    ASSERT(held - vm.bytesAllocated >= stacks);
+}
+
+TEST(errors) {
+    ASSERT_EQUAL(INTERPRET_RUNTIME_ERROR, interpret(&vm, "yield(1);", false));
+    ASSERT_EQUAL(INTERPRET_RUNTIME_ERROR,
+                 interpret(&vm,
+                           "fun once() {} var o = fiber(once);"
+                           "resume(o); resume(o);",
+                           false));
+    ASSERT_EQUAL(INTERPRET_RUNTIME_ERROR,
+                 interpret(&vm,
+                           "fun fails() { yield(); return nil + 1; }"
+                           "var e = fiber(fails); resume(e); resume(e);",
+                           false));
+
+    // Failing inside a fiber unwinds back to the VM's own stacks.
+    ASSERT(vm.fiber == NULL);
+    ASSERT_EQUAL(0, vm.frameCount);
+    ASSERT_EQUAL(FIBER_DONE, AS_FIBER(global(&vm, "e"))->state);
+}
+
+int main() {
+    initVM(&vm);
+
+    RUN_TEST(generator);
+    RUN_TEST(valuesBothWays);
+    RUN_TEST(upvaluesStayWithTheirFiber);
+    RUN_TEST(stacksGrowPerFiber);
+    RUN_TEST(stackGrowthCounted);
+    RUN_TEST(errors);
+
+    freeVM(&vm);
+    return 0;
+}
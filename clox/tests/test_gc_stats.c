@@ -0,0 +1,87 @@
+// open_memstream is POSIX, strict -std modes hide it.
+#define _DEFAULT_SOURCE
+
+#include <stdio.h>
+#include "../debug.h"
+#include "../object.h"
+#include "../vm.h"
+#include "test_utils.c"
+
+static VM vm;
+
+// A number field of the instance gcStats() returned into global "stats".
+static double stat(const char* name) {
+    Value value = NIL_VAL;
+    getField(AS_INSTANCE(global(&vm, "stats")),
+             copyString(&vm, name, (int)strlen(name)), &value);
+    return IS_NUMBER(value) ? AS_NUMBER(value) : -1;
+}
+
+TEST(recordsEveryCollection) {
+    collectYoung(&vm);
+    collectGarbage(&vm);
+    GCStats* stats = &vm.gcStats;
+    ASSERT_EQUAL(2, stats->collections);
+    ASSERT_EQUAL(1, stats->minorCollections);
+    ASSERT(stats->totalPause >= stats->maxPause);
+    ASSERT(stats->maxPause >= stats->lastPause);
+    ASSERT_EQUAL(vm.bytesAllocated, stats->bytesAfter);
+    ASSERT_EQUAL(vm.strings.count, stats->strings);
+
+    uint64_t histogram = 0;
+    for (int bucket = 0; bucket < GC_PAUSE_BUCKETS; bucket++)
+        histogram += stats->pauses[bucket];
+    ASSERT_EQUAL(2, (int)histogram);
+    ASSERT(gcPausePercentile(&vm, 0.5) <= gcPausePercentile(&vm, 0.99));
+    ASSERT(gcPausePercentile(&vm, 0.99) <= stats->maxPause);
+}
+
+TEST(countsFreedObjects) {
+    const char* source = "class Box {}"
+                         "for (var i = 0; i < 100; i = i + 1) {"
+                         "  var box = Box(); box.s = \"x\" + \"y\"; }";
+    // Collections may run during interpret() already.
+    uint64_t instances = vm.gcStats.freed[OBJ_INSTANCE];
+    ASSERT_EQUAL(INTERPRET_OK, interpret(&vm, source, false));
+    collectGarbage(&vm);
+    ASSERT_EQUAL(100, (int)(vm.gcStats.freed[OBJ_INSTANCE] - instances));
+    // Box itself is still reachable, through the globals.
+    ASSERT(vm.gcStats.maxGrayPeak > 0);
+}
+
+TEST(nativeReturnsInstance) {
+    const char* source = "var stats = gcStats();";
+    ASSERT_EQUAL(INTERPRET_OK, interpret(&vm, source, false));
+    ASSERT(IS_INSTANCE(global(&vm, "stats")));
+    ASSERT(stat("collections") >= 3);
+    ASSERT(stat("promoted") > 0);
+    ASSERT(stat("freedInstances") >= 100);
+    ASSERT(stat("maxPause") >= stat("p99Pause"));
+    ASSERT(stat("bytesAllocated") > 0);
+    ASSERT(stat("grayPeak") > 0);
+}
+
+TEST(printsSummary) {
+    char* text = NULL;
+    size_t size = 0;
+    FILE* out = open_memstream(&text, &size);
+    printGCStats(&vm, out);
+    fclose(out);
+
+    ASSERT(strstr(text, "== gc ==\ncollections ") != NULL);
+    ASSERT(strstr(text, "pauses < ") != NULL);
+    ASSERT(strstr(text, "freed instance ") != NULL);
+    free(text);
+}
+
+int main() {
+    initVM(&vm);
+
+    RUN_TEST(recordsEveryCollection);
+    RUN_TEST(countsFreedObjects);
+    RUN_TEST(nativeReturnsInstance);
+    RUN_TEST(printsSummary);
+
+    freeVM(&vm);
+    return 0;
+}
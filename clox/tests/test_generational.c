@@ -0,0 +1,134 @@
+#include <stdio.h>
+#include "../object.h"
+#include "../vm.h"
+#include "gc_utils.c"
+
+static VM vm;
+
+// Runs setup and promotes what it left, then runs store, which puts a young
+// string where only an old object holds it, and reads it back after a minor
+// collection into global "got".
+static bool survivesMinor(const char* setup, const char* store,
+                          const char* read) {
+    if (interpret(&vm, setup, false) != INTERPRET_OK)
+        return false;
+    collect(&vm);
+    if (interpret(&vm, store, false) != INTERPRET_OK)
+        return false;
+    collectYoung(&vm);
+    if (vm.rememberedCount != 0)
+        return false;
+    if (interpret(&vm, read, false) != INTERPRET_OK)
+        return false;
+    Value got = global(&vm, "got");
+    return IS_STRING(got) && AS_OBJ(got)->old && inHeap(&vm, AS_OBJ(got)) &&
+           strcmp(AS_CSTRING(got), "ab") == 0;
+}
+
+TEST(minorFreesYoungGarbage) {
+    ObjString* name = copyString(&vm, "Young", 5);
+    push(&vm, OBJ_VAL(name));
+    ObjClass* klass = newClass(&vm, name);
+    push(&vm, OBJ_VAL(klass));
+    ObjInstance* garbage = newInstance(&vm, klass);
+    collectYoung(&vm);
+
+    ASSERT(!inHeap(&vm, (Obj*)garbage));
+    ASSERT(inHeap(&vm, (Obj*)klass));
+    ASSERT(klass->obj.old);
+    ASSERT(!objectMarked(&klass->obj));
+    pop(&vm);
+    pop(&vm);
+}
+
+TEST(minorKeepsOldGarbage) {
+    ObjString* name = copyString(&vm, "Old", 3);
+    push(&vm, OBJ_VAL(name));
+    collectYoung(&vm);
+    pop(&vm);
+    uint64_t promoted = vm.gcStats.promoted;
+
+    collectYoung(&vm);
+    ASSERT(inHeap(&vm, (Obj*)name));
+    ASSERT_EQUAL(promoted, vm.gcStats.promoted);
+    collect(&vm);
+    ASSERT(!inHeap(&vm, (Obj*)name));
+}
+
+TEST(fieldStores) {
+    ASSERT(survivesMinor("class Box {} var box = Box(); box.s = nil;",
+                         "box.s = \"a\" + \"b\";", "var got = box.s;"));
+}
+
+TEST(cachedFieldStores) {
+    // Past the first store the slot comes from the site's inline cache.
+    ASSERT(survivesMinor("class Cell {} var cells = Cell(); cells.s = nil;"
+                         "fun put(c, v) { c.s = v; }"
+                         "for (var i = 0; i < 10; i = i + 1) put(Cell(), i);",
+                         "put(cells, \"a\" + \"b\");", "var got = cells.s;"));
+}
+
+TEST(closedUpvalues) {
+    ASSERT(survivesMinor("var set; var get;"
+                         "{ var v; fun s(x) { v = x; } fun g() { return v; }"
+                         "  set = s; get = g; }",
+                         "set(\"a\" + \"b\");", "var got = get();"));
+}
+
+TEST(suspendedFibers) {
+    // Only the fiber's own stack holds the string while it is suspended.
+    ASSERT(survivesMinor("fun hold() { var s = yield(); yield(); yield(s); }"
+                         "var holder = fiber(hold); resume(holder);",
+                         "resume(holder, \"a\" + \"b\");",
+                         "var got = resume(holder);"));
+}
+
+TEST(rememberedSetIsCleared) {
+    ASSERT_EQUAL(INTERPRET_OK,
+                 interpret(&vm, "class Pair {} var pair = Pair();", false));
+    collect(&vm);
+    ASSERT_EQUAL(INTERPRET_OK,
+                 interpret(&vm, "pair.left = \"x\" + \"y\";", false));
+    Obj* pair = AS_OBJ(global(&vm, "pair"));
+    ASSERT(pair->remembered);
+    ASSERT(vm.rememberedCount > 0);
+
+    collect(&vm);
+    ASSERT(!pair->remembered);
+    ASSERT_EQUAL(0, vm.rememberedCount);
+}
+
+TEST(smallHeapRunsMinors) {
+    // Scheduled from a heap far smaller than the nursery.
+    collectGarbage(&vm);
+    int collections = vm.gcStats.collections;
+    int minor = vm.gcStats.minorCollections;
+    ASSERT_EQUAL(INTERPRET_OK,
+                 interpret(&vm,
+                           "class Box {}"
+                           "for (var i = 0; i < 100000; i = i + 1) Box();",
+                           false));
+    holdCollections(&vm);
+
+    minor = vm.gcStats.minorCollections - minor;
+    int full = vm.gcStats.collections - collections - minor;
+    ASSERT(minor > 10);
+    ASSERT(minor > 10 * full);
+}
+
+int main() {
+    initVM(&vm);
+    holdCollections(&vm);
+
+    RUN_TEST(minorFreesYoungGarbage);
+    RUN_TEST(minorKeepsOldGarbage);
+    RUN_TEST(fieldStores);
+    RUN_TEST(cachedFieldStores);
+    RUN_TEST(closedUpvalues);
+    RUN_TEST(suspendedFibers);
+    RUN_TEST(rememberedSetIsCleared);
+    RUN_TEST(smallHeapRunsMinors);
+
+    freeVM(&vm);
+    return 0;
+}
@@ -0,0 +1,120 @@
+#include <stdio.h>
+#include "../object.h"
+#include "../vm.h"
+#include "gc_utils.c"
+
+static VM vm;
+
+static int pageCount(int sizeClass) {
+    int count = 0;
+    for (Page* page = vm.heap.pages[sizeClass]; page != NULL;
+         page = page->next)
+        count++;
+    return count;
+}
+
+static int instanceClass() {
+    return pageOf(AS_OBJ(global(&vm, "box")))->sizeClass;
+}
+
+TEST(walksEveryObject) {
+    ASSERT_EQUAL(INTERPRET_OK,
+                 interpret(&vm,
+                           "class Box {} var box = Box(); var boxes = nil;"
+                           "for (var i = 0; i < 5000; i = i + 1) {"
+                           "  var next = Box(); next.next = boxes;"
+                           "  boxes = next; }",
+                           false));
+    int instances = 0;
+    for (Obj* object = nextObject(&vm.heap, NULL); object != NULL;
+         object = nextObject(&vm.heap, object)) {
+        if (object->type == OBJ_INSTANCE)
+            instances++;
+    }
+    ASSERT_EQUAL(5001, instances);
+}
+
+TEST(freesEmptyPages) {
+    int pages = pageCount(instanceClass());
+    ASSERT(pages > 1);
+    ASSERT_EQUAL(INTERPRET_OK, interpret(&vm, "boxes = nil;", false));
+    collect(&vm);
+    // Down to the page holding the box, and an empty one kept unless that
+    // was swept first.
+    ASSERT(pageCount(instanceClass()) <= 2);
+}
+
+TEST(reusesFreedCells) {
+    const char* source = "for (var i = 0; i < 2000; i = i + 1) Box();";
+    ASSERT_EQUAL(INTERPRET_OK, interpret(&vm, source, false));
+    int pages = pageCount(instanceClass());
+    collect(&vm);
+    ASSERT_EQUAL(INTERPRET_OK, interpret(&vm, source, false));
+    ASSERT_EQUAL(pages, pageCount(instanceClass()));
+}
+
+TEST(sweepsOnAllocation) {
+    collect(&vm);
+    uint64_t instances = vm.gcStats.freed[OBJ_INSTANCE];
+    uint64_t closures = vm.gcStats.freed[OBJ_CLOSURE];
+    ASSERT_EQUAL(INTERPRET_OK,
+                 interpret(&vm,
+                           "for (var i = 0; i < 20000; i = i + 1) {"
+                           "  Box(); fun f() {} }",
+                           false));
+    // Marked at once by the step this allocation runs, which then sweeps
+    // pages of instances only, until one has a free cell.
+    vm.gcStepSize = 0;
+    vm.nextGC = 0;
+    newInstance(&vm, AS_CLASS(global(&vm, "Box")));
+    holdCollections(&vm);
+    ASSERT_EQUAL(GC_SWEEP, vm.gcPhase);
+    ASSERT(vm.gcStats.freed[OBJ_INSTANCE] > instances);
+    ASSERT(vm.gcStats.freed[OBJ_INSTANCE] < instances + 20000);
+    ASSERT_EQUAL(closures, vm.gcStats.freed[OBJ_CLOSURE]);
+
+    // The one allocated as well.
+    collect(&vm);
+    ASSERT_EQUAL(instances + 20001, vm.gcStats.freed[OBJ_INSTANCE]);
+    ASSERT(vm.gcStats.freed[OBJ_CLOSURE] >= closures + 20000);
+    vm.gcStepSize = GC_STEP_SIZE;
+}
+
+TEST(largeObjectsGetPages) {
+    char chars[2000];
+    memset(chars, 'x', sizeof(chars));
+    ObjString* string = copyString(&vm, chars, sizeof(chars));
+    ASSERT_EQUAL(HEAP_LARGE, pageOf(&string->obj)->sizeClass);
+    ASSERT(vm.heap.pages[HEAP_LARGE] == pageOf(&string->obj));
+    collect(&vm);
+    ASSERT(vm.heap.pages[HEAP_LARGE] == NULL);
+}
+
+TEST(marksInBitmaps) {
+    ObjInstance* box = AS_INSTANCE(global(&vm, "box"));
+    vm.gcStepSize = 1;
+    vm.nextGC = 0;
+    newInstance(&vm, box->klass);
+    holdCollections(&vm);
+    // A root, marked as the collection started.
+    ASSERT_EQUAL(GC_MARK, vm.gcPhase);
+    ASSERT(objectMarked(&box->obj));
+    collect(&vm);
+    ASSERT(!objectMarked(&box->obj));
+    vm.gcStepSize = GC_STEP_SIZE;
+}
+
+int main() {
+    initVM(&vm);
+    holdCollections(&vm);
+
+    RUN_TEST(walksEveryObject);
+    RUN_TEST(freesEmptyPages);
+    RUN_TEST(reusesFreedCells);
+    RUN_TEST(sweepsOnAllocation);
+    RUN_TEST(largeObjectsGetPages);
+    RUN_TEST(marksInBitmaps);
+
+    freeVM(&vm);
+    return 0;
+}
@@ -0,0 +1,118 @@
+#include <stdio.h>
+#include "../object.h"
+#include "../vm.h"
+#include "gc_utils.c"
+
+static VM vm;
+
+// Starts a full collection on the next allocation.
+static void startCollection(int stepSize) {
+    vm.gcStepSize = stepSize;
+    vm.nextGC = 0;
+    allocate(&vm);
+    holdCollections(&vm);
+}
+
+TEST(stepsUntilDone) {
+    const char* source = "class Node {}"
+                         "var list = nil;"
+                         "for (var i = 0; i < 200; i = i + 1) {"
+                         "  var node = Node(); node.next = list; list = node; }";
+    ASSERT_EQUAL(INTERPRET_OK, interpret(&vm, source, false));
+    int collections = vm.gcStats.collections;
+    int steps = vm.gcStats.steps;
+
+    startCollection(10);
+    ASSERT_EQUAL(GC_MARK, vm.gcPhase);
+    while (vm.gcPhase != GC_IDLE)
+        allocate(&vm);
+    ASSERT_EQUAL(collections + 1, vm.gcStats.collections);
+    // 200 nodes to trace, 10 objects a step, then the pages to sweep.
+    ASSERT(vm.gcStats.steps - steps > 20);
+    ASSERT(swept(&vm));
+}
+
+TEST(stepSizeZeroMarksAtOnce) {
+    int collections = vm.gcStats.collections;
+    int steps = vm.gcStats.steps;
+    startCollection(0);
+    // Sweeping a page a step from then on.
+    ASSERT_EQUAL(GC_SWEEP, vm.gcPhase);
+    ASSERT_EQUAL(steps + 1, vm.gcStats.steps);
+    while (vm.gcPhase != GC_IDLE)
+        allocate(&vm);
+    ASSERT_EQUAL(collections + 1, vm.gcStats.collections);
+    ASSERT(swept(&vm));
+}
+
+TEST(storesDuringMarking) {
+    // The only path to the "keep" cell moves between a and b while the
+    // collection marks, a step per allocation. Either may have been traced
+    // already when the cell moves into it.
+    const char* setup = "class Cell {} var a = Cell(); var b = Cell();"
+                        "a.x = Cell(); a.x.v = \"keep\"; b.x = nil;"
+                        "fun churn() { for (var i = 0; i < 2000; i = i + 1) {"
+                        "  var garbage = Cell();"
+                        "  b.x = a.x; a.x = nil;"
+                        "  garbage = Cell();"
+                        "  a.x = b.x; b.x = nil; } }";
+    ASSERT_EQUAL(INTERPRET_OK, interpret(&vm, setup, false));
+    // Promoted, so that stores of the cell don't remember a or b.
+    collect(&vm);
+    Value cell = NIL_VAL;
+    getField(AS_INSTANCE(global(&vm, "a")), copyString(&vm, "x", 1), &cell);
+    // Each shift changes which of a and b is traced while holding the cell.
+    for (int shift = 0; shift < 4; shift++) {
+        startCollection(1);
+        for (int i = 0; i < shift; i++)
+            allocate(&vm);
+        ASSERT_EQUAL(INTERPRET_OK, interpret(&vm, "churn();", false));
+    }
+    collect(&vm);
+    ASSERT_EQUAL(INTERPRET_OK, interpret(&vm, "var got = a.x.v;", false));
+
+    ASSERT(inHeap(&vm, AS_OBJ(cell)));
+    ASSERT(IS_STRING(global(&vm, "got")));
+    ASSERT_STRING_EQUAL("keep", AS_CSTRING(global(&vm, "got")));
+}
+
+TEST(barrierMarksStores) {
+    ASSERT_EQUAL(INTERPRET_OK,
+                 interpret(&vm, "class Box {} var box = Box();", false));
+    ObjInstance* box = AS_INSTANCE(global(&vm, "box"));
+    startCollection(1);
+    // A root, marked as the collection started.
+    ASSERT(objectMarked(&box->obj));
+    ObjInstance* fresh = newInstance(&vm, box->klass);
+    ASSERT_EQUAL(GC_MARK, vm.gcPhase);
+    ASSERT(!objectMarked(&fresh->obj));
+
+    setField(&vm, box, copyString(&vm, "fresh", 5), OBJ_VAL(fresh));
+    ASSERT(objectMarked(&fresh->obj));
+    collect(&vm);
+    ASSERT(inHeap(&vm, &fresh->obj));
+}
+
+TEST(minorFinishesFullCollection) {
+    int minor = vm.gcStats.minorCollections;
+    startCollection(1);
+    ASSERT(vm.gcPhase != GC_IDLE);
+    collectYoung(&vm);
+    ASSERT_EQUAL(GC_IDLE, vm.gcPhase);
+    ASSERT_EQUAL(minor, vm.gcStats.minorCollections);
+    ASSERT_EQUAL(0, vm.rememberedCount);
+}
+
+int main() {
+    initVM(&vm);
+    holdCollections(&vm);
+
+    RUN_TEST(stepsUntilDone);
+    RUN_TEST(stepSizeZeroMarksAtOnce);
+    RUN_TEST(storesDuringMarking);
+    RUN_TEST(barrierMarksStores);
+    RUN_TEST(minorFinishesFullCollection);
+
+    freeVM(&vm);
+    return 0;
+}
@@ -0,0 +1,95 @@
+#include <stdio.h>
+#include "../jit.h"
+#include "../object.h"
+#include "../vm.h"
+#include "test_utils.c"
+
+static VM vm;
+
+#ifdef JIT
+
+// fun add(a, b) { return a + b; }, compiled right away.
+static ObjClosure* compileAdd() {
+    ObjFunction* function = newFunction(&vm);
+    function->arity = 2;
+    function->name = copyString(&vm, "add", 3);
+    writeChunk(&vm, &function->chunk, OP_GET_LOCAL, 1);
+    writeChunk(&vm, &function->chunk, 1, 1);
+    writeChunk(&vm, &function->chunk, OP_GET_LOCAL, 1);
+    writeChunk(&vm, &function->chunk, 2, 1);
+    writeChunk(&vm, &function->chunk, OP_ADD, 1);
+    writeChunk(&vm, &function->chunk, OP_RETURN, 1);
+    jitCompile(function);
+    return newClosure(&vm, function);
+}
+
+TEST(compileFunction) {
+    ObjClosure* closure = compileAdd();
+
+    ASSERT(closure->function->native != NULL);
+    ASSERT(closure->function->nativeSize > 0);
+}
+
+TEST(numberFastPath) {
+    ObjClosure* closure = compileAdd();
+
+    push(&vm, OBJ_VAL(closure));
+    push(&vm, NUMBER_VAL(1.5));
+    push(&vm, NUMBER_VAL(2));
+    ASSERT(callValue(&vm, OBJ_VAL(closure), 2));
+
+    ASSERT_EQUAL(0, vm.frameCount);
+    ASSERT_EQUAL(vm.stack + 1, vm.stackTop);
+    ASSERT_EQUAL(3.5, AS_NUMBER(pop(&vm)));
+}
+
+TEST(concatenateSlowPath) {
+    ObjClosure* closure = compileAdd();
+
+    push(&vm, OBJ_VAL(closure));
+    push(&vm, OBJ_VAL(copyString(&vm, "a", 1)));
+    push(&vm, NUMBER_VAL(1));
+    ASSERT(callValue(&vm, OBJ_VAL(closure), 2));
+
+    ASSERT_EQUAL(vm.stack + 1, vm.stackTop);
+    ASSERT_STRING_EQUAL("a1.0", AS_CSTRING(pop(&vm)));
+}
+
+TEST(hotFunction) {
+    ObjFunction* function = newFunction(&vm);
+    function->name = copyString(&vm, "nil", 3);
+    writeChunk(&vm, &function->chunk, OP_NIL, 1);
+    writeChunk(&vm, &function->chunk, OP_RETURN, 1);
+    ObjClosure* closure = newClosure(&vm, function);
+
+    for (int i = 0; i < JIT_THRESHOLD; i++) {
+        ASSERT(function->native == NULL);
+        push(&vm, OBJ_VAL(closure));
+        ASSERT(callValue(&vm, OBJ_VAL(closure), 0));
+        // Interpreted calls leave their frame to run(), which returns from
+        // it like from a script. Compiled ones have already returned.
+        if (vm.frameCount > 0) {
+            ASSERT_EQUAL(INTERPRET_OK, run(&vm));
+        } else {
+            ASSERT(IS_NIL(pop(&vm)));
+        }
+        ASSERT_EQUAL(vm.stack, vm.stackTop);
+    }
+    ASSERT(function->native != NULL);
+}
+
+#endif
+
+int main() {
+    initVM(&vm);
+
+#ifdef JIT
+    RUN_TEST(compileFunction);
+    RUN_TEST(numberFastPath);
+    RUN_TEST(concatenateSlowPath);
+    RUN_TEST(hotFunction);
+#endif
+
+    freeVM(&vm);
+    return 0;
+}
@@ -13,7 +13,7 @@ TEST(copyString) {
     const char* testStr = "Hello, World!";
     int length = strlen(testStr);
 
-    ObjString* str = copyString(testStr, length);
+    ObjString* str = copyString(&vm, testStr, length);
 
     ASSERT(str != NULL);
     ASSERT_EQUAL(str->length, length);
@@ -31,7 +31,7 @@ TEST(takeString) {
     strcpy(testStr, "Hello, World!");
     int length = strlen(testStr);
 
-    ObjString* str = takeString(testStr, length);
+    ObjString* str = takeString(&vm, testStr, length);
 
     ASSERT(str != NULL);
     ASSERT_EQUAL(str->length, length);
@@ -48,11 +48,11 @@ TEST(printObject) {
     const char* testStr = "Test String";
     int length = strlen(testStr);
 
-    ObjString* str = copyString(testStr, length);
+    ObjString* str = copyString(&vm, testStr, length);
     Value strValue = OBJ_VAL(str);
 
     printf("Printing object: ");
-    printObject(strValue);
+    printObject(stdout, strValue);
     printf("\n");
 
     freeVM(&vm);
@@ -0,0 +1,77 @@
+// open_memstream is POSIX, strict -std modes hide it.
+#define _DEFAULT_SOURCE
+
+#include <stdio.h>
+#include "../debug.h"
+#include "../object.h"
+#include "../vm.h"
+#include "test_utils.c"
+
+static VM vm;
+static OpcodeStats stats;
+
+static void resetStats() {
+    memset(&stats, 0, sizeof(stats));
+    stats.previous = -1;
+    vm.opcodeStats = &stats;
+}
+
+TEST(countsEveryCall) {
+    // Far past JIT_THRESHOLD, compiled code would skip the counting.
+    const char* source = "fun one() { return 1; }"
+                         "for (var i = 0; i < 3000; i = i + 1) one();";
+    resetStats();
+    ASSERT_EQUAL(INTERPRET_OK, interpret(&vm, source, false));
+
+    ObjFunction* one = AS_CLOSURE(global(&vm, "one"))->function;
+    ASSERT_EQUAL(3000 * 2, (int)one->executed);
+    ASSERT_EQUAL(3000, (int)stats.pairs[OP_CONSTANT][OP_RETURN]);
+    ASSERT(stats.counts[OP_CALL] >= 3000);
+
+    uint64_t total = 0;
+    for (int op = 0; op < UINT8_COUNT; op++)
+        total += stats.counts[op];
+    uint64_t pairs = 0;
+    for (int first = 0; first < UINT8_COUNT; first++) {
+        for (int second = 0; second < UINT8_COUNT; second++)
+            pairs += stats.pairs[first][second];
+    }
+    ASSERT_EQUAL(total - 1, pairs);
+}
+
+TEST(writesJson) {
+    resetStats();
+    ASSERT_EQUAL(INTERPRET_OK,
+                 interpret(&vm, "fun two() { return 2; } two();", false));
+
+    char* json = NULL;
+    size_t size = 0;
+    FILE* out = open_memstream(&json, &size);
+    writeOpcodeStats(&vm, out);
+    fclose(out);
+
+    ASSERT(strstr(json, "\"total\": ") != NULL);
+    ASSERT(strstr(json, "{\"first\": \"OP_CONSTANT\", "
+                        "\"second\": \"OP_RETURN\", \"count\": 1}") != NULL);
+    ASSERT(strstr(json, "{\"name\": \"two\", \"line\": 1, "
+                        "\"instructions\": 2}") != NULL);
+    free(json);
+}
+
+TEST(offByDefault) {
+    vm.opcodeStats = NULL;
+    ObjFunction* two = AS_CLOSURE(global(&vm, "two"))->function;
+    ASSERT_EQUAL(INTERPRET_OK, interpret(&vm, "two();", false));
+    ASSERT_EQUAL(2, (int)two->executed);
+}
+
+int main() {
+    initVM(&vm);
+
+    RUN_TEST(countsEveryCall);
+    RUN_TEST(writesJson);
+    RUN_TEST(offByDefault);
+
+    freeVM(&vm);
+    return 0;
+}
@@ -0,0 +1,143 @@
+#include <stdio.h>
+#include "../chunk.h"
+#include "../optimizer.h"
+#include "../vm.h"
+#include "test_utils.c"
+
+static VM vm;
+
+TEST(fuseAddLocals) {
+    Chunk chunk;
+    initChunk(&chunk);
+
+    writeChunk(&vm, &chunk, OP_GET_LOCAL, 1);
+    writeChunk(&vm, &chunk, 1, 1);
+    writeChunk(&vm, &chunk, OP_GET_LOCAL, 1);
+    writeChunk(&vm, &chunk, 2, 1);
+    writeChunk(&vm, &chunk, OP_ADD, 1);
+    writeChunk(&vm, &chunk, OP_POP, 2);
+    writeChunk(&vm, &chunk, OP_RETURN, 3);
+
+    optimizeChunk(&vm, &chunk);
+
+    ASSERT_EQUAL(5, chunk.count);
+    ASSERT_EQUAL(OP_ADD_LOCALS, chunk.code[0]);
+    ASSERT_EQUAL(1, chunk.code[1]);
+    ASSERT_EQUAL(2, chunk.code[2]);
+    ASSERT_EQUAL(OP_POP, chunk.code[3]);
+    ASSERT_EQUAL(OP_RETURN, chunk.code[4]);
+    ASSERT_EQUAL(1, getLine(&chunk, 0));
+    ASSERT_EQUAL(1, getLine(&chunk, 2));
+    ASSERT_EQUAL(2, getLine(&chunk, 3));
+    ASSERT_EQUAL(3, getLine(&chunk, 4));
+
+    freeChunk(&vm, &chunk);
+}
+
+TEST(fuseIncrementLocal) {
+    Chunk chunk;
+    initChunk(&chunk);
+
+    int constant = addConstant(&vm, &chunk, NUMBER_VAL(1));
+    writeChunk(&vm, &chunk, OP_GET_LOCAL, 1);
+    writeChunk(&vm, &chunk, 3, 1);
+    writeChunk(&vm, &chunk, OP_CONSTANT, 1);
+    writeChunk(&vm, &chunk, constant, 1);
+    writeChunk(&vm, &chunk, OP_ADD, 1);
+    writeChunk(&vm, &chunk, OP_SET_LOCAL, 1);
+    writeChunk(&vm, &chunk, 3, 1);
+    writeChunk(&vm, &chunk, OP_POP, 1);
+    writeChunk(&vm, &chunk, OP_RETURN, 1);
+
+    optimizeChunk(&vm, &chunk);
+
+    ASSERT_EQUAL(4, chunk.count);
+    ASSERT_EQUAL(OP_INCREMENT_LOCAL, chunk.code[0]);
+    ASSERT_EQUAL(3, chunk.code[1]);
+    ASSERT_EQUAL(constant, chunk.code[2]);
+    ASSERT_EQUAL(OP_RETURN, chunk.code[3]);
+
+    freeChunk(&vm, &chunk);
+}
+
+TEST(relocateJumps) {
+    Chunk chunk;
+    initChunk(&chunk);
+
+    // 0: LESS; JUMP_IF_FALSE -> 12; POP; GET_LOCAL 1; GET_LOCAL 2; ADD;
+    // POP; LOOP -> 0; POP; RETURN
+    writeChunk(&vm, &chunk, OP_LESS, 1);
+    writeChunk(&vm, &chunk, OP_JUMP_IF_FALSE, 1);
+    writeChunk(&vm, &chunk, 0, 1);
+    writeChunk(&vm, &chunk, 10, 1);
+    writeChunk(&vm, &chunk, OP_POP, 1);
+    writeChunk(&vm, &chunk, OP_GET_LOCAL, 2);
+    writeChunk(&vm, &chunk, 1, 2);
+    writeChunk(&vm, &chunk, OP_GET_LOCAL, 2);
+    writeChunk(&vm, &chunk, 2, 2);
+    writeChunk(&vm, &chunk, OP_ADD, 2);
+    writeChunk(&vm, &chunk, OP_POP, 2);
+    writeChunk(&vm, &chunk, OP_LOOP, 3);
+    writeChunk(&vm, &chunk, 0, 3);
+    writeChunk(&vm, &chunk, 14, 3);
+    writeChunk(&vm, &chunk, OP_POP, 4);
+    writeChunk(&vm, &chunk, OP_RETURN, 4);
+
+    optimizeChunk(&vm, &chunk);
+
+    // 0: LESS_JUMP_IF_FALSE -> 10; ADD_LOCALS 1 2; POP; LOOP -> 0; POP;
+    // RETURN
+    ASSERT_EQUAL(12, chunk.count);
+    ASSERT_EQUAL(OP_LESS_JUMP_IF_FALSE, chunk.code[0]);
+    ASSERT_EQUAL(7, (chunk.code[1] << 8) | chunk.code[2]);
+    ASSERT_EQUAL(OP_ADD_LOCALS, chunk.code[3]);
+    ASSERT_EQUAL(OP_POP, chunk.code[6]);
+    ASSERT_EQUAL(OP_LOOP, chunk.code[7]);
+    ASSERT_EQUAL(10, (chunk.code[8] << 8) | chunk.code[9]);
+    ASSERT_EQUAL(OP_POP, chunk.code[10]);
+    ASSERT_EQUAL(1, getLine(&chunk, 0));
+    ASSERT_EQUAL(2, getLine(&chunk, 3));
+    ASSERT_EQUAL(3, getLine(&chunk, 7));
+    ASSERT_EQUAL(4, getLine(&chunk, 10));
+
+    freeChunk(&vm, &chunk);
+}
+
+TEST(keepJumpTargets) {
+    Chunk chunk;
+    initChunk(&chunk);
+
+    // The jump lands on the second GET_LOCAL, the sequence can't be fused.
+    writeChunk(&vm, &chunk, OP_GET_LOCAL, 1);
+    writeChunk(&vm, &chunk, 1, 1);
+    writeChunk(&vm, &chunk, OP_JUMP, 1);
+    writeChunk(&vm, &chunk, 0, 1);
+    writeChunk(&vm, &chunk, 2, 1);
+    writeChunk(&vm, &chunk, OP_GET_LOCAL, 1);
+    writeChunk(&vm, &chunk, 1, 1);
+    writeChunk(&vm, &chunk, OP_GET_LOCAL, 1);
+    writeChunk(&vm, &chunk, 2, 1);
+    writeChunk(&vm, &chunk, OP_ADD, 1);
+    writeChunk(&vm, &chunk, OP_RETURN, 1);
+
+    optimizeChunk(&vm, &chunk);
+
+    ASSERT_EQUAL(11, chunk.count);
+    ASSERT_EQUAL(OP_GET_LOCAL, chunk.code[5]);
+    ASSERT_EQUAL(OP_GET_LOCAL, chunk.code[7]);
+    ASSERT_EQUAL(OP_ADD, chunk.code[9]);
+
+    freeChunk(&vm, &chunk);
+}
+
+int main() {
+    initVM(&vm);
+
+    RUN_TEST(fuseAddLocals);
+    RUN_TEST(fuseIncrementLocal);
+    RUN_TEST(relocateJumps);
+    RUN_TEST(keepJumpTargets);
+
+    freeVM(&vm);
+    return 0;
+}
@@ -0,0 +1,94 @@
+#include <stdio.h>
+#include "../object.h"
+#include "../vm.h"
+#include "gc_utils.c"
+
+static VM vm;
+
+static ObjString* fieldName(int i) {
+    char name[16];
+    int length = snprintf(name, sizeof(name), "f%d", i);
+    return copyString(&vm, name, length);
+}
+
+TEST(oneThreadMarksAlone) {
+    vm.gcThreads = 1;
+    collect(&vm);
+    ASSERT(vm.markPool == NULL);
+    vm.gcThreads = 4;
+}
+
+TEST(keepsWhatIsReachable) {
+    const char* source = "class Node {}"
+                         "var list = nil;"
+                         "for (var i = 0; i < 20000; i = i + 1) {"
+                         "  var node = Node(); node.next = list;"
+                         "  node.name = \"n\" + \"ode\"; list = node;"
+                         "  var garbage = Node(); garbage.next = node; }";
+    ASSERT_EQUAL(INTERPRET_OK, interpret(&vm, source, false));
+    uint64_t freed = vm.gcStats.freed[OBJ_INSTANCE];
+    collect(&vm);
+    ASSERT(vm.markPool != NULL);
+    ASSERT_EQUAL(20000, (int)(vm.gcStats.freed[OBJ_INSTANCE] - freed));
+    ASSERT(vm.gcStats.grayPeak > 0);
+
+    ASSERT_EQUAL(INTERPRET_OK,
+                 interpret(&vm,
+                           "var length = 0;"
+                           "for (var node = list; node != nil;"
+                           "     node = node.next) length = length + 1;"
+                           "list = nil;",
+                           false));
+    ASSERT_EQUAL(20000, (int)AS_NUMBER(global(&vm, "length")));
+    collect(&vm);
+    ASSERT_EQUAL(40000, (int)(vm.gcStats.freed[OBJ_INSTANCE] - freed));
+}
+
+TEST(splitsLongFieldTables) {
+    ASSERT_EQUAL(INTERPRET_OK,
+                 interpret(&vm, "class Box {} var box = Box();", false));
+    ObjInstance* box = AS_INSTANCE(global(&vm, "box"));
+    for (int i = 0; i < 5000; i++) {
+        ObjInstance* field = newInstance(&vm, box->klass);
+        setField(&vm, box, fieldName(i), OBJ_VAL(field));
+        newInstance(&vm, box->klass);
+    }
+    // Too many fields for a shape, in slices of a dictionary.
+    ASSERT(box->shape == NULL);
+    ASSERT(box->dictionary->capacity + 1 > 1024);
+
+    uint64_t freed = vm.gcStats.freed[OBJ_INSTANCE];
+    collect(&vm);
+    ASSERT_EQUAL(5000, (int)(vm.gcStats.freed[OBJ_INSTANCE] - freed));
+    for (int i = 0; i < 5000; i += 499) {
+        Value value = NIL_VAL;
+        ASSERT(getField(box, fieldName(i), &value));
+        ASSERT(IS_INSTANCE(value));
+    }
+}
+
+TEST(marksTheRestOfIncrementalCollections) {
+    uint64_t freed = vm.gcStats.freed[OBJ_INSTANCE];
+    ASSERT_EQUAL(INTERPRET_OK, interpret(&vm, "box = nil;", false));
+    // The first step marks everything with all the threads.
+    vm.nextGC = 0;
+    newInstance(&vm, AS_CLASS(global(&vm, "Box")));
+    holdCollections(&vm);
+    ASSERT_EQUAL(GC_SWEEP, vm.gcPhase);
+    collect(&vm);
+    ASSERT(vm.gcStats.freed[OBJ_INSTANCE] - freed >= 5001);
+}
+
+int main() {
+    initVM(&vm);
+    vm.gcThreads = 4;
+    holdCollections(&vm);
+
+    RUN_TEST(oneThreadMarksAlone);
+    RUN_TEST(keepsWhatIsReachable);
+    RUN_TEST(splitsLongFieldTables);
+    RUN_TEST(marksTheRestOfIncrementalCollections);
+
+    freeVM(&vm);
+    return 0;
+}
@@ -0,0 +1,73 @@
+#include <stdio.h>
+#include "../profile.h"
+#include "../vm.h"
+#include "test_utils.c"
+
+#define PROFILE_PATH "build/tests/test_profile.folded"
+
+static VM vm;
+
+// Samples charged to stacks containing frame, read back from the profile.
+static long samplesIn(const char* frame) {
+    FILE* file = fopen(PROFILE_PATH, "r");
+    if (file == NULL)
+        return -1;
+    long total = 0;
+    char line[4096];
+    while (fgets(line, sizeof(line), file) != NULL) {
+        char* count = strrchr(line, ' ');
+        if (count != NULL && strstr(line, frame) != NULL)
+            total += atol(count + 1);
+    }
+    fclose(file);
+    return total;
+}
+
+TEST(pendingTicksGoToTheNextCall) {
+    ASSERT(startProfiler(&vm));
+    // Ticks counted before the script starts are charged when it is called.
+    profilePending = 3;
+    ASSERT_EQUAL(INTERPRET_OK, interpret(&vm, "var x = 1;", false));
+    ASSERT(stopProfiler(&vm, PROFILE_PATH));
+
+    ASSERT_EQUAL(3, samplesIn("script:1 "));
+    ASSERT(vm.profiler == NULL);
+}
+
+TEST(hotFunctionIsSampled) {
+    const char* source = "fun spin(n) {\n"
+                         "  var total = 0;\n"
+                         "  for (var i = 0; i < n; i = i + 1)\n"
+                         "    total = total + i * 2;\n"
+                         "  return total;\n"
+                         "}\n"
+                         "var start = clock();\n"
+                         "while (clock() - start < 0.3) spin(1000);\n";
+    ASSERT(startProfiler(&vm));
+    ASSERT_EQUAL(INTERPRET_OK, interpret(&vm, source, false));
+    ASSERT(stopProfiler(&vm, PROFILE_PATH));
+
+    // Most of the time goes to spin(), whether interpreted or compiled.
+    long inSpin = samplesIn(";spin:");
+    long total = samplesIn("script:");
+    ASSERT(total > 0);
+    ASSERT(inSpin * 2 > total);
+}
+
+TEST(unprofiledVmDropsTicks) {
+    profilePending = 2;
+    ASSERT_EQUAL(INTERPRET_OK, interpret(&vm, "var y = 2;", false));
+    ASSERT_EQUAL(0, profilePending);
+}
+
+int main() {
+    initVM(&vm);
+
+    RUN_TEST(pendingTicksGoToTheNextCall);
+    RUN_TEST(hotFunctionIsSampled);
+    RUN_TEST(unprofiledVmDropsTicks);
+
+    remove(PROFILE_PATH);
+    freeVM(&vm);
+    return 0;
+}
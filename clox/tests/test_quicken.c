@@ -0,0 +1,125 @@
+#include <stdio.h>
+#include "../chunk.h"
+#include "../object.h"
+#include "../vm.h"
+#include "test_utils.c"
+
+static VM vm;
+
+static ObjFunction* function(const char* name) {
+    return AS_CLOSURE(global(&vm, name))->function;
+}
+
+// How many instructions of a global function are currently op.
+static int countOp(const char* name, OpCode op) {
+    Chunk* chunk = &function(name)->chunk;
+    int count = 0;
+    for (int offset = 0; offset < chunk->count;
+         offset += instructionLength(chunk, offset))
+        if (chunk->code[offset] == op)
+            count++;
+    return count;
+}
+
+TEST(addQuickened) {
+    const char* source = "fun add(a) { return a + 1; }"
+                         "var sum = add(1) + add(3);";
+    ASSERT_EQUAL(INTERPRET_OK, interpret(&vm, source, false));
+
+    ASSERT_EQUAL(1, countOp("add", OP_ADD_NUM));
+    ASSERT_EQUAL(0, countOp("add", OP_ADD));
+    ASSERT_EQUAL(0, function("add")->deopts);
+    ASSERT_EQUAL(6.0, AS_NUMBER(global(&vm, "sum")));
+}
+
+TEST(addDeoptimized) {
+    // id() keeps the peephole pass from fusing the add into OP_ADD_LOCALS.
+    const char* source = "fun id(x) { return x; }"
+                         "fun concat(a) { return id(a) + a; }"
+                         "var n = concat(1);"
+                         "var s = concat(\"a\");";
+    ASSERT_EQUAL(INTERPRET_OK, interpret(&vm, source, false));
+
+    // Strings do not requicken the instruction.
+    ASSERT_EQUAL(0, countOp("concat", OP_ADD_NUM));
+    ASSERT_EQUAL(1, countOp("concat", OP_ADD));
+    ASSERT_EQUAL(1, function("concat")->deopts);
+    ASSERT_EQUAL(2.0, AS_NUMBER(global(&vm, "n")));
+    ASSERT(IS_STRING(global(&vm, "s")));
+}
+
+TEST(propertySlot) {
+    const char* source = "class P { init() { this.x = 1; this.y = 2; } }"
+                         "fun getY(p) { return p.y; }"
+                         "var a = getY(P());"
+                         "var b = getY(P());";
+    ASSERT_EQUAL(INTERPRET_OK, interpret(&vm, source, false));
+    ASSERT_EQUAL(1, countOp("getY", OP_GET_PROPERTY_SLOT));
+    ASSERT_EQUAL(2.0, AS_NUMBER(global(&vm, "b")));
+
+    // Another shape reaching the quickened instruction deoptimizes it.
+    const char* other = "var r = P(); r.w = 5; r.y = 7;"
+                        "var c = getY(r);";
+    ASSERT_EQUAL(INTERPRET_OK, interpret(&vm, other, false));
+    ASSERT_EQUAL(0, countOp("getY", OP_GET_PROPERTY_SLOT));
+    ASSERT_EQUAL(1, countOp("getY", OP_GET_PROPERTY));
+    ASSERT_EQUAL(7.0, AS_NUMBER(global(&vm, "c")));
+}
+
+TEST(storeSlot) {
+    const char* source = "class S { init() { this.v = 0; } }"
+                         "fun set(s, v) { s.v = v; return s; }"
+                         "var s = set(S(), 1);"
+                         "var t = set(S(), 2);";
+    ASSERT_EQUAL(INTERPRET_OK, interpret(&vm, source, false));
+
+    ASSERT_EQUAL(1, countOp("set", OP_SET_PROPERTY_SLOT));
+    ASSERT_EQUAL(2.0, AS_NUMBER(AS_INSTANCE(global(&vm, "t"))->fields[0]));
+}
+
+TEST(methodQuickened) {
+    const char* source = "class M { init() { this.n = 3; } twice() {"
+                         "  return this.n * 2; } }"
+                         "class N < M { twice() { return 0; } }"
+                         "fun call(m) { return m.twice(); }"
+                         "var a = call(M());"
+                         "var b = call(M());";
+    ASSERT_EQUAL(INTERPRET_OK, interpret(&vm, source, false));
+    ASSERT_EQUAL(1, countOp("call", OP_INVOKE_METHOD));
+    ASSERT_EQUAL(6.0, AS_NUMBER(global(&vm, "b")));
+
+    // Same shape, other class.
+    ASSERT_EQUAL(INTERPRET_OK, interpret(&vm, "var c = call(N());", false));
+    ASSERT_EQUAL(0, countOp("call", OP_INVOKE_METHOD));
+    ASSERT_EQUAL(0.0, AS_NUMBER(global(&vm, "c")));
+}
+
+TEST(deoptLimit) {
+    const char* source = "fun id(x) { return x; }"
+                         "fun flip(a) { return id(a) + a; }"
+                         "for (var i = 0; i < 40; i = i + 1) {"
+                         "  flip(1);"
+                         "  flip(\"a\");"
+                         "}";
+    ASSERT_EQUAL(INTERPRET_OK, interpret(&vm, source, false));
+
+    // A function that keeps changing its mind stays generic.
+    ASSERT_EQUAL(QUICKEN_MAX_DEOPTS, function("flip")->deopts);
+    ASSERT_EQUAL(1, countOp("flip", OP_ADD));
+    ASSERT_EQUAL(INTERPRET_OK, interpret(&vm, "flip(1);", false));
+    ASSERT_EQUAL(1, countOp("flip", OP_ADD));
+}
+
+int main() {
+    initVM(&vm);
+
+    RUN_TEST(addQuickened);
+    RUN_TEST(addDeoptimized);
+    RUN_TEST(propertySlot);
+    RUN_TEST(storeSlot);
+    RUN_TEST(methodQuickened);
+    RUN_TEST(deoptLimit);
+
+    freeVM(&vm);
+    return 0;
+}
@@ -0,0 +1,100 @@
+#include <stdio.h>
+#include "../object.h"
+#include "../shape.h"
+#include "../vm.h"
+#include "test_utils.c"
+
+static VM vm;
+
+static ObjString* fieldName(int i) {
+    char name[16];
+    int length = snprintf(name, sizeof(name), "f%d", i);
+    return copyString(&vm, name, length);
+}
+
+static ObjInstance* instance() {
+    return newInstance(&vm, newClass(&vm, copyString(&vm, "Point", 5)));
+}
+
+TEST(sameOrderSharesShape) {
+    ObjInstance* a = instance();
+    ObjInstance* b = instance();
+    ASSERT(a->shape == vm.rootShape);
+
+    setField(&vm, a, copyString(&vm, "x", 1), NUMBER_VAL(1));
+    setField(&vm, a, copyString(&vm, "y", 1), NUMBER_VAL(2));
+    setField(&vm, b, copyString(&vm, "x", 1), NUMBER_VAL(3));
+    setField(&vm, b, copyString(&vm, "y", 1), NUMBER_VAL(4));
+
+    ASSERT(a->shape == b->shape);
+    ASSERT_EQUAL(2, a->shape->slotCount);
+    ASSERT_EQUAL(1, shapeFind(a->shape, copyString(&vm, "y", 1)));
+    ASSERT_EQUAL(4.0, AS_NUMBER(b->fields[1]));
+}
+
+TEST(otherOrderOtherShape) {
+    ObjInstance* a = instance();
+    ObjInstance* b = instance();
+
+    setField(&vm, a, copyString(&vm, "x", 1), NUMBER_VAL(1));
+    setField(&vm, a, copyString(&vm, "y", 1), NUMBER_VAL(2));
+    setField(&vm, b, copyString(&vm, "y", 1), NUMBER_VAL(2));
+    setField(&vm, b, copyString(&vm, "x", 1), NUMBER_VAL(1));
+
+    ASSERT(a->shape != b->shape);
+    ASSERT_EQUAL(0, shapeFind(b->shape, copyString(&vm, "y", 1)));
+}
+
+TEST(overwriteKeepsShape) {
+    ObjInstance* a = instance();
+    setField(&vm, a, copyString(&vm, "x", 1), NUMBER_VAL(1));
+    Shape* shape = a->shape;
+
+    setField(&vm, a, copyString(&vm, "x", 1), NIL_VAL);
+
+    Value value;
+    ASSERT(a->shape == shape);
+    ASSERT(getField(a, copyString(&vm, "x", 1), &value));
+    ASSERT(IS_NIL(value));
+    ASSERT(!getField(a, copyString(&vm, "z", 1), &value));
+}
+
+TEST(overflowSlots) {
+    ObjInstance* a = instance();
+    for (int i = 0; i < 10; i++)
+        setField(&vm, a, fieldName(i), NUMBER_VAL(i));
+
+    ASSERT_EQUAL(10, a->shape->slotCount);
+    ASSERT(a->overflowCapacity >= 10 - INSTANCE_INLINE_SLOTS);
+    for (int i = 0; i < 10; i++) {
+        Value value;
+        ASSERT(getField(a, fieldName(i), &value));
+        ASSERT_EQUAL((double)i, AS_NUMBER(value));
+    }
+}
+
+TEST(dictionaryMode) {
+    ObjInstance* a = instance();
+    for (int i = 0; i <= SHAPE_MAX_SLOTS; i++)
+        setField(&vm, a, fieldName(i), NUMBER_VAL(i));
+
+    ASSERT(a->shape == NULL);
+    for (int i = 0; i <= SHAPE_MAX_SLOTS; i++) {
+        Value value;
+        ASSERT(getField(a, fieldName(i), &value));
+        ASSERT_EQUAL((double)i, AS_NUMBER(value));
+    }
+}
+
+int main() {
+    initVM(&vm);
+
+    RUN_TEST(sameOrderSharesShape);
+    RUN_TEST(otherOrderOtherShape);
+    RUN_TEST(overwriteKeepsShape);
+    RUN_TEST(overflowSlots);
+    RUN_TEST(dictionaryMode);
+
+    freeVM(&vm);
+    return 0;
+}
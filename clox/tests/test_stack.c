@@ -0,0 +1,90 @@
+#include <stdio.h>
+#include "../object.h"
+#include "../vm.h"
+#include "test_utils.c"
+
+static VM vm;
+
+TEST(startsSmall) {
+    ASSERT_EQUAL(FRAMES_INITIAL, vm.frameCapacity);
+    ASSERT_EQUAL(STACK_INITIAL, vm.stackCapacity);
+    ASSERT(sizeof(VM) < 4096);
+}
+
+TEST(growsForDeepCalls) {
+    const char* source = "fun depth(n) { if (n == 0) return 0;"
+                         "  return 1 + depth(n - 1); }"
+                         "var result = depth(2000);";
+    ASSERT_EQUAL(INTERPRET_OK, interpret(&vm, source, false));
+
+    ASSERT_EQUAL(2000.0, AS_NUMBER(global(&vm, "result")));
+    ASSERT(vm.frameCapacity > 2000);
+    // The callee and its argument, for each frame.
+    ASSERT(vm.stackCapacity >= 2 * 2000 + STACK_HEADROOM);
+    ASSERT_EQUAL(vm.stack, vm.stackTop);
+}
+
+TEST(upvaluesFollowTheStack) {
+    // Upvalues still open in every frame while the stack is moved, closed
+    // once the frames return.
+    const char* source = "var first;"
+                         "fun dive(n) {"
+                         "  var local = n;"
+                         "  fun get() { return local; }"
+                         "  if (n == 0) { first = get; return 0; }"
+                         "  var below = dive(n - 1);"
+                         "  local = local + below;"
+                         "  return get();"
+                         "}"
+                         "var result = dive(3000);"
+                         "var bottom = first();";
+    ASSERT_EQUAL(INTERPRET_OK, interpret(&vm, source, false));
+
+    ASSERT_EQUAL(4501500.0, AS_NUMBER(global(&vm, "result")));
+    ASSERT_EQUAL(0.0, AS_NUMBER(global(&vm, "bottom")));
+    ASSERT(vm.openUpvalues == NULL);
+}
+
+TEST(deepOperandStack) {
+    // Every operand stays pushed until the innermost addition, a call to
+    // deep() needs more slots than any stack it could start on has left.
+    char source[8192];
+    int length = sprintf(source, "fun deep() { return ");
+    for (int i = 0; i < 1100; i++)
+        length += sprintf(source + length, "(1 + ");
+    length += sprintf(source + length, "1");
+    for (int i = 0; i < 1100; i++)
+        source[length++] = ')';
+    sprintf(source + length, "; }"
+                             "fun tail() { return deep(); }"
+                             "var result = deep(); var tailResult = tail();");
+    ASSERT_EQUAL(INTERPRET_OK, interpret(&vm, source, false));
+
+    ASSERT_EQUAL(1101.0, AS_NUMBER(global(&vm, "result")));
+    ASSERT_EQUAL(1101.0, AS_NUMBER(global(&vm, "tailResult")));
+    ASSERT(AS_CLOSURE(global(&vm, "deep"))->function->maxSlots > 1101);
+    ASSERT_EQUAL(vm.stack, vm.stackTop);
+}
+
+TEST(hardLimit) {
+    const char* source = "fun forever(n) { return 1 + forever(n + 1); }"
+                         "forever(0);";
+    ASSERT_EQUAL(INTERPRET_RUNTIME_ERROR, interpret(&vm, source, false));
+
+    ASSERT_EQUAL(FRAMES_MAX, vm.frameCapacity);
+    ASSERT(vm.stackCapacity <= STACK_MAX);
+    ASSERT_EQUAL(0, vm.frameCount);
+}
+
+int main() {
+    initVM(&vm);
+
+    RUN_TEST(startsSmall);
+    RUN_TEST(growsForDeepCalls);
+    RUN_TEST(upvaluesFollowTheStack);
+    RUN_TEST(deepOperandStack);
+    RUN_TEST(hardLimit);
+
+    freeVM(&vm);
+    return 0;
+}
@@ -3,10 +3,13 @@
 #include "table.h"
 #include "object.h"
 #include "memory.h"
+#include "vm.h"
 #include "test_utils.c"
 
+static VM vm;
+
 static ObjString* createTestString(const char* chars) {
-    return copyString(chars, strlen(chars));
+    return copyString(&vm, chars, strlen(chars));
 }
 
 TEST(InitTable) {
@@ -24,7 +27,7 @@ TEST(TableSetAndGet) {
     ObjString* key = createTestString("test_key");
     Value value = NUMBER_VAL(42.0);
 
-    bool isNewKey = tableSet(&table, key, value);
+    bool isNewKey = tableSet(&vm, &table, key, value);
     ASSERT(isNewKey);
 
     Value retrievedValue;
@@ -32,7 +35,7 @@ TEST(TableSetAndGet) {
     ASSERT(found);
     ASSERT_FLOAT_EQUAL(42.0, AS_NUMBER(retrievedValue), 0.0001);
 
-    freeTable(&table);
+    freeTable(&vm, &table);
 }
 
 TEST(TableDelete) {
@@ -40,7 +43,7 @@ TEST(TableDelete) {
     initTable(&table);
 
     ObjString* key = createTestString("delete_me");
-    tableSet(&table, key, NUMBER_VAL(1.0));
+    tableSet(&vm, &table, key, NUMBER_VAL(1.0));
 
     bool deleted = tableDelete(&table, key);
     ASSERT(deleted);
@@ -49,7 +52,7 @@ TEST(TableDelete) {
     bool found = tableGet(&table, key, &value);
     ASSERT(!found);
 
-    freeTable(&table);
+    freeTable(&vm, &table);
 }
 
 TEST(TableAddAll) {
@@ -59,10 +62,10 @@ TEST(TableAddAll) {
 
     ObjString* key1 = createTestString("key1");
     ObjString* key2 = createTestString("key2");
-    tableSet(&source, key1, NUMBER_VAL(1.0));
-    tableSet(&source, key2, NUMBER_VAL(2.0));
+    tableSet(&vm, &source, key1, NUMBER_VAL(1.0));
+    tableSet(&vm, &source, key2, NUMBER_VAL(2.0));
 
-    tableAddAll(&source, &destination);
+    tableAddAll(&vm, &source, &destination);
 
     Value value;
     ASSERT(tableGet(&destination, key1, &value));
@@ -70,8 +73,8 @@ TEST(TableAddAll) {
     ASSERT(tableGet(&destination, key2, &value));
     ASSERT_FLOAT_EQUAL(2.0, AS_NUMBER(value), 0.0001);
 
-    freeTable(&source);
-    freeTable(&destination);
+    freeTable(&vm, &source);
+    freeTable(&vm, &destination);
 }
 
 TEST(TableFindString) {
@@ -79,8 +82,8 @@ TEST(TableFindString) {
     initTable(&table);
 
     const char* testString = "findme";
-    ObjString* key = copyString(testString, strlen(testString));
-    tableSet(&table, key, NUMBER_VAL(1.0));
+    ObjString* key = copyString(&vm, testString, strlen(testString));
+    tableSet(&vm, &table, key, NUMBER_VAL(1.0));
 
     ObjString* found = tableFindString(&table, testString, strlen(testString), key->hash);
     ASSERT_EQUAL(key, found);
@@ -88,7 +91,7 @@ TEST(TableFindString) {
     found = tableFindString(&table, "notfound", 8, 0);
     ASSERT(found == NULL);
 
-    freeTable(&table);
+    freeTable(&vm, &table);
 }
 
 int main() {
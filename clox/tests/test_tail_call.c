@@ -0,0 +1,122 @@
+#include <stdio.h>
+#include "../chunk.h"
+#include "../object.h"
+#include "../vm.h"
+#include "test_utils.c"
+
+static VM vm;
+
+// How many instructions of a global function are op.
+static int countOp(const char* name, OpCode op) {
+    Chunk* chunk = &AS_CLOSURE(global(&vm, name))->function->chunk;
+    int count = 0;
+    for (int offset = 0; offset < chunk->count;
+         offset += instructionLength(chunk, offset))
+        if (chunk->code[offset] == op)
+            count++;
+    return count;
+}
+
+TEST(onlyReturnedCalls) {
+    const char* source = "fun id(x) { return x; }"
+                         "fun tail(x) { return id(x); }"
+                         "fun notTail(x) { return id(x) + 1; }"
+                         "fun branches(x) { return x ? id(1) : id(2); }";
+    ASSERT_EQUAL(INTERPRET_OK, interpret(&vm, source, false));
+
+    ASSERT_EQUAL(1, countOp("tail", OP_TAIL_CALL));
+    ASSERT_EQUAL(0, countOp("notTail", OP_TAIL_CALL));
+    ASSERT_EQUAL(1, countOp("notTail", OP_CALL));
+    // Only the last branch ends the expression.
+    ASSERT_EQUAL(1, countOp("branches", OP_TAIL_CALL));
+    ASSERT_EQUAL(1, countOp("branches", OP_CALL));
+}
+
+TEST(deepRecursion) {
+    const char* source = "fun count(n, acc) {"
+                         "  if (n == 0) return acc;"
+                         "  return count(n - 1, acc + 1);"
+                         "}"
+                         "var total = count(100000, 0);";
+    ASSERT_EQUAL(INTERPRET_OK, interpret(&vm, source, false));
+    ASSERT_EQUAL(100000.0, AS_NUMBER(global(&vm, "total")));
+    ASSERT_EQUAL(vm.stack, vm.stackTop);
+}
+
+TEST(mutualRecursion) {
+    const char* source = "fun even(n) { if (n == 0) return true;"
+                         "  return odd(n - 1); }"
+                         "fun odd(n) { if (n == 0) return false;"
+                         "  return even(n - 1); }"
+                         "var result = even(100001);";
+    ASSERT_EQUAL(INTERPRET_OK, interpret(&vm, source, false));
+    ASSERT(IS_BOOL(global(&vm, "result")) && !AS_BOOL(global(&vm, "result")));
+}
+
+TEST(upvaluesClosed) {
+    // Every get() keeps the n of the frame that was reused after it.
+    const char* source = "var sum = 0;"
+                         "fun loop(n, last) {"
+                         "  if (last != nil) sum = sum + last();"
+                         "  fun get() { return n; }"
+                         "  if (n == 0) return sum;"
+                         "  return loop(n - 1, get);"
+                         "}"
+                         "var result = loop(3000, nil);";
+    ASSERT_EQUAL(INTERPRET_OK, interpret(&vm, source, false));
+    ASSERT_EQUAL(4501500.0, AS_NUMBER(global(&vm, "result")));
+}
+
+TEST(otherCallees) {
+    // Natives and classes still get a call of their own.
+    const char* source = "class Box { init(v) { this.v = v; } }"
+                         "fun box(v) { return Box(v); }"
+                         "fun now() { return clock(); }"
+                         "var v = box(5).v;"
+                         "var t = now();";
+    ASSERT_EQUAL(INTERPRET_OK, interpret(&vm, source, false));
+    ASSERT_EQUAL(5.0, AS_NUMBER(global(&vm, "v")));
+    ASSERT(IS_NUMBER(global(&vm, "t")));
+}
+
+TEST(invokesKeepTheirFrame) {
+    // Method calls through this and super are not tail calls, so deep
+    // recursion through them still runs out of frames.
+    const char* source = "class Base { down(n) { if (n == 0) return 0;"
+                         "  return this.down(n - 1); } }"
+                         "class Sub < Base { down(n) { if (n == 0) return 0;"
+                         "  return super.down(n - 1); } }"
+                         "fun viaThis() { return Base().down(100000); }"
+                         "fun viaSuper(n) { return Sub().down(n); }";
+    ASSERT_EQUAL(INTERPRET_OK, interpret(&vm, source, false));
+    ASSERT_EQUAL(1, countOp("viaThis", OP_INVOKE));
+    ASSERT_EQUAL(0, countOp("viaThis", OP_TAIL_CALL));
+
+    ASSERT_EQUAL(INTERPRET_RUNTIME_ERROR,
+                 interpret(&vm, "viaThis();", false));
+    ASSERT_EQUAL(INTERPRET_OK, interpret(&vm, "viaSuper(2);", false));
+    ASSERT_EQUAL(INTERPRET_RUNTIME_ERROR,
+                 interpret(&vm, "viaSuper(100000);", false));
+}
+
+TEST(arityError) {
+    const char* source = "fun two(a, b) { return a; }"
+                         "fun one(a) { return two(a); }"
+                         "one(1);";
+    ASSERT_EQUAL(INTERPRET_RUNTIME_ERROR, interpret(&vm, source, false));
+}
+
+int main() {
+    initVM(&vm);
+
+    RUN_TEST(onlyReturnedCalls);
+    RUN_TEST(deepRecursion);
+    RUN_TEST(mutualRecursion);
+    RUN_TEST(upvaluesClosed);
+    RUN_TEST(otherCallees);
+    RUN_TEST(invokesKeepTheirFrame);
+    RUN_TEST(arityError);
+
+    freeVM(&vm);
+    return 0;
+}
@@ -0,0 +1,110 @@
+#include <stdio.h>
+#include "../object.h"
+#include "../trace.h"
+#include "../vm.h"
+#include "test_utils.c"
+
+static VM vm;
+
+#ifdef JIT
+
+static int compiledLoops() {
+    int count = 0;
+    for (int i = 0; i < HOT_LOOPS; i++) {
+        if (vm.hotLoops[i].trace != NULL)
+            count++;
+    }
+    return count;
+}
+
+TEST(hotLoopCompiles) {
+    const char* source = "fun f() {"
+                         "  var sum = 0;"
+                         "  for (var i = 0; i < 1000; i = i + 1)"
+                         "    sum = sum + i * 2;"
+                         "  return sum;"
+                         "}"
+                         "var result = f();";
+    ASSERT_EQUAL(INTERPRET_OK, interpret(&vm, source, false));
+
+    ASSERT(compiledLoops() > 0);
+    ASSERT(vm.recorder == NULL);
+    ASSERT_EQUAL(999000.0, AS_NUMBER(global(&vm, "result")));
+}
+
+TEST(guardSideExits) {
+    // The trace is recorded while x is a number, then x turns into a string
+    // and the next guard hands the loop back to the interpreter.
+    const char* source = "fun f() {"
+                         "  var x = 0;"
+                         "  var i = 0;"
+                         "  while (i < 500) {"
+                         "    if (i == 400) x = \"s\";"
+                         "    x = x + 1;"
+                         "    i = i + 1;"
+                         "  }"
+                         "  return x;"
+                         "}"
+                         "var result = f();";
+    ASSERT_EQUAL(INTERPRET_OK, interpret(&vm, source, false));
+
+    Value result = global(&vm, "result");
+    ASSERT(IS_STRING(result));
+    // "s" and a "1.0" per iteration from then on.
+    ASSERT_EQUAL(1 + 100 * 3, AS_STRING(result)->length);
+}
+
+TEST(branchSideExits) {
+    const char* source = "fun f() {"
+                         "  var late = 0;"
+                         "  for (var i = 0; i < 1000; i = i + 1)"
+                         "    if (i > 600) late = late + 1;"
+                         "  return late;"
+                         "}"
+                         "var result = f();";
+    ASSERT_EQUAL(INTERPRET_OK, interpret(&vm, source, false));
+
+    ASSERT_EQUAL(399.0, AS_NUMBER(global(&vm, "result")));
+}
+
+TEST(unsupportedLoopAborts) {
+    memset(vm.hotLoops, 0, sizeof(vm.hotLoops));
+    const char* source = "fun g() { return 1; }"
+                         "var n = 0;"
+                         "for (var i = 0; i < 1000; i = i + 1)"
+                         "  n = n + g();";
+    ASSERT_EQUAL(INTERPRET_OK, interpret(&vm, source, false));
+
+    ASSERT_EQUAL(0, compiledLoops());
+    ASSERT(vm.recorder == NULL);
+    ASSERT_EQUAL(1000.0, AS_NUMBER(global(&vm, "n")));
+}
+
+TEST(errorAfterSideExit) {
+    const char* source = "var i = 0;"
+                         "while (true) {"
+                         "  i = i + 1;"
+                         "  if (i == 500) i = -undefined;"
+                         "}";
+    ASSERT_EQUAL(INTERPRET_RUNTIME_ERROR, interpret(&vm, source, false));
+
+    ASSERT(vm.recorder == NULL);
+    ASSERT_EQUAL(vm.stack, vm.stackTop);
+}
+
+#endif
+
+int main() {
+    initVM(&vm);
+
+#ifdef JIT
+    RUN_TEST(hotLoopCompiles);
+    RUN_TEST(guardSideExits);
+    RUN_TEST(branchSideExits);
+    RUN_TEST(unsupportedLoopAborts);
+    RUN_TEST(errorAfterSideExit);
+#endif
+
+    freeVM(&vm);
+    return 0;
+}
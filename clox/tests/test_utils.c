@@ -8,6 +8,9 @@
 #include <stdbool.h>
 #include <math.h>
 
+#include "../object.h"
+#include "../vm.h"
+
 #define ANSI_COLOR_RED     "\x1b[31m"
 #define ANSI_COLOR_GREEN   "\x1b[32m"
 #define ANSI_COLOR_RESET   "\x1b[0m"
@@ -55,5 +58,11 @@ void run_test(void (*test_func)(), const char* test_name) {
     printf(ANSI_COLOR_GREEN "Passed\n" ANSI_COLOR_RESET);
 }
 
+// Value of the global variable name.
+static inline Value global(VM* vm, const char* name) {
+    int slot = globalSlot(vm, copyString(vm, name, (int)strlen(name)));
+    return vm->globalValues.values[slot];
+}
+
 #endif // TEST_UTILS_H
 
@@ -0,0 +1,905 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "assembler.h"
+#include "jit.h"
+#include "trace.h"
+
+#ifdef JIT
+
+// Instructions in one recorded iteration.
+#define MAX_TRACE 256
+// The stack of the trace lives in xmm0..xmm13 while it holds numbers.
+#define MAX_DEPTH 14
+
+// Registers pinned for the whole trace, all callee-saved.
+#define BASE RBX    // frame->slots + base: where the trace's stack starts.
+#define SLOTS R12   // frame->slots.
+#define FRAME R14   // The CallFrame* the trace was entered with.
+#define VM_BASE R15 // The VM running the trace.
+
+typedef struct {
+    uint8_t* ip;
+    bool numeric; // Every operand was a number.
+    bool taken;   // The branch was taken.
+} TraceStep;
+
+struct Recorder {
+    CallFrame* frame;
+    HotLoop* loop;
+    uint8_t* header;
+    int base; // Slots of the frame in use at the header.
+    bool numberAtEntry[UINT8_COUNT];
+    TraceStep steps[MAX_TRACE];
+    int count;
+};
+
+static void stopRecording(VM* vm, bool failed) {
+    if (failed && vm->recorder->loop->aborts < UINT8_MAX)
+        vm->recorder->loop->aborts++;
+    free(vm->recorder);
+    vm->recorder = NULL;
+}
+
+bool traceCountLoop(VM* vm, HotLoop* loop, CallFrame* frame, uint8_t* header) {
+    if (loop->header != header) {
+        // Another loop claimed the slot, its trace stays with its function.
+        loop->header = header;
+        loop->count = 0;
+        loop->aborts = 0;
+        loop->trace = NULL;
+    }
+    if (vm->recorder != NULL || loop->aborts >= MAX_TRACE_ABORTS ||
+        ++loop->count < HOT_LOOP_THRESHOLD) {
+        return false;
+    }
+    loop->count = 0;
+
+    Recorder* recorder = malloc(sizeof(Recorder));
+    if (recorder == NULL)
+        exit(1);
+    recorder->frame = frame;
+    recorder->loop = loop;
+    recorder->header = header;
+    recorder->base = (int)(vm->stackTop - frame->slots);
+    recorder->count = 0;
+    for (int i = 0; i < recorder->base && i < UINT8_COUNT; i++)
+        recorder->numberAtEntry[i] = IS_NUMBER(frame->slots[i]);
+    vm->recorder = recorder;
+    return true;
+}
+
+void traceAbort(VM* vm) {
+    if (vm->recorder != NULL)
+        stopRecording(vm, true);
+}
+
+static void compileTrace(Recorder* recorder);
+
+static inline Value recordedRegister(CallFrame* frame, uint8_t operand) {
+    if (operand & RK_CONSTANT)
+        return frame->closure->function->chunk.constants
+            .values[operand & ~RK_CONSTANT];
+    return frame->slots[operand];
+}
+
+static inline bool bothNumbers(Value a, Value b) {
+    return IS_NUMBER(a) && IS_NUMBER(b);
+}
+
+bool traceRecord(VM* vm, CallFrame* frame, uint8_t* ip) {
+    Recorder* recorder = vm->recorder;
+    if (recorder == NULL)
+        return false;
+
+    if (ip == recorder->header && recorder->count > 0) {
+        compileTrace(recorder);
+        stopRecording(vm, recorder->loop->trace == NULL);
+        return false;
+    }
+    if (frame != recorder->frame || recorder->count == MAX_TRACE ||
+        recorder->base >= UINT8_COUNT) {
+        stopRecording(vm, true);
+        return false;
+    }
+
+    TraceStep* step = &recorder->steps[recorder->count++];
+    step->ip = ip;
+    step->numeric = true;
+    step->taken = false;
+
+    Value* top = vm->stackTop;
+    OpCode op = genericOp(*ip);
+    switch (op) {
+        case OP_CONSTANT:
+        case OP_CONSTANT_LONG:
+        case OP_NIL:
+        case OP_TRUE:
+        case OP_FALSE:
+        case OP_POP:
+        case OP_GET_LOCAL:
+        case OP_SET_LOCAL:
+        case OP_GET_GLOBAL:
+        case OP_SET_GLOBAL:
+        case OP_PRINT:
+        case OP_NOT:
+        case OP_JUMP:
+        case OP_LOOP:
+        case OP_R_MOVE: break;
+        case OP_NEGATE: step->numeric = IS_NUMBER(top[-1]); break;
+        case OP_ADD:
+        case OP_SUBTRACT:
+        case OP_MULTIPLY:
+        case OP_DIVIDE:
+        case OP_EQUAL:
+        case OP_GREATER:
+        case OP_LESS: step->numeric = bothNumbers(top[-2], top[-1]); break;
+        case OP_JUMP_IF_FALSE:
+            step->taken = IS_NIL(top[-1]) ||
+                          (IS_BOOL(top[-1]) && !AS_BOOL(top[-1]));
+            break;
+        case OP_LESS_JUMP_IF_FALSE:
+            step->numeric = bothNumbers(top[-2], top[-1]);
+            step->taken = step->numeric &&
+                          !(AS_NUMBER(top[-2]) < AS_NUMBER(top[-1]));
+            break;
+        case OP_ADD_LOCALS:
+            step->numeric =
+                bothNumbers(frame->slots[ip[1]], frame->slots[ip[2]]);
+            break;
+        case OP_INCREMENT_LOCAL:
+            step->numeric = bothNumbers(
+                frame->slots[ip[1]],
+                frame->closure->function->chunk.constants.values[ip[2]]);
+            break;
+        case OP_R_ADD:
+        case OP_R_SUBTRACT:
+        case OP_R_MULTIPLY:
+        case OP_R_DIVIDE:
+        case OP_R_EQUAL:
+        case OP_R_GREATER:
+        case OP_R_LESS:
+            step->numeric = bothNumbers(recordedRegister(frame, ip[2]),
+                                        recordedRegister(frame, ip[3]));
+            break;
+        case OP_R_LESS_JUMP_IF_FALSE:
+        case OP_R_GREATER_JUMP_IF_FALSE: {
+            Value a = recordedRegister(frame, ip[1]);
+            Value b = recordedRegister(frame, ip[2]);
+            step->numeric = bothNumbers(a, b);
+            if (step->numeric) {
+                step->taken = op == OP_R_LESS_JUMP_IF_FALSE
+                                  ? !(AS_NUMBER(a) < AS_NUMBER(b))
+                                  : !(AS_NUMBER(a) > AS_NUMBER(b));
+            }
+            break;
+        }
+        default:
+            // Calls, returns, objects and upvalues stay in the interpreter.
+            stopRecording(vm, true);
+            return false;
+    }
+    return true;
+}
+
+// Where a value of the trace's stack currently is.
+typedef enum {
+    IN_CONSTANT, // Known at compile time.
+    IN_LOCAL,    // Still in frame->slots[slot], not loaded yet.
+    IN_XMM,      // Unboxed number in xmm<depth>.
+    IN_MEMORY,   // Boxed at BASE[depth], where the interpreter expects it.
+} Location;
+
+typedef struct {
+    Location location;
+    bool isNumber;
+    int slot;
+    Value constant;
+} StackValue;
+
+// Interpreter state to rebuild when a guard fails.
+typedef struct {
+    int at; // rel32 of the guard's jump.
+    uint8_t* ip;
+    int depth;
+    StackValue stack[MAX_DEPTH];
+} SideExit;
+
+typedef struct {
+    Assembler as;
+    Recorder* recorder;
+    Chunk* chunk;
+    int base;
+
+    StackValue stack[MAX_DEPTH];
+    int depth;
+    // State before the instruction being compiled, for type guards.
+    StackValue before[MAX_DEPTH];
+    int beforeDepth;
+    uint8_t* beforeIp;
+
+    bool localNumber[UINT8_COUNT]; // Known to hold a number here.
+    bool assumed[UINT8_COUNT];     // Guarded once on entry.
+    int violation; // Assumed local given something else, or -1.
+    bool failed;   // Nothing sensible to compile.
+
+    SideExit* exits;
+    int exitCount;
+    int exitCapacity;
+    int* errors; // rel32s jumping to the error exit.
+    int errorCount;
+    int errorCapacity;
+} TraceCompiler;
+
+static void fail(TraceCompiler* tc) { tc->failed = true; }
+
+static void addExit(TraceCompiler* tc, int cc, uint8_t* ip,
+                    StackValue* stack, int depth) {
+    if (tc->exitCount == tc->exitCapacity) {
+        tc->exitCapacity = tc->exitCapacity < 16 ? 16 : tc->exitCapacity * 2;
+        tc->exits = realloc(tc->exits, sizeof(SideExit) * tc->exitCapacity);
+        if (tc->exits == NULL)
+            exit(1);
+    }
+    SideExit* sideExit = &tc->exits[tc->exitCount++];
+    sideExit->at = emitJump(&tc->as, cc);
+    sideExit->ip = ip;
+    sideExit->depth = depth;
+    memcpy(sideExit->stack, stack, sizeof(StackValue) * depth);
+}
+
+// Exit back to the start of the current instruction.
+static void guardExit(TraceCompiler* tc, int cc) {
+    addExit(tc, cc, tc->beforeIp, tc->before, tc->beforeDepth);
+}
+
+static void errorExit(TraceCompiler* tc, int cc) {
+    if (tc->errorCount == tc->errorCapacity) {
+        tc->errorCapacity = tc->errorCapacity < 16 ? 16 : tc->errorCapacity * 2;
+        tc->errors = realloc(tc->errors, sizeof(int) * tc->errorCapacity);
+        if (tc->errors == NULL)
+            exit(1);
+    }
+    tc->errors[tc->errorCount++] = emitJump(&tc->as, cc);
+}
+
+// Boxed value of a stack entry at depth in dst.
+static void emitBoxed(TraceCompiler* tc, StackValue* value, int depth,
+                      Register dst) {
+    switch (value->location) {
+        case IN_CONSTANT: movImm(&tc->as, dst, value->constant); break;
+        case IN_LOCAL:
+            load(&tc->as, dst, SLOTS, value->slot * sizeof(Value));
+            break;
+        case IN_XMM: movqFromXmm(&tc->as, dst, depth); break;
+        case IN_MEMORY:
+            load(&tc->as, dst, BASE, depth * sizeof(Value));
+            break;
+    }
+}
+
+static void materialize(TraceCompiler* tc, int depth) {
+    StackValue* value = &tc->stack[depth];
+    if (value->location == IN_MEMORY)
+        return;
+    emitBoxed(tc, value, depth, RAX);
+    store(&tc->as, BASE, depth * sizeof(Value), RAX);
+    value->location = IN_MEMORY;
+}
+
+// Puts the whole stack where the interpreter and the VM helpers see it.
+static void flush(TraceCompiler* tc) {
+    for (int i = 0; i < tc->depth; i++)
+        materialize(tc, i);
+}
+
+static void markLocalNumber(TraceCompiler* tc, int slot) {
+    tc->localNumber[slot] = true;
+    for (int i = 0; i < tc->depth; i++) {
+        if (tc->stack[i].location == IN_LOCAL && tc->stack[i].slot == slot)
+            tc->stack[i].isNumber = true;
+    }
+}
+
+// Side exit unless rax holds a number. Clobbers rcx and rsi.
+static void guardNumber(TraceCompiler* tc) {
+    Assembler* as = &tc->as;
+    movImm(as, RCX, QNAN);
+    alu(as, ALU_MOV, RSI, RAX);
+    alu(as, ALU_AND, RSI, RCX);
+    alu(as, ALU_CMP, RSI, RCX);
+    guardExit(tc, CC_E);
+}
+
+// Unboxes the entry at depth into xmm<depth>, guarding its type if unknown.
+static void toNumber(TraceCompiler* tc, int depth) {
+    StackValue* value = &tc->stack[depth];
+    switch (value->location) {
+        case IN_XMM: return;
+        case IN_CONSTANT:
+            if (!IS_NUMBER(value->constant)) {
+                fail(tc);
+                return;
+            }
+            movImm(&tc->as, RAX, value->constant);
+            break;
+        case IN_LOCAL:
+        case IN_MEMORY:
+            emitBoxed(tc, value, depth, RAX);
+            if (!value->isNumber) {
+                guardNumber(tc);
+                if (value->location == IN_LOCAL)
+                    markLocalNumber(tc, value->slot);
+            }
+            break;
+    }
+    movqToXmm(&tc->as, depth, RAX);
+    value->location = IN_XMM;
+    value->isNumber = true;
+}
+
+static void pushValue(TraceCompiler* tc, StackValue value) {
+    if (tc->depth == MAX_DEPTH) {
+        fail(tc);
+        return;
+    }
+    tc->stack[tc->depth++] = value;
+}
+
+static void pushConstant(TraceCompiler* tc, Value constant) {
+    pushValue(tc, (StackValue){IN_CONSTANT, IS_NUMBER(constant), 0, constant});
+}
+
+// Copies a stack entry to another depth, moving its register or memory.
+static void copyEntry(TraceCompiler* tc, int from, int to) {
+    if (from == to)
+        return;
+    StackValue value = tc->stack[from];
+    if (value.location == IN_XMM) {
+        sse(&tc->as, SSE_MOVSD, to, from);
+    } else if (value.location == IN_MEMORY) {
+        load(&tc->as, RAX, BASE, from * sizeof(Value));
+        store(&tc->as, BASE, to * sizeof(Value), RAX);
+    }
+    tc->stack[to] = value;
+}
+
+// Locals declared inside the loop live on the trace's stack.
+static void pushSlot(TraceCompiler* tc, int slot) {
+    if (slot < tc->base) {
+        pushValue(tc, (StackValue){IN_LOCAL, tc->localNumber[slot], slot,
+                                   NIL_VAL});
+        return;
+    }
+    int from = slot - tc->base;
+    if (from >= tc->depth || tc->depth == MAX_DEPTH) {
+        fail(tc);
+        return;
+    }
+    tc->depth++;
+    copyEntry(tc, from, tc->depth - 1);
+}
+
+static void pushRegister(TraceCompiler* tc, uint8_t operand) {
+    if (operand & RK_CONSTANT) {
+        pushConstant(tc, tc->chunk->constants.values[operand & ~RK_CONSTANT]);
+    } else {
+        pushSlot(tc, operand);
+    }
+}
+
+// Assigns the entry at depth from to a local slot.
+static void writeSlot(TraceCompiler* tc, int slot, int from) {
+    if (slot >= tc->base) {
+        if (slot - tc->base >= tc->depth) {
+            fail(tc);
+            return;
+        }
+        copyEntry(tc, from, slot - tc->base);
+        return;
+    }
+
+    StackValue* value = &tc->stack[from];
+    if (value->location == IN_LOCAL && value->slot == slot)
+        return;
+    // Entries still reading the old value must load it first.
+    for (int i = 0; i < tc->depth; i++) {
+        StackValue* other = &tc->stack[i];
+        if (i != from && other->location == IN_LOCAL && other->slot == slot) {
+            if (other->isNumber) {
+                toNumber(tc, i);
+            } else {
+                materialize(tc, i);
+            }
+        }
+    }
+    emitBoxed(tc, value, from, RAX);
+    store(&tc->as, SLOTS, slot * sizeof(Value), RAX);
+    tc->localNumber[slot] = value->isNumber;
+    if (tc->assumed[slot] && !value->isNumber)
+        tc->violation = slot;
+}
+
+// Calls a VM helper on the flushed stack, the VM in rdi and other arguments
+// in rsi. Errors leave through the error exit with frame->ip at next.
+static void callHelper(TraceCompiler* tc, void* helper, uint8_t* next,
+                       bool canFail) {
+    Assembler* as = &tc->as;
+    flush(tc);
+    movImm(as, RAX, (uint64_t)(uintptr_t)next);
+    store(as, FRAME, offsetof(CallFrame, ip), RAX);
+    alu(as, ALU_MOV, RAX, BASE);
+    addImm(as, RAX, tc->depth * sizeof(Value));
+    store(as, VM_BASE, offsetof(VM, stackTop), RAX);
+    alu(as, ALU_MOV, RDI, VM_BASE);
+    emitCall(as, helper);
+    if (canFail) {
+        emitBytes(as, 2, 0x84, 0xc0); // test al, al
+        errorExit(tc, CC_E);
+    }
+    load(as, SLOTS, FRAME, offsetof(CallFrame, slots));
+    alu(as, ALU_MOV, BASE, SLOTS);
+    addImm(as, BASE, tc->base * sizeof(Value));
+}
+
+static void binary(TraceCompiler* tc, TraceStep* step, OpCode op,
+                   uint8_t* next) {
+    if (!step->numeric) {
+        // Only OP_ADD has a meaning for objects, concatenation.
+        if (op != OP_ADD) {
+            fail(tc);
+            return;
+        }
+        callHelper(tc, jitAdd, next, true);
+        tc->depth--;
+        tc->stack[tc->depth - 1] = (StackValue){IN_MEMORY, false, 0, NIL_VAL};
+        return;
+    }
+
+    int a = tc->depth - 2;
+    toNumber(tc, a);
+    toNumber(tc, a + 1);
+    switch (op) {
+        case OP_ADD: sse(&tc->as, SSE_ADDSD, a, a + 1); break;
+        case OP_SUBTRACT: sse(&tc->as, SSE_SUBSD, a, a + 1); break;
+        case OP_MULTIPLY: sse(&tc->as, SSE_MULSD, a, a + 1); break;
+        case OP_DIVIDE: sse(&tc->as, SSE_DIVSD, a, a + 1); break;
+        default: break;
+    }
+    tc->depth--;
+}
+
+// Compares the two entries on top, leaving flags for the returned condition
+// code meaning true.
+static int compare(TraceCompiler* tc, OpCode op) {
+    int a = tc->depth - 2;
+    if (op == OP_EQUAL) {
+        emitBoxed(tc, &tc->stack[a], a, RDX);
+        emitBoxed(tc, &tc->stack[a + 1], a + 1, RAX);
+        alu(&tc->as, ALU_CMP, RDX, RAX);
+        return CC_E;
+    }
+
+    toNumber(tc, a);
+    toNumber(tc, a + 1);
+    // Above without unordered: a < b is b above a.
+    if (op == OP_LESS) {
+        sse(&tc->as, SSE_UCOMISD, a + 1, a);
+    } else {
+        sse(&tc->as, SSE_UCOMISD, a, a + 1);
+    }
+    return CC_A;
+}
+
+static int negate(int cc) { return cc ^ 1; }
+
+// OP_LESS, OP_GREATER and OP_EQUAL pushing their result. Followed by
+// OP_JUMP_IF_FALSE, the result is guarded to be what was recorded and
+// becomes a constant.
+static void comparison(TraceCompiler* tc, TraceStep* step, OpCode op,
+                       uint8_t* next) {
+    if (!step->numeric && op != OP_EQUAL) {
+        fail(tc);
+        return;
+    }
+    int cc = compare(tc, op);
+    tc->depth -= 2;
+
+    TraceStep* branch = step + 1;
+    if (next != NULL &&
+        branch < tc->recorder->steps + tc->recorder->count &&
+        branch->ip == next && *next == OP_JUMP_IF_FALSE) {
+        bool result = !branch->taken;
+        pushConstant(tc, BOOL_VAL(!result));
+        addExit(tc, result ? negate(cc) : cc, next, tc->stack, tc->depth);
+        tc->stack[tc->depth - 1].constant = BOOL_VAL(result);
+        return;
+    }
+
+    setcc(&tc->as, cc);
+    movImm(&tc->as, RCX, FALSE_VAL);
+    alu(&tc->as, ALU_ADD, RAX, RCX);
+    store(&tc->as, BASE, tc->depth * sizeof(Value), RAX);
+    pushValue(tc, (StackValue){IN_MEMORY, false, 0, NIL_VAL});
+}
+
+// Fused comparison and OP_JUMP_IF_FALSE of the superinstructions and
+// register instructions. Taking the jump leaves false on the stack.
+static void compareJump(TraceCompiler* tc, TraceStep* step, OpCode op,
+                        uint8_t* target, uint8_t* next) {
+    if (!step->numeric) {
+        fail(tc);
+        return;
+    }
+    int cc = compare(tc, op);
+    tc->depth -= 2;
+
+    if (step->taken) {
+        addExit(tc, cc, next, tc->stack, tc->depth);
+        pushConstant(tc, FALSE_VAL);
+    } else {
+        pushConstant(tc, FALSE_VAL);
+        addExit(tc, negate(cc), target, tc->stack, tc->depth);
+        tc->depth--;
+    }
+}
+
+// Sets al to whether the value in rax is falsey, clobbers rcx and rdx.
+static void testFalsey(TraceCompiler* tc) {
+    Assembler* as = &tc->as;
+    movImm(as, RCX, NIL_VAL);
+    alu(as, ALU_CMP, RAX, RCX);
+    emitBytes(as, 3, 0x0f, 0x94, 0xc2); // sete dl
+    movImm(as, RCX, FALSE_VAL);
+    alu(as, ALU_CMP, RAX, RCX);
+    emitBytes(as, 3, 0x0f, 0x94, 0xc0); // sete al
+    emitBytes(as, 2, 0x08, 0xd0);       // or al, dl
+}
+
+static bool constantFalsey(Value value) {
+    return IS_NIL(value) || (IS_BOOL(value) && !AS_BOOL(value));
+}
+
+static void jumpIfFalse(TraceCompiler* tc, TraceStep* step, uint8_t* target,
+                        uint8_t* next) {
+    StackValue* top = &tc->stack[tc->depth - 1];
+    if (top->location == IN_CONSTANT) {
+        if (constantFalsey(top->constant) != step->taken)
+            fail(tc);
+        return;
+    }
+    if (top->isNumber) {
+        // Numbers are always true.
+        if (step->taken)
+            fail(tc);
+        return;
+    }
+
+    emitBoxed(tc, top, tc->depth - 1, RAX);
+    testFalsey(tc);
+    emitBytes(&tc->as, 2, 0x84, 0xc0); // test al, al
+    if (step->taken) {
+        addExit(tc, CC_E, next, tc->stack, tc->depth);
+    } else {
+        addExit(tc, CC_NE, target, tc->stack, tc->depth);
+    }
+}
+
+static uint16_t readShort(uint8_t* operand) {
+    return (uint16_t)((operand[0] << 8) | operand[1]);
+}
+
+static void compileStep(TraceCompiler* tc, TraceStep* step) {
+    uint8_t* ip = step->ip;
+    int offset = (int)(ip - tc->chunk->code);
+    uint8_t* next = ip + instructionLength(tc->chunk, offset);
+    Value* constants = tc->chunk->constants.values;
+
+    tc->beforeIp = ip;
+    tc->beforeDepth = tc->depth;
+    memcpy(tc->before, tc->stack, sizeof(StackValue) * tc->depth);
+
+    OpCode op = genericOp(*ip);
+    switch (op) {
+        case OP_CONSTANT:
+        case OP_CONSTANT_LONG: pushConstant(tc, constants[ip[1]]); break;
+        case OP_NIL: pushConstant(tc, NIL_VAL); break;
+        case OP_TRUE: pushConstant(tc, TRUE_VAL); break;
+        case OP_FALSE: pushConstant(tc, FALSE_VAL); break;
+        case OP_POP:
+            if (tc->depth == 0) {
+                fail(tc);
+                return;
+            }
+            tc->depth--;
+            break;
+        case OP_GET_LOCAL: pushSlot(tc, ip[1]); break;
+        case OP_SET_LOCAL: writeSlot(tc, ip[1], tc->depth - 1); break;
+        case OP_GET_GLOBAL:
+            movImm(&tc->as, RSI, readShort(ip + 1));
+            callHelper(tc, jitGetGlobal, next, true);
+            pushValue(tc, (StackValue){IN_MEMORY, false, 0, NIL_VAL});
+            break;
+        case OP_SET_GLOBAL:
+            movImm(&tc->as, RSI, readShort(ip + 1));
+            callHelper(tc, jitSetGlobal, next, true);
+            break;
+        case OP_PRINT:
+            callHelper(tc, jitPrint, next, false);
+            tc->depth--;
+            break;
+        case OP_NEGATE:
+            if (!step->numeric) {
+                fail(tc);
+                return;
+            }
+            toNumber(tc, tc->depth - 1);
+            movqFromXmm(&tc->as, RAX, tc->depth - 1);
+            emitBytes(&tc->as, 5, 0x48, 0x0f, 0xba, 0xf8, 63); // btc rax, 63
+            movqToXmm(&tc->as, tc->depth - 1, RAX);
+            break;
+        case OP_NOT: {
+            StackValue* top = &tc->stack[tc->depth - 1];
+            if (top->location == IN_CONSTANT || top->isNumber) {
+                bool falsey = top->location == IN_CONSTANT &&
+                              constantFalsey(top->constant);
+                tc->depth--;
+                pushConstant(tc, BOOL_VAL(falsey));
+                break;
+            }
+            emitBoxed(tc, top, tc->depth - 1, RAX);
+            testFalsey(tc);
+            emitBytes(&tc->as, 3, 0x0f, 0xb6, 0xc0); // movzx eax, al
+            movImm(&tc->as, RCX, FALSE_VAL);
+            alu(&tc->as, ALU_ADD, RAX, RCX);
+            store(&tc->as, BASE, (tc->depth - 1) * sizeof(Value), RAX);
+            *top = (StackValue){IN_MEMORY, false, 0, NIL_VAL};
+            break;
+        }
+        case OP_ADD:
+        case OP_SUBTRACT:
+        case OP_MULTIPLY:
+        case OP_DIVIDE: binary(tc, step, op, next); break;
+        case OP_EQUAL:
+        case OP_GREATER:
+        case OP_LESS: comparison(tc, step, op, next); break;
+        case OP_JUMP:
+        case OP_LOOP: break;
+        case OP_JUMP_IF_FALSE:
+            jumpIfFalse(tc, step, next + readShort(ip + 1), next);
+            break;
+        case OP_LESS_JUMP_IF_FALSE:
+            compareJump(tc, step, OP_LESS, next + readShort(ip + 1), next);
+            break;
+        case OP_ADD_LOCALS:
+            pushSlot(tc, ip[1]);
+            pushSlot(tc, ip[2]);
+            binary(tc, step, OP_ADD, next);
+            break;
+        case OP_INCREMENT_LOCAL:
+            pushSlot(tc, ip[1]);
+            pushConstant(tc, constants[ip[2]]);
+            binary(tc, step, OP_ADD, next);
+            if (tc->failed)
+                return;
+            writeSlot(tc, ip[1], tc->depth - 1);
+            tc->depth--;
+            break;
+        case OP_R_MOVE:
+            pushRegister(tc, ip[2]);
+            if (tc->failed)
+                return;
+            writeSlot(tc, ip[1], tc->depth - 1);
+            tc->depth--;
+            break;
+        case OP_R_ADD:
+        case OP_R_SUBTRACT:
+        case OP_R_MULTIPLY:
+        case OP_R_DIVIDE:
+        case OP_R_EQUAL:
+        case OP_R_GREATER:
+        case OP_R_LESS: {
+            OpCode ops[] = {
+                [OP_R_ADD] = OP_ADD,           [OP_R_SUBTRACT] = OP_SUBTRACT,
+                [OP_R_MULTIPLY] = OP_MULTIPLY, [OP_R_DIVIDE] = OP_DIVIDE,
+                [OP_R_EQUAL] = OP_EQUAL,       [OP_R_GREATER] = OP_GREATER,
+                [OP_R_LESS] = OP_LESS,
+            };
+            OpCode binaryOp = ops[op];
+            pushRegister(tc, ip[2]);
+            pushRegister(tc, ip[3]);
+            if (tc->failed)
+                return;
+            if (binaryOp == OP_EQUAL || binaryOp == OP_GREATER ||
+                binaryOp == OP_LESS) {
+                comparison(tc, step, binaryOp,
+                           ip[1] == R_STACK ? next : NULL);
+            } else {
+                binary(tc, step, binaryOp, next);
+            }
+            if (tc->failed || ip[1] == R_STACK)
+                return;
+            writeSlot(tc, ip[1], tc->depth - 1);
+            tc->depth--;
+            break;
+        }
+        case OP_R_LESS_JUMP_IF_FALSE:
+        case OP_R_GREATER_JUMP_IF_FALSE:
+            pushRegister(tc, ip[1]);
+            pushRegister(tc, ip[2]);
+            if (tc->failed)
+                return;
+            compareJump(tc, step,
+                        op == OP_R_LESS_JUMP_IF_FALSE ? OP_LESS : OP_GREATER,
+                        next + readShort(ip + 3), next);
+            break;
+        default: fail(tc); break;
+    }
+}
+
+// Slots read or written by the trace.
+static void usedSlots(Recorder* recorder, bool* used) {
+    for (int i = 0; i < recorder->count; i++) {
+        uint8_t* ip = recorder->steps[i].ip;
+        switch (*ip) {
+            case OP_GET_LOCAL:
+            case OP_SET_LOCAL:
+            case OP_INCREMENT_LOCAL: used[ip[1]] = true; break;
+            case OP_ADD_LOCALS:
+                used[ip[1]] = true;
+                used[ip[2]] = true;
+                break;
+            case OP_R_MOVE:
+            case OP_R_LESS_JUMP_IF_FALSE:
+            case OP_R_GREATER_JUMP_IF_FALSE:
+                // R_STACK has the RK_CONSTANT bit set too.
+                for (int operand = 1; operand <= 2; operand++) {
+                    if (!(ip[operand] & RK_CONSTANT))
+                        used[ip[operand]] = true;
+                }
+                break;
+            case OP_R_ADD:
+            case OP_R_SUBTRACT:
+            case OP_R_MULTIPLY:
+            case OP_R_DIVIDE:
+            case OP_R_EQUAL:
+            case OP_R_GREATER:
+            case OP_R_LESS:
+                for (int operand = 1; operand <= 3; operand++) {
+                    if (!(ip[operand] & RK_CONSTANT))
+                        used[ip[operand]] = true;
+                }
+                break;
+            default: break;
+        }
+    }
+}
+
+static void emitSideExits(TraceCompiler* tc, int epilogue) {
+    Assembler* as = &tc->as;
+    for (int i = 0; i < tc->exitCount; i++) {
+        SideExit* sideExit = &tc->exits[i];
+        patchJump(as, sideExit->at, as->count);
+        for (int depth = 0; depth < sideExit->depth; depth++) {
+            if (sideExit->stack[depth].location == IN_MEMORY)
+                continue;
+            emitBoxed(tc, &sideExit->stack[depth], depth, RAX);
+            store(as, BASE, depth * sizeof(Value), RAX);
+        }
+        alu(as, ALU_MOV, RAX, BASE);
+        addImm(as, RAX, sideExit->depth * sizeof(Value));
+        store(as, VM_BASE, offsetof(VM, stackTop), RAX);
+        movImm(as, RAX, (uint64_t)(uintptr_t)sideExit->ip);
+        store(as, FRAME, offsetof(CallFrame, ip), RAX);
+        movImm(as, RAX, 1);
+        patchJump(as, emitJump(as, -1), epilogue);
+    }
+}
+
+// Emits the loop once. Locals in tc->assumed are guarded on entry and
+// trusted inside, tc->violation tells if that didn't hold.
+static void emitTrace(TraceCompiler* tc) {
+    Recorder* recorder = tc->recorder;
+    Assembler* as = &tc->as;
+
+    emitSaveRegisters(as);
+    alu(as, ALU_MOV, VM_BASE, RDI);
+    alu(as, ALU_MOV, FRAME, RSI);
+    load(as, SLOTS, FRAME, offsetof(CallFrame, slots));
+    alu(as, ALU_MOV, BASE, SLOTS);
+    addImm(as, BASE, tc->base * sizeof(Value));
+
+    tc->depth = 0;
+    tc->beforeIp = recorder->header;
+    tc->beforeDepth = 0;
+    for (int slot = 0; slot < tc->base; slot++) {
+        if (!tc->assumed[slot])
+            continue;
+        load(as, RAX, SLOTS, slot * sizeof(Value));
+        guardNumber(tc);
+    }
+
+    int loop = as->count;
+    memcpy(tc->localNumber, tc->assumed, sizeof(tc->localNumber));
+    for (int i = 0; i < recorder->count && !tc->failed; i++)
+        compileStep(tc, &recorder->steps[i]);
+    if (tc->depth != 0)
+        fail(tc);
+    patchJump(as, emitJump(as, -1), loop);
+
+    int error = as->count;
+    emitBytes(as, 2, 0x31, 0xc0); // xor eax, eax
+    int epilogue = as->count;
+    emitRestoreRegisters(as);
+    for (int i = 0; i < tc->errorCount; i++)
+        patchJump(as, tc->errors[i], error);
+    emitSideExits(tc, epilogue);
+}
+
+static void compileTrace(Recorder* recorder) {
+    TraceCompiler tc = {
+        .recorder = recorder,
+        .chunk = &recorder->frame->closure->function->chunk,
+        .base = recorder->base,
+    };
+
+    bool used[UINT8_COUNT] = {false};
+    usedSlots(recorder, used);
+    for (int slot = 0; slot < tc.base; slot++)
+        tc.assumed[slot] = used[slot] && recorder->numberAtEntry[slot];
+
+    // Each pass drops an assumption a store broke, until the loop is
+    // consistent with its entry guards.
+    for (;;) {
+        tc.violation = -1;
+        tc.failed = false;
+        tc.exitCount = 0;
+        tc.errorCount = 0;
+        tc.as.count = 0;
+        emitTrace(&tc);
+        if (tc.failed || tc.violation < 0)
+            break;
+        tc.assumed[tc.violation] = false;
+    }
+
+    if (!tc.failed) {
+        Trace* trace = malloc(sizeof(Trace));
+        if (trace == NULL)
+            exit(1);
+        trace->native = finishCode(&tc.as, &trace->nativeSize);
+        if (trace->native == NULL) {
+            free(trace);
+        } else {
+            ObjFunction* function = recorder->frame->closure->function;
+            trace->function = function;
+            trace->header = recorder->header;
+            trace->next = function->traces;
+            function->traces = trace;
+            recorder->loop->trace = trace;
+        }
+    }
+#ifdef DEBUG_LOG_TRACE
+    printf("-- trace %p: %d instructions, %s\n", (void*)recorder->header,
+           recorder->count, recorder->loop->trace ? "compiled" : "failed");
+#endif
+
+    free(tc.as.code);
+    free(tc.exits);
+    free(tc.errors);
+}
+
+void traceFree(VM* vm, ObjFunction* function) {
+    while (function->traces != NULL) {
+        Trace* trace = function->traces;
+        function->traces = trace->next;
+        for (int i = 0; i < HOT_LOOPS; i++) {
+            if (vm->hotLoops[i].trace == trace)
+                vm->hotLoops[i] = (HotLoop){NULL, 0, 0, NULL};
+        }
+        freeCode(trace->native, trace->nativeSize);
+        free(trace);
+    }
+}
+
+#endif
@@ -0,0 +1,86 @@
+#ifndef clox_trace_h
+#define clox_trace_h
+
+#include "common.h"
+#include "object.h"
+#include "vm.h"
+
+#ifdef JIT
+
+// Back-edges to a loop header after which its next iteration is recorded.
+#ifndef HOT_LOOP_THRESHOLD
+#define HOT_LOOP_THRESHOLD 56
+#endif
+
+// Recordings of a loop that may fail before it is left to the interpreter.
+#define MAX_TRACE_ABORTS 4
+
+/**
+ * @struct Trace
+ * @brief Native code for one loop, compiled from a recorded iteration.
+ */
+struct Trace {
+    struct Trace* next;     /**< Next trace of the same function */
+    ObjFunction* function;  /**< Function the loop belongs to */
+    uint8_t* header;        /**< First instruction of the loop */
+    void* native;           /**< Executable code, a TraceFn */
+    size_t nativeSize;      /**< Size of the mapping holding native */
+};
+
+/**
+ * @brief Entry point of a trace.
+ *
+ * Runs the loop from its header until a guard fails, then leaves the VM
+ * stack and frame->ip as the interpreter expects them at the exit.
+ *
+ * @param vm The VM running the loop.
+ * @param frame The frame running the loop, on top of vm->frames.
+ * @return false if a runtime error was reported.
+ */
+typedef bool (*TraceFn)(VM* vm, CallFrame* frame);
+
+/**
+ * @brief Counter slot of a loop header in vm->hotLoops.
+ */
+static inline HotLoop* hotLoopFor(VM* vm, uint8_t* header) {
+    uintptr_t hash = (uintptr_t)header;
+    return &vm->hotLoops[(hash ^ (hash >> 7)) & (HOT_LOOPS - 1)];
+}
+
+/**
+ * @brief Counts a back-edge taken by OP_LOOP, in run().
+ *
+ * Once the loop is hot, starts recording its next iteration: run() must then
+ * pass every instruction to traceRecord() before executing it.
+ *
+ * @param loop Slot from hotLoopFor(header).
+ * @param frame Frame running the loop.
+ * @param header Target of the back-edge.
+ * @return true if recording started.
+ */
+bool traceCountLoop(VM* vm, HotLoop* loop, CallFrame* frame, uint8_t* header);
+
+/**
+ * @brief Records the instruction at ip, before it is executed.
+ *
+ * Notes which way branches go and whether operands are numbers. Back at the
+ * header the trace is compiled and installed in its HotLoop. Instructions
+ * leaving the frame or not supported in traces abort the recording.
+ *
+ * @return false once recording is over, successful or not.
+ */
+bool traceRecord(VM* vm, CallFrame* frame, uint8_t* ip);
+
+/**
+ * @brief Drops the recording in progress, if any.
+ */
+void traceAbort(VM* vm);
+
+/**
+ * @brief Frees the traces of a function and forgets their loops.
+ */
+void traceFree(VM* vm, ObjFunction* function);
+
+#endif
+
+#endif
@@ -11,34 +11,37 @@ void initValueArray(ValueArray* array) {
     array->count = 0;
 }
 
-void writeValueArray(ValueArray* array, Value value) {
+void writeValueArray(VM* vm, ValueArray* array, Value value) {
     if (array->capacity < array->count + 1) {
         int oldCapacity = array->capacity;
         array->capacity = GROW_CAPACITY(oldCapacity);
         array->values =
-            GROW_ARRAY(Value, array->values, oldCapacity, array->capacity);
+            GROW_ARRAY(vm, Value, array->values, oldCapacity, array->capacity);
     }
     array->values[array->count] = value;
     array->count++;
 }
 
-void printValue(Value value) {
+void printValue(Value value) { fprintValue(stdout, value); }
+
+void fprintValue(FILE* file, Value value) {
 #ifdef NAN_BOXING
     if (IS_BOOL(value)) {
-        printf(AS_BOOL(value) ? "true" : "false");
+        fputs(AS_BOOL(value) ? "true" : "false", file);
     } else if (IS_NIL(value)) {
-        printf("nil");
+        fputs("nil", file);
     } else if (IS_NUMBER(value)) {
-        printf("%g", AS_NUMBER(value));
+        fprintf(file, "%g", AS_NUMBER(value));
     } else if (IS_OBJ(value)) {
-        printObject(value);
+        printObject(file, value);
     }
 #else
     switch (value.type) {
-        case VAL_BOOL: printf(AS_BOOL(value) ? "true" : "false"); break;
-        case VAL_NIL: printf("nil"); break;
-        case VAL_NUMBER: printf("%g", AS_NUMBER(value)); break;
-        case VAL_OBJ: printObject(value); break;
+        case VAL_BOOL: fputs(AS_BOOL(value) ? "true" : "false", file); break;
+        case VAL_NIL: fputs("nil", file); break;
+        case VAL_NUMBER: fprintf(file, "%g", AS_NUMBER(value)); break;
+        case VAL_OBJ: printObject(file, value); break;
+        case VAL_UNDEFINED: break;
     }
 #endif
 }
@@ -59,7 +62,7 @@ bool valuesEqual(Value a, Value b) {
 #endif
 }
 
-void freeValueArray(ValueArray* array) {
-    FREE_ARRAY(Value, array->values, array->capacity);
+void freeValueArray(VM* vm, ValueArray* array) {
+    FREE_ARRAY(vm, Value, array->values, array->capacity);
     initValueArray(array);
 }
\ No newline at end of file
@@ -1,10 +1,14 @@
 #ifndef clox_value_h
 #define clox_value_h
 
+#include <stdio.h>
+
 #include "common.h"
 
 typedef struct Obj Obj;
 typedef struct ObjString ObjString;
+// Functions that allocate or collect take the VM owning the heap first.
+typedef struct VM VM;
 
 #ifdef NAN_BOXING
 
@@ -18,11 +22,14 @@ typedef uint64_t Value;
 #define TAG_NIL 1   // 01.
 #define TAG_FALSE 2 // 10.
 #define TAG_TRUE 3  // 11.
+// Never seen by scripts, marks global slots that were not defined yet.
+#define TAG_UNDEFINED 0 // 00.
 
 #define IS_BOOL(value) (((value) | 1) == TRUE_VAL)
 #define IS_NIL(value) ((value) == NIL_VAL)
 #define IS_NUMBER(value) (((value) & QNAN) != QNAN)
 #define IS_OBJ(value) (((value) & (QNAN | SIGN_BIT)) == (QNAN | SIGN_BIT))
+#define IS_UNDEFINED(value) ((value) == UNDEFINED_VAL)
 
 #define AS_BOOL(value) ((value) == TRUE_VAL)
 #define AS_NUMBER(value) valueToNum(value)
@@ -33,6 +40,7 @@ typedef uint64_t Value;
 #define TRUE_VAL ((Value)(uint64_t)(QNAN | TAG_TRUE))
 #define BOOL_VAL(b) ((b) ? TRUE_VAL : FALSE_VAL)
 #define NIL_VAL ((Value)(uint64_t)(QNAN | TAG_NIL))
+#define UNDEFINED_VAL ((Value)(uint64_t)(QNAN | TAG_UNDEFINED))
 #define NUMBER_VAL(num) numToValue(num)
 
 static inline double valueToNum(Value value) {
@@ -52,7 +60,13 @@ static inline Value numToValue(double num) {
 
 #else
 
-typedef enum { VAL_BOOL, VAL_NIL, VAL_NUMBER, VAL_OBJ } ValueType;
+typedef enum {
+    VAL_BOOL,
+    VAL_NIL,
+    VAL_NUMBER,
+    VAL_OBJ,
+    VAL_UNDEFINED // Never seen by scripts, marks undefined global slots.
+} ValueType;
 
 typedef struct {
     ValueType type;
@@ -67,6 +81,7 @@ typedef struct {
 #define IS_NIL(value) ((value).type == VAL_NIL)
 #define IS_NUMBER(value) ((value).type == VAL_NUMBER)
 #define IS_OBJ(value) ((value).type == VAL_OBJ)
+#define IS_UNDEFINED(value) ((value).type == VAL_UNDEFINED)
 
 #define AS_BOOL(value) ((value).as.boolean)
 #define AS_NUMBER(value) ((value).as.number)
@@ -74,6 +89,7 @@ typedef struct {
 
 #define BOOL_VAL(value) ((Value){VAL_BOOL, {.boolean = value}})
 #define NIL_VAL ((Value){VAL_NIL, {.number = 0}})
+#define UNDEFINED_VAL ((Value){VAL_UNDEFINED, {.number = 0}})
 #define NUMBER_VAL(value) ((Value){VAL_NUMBER, {.number = value}})
 #define OBJ_VAL(object) ((Value){VAL_OBJ, {.obj = (Obj*)object}})
 
@@ -86,9 +102,10 @@ typedef struct {
 } ValueArray;
 
 void initValueArray(ValueArray* array);
-void writeValueArray(ValueArray* array, Value value);
+void writeValueArray(VM* vm, ValueArray* array, Value value);
 void printValue(Value value);
+void fprintValue(FILE* file, Value value);
 bool valuesEqual(Value a, Value b);
-void freeValueArray(ValueArray* array);
+void freeValueArray(VM* vm, ValueArray* array);
 
 #endif
@@ -3,154 +3,346 @@
 #include <string.h>
 #include <time.h>
 
+#include "cache.h"
 #include "compiler.h"
 #include "debug.h"
+#include "jit.h"
 #include "object.h"
+#include "profile.h"
+#include "shape.h"
+#include "trace.h"
 #include "vm.h"
 
-VM vm;
-
-static inline Value clockNative(int argCount, Value* args) {
+static inline Value clockNative(VM* vm, int argCount, Value* args) {
+    (void)vm;
     (void)argCount;
     (void)args;
     return NUMBER_VAL((double)clock() / CLOCKS_PER_SEC);
 }
 
-static inline void resetStack() { vm.stackTop = vm.stack; }
-
-static void runtimeError(const char* format, ...) {
-    va_list args;
-    va_start(args, format);
-    vfprintf(stderr, format, args);
-    va_end(args);
-    fputs("\n", stderr);
+static inline void resetStack(VM* vm) {
+    if (vm->callProfiler != NULL)
+        unwindCalls(vm);
+    vm->stackTop = vm->stack;
+    vm->frameCount = 0;
+    vm->openUpvalues = NULL;
+#ifdef JIT
+    traceAbort(vm);
+#endif
+}
 
-    for (int i = vm.frameCount - 1; i >= 0; i--) {
-        CallFrame* frame = &vm.frames[i];
+// Prints the line each frame is at, innermost first.
+static void printStackTrace(VM* vm) {
+    for (int i = vm->frameCount - 1; i >= 0; i--) {
+        CallFrame* frame = &vm->frames[i];
         ObjFunction* function = frame->closure->function;
         // -1 because the IP is sitting on the next instruction to be
         // executed.
         size_t instruction = frame->ip - function->chunk.code - 1;
-        fprintf(stderr, "[line %d] in ",
+        fprintf(vm->err, "[line %d] in ",
                 getLine(&function->chunk, instruction));
         if (function->name == NULL) {
-            fprintf(stderr, "script\n");
+            fprintf(vm->err, "script\n");
         } else {
-            fprintf(stderr, "%s()\n", function->name->chars);
+            fprintf(vm->err, "%s()\n", function->name->chars);
         }
     }
+}
 
-    resetStack();
+static void runtimeError(VM* vm, const char* format, ...) {
+    va_list args;
+    va_start(args, format);
+    vfprintf(vm->err, format, args);
+    va_end(args);
+    fputs("\n", vm->err);
+
+    printStackTrace(vm);
+    resetStack(vm);
+}
+
+int globalSlot(VM* vm, ObjString* name) {
+    Value slot;
+    if (tableGet(&vm->globalSlots, name, &slot))
+        return (int)AS_NUMBER(slot);
+
+    push(vm, OBJ_VAL(name));
+    writeValueArray(vm, &vm->globalNames, OBJ_VAL(name));
+    writeValueArray(vm, &vm->globalValues, UNDEFINED_VAL);
+    tableSet(vm, &vm->globalSlots, name, NUMBER_VAL(vm->globalNames.count - 1));
+    pop(vm);
+    return vm->globalNames.count - 1;
+}
+
+static void defineNative(VM* vm, const char* name, NativeFn function) {
+    int slot = globalSlot(vm, copyString(vm, name, (int)strlen(name)));
+    Value native = OBJ_VAL(newNative(vm, name, function));
+    vm->globalValues.values[slot] = native;
+}
+
+static inline Value peek(VM* vm, int distance) {
+    return vm->stackTop[-1 - distance];
 }
 
-static void defineNative(const char* name, NativeFn function) {
-    push(OBJ_VAL(copyString(name, (int)strlen(name))));
-    push(OBJ_VAL(newNative(function)));
-    tableSet(&vm.globals, AS_STRING(vm.stack[0]), vm.stack[1]);
-    pop();
-    pop();
+// Counts the growth of the stacks the VM runs on towards the next collection
+// when they are a fiber's, which are freed with it. The VM's own stacks are
+// not part of the heap.
+static void countStacks(VM* vm, size_t oldSize, size_t newSize) {
+    if (vm->fiber != NULL)
+        countAllocation(vm, oldSize, newSize);
 }
 
-static inline Value peek(int distance) { return vm.stackTop[-1 - distance]; }
+// Moves the value stack to a new array of the given capacity, along with the
+// slots of the frames and the open upvalues pointing into it.
+static void moveStack(VM* vm, int capacity) {
+    Value* stack = malloc(sizeof(Value) * capacity);
+    if (stack == NULL)
+        exit(1);
+    memcpy(stack, vm->stack, sizeof(Value) * (vm->stackTop - vm->stack));
+
+    for (int i = 0; i < vm->frameCount; i++)
+        vm->frames[i].slots = stack + (vm->frames[i].slots - vm->stack);
+    for (ObjUpvalue* upvalue = vm->openUpvalues; upvalue != NULL;
+         upvalue = upvalue->next) {
+        snapshotBarrier(vm, &upvalue->obj);
+        upvalue->location = stack + (upvalue->location - vm->stack);
+    }
+    vm->stackTop = stack + (vm->stackTop - vm->stack);
+
+    free(vm->stack);
+    vm->stack = stack;
+    countStacks(vm, sizeof(Value) * vm->stackCapacity,
+                sizeof(Value) * capacity);
+    vm->stackCapacity = capacity;
+}
+
+// Makes room for the stack to hold needed slots, false past STACK_MAX.
+// Pointers to stack slots held across a call must be reloaded after it.
+static bool reserveStack(VM* vm, ptrdiff_t needed) {
+    if (needed > vm->stackCapacity) {
+        if (needed > STACK_MAX)
+            return false;
+        int capacity = vm->stackCapacity * 2;
+        while (capacity < needed)
+            capacity *= 2;
+        moveStack(vm, capacity < STACK_MAX ? capacity : STACK_MAX);
+    }
+    return true;
+}
+
+// Stack slots needed to run closure in a frame starting at slots.
+static inline ptrdiff_t frameEnd(VM* vm, Value* slots, ObjClosure* closure) {
+    return slots - vm->stack + closure->function->maxSlots + STACK_HEADROOM;
+}
+
+// Makes room for one more frame and the stack slots it needs, false past
+// FRAMES_MAX or STACK_MAX. Pointers to frames and stack slots held across a
+// call must be reloaded after it.
+static bool growStacks(VM* vm, ptrdiff_t needed) {
+    if (vm->frameCount == vm->frameCapacity) {
+        if (vm->frameCapacity == FRAMES_MAX)
+            return false;
+        int oldCapacity = vm->frameCapacity;
+        int capacity = vm->frameCapacity * 2;
+        vm->frameCapacity = capacity < FRAMES_MAX ? capacity : FRAMES_MAX;
+        vm->frames = realloc(vm->frames, sizeof(CallFrame) * vm->frameCapacity);
+        if (vm->frames == NULL)
+            exit(1);
+        countStacks(vm, sizeof(CallFrame) * oldCapacity,
+                    sizeof(CallFrame) * vm->frameCapacity);
+    }
+    return reserveStack(vm, needed);
+}
+
+// Starts the function of a frame that was just set up, on top of vm->frames.
+// Charges the SIGPROF ticks counted so far to the current stack, when
+// --profile is sampling. Every frame's ip must be up to date.
+static inline void pollProfiler(VM* vm) {
+    if (__builtin_expect(profilePending != 0, false))
+        profileSample(vm);
+}
+
+// Whether run() must see every instruction, keeping compiled code and traces
+// out of the way.
+static inline bool instrumented(VM* vm) {
+    return vm->opcodeStats != NULL || vm->callProfiler != NULL;
+}
+
+static inline bool enterFrame(VM* vm, CallFrame* frame) {
+#ifdef JIT
+    // Compiled code runs the whole call before returning here, as if the
+    // frame had already been popped by OP_RETURN. After a tail call to
+    // another function it returns early, leaving the frame to the callee for
+    // the interpreter, so that mutual recursion doesn't grow the native
+    // stack. Fibers stay interpreted, as yield() leaves run() expecting to
+    // find nothing but the fiber's frames when resumed, and so do
+    // instrumented runs.
+    ObjFunction* function = frame->closure->function;
+    if (function->native == NULL && ++function->calls == JIT_THRESHOLD)
+        jitCompile(function);
+    if (function->native != NULL && vm->fiber == NULL && !instrumented(vm))
+        return ((JitFn)function->native)(vm, frame);
+#else
+    (void)vm;
+    (void)frame;
+#endif
+    return true;
+}
 
-static bool call(ObjClosure* closure, int argCount) {
+static bool call(VM* vm, ObjClosure* closure, int argCount) {
     if (argCount != closure->function->arity) {
-        runtimeError("Expected %d arguments but got %d.",
+        runtimeError(vm, "Expected %d arguments but got %d.",
                      closure->function->arity, argCount);
         return false;
     }
 
-    if (vm.frameCount == FRAMES_MAX) {
-        runtimeError("Stack overflow.");
+    ptrdiff_t needed = frameEnd(vm, vm->stackTop - argCount - 1, closure);
+    if (__builtin_expect(vm->frameCount == vm->frameCapacity ||
+                             needed > vm->stackCapacity,
+                         false) &&
+        !growStacks(vm, needed)) {
+        runtimeError(vm, "Stack overflow.");
         return false;
     }
 
-    CallFrame* frame = &vm.frames[vm.frameCount++];
+    CallFrame* frame = &vm->frames[vm->frameCount++];
     frame->closure = closure;
     frame->ip = closure->function->chunk.code;
 
-    frame->slots = vm.stackTop - argCount - 1;
-    return true;
+    frame->slots = vm->stackTop - argCount - 1;
+    if (__builtin_expect(vm->callProfiler != NULL, false))
+        enterCall(vm, frame);
+    pollProfiler(vm);
+    return enterFrame(vm, frame);
 }
 
-bool callValue(Value callee, int argCount) {
+bool callValue(VM* vm, Value callee, int argCount) {
     if (__builtin_expect(IS_OBJ(callee), true)) {
         switch (OBJ_TYPE(callee)) {
-            case OBJ_CLOSURE: return call(AS_CLOSURE(callee), argCount);
+            case OBJ_CLOSURE: return call(vm, AS_CLOSURE(callee), argCount);
             case OBJ_NATIVE: {
-                NativeFn native = AS_NATIVE(callee);
-                Value result = native(argCount, vm.stackTop - argCount);
-                vm.stackTop -= argCount + 1;
-                push(result);
+                Value* args = vm->stackTop - argCount;
+                Value result =
+                    __builtin_expect(vm->callProfiler != NULL, false)
+                        ? callNative(vm, (ObjNative*)AS_OBJ(callee),
+                                     argCount, args)
+                        : AS_NATIVE(callee)(vm, argCount, args);
+                // Natives fail with UNDEFINED_VAL, once they have reported the
+                // error or suspended the running fiber.
+                if (__builtin_expect(IS_UNDEFINED(result), false))
+                    return false;
+                vm->stackTop -= argCount + 1;
+                push(vm, result);
                 return true;
             }
             case OBJ_CLASS: {
                 ObjClass* klass = AS_CLASS(callee);
-                vm.stackTop[-argCount - 1] = OBJ_VAL(newInstance(klass));
+                vm->stackTop[-argCount - 1] = OBJ_VAL(newInstance(vm, klass));
 
                 Value initializer;
-                if (tableGet(&klass->methods, vm.initString, &initializer)) {
-                    return call(AS_CLOSURE(initializer), argCount);
+                if (tableGet(&klass->methods, vm->initString, &initializer)) {
+                    return call(vm, AS_CLOSURE(initializer), argCount);
                 } else if (__builtin_expect(argCount != 0, false)) {
-                    runtimeError("Expected 0 arguments but got %d.", argCount);
+                    runtimeError(vm, "Expected 0 arguments but got %d.",
+                                 argCount);
                     return false;
                 }
                 return true;
             }
             case OBJ_BOUND_METHOD: {
                 ObjBoundMethod* bound = AS_BOUND_METHOD(callee);
-                vm.stackTop[-argCount - 1] = bound->receiver;
-                return call(bound->method, argCount);
+                vm->stackTop[-argCount - 1] = bound->receiver;
+                return call(vm, bound->method, argCount);
             }
             default: break;
         }
     }
 
-    runtimeError("Can only call functions and classes.");
+    runtimeError(vm, "Can only call functions and classes.");
     return false;
 }
 
-static bool invokeFromClass(ObjClass* klass, ObjString* name, int argCount) {
+// Adds an entry to a cache of the running function, which may be older than
+// the classes and methods the entry holds.
+static void learn(VM* vm, InlineCache* cache, CacheEntry entry) {
+    Obj* function = (Obj*)vm->frames[vm->frameCount - 1].closure->function;
+    snapshotBarrier(vm, function);
+    cacheAdd(cache, entry);
+    writeBarrierAll(vm, function);
+}
+
+// Calls a method of klass. Unless cache is NULL, it learns the method for
+// receivers of the given shape.
+static bool invokeFromClass(VM* vm, ObjClass* klass, ObjString* name,
+                            int argCount, InlineCache* cache, Shape* shape) {
     Value method;
     if (!tableGet(&klass->methods, name, &method)) {
-        runtimeError("Undefined property '%s'.", name->chars);
+        runtimeError(vm, "Undefined property '%s'.", name->chars);
         return false;
     }
-    return call(AS_CLOSURE(method), argCount);
+    if (cache != NULL) {
+        learn(vm, cache, (CacheEntry){.shape = shape,
+                                      .klass = klass,
+                                      .method = AS_CLOSURE(method)});
+    }
+    return call(vm, AS_CLOSURE(method), argCount);
 }
 
-static bool invoke(ObjString* name, int argCount) {
-    Value receiver = peek(argCount);
+static bool invoke(VM* vm, ObjString* name, int argCount, InlineCache* cache) {
+    Value receiver = peek(vm, argCount);
     if (!IS_INSTANCE(receiver)) {
-        runtimeError("Only instances have methods.");
+        runtimeError(vm, "Only instances have methods.");
         return false;
     }
     ObjInstance* instance = AS_INSTANCE(receiver);
+    CacheEntry* entry = cacheLookup(cache, instance->shape, instance->klass);
+    if (entry != NULL && entry->method != NULL)
+        return call(vm, entry->method, argCount);
+
     Value value;
-    if (tableGet(&instance->fields, name, &value)) {
-        vm.stackTop[-argCount - 1] = value;
-        return callValue(value, argCount);
+    if (entry != NULL) {
+        value = *instanceSlot(instance, entry->slot);
+    } else if (getField(instance, name, &value)) {
+        if (instance->shape != NULL) {
+            learn(vm, cache, (CacheEntry){
+                                 .shape = instance->shape,
+                                 .klass = instance->klass,
+                                 .slot = shapeFind(instance->shape, name)});
+        }
+    } else {
+        // Fields added to a dictionary could shadow the method later on.
+        return invokeFromClass(vm, instance->klass, name, argCount,
+                               instance->shape == NULL ? NULL : cache,
+                               instance->shape);
     }
+    vm->stackTop[-argCount - 1] = value;
+    return callValue(vm, value, argCount);
+}
 
-    return invokeFromClass(instance->klass, name, argCount);
+// Nothing about the receiver matters, the superclass alone picks the method.
+static bool superInvoke(VM* vm, ObjClass* superclass, ObjString* name,
+                        int argCount, InlineCache* cache) {
+    CacheEntry* entry = cacheLookup(cache, NULL, superclass);
+    if (entry != NULL)
+        return call(vm, entry->method, argCount);
+    return invokeFromClass(vm, superclass, name, argCount, cache, NULL);
 }
 
-static bool bindMethod(ObjClass* klass, ObjString* name) {
+static bool bindMethod(VM* vm, ObjClass* klass, ObjString* name) {
     Value method;
     if (!tableGet(&klass->methods, name, &method)) {
         return false;
     }
     // push(OBJ_VAL(name));
-    ObjBoundMethod* bound = newBoundMethod(peek(0), AS_CLOSURE(method));
+    ObjBoundMethod* bound = newBoundMethod(vm, peek(vm, 0), AS_CLOSURE(method));
     // pop();
-    pop();
-    push(OBJ_VAL(bound));
+    pop(vm);
+    push(vm, OBJ_VAL(bound));
     return true;
 }
 
-static ObjUpvalue* captureUpvalue(Value* local) {
+static ObjUpvalue* captureUpvalue(VM* vm, Value* local) {
     ObjUpvalue* prevUpvalue = NULL;
-    ObjUpvalue* upvalue = vm.openUpvalues;
+    ObjUpvalue* upvalue = vm->openUpvalues;
     while (upvalue != NULL && upvalue->location > local) {
         prevUpvalue = upvalue;
         upvalue = upvalue->next;
@@ -158,39 +350,98 @@ static ObjUpvalue* captureUpvalue(Value* local) {
     if (upvalue != NULL && upvalue->location == local) {
         return upvalue;
     }
-    ObjUpvalue* createdUpvalue = newUpvalue(local);
+    ObjUpvalue* createdUpvalue = newUpvalue(vm, local);
 
     createdUpvalue->next = upvalue;
     if (prevUpvalue == NULL) {
-        vm.openUpvalues = createdUpvalue;
+        vm->openUpvalues = createdUpvalue;
     } else {
         prevUpvalue->next = createdUpvalue;
     }
     return createdUpvalue;
 }
 
-static void closeUpvalues(Value* last) {
-    while (vm.openUpvalues != NULL && vm.openUpvalues->location >= last) {
-        ObjUpvalue* upvalue = vm.openUpvalues;
+static inline void setUpvalue(VM* vm, ObjUpvalue* upvalue, Value value) {
+    Obj* object = NULL;
+    if (upvalue->location == &upvalue->closed)
+        object = &upvalue->obj;
+    else if (upvalue->fiber != NULL)
+        object = &upvalue->fiber->obj; // Into its stack.
+    if (object != NULL)
+        snapshotBarrier(vm, object);
+    *upvalue->location = value;
+    if (object != NULL)
+        writeBarrier(vm, object, value);
+}
+
+static void closeUpvalues(VM* vm, Value* last) {
+    while (vm->openUpvalues != NULL && vm->openUpvalues->location >= last) {
+        ObjUpvalue* upvalue = vm->openUpvalues;
+        snapshotBarrier(vm, &upvalue->obj);
         upvalue->closed = *upvalue->location;
+        writeBarrier(vm, &upvalue->obj, upvalue->closed);
         upvalue->location = &upvalue->closed;
-        vm.openUpvalues = upvalue->next;
+        vm->openUpvalues = upvalue->next;
+    }
+}
+
+// The closure a call in tail position runs in the frame of its caller, NULL
+// for natives and classes that get an ordinary call.
+static ObjClosure* tailCallee(VM* vm, Value callee, int argCount) {
+    if (IS_CLOSURE(callee))
+        return AS_CLOSURE(callee);
+    if (IS_BOUND_METHOD(callee)) {
+        ObjBoundMethod* bound = AS_BOUND_METHOD(callee);
+        vm->stackTop[-argCount - 1] = bound->receiver;
+        return bound->method;
+    }
+    return NULL;
+}
+
+// Hands the frame of a function returning the result of a call over to the
+// callee. The caller is done with its locals, so its upvalues are closed and
+// the callee and arguments slide down over them.
+static bool reuseFrame(VM* vm, CallFrame* frame, ObjClosure* closure,
+                       int argCount) {
+    if (argCount != closure->function->arity) {
+        runtimeError(vm, "Expected %d arguments but got %d.",
+                     closure->function->arity, argCount);
+        return false;
     }
+
+    closeUpvalues(vm, frame->slots);
+    memmove(frame->slots, vm->stackTop - argCount - 1,
+            sizeof(Value) * (argCount + 1));
+    vm->stackTop = frame->slots + argCount + 1;
+    if (!reserveStack(vm, frameEnd(vm, frame->slots, closure))) {
+        runtimeError(vm, "Stack overflow.");
+        return false;
+    }
+    // Profiled as a return followed by a call.
+    if (vm->callProfiler != NULL)
+        exitCall(vm);
+    frame->closure = closure;
+    frame->ip = closure->function->chunk.code;
+    if (vm->callProfiler != NULL)
+        enterCall(vm, frame);
+    return true;
 }
 
-static void defineMethod(ObjString* name) {
-    Value method = peek(0);
-    ObjClass* klass = AS_CLASS(peek(1));
-    tableSet(&klass->methods, name, method);
-    pop();
+static void defineMethod(VM* vm, ObjString* name) {
+    Value method = peek(vm, 0);
+    ObjClass* klass = AS_CLASS(peek(vm, 1));
+    snapshotBarrier(vm, &klass->obj);
+    tableSet(vm, &klass->methods, name, method);
+    writeBarrier(vm, &klass->obj, method);
+    pop(vm);
 }
 
 static bool isFalsey(Value value) {
     return IS_NIL(value) || (IS_BOOL(value) && !AS_BOOL(value));
 }
 
-static void toString(int distance) {
-    Value value = peek(distance);
+static bool toString(VM* vm, int distance) {
+    Value value = peek(vm, distance);
     if (!IS_STRING(value)) {
         ObjString* string;
 
@@ -198,413 +449,1263 @@ static void toString(int distance) {
             char buffer[24];
             int length =
                 snprintf(buffer, sizeof(buffer), "%.1f", AS_NUMBER(value));
-            string = copyString(buffer, length);
+            string = copyString(vm, buffer, length);
         } else if (IS_BOOL(value)) {
-            string =
-                AS_BOOL(value) ? copyString("true", 4) : copyString("false", 5);
+            string = AS_BOOL(value) ? copyString(vm, "true", 4)
+                                    : copyString(vm, "false", 5);
         } else if (IS_NIL(value)) {
-            string = copyString("nil", 3);
+            string = copyString(vm, "nil", 3);
         } else {
-            runtimeError("Cannot convert object value to string.");
-            return;
+            runtimeError(vm, "Cannot convert object value to string.");
+            return false;
         }
 
         // side note : no need to worry about freeing anything, it can't be
         // an obj :)
-        vm.stackTop[-1 - distance] = OBJ_VAL(string);
+        vm->stackTop[-1 - distance] = OBJ_VAL(string);
     }
+    return true;
 }
 
-static void concatenate() {
+static void concatenate(VM* vm) {
     // Keep them on the stack to avoid getting GC'ed
-    ObjString* b = AS_STRING(peek(0));
-    ObjString* a = AS_STRING(peek(1));
+    ObjString* b = AS_STRING(peek(vm, 0));
+    ObjString* a = AS_STRING(peek(vm, 1));
 
     int length = a->length + b->length;
-    char str[length];
+    char str[length + 1];
 
     memcpy(str, a->chars, a->length);
     memcpy(str + a->length, b->chars, b->length);
     str[length] = '\0';
 
-    ObjString* result = takeString(str, length);
+    ObjString* result = takeString(vm, str, length);
 
     // needed ? those are not variable strings but raw data
-    tableSet(&vm.strings, result, NIL_VAL);
-
-    pop();
-    pop();
-    push(OBJ_VAL(result));
-}
-
-void initVM() {
-    resetStack();
-    vm.objects = NULL;
-    initTable(&vm.strings);
-    initTable(&vm.globals);
-    vm.frameCount = 0;
-    vm.initString = NULL;
-    vm.initString = copyString("init", 4);
-    defineNative("clock", clockNative);
-    vm.openUpvalues = NULL;
-    vm.bytesAllocated = 0;
-    vm.nextGC = 1024 * 1024;
-    vm.currentGC = 0;
-    vm.grayCount = 0;
-    vm.grayCapacity = 0;
-    vm.grayStack = NULL;
-}
-
-InterpretResult run() {
-    CallFrame* frame = &vm.frames[vm.frameCount - 1];
+    // Rooted while interning, the table may grow and trigger a collection.
+    push(vm, OBJ_VAL(result));
+    tableSet(vm, &vm->strings, result, NIL_VAL);
+    pop(vm);
+
+    pop(vm);
+    pop(vm);
+    push(vm, OBJ_VAL(result));
+}
+
+// Register operands are local slots, or constants when RK_CONSTANT is set.
+static inline Value readRegister(CallFrame* frame, uint8_t operand) {
+    if (operand & RK_CONSTANT)
+        return frame->closure->function->chunk.constants
+            .values[operand & ~RK_CONSTANT];
+    return frame->slots[operand];
+}
+
+static inline void writeRegister(VM* vm, CallFrame* frame, uint8_t operand,
+                                 Value value) {
+    if (operand == R_STACK) {
+        push(vm, value);
+    } else {
+        frame->slots[operand] = value;
+    }
+}
+
+// Replaces the two values on top of the stack with their sum, or with their
+// concatenation when either one is a string.
+static inline bool addValues(VM* vm) {
+    if (__builtin_expect(IS_NUMBER(peek(vm, 0)) && IS_NUMBER(peek(vm, 1)),
+                         true)) {
+        double b = AS_NUMBER(pop(vm));
+        double a = AS_NUMBER(pop(vm));
+        push(vm, NUMBER_VAL(a + b));
+    } else if (IS_STRING(peek(vm, 0)) || IS_STRING(peek(vm, 1))) {
+        if (!toString(vm, 0) || !toString(vm, 1))
+            return false;
+        concatenate(vm);
+    } else {
+        runtimeError(vm, "Operands must be two numbers or one of them "
+                     "must be a strings.");
+        return false;
+    }
+    return true;
+}
+
+static inline void defineGlobal(VM* vm, int slot) {
+    vm->globalValues.values[slot] = pop(vm);
+}
+
+static inline bool getGlobal(VM* vm, int slot) {
+    Value value = vm->globalValues.values[slot];
+    if (__builtin_expect(IS_UNDEFINED(value), false)) {
+        runtimeError(vm, "Undefined variable %s.\n",
+                     AS_STRING(vm->globalNames.values[slot])->chars);
+        return false;
+    }
+    push(vm, value);
+    return true;
+}
+
+static inline bool setGlobal(VM* vm, int slot) {
+    Value* value = &vm->globalValues.values[slot];
+    if (__builtin_expect(IS_UNDEFINED(*value), false)) {
+        runtimeError(vm, "Undefined variable %s\n",
+                     AS_STRING(vm->globalNames.values[slot])->chars);
+        return false;
+    }
+    *value = peek(vm, 0);
+    return true;
+}
+
+// Reads the operands of OP_CLOSURE starting at ip, returns the next ip.
+static inline uint8_t* makeClosure(VM* vm, CallFrame* frame, uint8_t* ip) {
+    ObjFunction* function =
+        AS_FUNCTION(frame->closure->function->chunk.constants.values[*ip++]);
+    ObjClosure* closure = newClosure(vm, function);
+    push(vm, OBJ_VAL(closure));
+
+    for (int i = 0; i < closure->upvalueCount; i++) {
+        uint8_t isLocal = *ip++;
+        uint8_t index = *ip++;
+
+        ObjUpvalue* upvalue = isLocal
+                                  ? captureUpvalue(vm, frame->slots + index)
+                                  : frame->closure->upvalues[index];
+        // Capturing allocates, the closure may be old by now, or not yet
+        // traced by a collection that started.
+        snapshotBarrier(vm, &closure->obj);
+        closure->upvalues[i] = upvalue;
+        writeBarrier(vm, &closure->obj, OBJ_VAL(upvalue));
+    }
+    return ip;
+}
+
+static inline bool getProperty(VM* vm, ObjString* name, InlineCache* cache) {
+    if (!IS_INSTANCE(peek(vm, 0))) {
+        runtimeError(vm, "Only instances have properties.");
+        return false;
+    }
+    ObjInstance* instance = AS_INSTANCE(peek(vm, 0));
+    Value value;
+
+    CacheEntry* entry = cacheLookup(cache, instance->shape, instance->klass);
+    if (entry != NULL) {
+        value = entry->method == NULL
+                    ? *instanceSlot(instance, entry->slot)
+                    : OBJ_VAL(newBoundMethod(vm, peek(vm, 0), entry->method));
+        pop(vm); // Instance.
+        push(vm, value);
+        return true;
+    }
+
+    if (getField(instance, name, &value)) {
+        if (instance->shape != NULL) {
+            learn(vm, cache, (CacheEntry){
+                                 .shape = instance->shape,
+                                 .klass = instance->klass,
+                                 .slot = shapeFind(instance->shape, name)});
+        }
+        pop(vm); // Instance.
+        push(vm, value);
+        return true;
+    }
+
+    if (!bindMethod(vm, instance->klass, name)) {
+        runtimeError(vm, "Undefined property '%s'.", name->chars);
+        return false;
+    }
+    if (instance->shape != NULL) {
+        learn(vm, cache,
+              (CacheEntry){.shape = instance->shape,
+                           .klass = instance->klass,
+                           .method = AS_BOUND_METHOD(peek(vm, 0))->method});
+    }
+    return true;
+}
+
+// Stores only depend on the layout, so their entries leave out the class and
+// are shared by instances of all classes.
+static inline bool setProperty(VM* vm, ObjString* name, InlineCache* cache) {
+    if (!IS_INSTANCE(peek(vm, 1))) {
+        runtimeError(vm, "Only instances have fields.");
+        return false;
+    }
+    ObjInstance* instance = AS_INSTANCE(peek(vm, 1));
+    Shape* shape = instance->shape;
+    CacheEntry* entry = cacheLookup(cache, shape, NULL);
+    if (entry != NULL)
+        snapshotBarrier(vm, &instance->obj);
+    if (entry != NULL && entry->transition != NULL) {
+        ensureSlots(vm, instance, entry->transition->slotCount);
+        // As in setField(), fill the slot before switching shapes.
+        *instanceSlot(instance, entry->slot) = peek(vm, 0);
+        writeBarrier(vm, &instance->obj, peek(vm, 0));
+        instance->shape = entry->transition;
+    } else if (entry != NULL) {
+        *instanceSlot(instance, entry->slot) = peek(vm, 0);
+        writeBarrier(vm, &instance->obj, peek(vm, 0));
+    } else {
+        setField(vm, instance, name, peek(vm, 0));
+        // Shapes aren't objects, the entry needs no write barrier. The
+        // marker thread reads the caches though.
+        if (shape != NULL && instance->shape != NULL) {
+            snapshotBarrier(
+                vm, (Obj*)vm->frames[vm->frameCount - 1].closure->function);
+            cacheAdd(cache, (CacheEntry){
+                                .shape = shape,
+                                .transition = instance->shape == shape
+                                                  ? NULL
+                                                  : instance->shape,
+                                .slot = shapeFind(instance->shape, name)});
+        }
+    }
+
+    Value value = pop(vm);
+    pop(vm);
+    push(vm, value);
+    return true;
+}
+
+static inline bool inherit(VM* vm) {
+    Value superclass = peek(vm, 1);
+    if (!IS_CLASS(superclass)) {
+        runtimeError(vm, "Superclass must be a class.");
+        return false;
+    }
+    ObjClass* subclass = AS_CLASS(peek(vm, 0));
+    snapshotBarrier(vm, &subclass->obj);
+    tableAddAll(vm, &AS_CLASS(superclass)->methods, &subclass->methods);
+    writeBarrierAll(vm, &subclass->obj);
+    pop(vm); // Subclass.
+    return true;
+}
+
+static InterpretResult execute(VM* vm, int baseFrame);
+
+// Exchanges the stacks the VM runs on with those the fiber holds.
+static void swapStacks(VM* vm, ObjFiber* fiber) {
+    snapshotBarrier(vm, &fiber->obj);
+#define SWAP(type, field)                                                      \
+    do {                                                                       \
+        type swap = vm->field;                                                 \
+        vm->field = fiber->field;                                              \
+        fiber->field = swap;                                                   \
+    } while (false)
+    SWAP(CallFrame*, frames);
+    SWAP(int, frameCount);
+    SWAP(int, frameCapacity);
+    SWAP(Value*, stack);
+    SWAP(Value*, stackTop);
+    SWAP(int, stackCapacity);
+    SWAP(ObjUpvalue*, openUpvalues);
+#undef SWAP
+    // The stacks it took were roots, changed without write barriers.
+    writeBarrierAll(vm, &fiber->obj);
+}
+
+// fiber(fn) makes a fiber that calls fn, with the value of the first resume()
+// as its argument if it takes one.
+static Value fiberNative(VM* vm, int argCount, Value* args) {
+    if (argCount != 1 || !IS_CLOSURE(args[0]) ||
+        AS_CLOSURE(args[0])->function->arity > 1) {
+        runtimeError(vm, "fiber() takes a function of at most one argument.");
+        return UNDEFINED_VAL;
+    }
+    return OBJ_VAL(newFiber(vm, AS_CLOSURE(args[0])));
+}
+
+// resume(fiber, value) runs the fiber until it yields or returns and gives
+// back the value it passed. The fiber runs on a nested run() of its own, so
+// resuming works from compiled code as well, and yield() only has to make
+// that run() return.
+static Value resumeNative(VM* vm, int argCount, Value* args) {
+    if (argCount < 1 || argCount > 2 || !IS_FIBER(args[0])) {
+        runtimeError(vm, "resume() takes a fiber and an optional value.");
+        return UNDEFINED_VAL;
+    }
+    ObjFiber* fiber = AS_FIBER(args[0]);
+    if (fiber->state == FIBER_RUNNING) {
+        runtimeError(vm, "Can't resume a running fiber.");
+        return UNDEFINED_VAL;
+    }
+    if (fiber->state == FIBER_DONE) {
+        runtimeError(vm, "Can't resume a finished fiber.");
+        return UNDEFINED_VAL;
+    }
+    Value value = argCount == 2 ? args[1] : NIL_VAL;
+
+    swapStacks(vm, fiber);
+    fiber->caller = vm->fiber;
+    vm->fiber = fiber;
+    bool ok = true;
+    if (fiber->state == FIBER_NEW) {
+        int arity = fiber->closure->function->arity;
+        push(vm, OBJ_VAL(fiber->closure));
+        if (arity == 1)
+            push(vm, value);
+        ok = call(vm, fiber->closure, arity);
+    } else {
+        // Returned by the yield() the fiber stopped in.
+        push(vm, value);
+        if (vm->callProfiler != NULL)
+            resumeCalls(vm);
+    }
+    fiber->state = FIBER_RUNNING;
+    // A yield fails the call to it, which stops run() like an error would.
+    ok = ok && (execute(vm, 0) == INTERPRET_OK ||
+                fiber->state == FIBER_SUSPENDED);
+    if (fiber->state == FIBER_RUNNING)
+        fiber->state = FIBER_DONE;
+    if (ok)
+        value = pop(vm);
+
+    vm->fiber = fiber->caller;
+    fiber->caller = NULL;
+    swapStacks(vm, fiber);
+    if (!ok) {
+        // The fiber reported its part of the trace, the resumer's follows.
+        printStackTrace(vm);
+        resetStack(vm);
+        return UNDEFINED_VAL;
+    }
+    return value;
+}
+
+// yield(value) suspends the running fiber, its resume() returns value.
+static Value yieldNative(VM* vm, int argCount, Value* args) {
+    if (vm->fiber == NULL) {
+        runtimeError(vm, "Can't yield outside of a fiber.");
+        return UNDEFINED_VAL;
+    }
+    if (argCount > 1) {
+        runtimeError(vm, "yield() takes an optional value.");
+        return UNDEFINED_VAL;
+    }
+    // The call is over, the value stays on top for resume() to take.
+    Value value = argCount == 1 ? args[0] : NIL_VAL;
+    vm->stackTop -= argCount + 1;
+    push(vm, value);
+    vm->fiber->state = FIBER_SUSPENDED;
+    if (vm->callProfiler != NULL)
+        suspendCalls(vm);
+    return UNDEFINED_VAL;
+}
+
+static Value isDoneNative(VM* vm, int argCount, Value* args) {
+    if (argCount != 1 || !IS_FIBER(args[0])) {
+        runtimeError(vm, "isDone() takes a fiber.");
+        return UNDEFINED_VAL;
+    }
+    return BOOL_VAL(AS_FIBER(args[0])->state == FIBER_DONE);
+}
+
+// Adds a number field to the instance gcStats() returns.
+static void setStat(VM* vm, ObjInstance* stats, const char* name,
+                    double value) {
+    push(vm, OBJ_VAL(copyString(vm, name, (int)strlen(name))));
+    setField(vm, stats, AS_STRING(peek(vm, 0)), NUMBER_VAL(value));
+    pop(vm);
+}
+
+// gcStats() returns what the collector measured so far, as the fields of a
+// GCStats instance. Pauses are in milliseconds.
+static Value gcStatsNative(VM* vm, int argCount, Value* args) {
+    if (argCount != 0) {
+        runtimeError(vm, "gcStats() takes no arguments.");
+        return UNDEFINED_VAL;
+    }
+    // The callee's slot keeps the class, then the instance, from the GC.
+    ObjString* name = copyString(vm, "GCStats", 7);
+    args[-1] = OBJ_VAL(name);
+    args[-1] = OBJ_VAL(newClass(vm, name));
+    ObjInstance* instance = newInstance(vm, AS_CLASS(args[-1]));
+    args[-1] = OBJ_VAL(instance);
+
+    GCStats* stats = &vm->gcStats;
+    setStat(vm, instance, "collections", stats->collections);
+    setStat(vm, instance, "minorCollections", stats->minorCollections);
+    setStat(vm, instance, "steps", stats->steps);
+    setStat(vm, instance, "promoted", stats->promoted);
+    setStat(vm, instance, "totalPause", stats->totalPause / 1e6);
+    setStat(vm, instance, "maxPause", stats->maxPause / 1e6);
+    setStat(vm, instance, "lastPause", stats->lastPause / 1e6);
+    setStat(vm, instance, "p50Pause", gcPausePercentile(vm, 0.5) / 1e6);
+    setStat(vm, instance, "p99Pause", gcPausePercentile(vm, 0.99) / 1e6);
+    setStat(vm, instance, "bytesBefore", stats->bytesBefore);
+    setStat(vm, instance, "bytesAfter", stats->bytesAfter);
+    setStat(vm, instance, "bytesAllocated", vm->bytesAllocated);
+    setStat(vm, instance, "nextGC", vm->nextGC);
+    setStat(vm, instance, "grayPeak", stats->maxGrayPeak);
+    setStat(vm, instance, "strings", stats->strings);
+    uint64_t freed = 0;
+    for (int type = 0; type < OBJ_TYPE_COUNT; type++)
+        freed += stats->freed[type];
+    setStat(vm, instance, "freed", freed);
+    setStat(vm, instance, "freedStrings", stats->freed[OBJ_STRING]);
+    setStat(vm, instance, "freedInstances", stats->freed[OBJ_INSTANCE]);
+    setStat(vm, instance, "freedClosures", stats->freed[OBJ_CLOSURE]);
+    return OBJ_VAL(instance);
+}
+
+void initVM(VM* vm) {
+    // Every field is set before the first allocation, which may collect.
+    vm->callProfiler = NULL;
+#ifdef JIT
+    memset(vm->hotLoops, 0, sizeof(vm->hotLoops));
+    vm->recorder = NULL;
+#endif
+    vm->frames = malloc(sizeof(CallFrame) * FRAMES_INITIAL);
+    vm->stack = malloc(sizeof(Value) * STACK_INITIAL);
+    if (vm->frames == NULL || vm->stack == NULL)
+        exit(1);
+    vm->frameCapacity = FRAMES_INITIAL;
+    vm->stackCapacity = STACK_INITIAL;
+    resetStack(vm);
+    initHeap(&vm->heap);
+    initTable(&vm->strings);
+    initTable(&vm->globalSlots);
+    initValueArray(&vm->globalNames);
+    initValueArray(&vm->globalValues);
+    vm->bytesAllocated = 0;
+    vm->nextGC = 1024 * 1024;
+    vm->nextMinorGC = NURSERY_SIZE;
+    vm->minorGC = false;
+    vm->gcPhase = GC_IDLE;
+    vm->gcStepSize = GC_STEP_SIZE;
+    vm->gcConcurrent = false;
+    vm->marker = NULL;
+    vm->gcThreads = 1;
+    vm->markPool = NULL;
+    vm->grayCount = 0;
+    vm->grayCapacity = 0;
+    vm->grayStack = NULL;
+    vm->rememberedCount = 0;
+    vm->rememberedCapacity = 0;
+    vm->remembered = NULL;
+    memset(&vm->gcStats, 0, sizeof(vm->gcStats));
+    vm->initString = NULL;
+    vm->rootShape = NULL;
+    vm->parser = NULL;
+    vm->fiber = NULL;
+    vm->backend = BACKEND_STACK;
+    vm->profiler = NULL;
+    vm->opcodeStats = NULL;
+    vm->out = stdout;
+    vm->err = stderr;
+
+    vm->initString = copyString(vm, "init", 4);
+    vm->rootShape = newShape(vm, NULL, NULL);
+    defineNative(vm, "clock", clockNative);
+    defineNative(vm, "fiber", fiberNative);
+    defineNative(vm, "resume", resumeNative);
+    defineNative(vm, "yield", yieldNative);
+    defineNative(vm, "isDone", isDoneNative);
+    defineNative(vm, "gcStats", gcStatsNative);
+}
+
+// Turns a quickened instruction whose guess did not hold back into its
+// generic form.
+static void deoptimize(CallFrame* frame, uint8_t* instruction) {
+    frame->closure->function->deopts++;
+    *instruction = genericOp(*instruction);
+}
+
+// Runs until the frame at baseFrame returns. Only the script's run() and those
+// of fibers start at the bottom, others run a call made from compiled code.
+static InterpretResult execute(VM* vm, int baseFrame) {
+    CallFrame* frame = &vm->frames[vm->frameCount - 1];
     register uint8_t* ip = frame->ip;
 #define READ_BYTE() (*ip++)
 #define READ_CONSTANT()                                                        \
     (frame->closure->function->chunk.constants.values[READ_BYTE()])
 #define READ_STRING() AS_STRING(READ_CONSTANT())
 #define READ_SHORT() (ip += 2, (uint16_t)((ip[-2] << 8) | ip[-1]))
+#define READ_CACHE() (&frame->closure->function->chunk.caches[READ_SHORT()])
+#define QUICKEN(function, instruction, quickened)                              \
+    do {                                                                       \
+        if ((function)->deopts < QUICKEN_MAX_DEOPTS)                           \
+            *(instruction) = (quickened);                                      \
+    } while (false)
+
+// pollProfiler() for the frame being run, whose ip lives in a register.
+#define POLL_PROFILER()                                                        \
+    do {                                                                       \
+        if (__builtin_expect(profilePending != 0, false)) {                    \
+            frame->ip = ip;                                                    \
+            profileSample(vm);                                                 \
+        }                                                                      \
+    } while (false)
 
 #define BINARY_OP(valueType, op)                                               \
     do {                                                                       \
-        if (__builtin_expect(!IS_NUMBER(peek(0)) || !IS_NUMBER(peek(1)),       \
-                             false)) {                                         \
-            runtimeError("Operands must be numbers.");                         \
+        if (__builtin_expect(                                                  \
+                !IS_NUMBER(peek(vm, 0)) || !IS_NUMBER(peek(vm, 1)), false)) {  \
+            runtimeError(vm, "Operands must be numbers.");                     \
             return INTERPRET_RUNTIME_ERROR;                                    \
         }                                                                      \
-        double b = AS_NUMBER(pop());                                           \
-        double a = AS_NUMBER(pop());                                           \
-        push(valueType(a op b));                                               \
+        double b = AS_NUMBER(pop(vm));                                         \
+        double a = AS_NUMBER(pop(vm));                                         \
+        push(vm, valueType(a op b));                                           \
+    } while (false)
+
+#define REGISTER_BINARY_OP(valueType, op)                                      \
+    do {                                                                       \
+        uint8_t dst = READ_BYTE();                                             \
+        Value a = readRegister(frame, READ_BYTE());                            \
+        Value b = readRegister(frame, READ_BYTE());                            \
+        if (__builtin_expect(!IS_NUMBER(a) || !IS_NUMBER(b), false)) {         \
+            runtimeError(vm, "Operands must be numbers.");                     \
+            return INTERPRET_RUNTIME_ERROR;                                    \
+        }                                                                      \
+        writeRegister(vm, frame, dst,                                          \
+                      valueType(AS_NUMBER(a) op AS_NUMBER(b)));                \
+    } while (false)
+
+#define REGISTER_JUMP_IF_FALSE(op)                                             \
+    do {                                                                       \
+        Value a = readRegister(frame, READ_BYTE());                            \
+        Value b = readRegister(frame, READ_BYTE());                            \
+        uint16_t offset = READ_SHORT();                                        \
+        if (__builtin_expect(!IS_NUMBER(a) || !IS_NUMBER(b), false)) {         \
+            runtimeError(vm, "Operands must be numbers.");                     \
+            return INTERPRET_RUNTIME_ERROR;                                    \
+        }                                                                      \
+        if (!(AS_NUMBER(a) op AS_NUMBER(b))) {                                 \
+            push(vm, BOOL_VAL(false));                                         \
+            ip += offset;                                                      \
+        }                                                                      \
     } while (false)
 
-// Caching
-#ifdef NAN_BOXING
-    Entry lastGlobalAccessed = {NULL, 0};
+#ifdef DEBUG_TRACE_EXECUTION
+#define TRACE_INSTRUCTION()                                                    \
+    do {                                                                       \
+        printf(" ");                                                           \
+        for (Value* slot = vm->stack; slot < vm->stackTop; slot++) {           \
+            printf("[ ");                                                      \
+            printValue(*slot);                                                 \
+            printf(" ]");                                                      \
+        }                                                                      \
+        printf("\n");                                                          \
+        disassembleInstruction(vm,                                             \
+            &frame->closure->function->chunk,                                  \
+            (int)(ip - frame->closure->function->chunk.code));                 \
+    } while (false)
 #else
-    Entry lastGlobalAccessed = {NULL, {0}};
+#define TRACE_INSTRUCTION() do { } while (false)
 #endif
 
-#ifdef DEBUG_PROFILE_CODE
-    int counts[OP_CALL + 1] = {0};
+// Every handler ends with DISPATCH(). With computed gotos each handler jumps
+// straight to the next one through its own indirect branch, which the branch
+// predictor can learn per opcode. The switch build funnels everything back
+// through the single branch at the top of the loop.
+#ifdef COMPUTED_GOTO
+    // Bytes that name no opcode go to L_UNKNOWN, the opcodes then override
+    // their entries.
+#pragma GCC diagnostic push
+#pragma GCC diagnostic ignored "-Woverride-init"
+    static void* dispatchTable[UINT8_COUNT] = {
+        [0 ... UINT8_MAX] = &&L_UNKNOWN,
+        [OP_CONSTANT] = &&L_OP_CONSTANT,
+        [OP_CONSTANT_LONG] = &&L_OP_CONSTANT_LONG,
+        [OP_NEGATE] = &&L_OP_NEGATE,
+        [OP_ADD] = &&L_OP_ADD,
+        [OP_SUBTRACT] = &&L_OP_SUBTRACT,
+        [OP_MULTIPLY] = &&L_OP_MULTIPLY,
+        [OP_DIVIDE] = &&L_OP_DIVIDE,
+        [OP_NIL] = &&L_OP_NIL,
+        [OP_TRUE] = &&L_OP_TRUE,
+        [OP_FALSE] = &&L_OP_FALSE,
+        [OP_NOT] = &&L_OP_NOT,
+        [OP_EQUAL] = &&L_OP_EQUAL,
+        [OP_GREATER] = &&L_OP_GREATER,
+        [OP_LESS] = &&L_OP_LESS,
+        [OP_RETURN] = &&L_OP_RETURN,
+        [OP_PRINT] = &&L_OP_PRINT,
+        [OP_ASSERT] = &&L_OP_ASSERT,
+        [OP_POP] = &&L_OP_POP,
+        [OP_DEFINE_GLOBAL] = &&L_OP_DEFINE_GLOBAL,
+        [OP_GET_GLOBAL] = &&L_OP_GET_GLOBAL,
+        [OP_SET_GLOBAL] = &&L_OP_SET_GLOBAL,
+        [OP_GET_LOCAL] = &&L_OP_GET_LOCAL,
+        [OP_SET_LOCAL] = &&L_OP_SET_LOCAL,
+        [OP_GET_UPVALUE] = &&L_OP_GET_UPVALUE,
+        [OP_SET_UPVALUE] = &&L_OP_SET_UPVALUE,
+        [OP_JUMP] = &&L_OP_JUMP,
+        [OP_JUMP_IF_FALSE] = &&L_OP_JUMP_IF_FALSE,
+        [OP_LOOP] = &&L_OP_LOOP,
+        [OP_CALL] = &&L_OP_CALL,
+        [OP_TAIL_CALL] = &&L_OP_TAIL_CALL,
+        [OP_CLOSURE] = &&L_OP_CLOSURE,
+        [OP_CLOSE_UPVALUE] = &&L_OP_CLOSE_UPVALUE,
+        [OP_CLASS] = &&L_OP_CLASS,
+        [OP_GET_PROPERTY] = &&L_OP_GET_PROPERTY,
+        [OP_SET_PROPERTY] = &&L_OP_SET_PROPERTY,
+        [OP_METHOD] = &&L_OP_METHOD,
+        [OP_INVOKE] = &&L_OP_INVOKE,
+        [OP_INHERIT] = &&L_OP_INHERIT,
+        [OP_GET_SUPER] = &&L_OP_GET_SUPER,
+        [OP_SUPER_INVOKE] = &&L_OP_SUPER_INVOKE,
+        [OP_ADD_LOCALS] = &&L_OP_ADD_LOCALS,
+        [OP_LESS_JUMP_IF_FALSE] = &&L_OP_LESS_JUMP_IF_FALSE,
+        [OP_INCREMENT_LOCAL] = &&L_OP_INCREMENT_LOCAL,
+        [OP_R_MOVE] = &&L_OP_R_MOVE,
+        [OP_R_ADD] = &&L_OP_R_ADD,
+        [OP_R_SUBTRACT] = &&L_OP_R_SUBTRACT,
+        [OP_R_MULTIPLY] = &&L_OP_R_MULTIPLY,
+        [OP_R_DIVIDE] = &&L_OP_R_DIVIDE,
+        [OP_R_EQUAL] = &&L_OP_R_EQUAL,
+        [OP_R_GREATER] = &&L_OP_R_GREATER,
+        [OP_R_LESS] = &&L_OP_R_LESS,
+        [OP_R_LESS_JUMP_IF_FALSE] = &&L_OP_R_LESS_JUMP_IF_FALSE,
+        [OP_R_GREATER_JUMP_IF_FALSE] = &&L_OP_R_GREATER_JUMP_IF_FALSE,
+        [OP_ADD_NUM] = &&L_OP_ADD_NUM,
+        [OP_GET_PROPERTY_SLOT] = &&L_OP_GET_PROPERTY_SLOT,
+        [OP_SET_PROPERTY_SLOT] = &&L_OP_SET_PROPERTY_SLOT,
+        [OP_INVOKE_METHOD] = &&L_OP_INVOKE_METHOD,
+    };
+#pragma GCC diagnostic pop
+
+    // With --opcode-stats every opcode first goes through L_COUNT.
+    static void* countTable[UINT8_COUNT] = {[0 ... UINT8_MAX] = &&L_COUNT};
+    void** dispatch = vm->opcodeStats != NULL ? countTable : dispatchTable;
+#ifdef JIT
+    // While a trace is recorded every opcode first goes through L_RECORD.
+    static void* recordTable[UINT8_COUNT] = {[0 ... UINT8_MAX] = &&L_RECORD};
+#define START_RECORDING() dispatch = recordTable
 #endif
-    for (;;) {
-        __builtin_prefetch(&vm.stackTop[-1], 0, 3);
-        // __builtin_prefetch(frame->closure->function->chunk.constants.values,
-        // 0,
-        //                    3);
-#ifdef DEBUG_TRACE_EXECUTION
-        printf(" ");
-        for (Value* slot = vm.stack; slot < vm.stackTop; slot++) {
-            printf("[ ");
-            printValue(*slot);
-            printf(" ]");
-        }
-        printf("\n");
-        disassembleInstruction(
-            &frame->closure->function->chunk,
-            (int)(ip - frame->closure->function->chunk.code));
+
+#define INTERPRET_LOOP DISPATCH();
+#define CASE(code) L_##code
+#define DISPATCH()                                                             \
+    do {                                                                       \
+        __builtin_prefetch(&vm->stackTop[-1], 0, 3);                           \
+        TRACE_INSTRUCTION();                                                   \
+        instruction = READ_BYTE();                                             \
+        goto* dispatch[instruction];                                           \
+    } while (false)
+#else
+#ifdef JIT
+    bool recording = false;
+#define START_RECORDING() recording = true
+#define RECORD_INSTRUCTION()                                                   \
+    do {                                                                       \
+        if (recording)                                                         \
+            recording = traceRecord(vm, frame, ip - 1);                        \
+    } while (false)
+#else
+#define RECORD_INSTRUCTION() do { } while (false)
 #endif
-        uint8_t instruction = READ_BYTE();
-#ifdef DEBUG_PROFILE_CODE
-        counts[instruction]++;
+    bool counting = vm->opcodeStats != NULL;
+#define COUNT_INSTRUCTION()                                                    \
+    do {                                                                       \
+        if (__builtin_expect(counting, false))                                 \
+            countInstruction(vm->opcodeStats, frame->closure->function,        \
+                             instruction);                                     \
+    } while (false)
+
+#define INTERPRET_LOOP                                                         \
+    loop:                                                                      \
+    __builtin_prefetch(&vm->stackTop[-1], 0, 3);                               \
+    TRACE_INSTRUCTION();                                                       \
+    instruction = READ_BYTE();                                                 \
+    COUNT_INSTRUCTION();                                                       \
+    RECORD_INSTRUCTION();                                                      \
+    switch (instruction)
+#define CASE(code) case code
+#define DISPATCH() goto loop
 #endif
-        switch (instruction) {
-            case OP_CONSTANT_LONG:
-            case OP_CONSTANT: push(READ_CONSTANT()); break;
-            case OP_NEGATE:
-                *(vm.stackTop - 1) = NUMBER_VAL(-AS_NUMBER(*(vm.stackTop - 1)));
-                break;
-            case OP_ADD: {
-                if (__builtin_expect(IS_NUMBER(peek(0)) && IS_NUMBER(peek(1)),
-                                     true)) {
-                    double b = AS_NUMBER(pop());
-                    double a = AS_NUMBER(pop());
-                    push(NUMBER_VAL(a + b));
-                } else if (IS_STRING(peek(0)) || IS_STRING(peek(1))) {
-                    if (!IS_STRING(peek(0))) {
-                        toString(0);
-                    }
-                    if (!IS_STRING(peek(1))) {
-                        toString(1);
-                    }
-                    concatenate();
-                } else {
-                    runtimeError("Operands must be two numbers or one of them "
-                                 "must be a strings.");
-                    return INTERPRET_RUNTIME_ERROR;
-                }
-                break;
-            }
-            case OP_SUBTRACT: BINARY_OP(NUMBER_VAL, -); break;
-            case OP_MULTIPLY: BINARY_OP(NUMBER_VAL, *); break;
-            case OP_DIVIDE: BINARY_OP(NUMBER_VAL, /); break;
-            case OP_NIL: push(NIL_VAL); break;
-            case OP_TRUE: push(BOOL_VAL(true)); break;
-            case OP_FALSE: push(BOOL_VAL(false)); break;
-            case OP_EQUAL: {
-                Value b = pop();
-                Value a = pop();
-                push(BOOL_VAL(valuesEqual(a, b)));
-                break;
-            }
-            case OP_GREATER: BINARY_OP(BOOL_VAL, >); break;
-            case OP_LESS: BINARY_OP(BOOL_VAL, <); break;
-            case OP_NOT: push(BOOL_VAL(isFalsey(pop()))); break;
-            case OP_PRINT:
-                printValue(pop());
-                printf("\n");
-                break;
-            case OP_ASSERT:
-                if (isFalsey(pop()))
-                    runtimeError("Assertion error.");
-                break;
-            case OP_POP: pop(); break;
-            case OP_DEFINE_GLOBAL: {
-                ObjString* name = READ_STRING();
-                tableSet(&vm.globals, name, peek(0));
-                pop();
-                break;
+
+    uint8_t instruction;
+    INTERPRET_LOOP {
+#ifdef COMPUTED_GOTO
+    L_COUNT:
+        countInstruction(vm->opcodeStats, frame->closure->function,
+                         instruction);
+        goto* dispatchTable[instruction];
+#endif
+#if defined(COMPUTED_GOTO) && defined(JIT)
+    L_RECORD:
+        if (!traceRecord(vm, frame, ip - 1))
+            dispatch = dispatchTable;
+        goto* dispatchTable[instruction];
+#endif
+        CASE(OP_CONSTANT_LONG):
+        CASE(OP_CONSTANT): push(vm, READ_CONSTANT()); DISPATCH();
+        CASE(OP_NEGATE):
+            *(vm->stackTop - 1) = NUMBER_VAL(-AS_NUMBER(*(vm->stackTop - 1)));
+            DISPATCH();
+        CASE(OP_ADD): {
+            if (IS_NUMBER(peek(vm, 0)) && IS_NUMBER(peek(vm, 1)))
+                QUICKEN(frame->closure->function, ip - 1, OP_ADD_NUM);
+            if (!addValues(vm))
+                return INTERPRET_RUNTIME_ERROR;
+            DISPATCH();
+        }
+        CASE(OP_ADD_NUM): {
+            Value b = peek(vm, 0);
+            Value a = peek(vm, 1);
+            if (__builtin_expect(IS_NUMBER(a) && IS_NUMBER(b), true)) {
+                vm->stackTop--;
+                vm->stackTop[-1] = NUMBER_VAL(AS_NUMBER(a) + AS_NUMBER(b));
+                DISPATCH();
             }
-            case OP_GET_GLOBAL: {
-                ObjString* name = READ_STRING();
-                Value value;
-
-                if (lastGlobalAccessed.key != NULL &&
-                    stringsEqual(lastGlobalAccessed.key, name)) {
-                    value = lastGlobalAccessed.value;
-                } else if (!tableGet(&vm.globals, name, &value)) {
-                    runtimeError("Undefined variable %s.\n", name->chars);
-                    return INTERPRET_RUNTIME_ERROR;
-                }
-                push(value);
-                lastGlobalAccessed.key = name;
-                lastGlobalAccessed.value = value;
-                break;
+            deoptimize(frame, ip - 1);
+            if (!addValues(vm))
+                return INTERPRET_RUNTIME_ERROR;
+            DISPATCH();
+        }
+        CASE(OP_SUBTRACT): BINARY_OP(NUMBER_VAL, -); DISPATCH();
+        CASE(OP_MULTIPLY): BINARY_OP(NUMBER_VAL, *); DISPATCH();
+        CASE(OP_DIVIDE): BINARY_OP(NUMBER_VAL, /); DISPATCH();
+        CASE(OP_NIL): push(vm, NIL_VAL); DISPATCH();
+        CASE(OP_TRUE): push(vm, BOOL_VAL(true)); DISPATCH();
+        CASE(OP_FALSE): push(vm, BOOL_VAL(false)); DISPATCH();
+        CASE(OP_EQUAL): {
+            Value b = pop(vm);
+            Value a = pop(vm);
+            push(vm, BOOL_VAL(valuesEqual(a, b)));
+            DISPATCH();
+        }
+        CASE(OP_GREATER): BINARY_OP(BOOL_VAL, >); DISPATCH();
+        CASE(OP_LESS): BINARY_OP(BOOL_VAL, <); DISPATCH();
+        CASE(OP_NOT): push(vm, BOOL_VAL(isFalsey(pop(vm)))); DISPATCH();
+        CASE(OP_PRINT):
+            fprintValue(vm->out, pop(vm));
+            fputc('\n', vm->out);
+            DISPATCH();
+        CASE(OP_ASSERT):
+            if (isFalsey(pop(vm))) {
+                runtimeError(vm, "Assertion error.");
+                return INTERPRET_RUNTIME_ERROR;
             }
-            case OP_SET_GLOBAL: {
-                ObjString* name = READ_STRING();
-                if (lastGlobalAccessed.key != NULL &&
-                    stringsEqual(lastGlobalAccessed.key, name)) {
-                    lastGlobalAccessed.value = peek(0);
-                }
-                if (__builtin_expect(tableSet(&vm.globals, name, peek(0)),
-                                     false)) {
-                    tableDelete(&vm.globals, name);
-                    runtimeError("Undefined variable %s\n", name->chars);
+            DISPATCH();
+        CASE(OP_POP): pop(vm); DISPATCH();
+        CASE(OP_DEFINE_GLOBAL): defineGlobal(vm, READ_SHORT()); DISPATCH();
+        CASE(OP_GET_GLOBAL):
+            if (!getGlobal(vm, READ_SHORT()))
+                return INTERPRET_RUNTIME_ERROR;
+            DISPATCH();
+        CASE(OP_SET_GLOBAL):
+            if (!setGlobal(vm, READ_SHORT()))
+                return INTERPRET_RUNTIME_ERROR;
+            DISPATCH();
+        CASE(OP_GET_LOCAL): {
+            uint8_t slot = READ_BYTE();
+            push(vm, frame->slots[slot]);
+            DISPATCH();
+        }
+        CASE(OP_SET_LOCAL): {
+            uint8_t slot = READ_BYTE();
+            frame->slots[slot] = peek(vm, 0);
+            DISPATCH();
+        }
+        CASE(OP_GET_UPVALUE): {
+            uint8_t slot = READ_BYTE();
+            push(vm, *frame->closure->upvalues[slot]->location);
+            DISPATCH();
+        }
+        CASE(OP_SET_UPVALUE): {
+            uint8_t slot = READ_BYTE();
+            setUpvalue(vm, frame->closure->upvalues[slot], peek(vm, 0));
+            DISPATCH();
+        }
+        CASE(OP_JUMP): {
+            uint16_t offset = READ_SHORT();
+            ip += offset;
+            DISPATCH();
+        }
+        CASE(OP_JUMP_IF_FALSE): {
+            uint16_t offset = READ_SHORT();
+            if (isFalsey(peek(vm, 0)))
+                ip += offset;
+            DISPATCH();
+        }
+        CASE(OP_LOOP): {
+            uint16_t offset = READ_SHORT();
+            POLL_PROFILER();
+            ip -= offset;
+#ifdef JIT
+            if (instrumented(vm))
+                DISPATCH();
+            HotLoop* loop = hotLoopFor(vm, ip);
+            // A recording must see every iteration of the loops it runs.
+            if (loop->header == ip && loop->trace != NULL &&
+                vm->recorder == NULL) {
+                frame->ip = ip;
+                if (!((TraceFn)loop->trace->native)(vm, frame))
                     return INTERPRET_RUNTIME_ERROR;
-                }
-                break;
-            }
-            case OP_GET_LOCAL: {
-                uint8_t slot = READ_BYTE();
-                push(frame->slots[slot]);
-                break;
-            }
-            case OP_SET_LOCAL: {
-                uint8_t slot = READ_BYTE();
-                frame->slots[slot] = peek(0);
-                break;
-            }
-            case OP_GET_UPVALUE: {
-                uint8_t slot = READ_BYTE();
-                push(*frame->closure->upvalues[slot]->location);
-                break;
-            }
-            case OP_SET_UPVALUE: {
-                uint8_t slot = READ_BYTE();
-                *frame->closure->upvalues[slot]->location = peek(0);
-                break;
-            }
-            case OP_JUMP: {
-                uint16_t offset = READ_SHORT();
+                // Ticks spent in the trace go to the loop, not to its exit.
+                uint8_t* exit = frame->ip;
                 ip += offset;
-                break;
+                POLL_PROFILER();
+                ip = exit;
+            } else if (traceCountLoop(vm, loop, frame, ip)) {
+                START_RECORDING();
             }
-            case OP_JUMP_IF_FALSE: {
-                uint16_t offset = READ_SHORT();
-                if (isFalsey(peek(0)))
-                    ip += offset;
-                break;
+#endif
+            DISPATCH();
+        }
+        CASE(OP_CALL): {
+            int argCount = READ_BYTE();
+            frame->ip = ip;
+            if (__builtin_expect(!callValue(vm, peek(vm, argCount), argCount),
+                                 false)) {
+                return INTERPRET_RUNTIME_ERROR;
             }
-            case OP_LOOP: {
-                uint16_t offset = READ_SHORT();
-                ip -= offset;
-                break;
+            frame = &vm->frames[vm->frameCount - 1];
+            ip = frame->ip;
+            DISPATCH();
+        }
+        CASE(OP_TAIL_CALL): {
+            int argCount = READ_BYTE();
+            frame->ip = ip;
+            Value callee = peek(vm, argCount);
+            ObjClosure* closure = tailCallee(vm, callee, argCount);
+            bool ok = closure == NULL
+                          ? callValue(vm, callee, argCount)
+                          : reuseFrame(vm, frame, closure, argCount) &&
+                                enterFrame(vm, frame);
+            if (!ok)
+                return INTERPRET_RUNTIME_ERROR;
+            // Compiled code may have returned from the reused frame already.
+            if (vm->frameCount == baseFrame)
+                return INTERPRET_OK;
+            frame = &vm->frames[vm->frameCount - 1];
+            ip = frame->ip;
+            DISPATCH();
+        }
+        CASE(OP_CLOSURE): ip = makeClosure(vm, frame, ip); DISPATCH();
+        CASE(OP_CLOSE_UPVALUE): {
+            closeUpvalues(vm, vm->stackTop - 1);
+            pop(vm);
+            DISPATCH();
+        }
+        CASE(OP_CLASS): {
+            push(vm, OBJ_VAL(newClass(vm, READ_STRING())));
+            DISPATCH();
+        }
+        CASE(OP_GET_PROPERTY): {
+            uint8_t* start = ip - 1;
+            ObjString* name = READ_STRING();
+            InlineCache* cache = READ_CACHE();
+            if (!getProperty(vm, name, cache))
+                return INTERPRET_RUNTIME_ERROR;
+            if (cache->count == 1 && cache->entries[0].method == NULL)
+                QUICKEN(frame->closure->function, start,
+                        OP_GET_PROPERTY_SLOT);
+            DISPATCH();
+        }
+        CASE(OP_GET_PROPERTY_SLOT): {
+            // Fields are found by shape alone, whatever the class.
+            uint8_t* start = ip - 1;
+            ObjString* name = READ_STRING();
+            InlineCache* cache = READ_CACHE();
+            Value receiver = peek(vm, 0);
+            if (__builtin_expect(IS_INSTANCE(receiver) &&
+                                     AS_INSTANCE(receiver)->shape ==
+                                         cache->entries[0].shape,
+                                 true)) {
+                cache->hits++;
+                vm->stackTop[-1] = *instanceSlot(AS_INSTANCE(receiver),
+                                                cache->entries[0].slot);
+                DISPATCH();
             }
-            case OP_CALL: {
-                int argCount = READ_BYTE();
-                frame->ip = ip;
-                if (__builtin_expect(!callValue(peek(argCount), argCount),
-                                     false)) {
-                    return INTERPRET_RUNTIME_ERROR;
-                }
-                frame = &vm.frames[vm.frameCount - 1];
-                ip = frame->ip;
-                break;
+            deoptimize(frame, start);
+            if (!getProperty(vm, name, cache))
+                return INTERPRET_RUNTIME_ERROR;
+            DISPATCH();
+        }
+        CASE(OP_SET_PROPERTY): {
+            uint8_t* start = ip - 1;
+            ObjString* name = READ_STRING();
+            InlineCache* cache = READ_CACHE();
+            if (!setProperty(vm, name, cache))
+                return INTERPRET_RUNTIME_ERROR;
+            if (cache->count == 1 && cache->entries[0].transition == NULL)
+                QUICKEN(frame->closure->function, start,
+                        OP_SET_PROPERTY_SLOT);
+            DISPATCH();
+        }
+        CASE(OP_SET_PROPERTY_SLOT): {
+            uint8_t* start = ip - 1;
+            ObjString* name = READ_STRING();
+            InlineCache* cache = READ_CACHE();
+            Value receiver = peek(vm, 1);
+            if (__builtin_expect(IS_INSTANCE(receiver) &&
+                                     AS_INSTANCE(receiver)->shape ==
+                                         cache->entries[0].shape,
+                                 true)) {
+                cache->hits++;
+                snapshotBarrier(vm, AS_OBJ(receiver));
+                Value value = pop(vm);
+                *instanceSlot(AS_INSTANCE(receiver), cache->entries[0].slot) =
+                    value;
+                writeBarrier(vm, AS_OBJ(receiver), value);
+                vm->stackTop[-1] = value;
+                DISPATCH();
             }
-            case OP_CLOSURE: {
-                ObjFunction* function = AS_FUNCTION(READ_CONSTANT());
-                ObjClosure* closure = newClosure(function);
-                push(OBJ_VAL(closure));
-
-                for (int i = 0; i < closure->upvalueCount; i++) {
-                    uint8_t isLocal = READ_BYTE();
-                    uint8_t index = READ_BYTE();
-
-                    if (isLocal) {
-                        closure->upvalues[i] =
-                            captureUpvalue(frame->slots + index);
-                    } else {
-                        closure->upvalues[i] = frame->closure->upvalues[index];
-                    }
-                }
-                break;
+            deoptimize(frame, start);
+            if (!setProperty(vm, name, cache))
+                return INTERPRET_RUNTIME_ERROR;
+            DISPATCH();
+        }
+        CASE(OP_METHOD): defineMethod(vm, READ_STRING()); DISPATCH();
+        CASE(OP_INVOKE): {
+            uint8_t* start = ip - 1;
+            ObjString* method = READ_STRING();
+            InlineCache* cache = READ_CACHE();
+            int argCount = READ_BYTE();
+            frame->ip = ip;
+            // The call may move the frames.
+            ObjFunction* function = frame->closure->function;
+            if (!invoke(vm, method, argCount, cache)) {
+                return INTERPRET_RUNTIME_ERROR;
             }
-            case OP_CLOSE_UPVALUE: {
-                closeUpvalues(vm.stackTop - 1);
-                pop();
-                break;
+            if (cache->count == 1 && cache->entries[0].method != NULL)
+                QUICKEN(function, start, OP_INVOKE_METHOD);
+            frame = &vm->frames[vm->frameCount - 1];
+            ip = frame->ip;
+            DISPATCH();
+        }
+        CASE(OP_INVOKE_METHOD): {
+            uint8_t* start = ip - 1;
+            ObjString* method = READ_STRING();
+            InlineCache* cache = READ_CACHE();
+            int argCount = READ_BYTE();
+            frame->ip = ip;
+            Value receiver = peek(vm, argCount);
+            CacheEntry* entry = &cache->entries[0];
+            bool ok;
+            if (__builtin_expect(IS_INSTANCE(receiver) &&
+                                     AS_INSTANCE(receiver)->shape ==
+                                         entry->shape &&
+                                     AS_INSTANCE(receiver)->klass ==
+                                         entry->klass,
+                                 true)) {
+                cache->hits++;
+                ok = call(vm, entry->method, argCount);
+            } else {
+                deoptimize(frame, start);
+                ok = invoke(vm, method, argCount, cache);
             }
-            case OP_CLASS: {
-                push(OBJ_VAL(newClass(READ_STRING())));
-                break;
+            if (!ok)
+                return INTERPRET_RUNTIME_ERROR;
+            frame = &vm->frames[vm->frameCount - 1];
+            ip = frame->ip;
+            DISPATCH();
+        }
+        CASE(OP_INHERIT):
+            if (!inherit(vm))
+                return INTERPRET_RUNTIME_ERROR;
+            DISPATCH();
+        CASE(OP_GET_SUPER): {
+            ObjString* name = READ_STRING();
+            ObjClass* superclass = AS_CLASS(pop(vm));
+            if (!bindMethod(vm, superclass, name)) {
+                return INTERPRET_RUNTIME_ERROR;
             }
-            case OP_GET_PROPERTY: {
-                if (!IS_INSTANCE(peek(0))) {
-                    runtimeError("Only instances have properties.");
-                    return INTERPRET_RUNTIME_ERROR;
-                }
-                ObjInstance* instance = AS_INSTANCE(peek(0));
-                ObjString* name = READ_STRING();
-                Value value;
-
-                if (tableGet(&instance->fields, name, &value)) {
-                    pop(); // Instance.
-                    push(value);
-                    break;
-                }
-
-                if (!bindMethod(instance->klass, name)) {
-                    runtimeError("Undefined property '%s'.", name->chars);
-                    return INTERPRET_RUNTIME_ERROR;
-                }
-
-                break;
+            DISPATCH();
+        }
+        CASE(OP_SUPER_INVOKE): {
+            ObjString* method = READ_STRING();
+            InlineCache* cache = READ_CACHE();
+            int argCount = READ_BYTE();
+            ObjClass* superclass = AS_CLASS(pop(vm));
+            frame->ip = ip;
+            if (!superInvoke(vm, superclass, method, argCount, cache)) {
+                return INTERPRET_RUNTIME_ERROR;
             }
-            case OP_SET_PROPERTY: {
-                if (!IS_INSTANCE(peek(1))) {
-                    runtimeError("Only instances have fields.");
+            frame = &vm->frames[vm->frameCount - 1];
+            ip = frame->ip;
+            DISPATCH();
+        }
+        CASE(OP_ADD_LOCALS): {
+            Value a = frame->slots[READ_BYTE()];
+            Value b = frame->slots[READ_BYTE()];
+            if (__builtin_expect(IS_NUMBER(a) && IS_NUMBER(b), true)) {
+                push(vm, NUMBER_VAL(AS_NUMBER(a) + AS_NUMBER(b)));
+            } else {
+                push(vm, a);
+                push(vm, b);
+                if (!addValues(vm))
                     return INTERPRET_RUNTIME_ERROR;
-                }
-                ObjInstance* instance = AS_INSTANCE(peek(1));
-                tableSet(&instance->fields, READ_STRING(), peek(0));
-
-                Value value = pop();
-                pop();
-                push(value);
-
-                break;
             }
-            case OP_METHOD: defineMethod(READ_STRING()); break;
-            case OP_INVOKE: {
-                ObjString* method = READ_STRING();
-                int argCount = READ_BYTE();
-                frame->ip = ip;
-                if (!invoke(method, argCount)) {
-                    return INTERPRET_RUNTIME_ERROR;
-                }
-                frame = &vm.frames[vm.frameCount - 1];
-                ip = frame->ip;
-                break;
+            DISPATCH();
+        }
+        CASE(OP_LESS_JUMP_IF_FALSE): {
+            uint16_t offset = READ_SHORT();
+            if (__builtin_expect(!IS_NUMBER(peek(vm, 0)) ||
+                                     !IS_NUMBER(peek(vm, 1)),
+                                 false)) {
+                runtimeError(vm, "Operands must be numbers.");
+                return INTERPRET_RUNTIME_ERROR;
             }
-            case OP_INHERIT: {
-                Value superclass = peek(1);
-                if (!IS_CLASS(superclass)) {
-                    runtimeError("Superclass must be a class.");
-                    return INTERPRET_RUNTIME_ERROR;
-                }
-                ObjClass* subclass = AS_CLASS(peek(0));
-                tableAddAll(&AS_CLASS(superclass)->methods, &subclass->methods);
-                pop(); // Subclass.
-                break;
+            double b = AS_NUMBER(pop(vm));
+            double a = AS_NUMBER(pop(vm));
+            // The fused OP_POP only ran on the fallthrough path, the jump
+            // target still expects the condition on the stack.
+            if (!(a < b)) {
+                push(vm, BOOL_VAL(false));
+                ip += offset;
             }
-            case OP_GET_SUPER: {
-                ObjString* name = READ_STRING();
-                ObjClass* superclass = AS_CLASS(pop());
-                if (!bindMethod(superclass, name)) {
+            DISPATCH();
+        }
+        CASE(OP_INCREMENT_LOCAL): {
+            uint8_t slot = READ_BYTE();
+            Value constant = READ_CONSTANT();
+            Value value = frame->slots[slot];
+            if (__builtin_expect(IS_NUMBER(value) && IS_NUMBER(constant),
+                                 true)) {
+                frame->slots[slot] =
+                    NUMBER_VAL(AS_NUMBER(value) + AS_NUMBER(constant));
+            } else {
+                push(vm, value);
+                push(vm, constant);
+                if (!addValues(vm))
                     return INTERPRET_RUNTIME_ERROR;
-                }
-                break;
+                frame->slots[slot] = pop(vm);
             }
-            case OP_SUPER_INVOKE: {
-                ObjString* method = READ_STRING();
-                int argCount = READ_BYTE();
-                ObjClass* superclass = AS_CLASS(pop());
-                if (!invokeFromClass(superclass, method, argCount)) {
+            DISPATCH();
+        }
+        CASE(OP_R_MOVE): {
+            uint8_t dst = READ_BYTE();
+            frame->slots[dst] = readRegister(frame, READ_BYTE());
+            DISPATCH();
+        }
+        CASE(OP_R_ADD): {
+            uint8_t dst = READ_BYTE();
+            Value a = readRegister(frame, READ_BYTE());
+            Value b = readRegister(frame, READ_BYTE());
+            if (__builtin_expect(IS_NUMBER(a) && IS_NUMBER(b), true)) {
+                writeRegister(vm, frame, dst,
+                              NUMBER_VAL(AS_NUMBER(a) + AS_NUMBER(b)));
+            } else {
+                push(vm, a);
+                push(vm, b);
+                if (!addValues(vm))
                     return INTERPRET_RUNTIME_ERROR;
-                }
-                frame = &vm.frames[vm.frameCount - 1];
-                break;
+                writeRegister(vm, frame, dst, pop(vm));
             }
-            case OP_RETURN: {
-                Value result = pop();
-
-                closeUpvalues(frame->slots);
-
-                vm.frameCount--;
-                if (__builtin_expect(vm.frameCount == 0, false)) {
-                    pop();
-#ifdef DEBUG_PROFILE_CODE
-                    printf("Instruction counts:\n");
-                    for (int i = 0; i <= OP_CALL; i++) {
-                        if (counts[i] > 0) {
-                            printf("  %-15s: %d\n", opCodeToString(i),
-                                   counts[i]);
-                        }
-                    }
-#endif
+            DISPATCH();
+        }
+        CASE(OP_R_SUBTRACT): REGISTER_BINARY_OP(NUMBER_VAL, -); DISPATCH();
+        CASE(OP_R_MULTIPLY): REGISTER_BINARY_OP(NUMBER_VAL, *); DISPATCH();
+        CASE(OP_R_DIVIDE): REGISTER_BINARY_OP(NUMBER_VAL, /); DISPATCH();
+        CASE(OP_R_EQUAL): {
+            uint8_t dst = READ_BYTE();
+            Value a = readRegister(frame, READ_BYTE());
+            Value b = readRegister(frame, READ_BYTE());
+            writeRegister(vm, frame, dst, BOOL_VAL(valuesEqual(a, b)));
+            DISPATCH();
+        }
+        CASE(OP_R_GREATER): REGISTER_BINARY_OP(BOOL_VAL, >); DISPATCH();
+        CASE(OP_R_LESS): REGISTER_BINARY_OP(BOOL_VAL, <); DISPATCH();
+        CASE(OP_R_LESS_JUMP_IF_FALSE): REGISTER_JUMP_IF_FALSE(<); DISPATCH();
+        CASE(OP_R_GREATER_JUMP_IF_FALSE):
+            REGISTER_JUMP_IF_FALSE(>);
+            DISPATCH();
+        CASE(OP_RETURN): {
+            POLL_PROFILER();
+            if (__builtin_expect(vm->callProfiler != NULL, false))
+                exitCall(vm);
+            Value result = pop(vm);
+
+            closeUpvalues(vm, frame->slots);
+
+            vm->frameCount--;
+            if (__builtin_expect(vm->frameCount == baseFrame, false)) {
+                // A fiber's result stays on its stack for resume().
+                if (baseFrame > 0 || vm->fiber != NULL) {
+                    vm->stackTop = frame->slots;
+                    push(vm, result);
                     return INTERPRET_OK;
                 }
+                pop(vm);
+                return INTERPRET_OK;
+            }
 
-                vm.stackTop = frame->slots;
-                push(result);
+            vm->stackTop = frame->slots;
+            push(vm, result);
 
-                frame = &vm.frames[vm.frameCount - 1];
-                ip = frame->ip;
-                break;
-            }
+            frame = &vm->frames[vm->frameCount - 1];
+            ip = frame->ip;
+            DISPATCH();
         }
     }
+#ifdef COMPUTED_GOTO
+L_UNKNOWN:
+#endif
+    // A byte that names no opcode, from corrupt or loaded bytecode.
+    frame->ip = ip;
+    runtimeError(vm, "Unknown opcode %d.", instruction);
+    return INTERPRET_RUNTIME_ERROR;
 #undef READ_BYTE
 #undef READ_CONSTANT
 #undef READ_STRING
 #undef READ_SHORT
+#undef READ_CACHE
+#undef QUICKEN
+#undef POLL_PROFILER
 #undef BINARY_OP
+#undef REGISTER_BINARY_OP
+#undef REGISTER_JUMP_IF_FALSE
+#undef TRACE_INSTRUCTION
+#undef COUNT_INSTRUCTION
+#undef INTERPRET_LOOP
+#undef CASE
+#undef DISPATCH
+#undef START_RECORDING
+#undef RECORD_INSTRUCTION
 }
 
-InterpretResult interpret(const char* source, bool saveCode) {
-    ObjFunction* function = compile(source);
+// Returning from the frame on top when entering ends this run.
+InterpretResult run(VM* vm) { return execute(vm, vm->frameCount - 1); }
+
+InterpretResult interpret(VM* vm, const char* source, bool saveCode) {
+    ObjFunction* function = compile(vm, source);
     if (function == NULL)
         return INTERPRET_COMPILE_ERROR;
 
-    push(OBJ_VAL(function));
-    ObjClosure* closure = newClosure(function);
-    pop();
-    push(OBJ_VAL(closure));
-    callValue(OBJ_VAL(closure), 0);
+    push(vm, OBJ_VAL(function));
+    ObjClosure* closure = newClosure(vm, function);
+    pop(vm);
+    push(vm, OBJ_VAL(closure));
+    callValue(vm, OBJ_VAL(closure), 0);
 
     if (saveCode)
-        writeFunctionToFile(function, "out.x7");
+        writeFunctionToFile(vm, function, "out.x7");
+
+    return run(vm);
+}
+
+void push(VM* vm, Value value) { *vm->stackTop++ = value; }
+
+Value pop(VM* vm) { return *--vm->stackTop; }
+
+#ifdef JIT
+// Runs the callee to completion when the call pushed an interpreted frame.
+static inline bool finishCall(VM* vm, int frameCount) {
+    if (vm->frameCount > frameCount)
+        return run(vm) == INTERPRET_OK;
+    return true;
+}
+
+bool jitAdd(VM* vm) { return addValues(vm); }
 
-    return run();
+bool jitNumberError(VM* vm) {
+    runtimeError(vm, "Operands must be numbers.");
+    return false;
+}
+
+void jitPrint(VM* vm) {
+    fprintValue(vm->out, pop(vm));
+    fputc('\n', vm->out);
+}
+
+bool jitAssert(VM* vm) {
+    if (isFalsey(pop(vm))) {
+        runtimeError(vm, "Assertion error.");
+        return false;
+    }
+    return true;
+}
+
+void jitDefineGlobal(VM* vm, int slot) { defineGlobal(vm, slot); }
+
+bool jitGetGlobal(VM* vm, int slot) { return getGlobal(vm, slot); }
+
+bool jitSetGlobal(VM* vm, int slot) { return setGlobal(vm, slot); }
+
+void jitGetUpvalue(VM* vm, CallFrame* frame, int slot) {
+    push(vm, *frame->closure->upvalues[slot]->location);
+}
+
+void jitSetUpvalue(VM* vm, CallFrame* frame, int slot) {
+    setUpvalue(vm, frame->closure->upvalues[slot], peek(vm, 0));
+}
+
+bool jitCall(VM* vm, int argCount) {
+    int frameCount = vm->frameCount;
+    return callValue(vm, peek(vm, argCount), argCount) &&
+           finishCall(vm, frameCount);
+}
+
+TailCall jitTailCall(VM* vm, CallFrame* frame, int argCount) {
+    ObjFunction* function = frame->closure->function;
+    ObjClosure* closure = tailCallee(vm, peek(vm, argCount), argCount);
+    if (closure == NULL)
+        return jitCall(vm, argCount) ? TAIL_CALLED : TAIL_ERROR;
+    if (!reuseFrame(vm, frame, closure, argCount))
+        return TAIL_ERROR;
+    if (closure->function == function)
+        return TAIL_REENTER;
+
+    return TAIL_HANDOFF;
 }
 
-void push(Value value) { *vm.stackTop++ = value; }
+void jitClosure(VM* vm, CallFrame* frame, uint8_t* ip) {
+    makeClosure(vm, frame, ip);
+}
+
+void jitCloseUpvalue(VM* vm) {
+    closeUpvalues(vm, vm->stackTop - 1);
+    pop(vm);
+}
+
+void jitClass(VM* vm, ObjString* name) {
+    push(vm, OBJ_VAL(newClass(vm, name)));
+}
+
+bool jitGetProperty(VM* vm, ObjString* name, InlineCache* cache) {
+    return getProperty(vm, name, cache);
+}
+
+bool jitSetProperty(VM* vm, ObjString* name, InlineCache* cache) {
+    return setProperty(vm, name, cache);
+}
+
+void jitMethod(VM* vm, ObjString* name) { defineMethod(vm, name); }
 
-Value pop() { return *--vm.stackTop; }
+bool jitInvoke(VM* vm, ObjString* name, int argCount, InlineCache* cache) {
+    int frameCount = vm->frameCount;
+    return invoke(vm, name, argCount, cache) && finishCall(vm, frameCount);
+}
+
+bool jitInherit(VM* vm) { return inherit(vm); }
+
+bool jitGetSuper(VM* vm, ObjString* name) {
+    return bindMethod(vm, AS_CLASS(pop(vm)), name);
+}
+
+bool jitSuperInvoke(VM* vm, ObjString* name, int argCount, InlineCache* cache) {
+    int frameCount = vm->frameCount;
+    ObjClass* superclass = AS_CLASS(pop(vm));
+    return superInvoke(vm, superclass, name, argCount, cache) &&
+           finishCall(vm, frameCount);
+}
 
-void freeVM() {
-    freeTable(&vm.strings);
-    freeTable(&vm.globals);
-    vm.initString = NULL;
-    freeObjects();
+void jitReturn(VM* vm, CallFrame* frame) {
+    Value result = pop(vm);
+    closeUpvalues(vm, frame->slots);
+    vm->frameCount--;
+    vm->stackTop = frame->slots;
+    push(vm, result);
+}
+#endif
+
+void freeVM(VM* vm) {
+    stopGCThreads(vm);
+#ifdef JIT
+    traceAbort(vm);
+#endif
+    freeTable(vm, &vm->strings);
+    freeTable(vm, &vm->globalSlots);
+    freeValueArray(vm, &vm->globalNames);
+    freeValueArray(vm, &vm->globalValues);
+    vm->initString = NULL;
+    freeShape(vm, vm->rootShape);
+    vm->rootShape = NULL;
+    freeObjects(vm);
+    free(vm->frames);
+    free(vm->stack);
+    vm->frames = NULL;
+    vm->stack = NULL;
 }
\ No newline at end of file
@@ -4,43 +4,231 @@
 #include <stdlib.h>
 
 #include "chunk.h"
+#include "heap.h"
 #include "value.h"
 #include "table.h"
 #include "object.h"
 
-#define FRAMES_MAX 512
+// Hard limits of the call stack, past which a call reports a stack overflow.
+// Calls made from compiled code also nest on the native stack, a few hundred
+// bytes each, which bounds how far FRAMES_MAX can be raised.
+#ifndef FRAMES_MAX
+#define FRAMES_MAX 8192
+#endif
+#ifndef STACK_MAX
 #define STACK_MAX (FRAMES_MAX * UINT8_COUNT)
+#endif
 
+// Sizes the frames and value stack start at, doubling when a call needs more.
+#define FRAMES_INITIAL 16
+#define STACK_INITIAL 1024
+
+// Stack slots a call reserves above the function's maxSlots, for the values
+// an instruction pushes for a moment, and those the natives it calls push.
+#define STACK_HEADROOM 8
+
+// Quickened instructions a function may revert before run() stops quickening
+// it, so instructions seeing mixed types do not flip back and forth.
+#ifndef QUICKEN_MAX_DEOPTS
+#define QUICKEN_MAX_DEOPTS 16
+#endif
+
+typedef enum {
+    BACKEND_STACK,    /**< Stack bytecode with superinstructions */
+    BACKEND_REGISTER, /**< Three-address register instructions where possible */
+} Backend;
+
+#ifdef JIT
+// Size of VM.hotLoops, a power of two.
+#define HOT_LOOPS 64
+
+typedef struct Trace Trace;
+typedef struct Recorder Recorder;
+
+/**
+ * @struct HotLoop
+ * @brief Back-edge counter of a loop header, and the trace compiled for it.
+ */
+typedef struct {
+    uint8_t* header; /**< Loop header owning the slot */
+    uint16_t count;  /**< Back-edges taken since the slot was claimed */
+    uint8_t aborts;  /**< Recordings of this loop that failed */
+    Trace* trace;    /**< Compiled trace, or NULL */
+} HotLoop;
+#endif
+
+// Buckets of GCStats.pauses. Bucket 0 counts pauses under a microsecond,
+// bucket i those under 2^i microseconds, the last one anything longer.
+#define GC_PAUSE_BUCKETS 32
+
+/**
+ * @struct GCStats
+ * @brief What collectGarbage() measured so far, for gcStats() and --gc-stats.
+ */
 typedef struct {
-    ObjClosure* closure;
-    uint8_t* ip;
-    Value* slots;
-} CallFrame;
-
-typedef struct
-{
-    CallFrame frames[FRAMES_MAX];
+    int collections;     /**< Full and minor ones */
+    int minorCollections;
+    int steps;           /**< Pauses of full collections run by allocation */
+    uint64_t promoted;   /**< Objects that survived a collection */
+    uint64_t totalPause; /**< Nanoseconds spent collecting */
+    uint64_t maxPause;   /**< Longest pause, in nanoseconds */
+    uint64_t lastPause;  /**< Last pause, in nanoseconds */
+    size_t bytesBefore;  /**< Heap size when the last collection started */
+    size_t bytesAfter;   /**< Heap size the last collection left */
+    uint64_t freed[OBJ_TYPE_COUNT]; /**< Objects freed, by type */
+    int grayPeak;        /**< Deepest gray stack of the last collection */
+    int maxGrayPeak;     /**< Deepest gray stack of any collection */
+    int strings;         /**< Interned strings after the last collection */
+    int stringCapacity;  /**< Size of the intern table then */
+    uint64_t pauses[GC_PAUSE_BUCKETS]; /**< Histogram of the pauses */
+} GCStats;
+
+/**
+ * @brief Where the full collection in progress is, see gcStep().
+ */
+typedef enum {
+    GC_IDLE,
+    GC_CONCURRENT, /**< The marker thread traces, see snapshotBarrier() */
+    GC_MARK,       /**< Tracing from the gray stack, barriers shade stores */
+    GC_SWEEP,      /**< Sweeping the pages of vm->heap, see startSweep() */
+} GCPhase;
+
+typedef struct Marker Marker;
+typedef struct MarkPool MarkPool;
+typedef struct Parser Parser;
+typedef struct Profiler Profiler;
+typedef struct CallProfiler CallProfiler;
+typedef struct OpcodeStats OpcodeStats;
+
+/**
+ * @struct VM
+ * @brief State of one interpreter: its heap, globals and call stack.
+ *
+ * Nothing is shared between VMs, each can run on a thread of its own.
+ */
+struct VM {
+    CallFrame* frames; /**< Call stack, grown by call() up to FRAMES_MAX */
     int frameCount;
+    int frameCapacity;
 
-    Value stack[STACK_MAX];
+    Value* stack; /**< Value stack, grown by call() up to STACK_MAX */
     Value* stackTop;
+    int stackCapacity;
 
-    Obj* objects;
+    Heap heap; /**< Every object */
     Table strings;
-    Table globals;
+    Table globalSlots;       /**< Slot of each global name, as a number */
+    ValueArray globalNames;  /**< Name of the global in each slot */
+    ValueArray globalValues; /**< Globals by slot, UNDEFINED_VAL until defined */
 
     ObjUpvalue* openUpvalues;
+    ObjFiber* fiber; /**< Fiber running on the stacks, NULL for the VM's own */
 
     size_t bytesAllocated;
-    size_t nextGC;
-    short currentGC;
+    size_t nextGC;      /**< Heap size that triggers a full collection */
+    size_t nextMinorGC; /**< Heap size that triggers a minor collection */
+    bool minorGC;       /**< The collection in progress is a minor one */
+    GCPhase gcPhase;
+    int gcStepSize;     /**< Objects traced or swept per step, 0 to mark all */
+    bool gcConcurrent;  /**< Full collections mark on the marker thread */
+    Marker* marker;     /**< That thread, started by the first of them */
+    int gcThreads;      /**< Threads marking full collections at once */
+    MarkPool* markPool; /**< Those of them but the VM's, started by the first */
 
     int grayCount;
     int grayCapacity;
     Obj** grayStack;
+    int rememberedCount;
+    int rememberedCapacity;
+    Obj** remembered; /**< Old objects that may point at young ones */
+    GCStats gcStats;
 
     ObjString* initString;
-} VM;
+    Shape* rootShape; /**< Shape of instances without fields */
+    Parser* parser;   /**< Compilation in progress, its functions are roots */
+
+    Backend backend;
+    Profiler* profiler; /**< Set by --profile, see profile.h, or NULL */
+    CallProfiler* callProfiler; /**< Set by --call-profile, or NULL */
+    OpcodeStats* opcodeStats; /**< Set by --opcode-stats, see debug.h */
+    FILE* out; /**< Where print writes, stdout unless redirected */
+    FILE* err; /**< Compile and runtime errors, stderr unless redirected */
+
+#ifdef JIT
+    HotLoop hotLoops[HOT_LOOPS]; /**< Indexed by a hash of the loop header */
+    Recorder* recorder;          /**< Trace being recorded, or NULL */
+#endif
+};
+
+/**
+ * @brief Adds an object to the remembered set, see writeBarrier().
+ */
+void rememberObject(VM* vm, Obj* object);
+
+/**
+ * @brief writeBarrier() once object is old or marked, defined in memory.c.
+ */
+void recordWrite(VM* vm, Obj* object, Obj* target);
+
+/**
+ * @brief snapshotBarrier() once object may not be traced yet.
+ */
+void scanObject(VM* vm, Obj* object);
+
+/**
+ * @brief Whether object is marked, as far as the write barriers go.
+ *
+ * No object is marked unless a full collection marks or sweeps, and the
+ * marker thread's marks are not read while it runs.
+ */
+static inline bool barrierMarked(VM* vm, Obj* object) {
+    return vm->gcPhase >= GC_MARK && objectMarked(object);
+}
+
+/**
+ * @brief Keeps track of value being stored into object.
+ *
+ * Minor collections only trace young objects, from the roots and from the
+ * objects in the remembered set, so an old object pointing at a young one
+ * must be in that set. Full collections mark incrementally, so a marked
+ * object must not point at an unmarked one. Every store of a reference into
+ * an object goes through here once done, with no allocation in between.
+ */
+static inline void writeBarrier(VM* vm, Obj* object, Value value) {
+    if (IS_OBJ(value) &&
+        ((object->old && !object->remembered && !AS_OBJ(value)->old) ||
+         (barrierMarked(vm, object) && !objectMarked(AS_OBJ(value)))))
+        recordWrite(vm, object, AS_OBJ(value));
+}
+
+/**
+ * @brief writeBarrier() for stores of more references than worth checking.
+ *
+ * The object is traced again by the next minor collection, or at the end of
+ * the marking in progress.
+ */
+static inline void writeBarrierAll(VM* vm, Obj* object) {
+    if ((object->old || barrierMarked(vm, object)) && !object->remembered)
+        rememberObject(vm, object);
+}
+
+/**
+ * @brief Lets the marker thread trace object before the VM changes it.
+ *
+ * The marker thread traces the heap as it was when the collection started,
+ * reading objects while the VM runs, so no object may change before it is
+ * traced: the VM traces it here first if the marker thread did not yet,
+ * logging what it points to for the marker thread. Objects allocated since
+ * the start count as traced. Every change of an object's fields goes
+ * through here before it starts, with no object allocated in between, and
+ * through writeBarrier() once done, which leaves the mark bits to the
+ * marker thread meanwhile.
+ */
+static inline void snapshotBarrier(VM* vm, Obj* object) {
+    if (vm->gcPhase == GC_CONCURRENT &&
+        atomic_load_explicit(&object->scan, memory_order_acquire) != SCAN_DONE)
+        scanObject(vm, object);
+}
 
 typedef enum {
     INTERPRET_OK,
@@ -48,14 +236,21 @@ typedef enum {
     INTERPRET_RUNTIME_ERROR,
 } InterpretResult;
 
-extern VM vm;
+void initVM(VM* vm);
+
+/**
+ * @brief Slot of a global variable in vm->globalValues.
+ *
+ * Names get a slot the first time they are seen, holding UNDEFINED_VAL until
+ * the variable is defined. Slots are never reused.
+ */
+int globalSlot(VM* vm, ObjString* name);
 
-void initVM();
-InterpretResult interpret(const char* source, bool saveChunk);
-InterpretResult run();
-bool callValue(Value callee, int argCount);
-void push(Value value);
-Value pop();
-void freeVM();
+InterpretResult interpret(VM* vm, const char* source, bool saveChunk);
+InterpretResult run(VM* vm);
+bool callValue(VM* vm, Value callee, int argCount);
+void push(VM* vm, Value value);
+Value pop(VM* vm);
+void freeVM(VM* vm);
 
 #endif
\ No newline at end of file
@@ -0,0 +1,83 @@
+#!/bin/sh
+# Runs the scripts in bench/ $RUNS times each and reports the median and
+# standard deviation of their wall time. The results go to $OUT as JSON and
+# are compared with $BASELINE when it exists. Run from clox/ (`make bench`,
+# then `make bench-baseline` to keep the results as the new baseline).
+#
+# CLOX_FLAGS is passed to every run, e.g. CLOX_FLAGS=--registers.
+
+set -e
+
+BENCH_DIR=${BENCH_DIR:-../bench}
+RUNS=${RUNS:-5}
+OUT=${OUT:-build/bench.json}
+BASELINE=${BASELINE:-$BENCH_DIR/baseline.json}
+# Changes of the median under this many percent are reported as noise.
+THRESHOLD=${THRESHOLD:-5}
+
+make -s
+
+now() { date +%s.%N; }
+
+# Wall times of $RUNS runs of a script, one per line.
+wall_times() {
+    i=0
+    while [ $i -lt "$RUNS" ]; do
+        start=$(now)
+        # Unquoted, CLOX_FLAGS may hold several flags.
+        build/clox $CLOX_FLAGS "$1" > /dev/null
+        end=$(now)
+        awk -v s="$start" -v e="$end" 'BEGIN { printf "%.6f\n", e - s }'
+        i=$((i + 1))
+    done
+}
+
+# Median of the baseline run of a benchmark, or nothing.
+baseline() {
+    [ -f "$BASELINE" ] || return 0
+    awk -v name="\"$1\"" '$2 == name "," { gsub(/,/, "", $4); print $4 }' \
+        "$BASELINE"
+}
+
+results=$(mktemp)
+trap 'rm -f "$results"' EXIT
+
+printf "%-20s %10s %10s %10s %8s\n" script median stddev baseline change
+for script in "$BENCH_DIR"/*.lox; do
+    name=$(basename "$script" .lox)
+    stats=$(wall_times "$script" | sort -n | awk '
+        { t[NR] = $1; sum += $1 }
+        END {
+            median = NR % 2 ? t[(NR + 1) / 2] : (t[NR / 2] + t[NR / 2 + 1]) / 2
+            mean = sum / NR
+            for (i = 1; i <= NR; i++)
+                squares += (t[i] - mean) ^ 2
+            printf "%.6f %.6f\n", median, sqrt(squares / NR)
+        }')
+    median=${stats% *}
+    stddev=${stats#* }
+    printf '    {"name": "%s", "median": %s, "stddev": %s},\n' "$name" \
+        "$median" "$stddev" >> "$results"
+
+    awk -v name="$name" -v m="$median" -v d="$stddev" \
+        -v b="$(baseline "$name")" -v limit="$THRESHOLD" 'BEGIN {
+            if (b == "") {
+                printf "%-20s %10.3f %10.3f %10s %8s\n", name, m, d, "-", "-"
+                exit
+            }
+            change = (m - b) / b * 100
+            verdict = change > limit ? " slower" : \
+                      change < -limit ? " faster" : ""
+            printf "%-20s %10.3f %10.3f %10.3f %+7.1f%%%s\n", name, m, d, b,
+                change, verdict
+        }'
+done
+
+mkdir -p "$(dirname "$OUT")"
+{
+    printf '{\n  "runs": %d,\n  "benchmarks": [\n' "$RUNS"
+    # The last entry takes no comma.
+    sed '$ s/},$/}/' "$results"
+    printf '  ]\n}\n'
+} > "$OUT"
+echo "Wrote $OUT"
@@ -0,0 +1,46 @@
+#!/bin/sh
+# Compares the stack and register backends on the scripts in bench/: the
+# number of dispatched instructions (from --opcode-stats) and the best wall
+# time. Run from clox/ (`make bench-backends`).
+
+set -e
+
+BENCH_DIR=${BENCH_DIR:-../bench}
+RUNS=${RUNS:-3}
+
+make -s
+
+now() { date +%s.%N; }
+
+# Best wall time over $RUNS runs of a command.
+best_time() {
+    best=
+    i=0
+    while [ $i -lt "$RUNS" ]; do
+        start=$(now)
+        "$@" > /dev/null
+        end=$(now)
+        best=$(awk -v s="$start" -v e="$end" -v b="$best" \
+            'BEGIN { t = e - s; print (b == "" || t < b) ? t : b }')
+        i=$((i + 1))
+    done
+    echo "$best"
+}
+
+count() {
+    stats=$(mktemp)
+    build/clox --opcode-stats="$stats" "$@" > /dev/null
+    awk '$1 == "\"total\":" { print $2 + 0 }' "$stats"
+    rm -f "$stats"
+}
+
+printf "%-20s %14s %14s %10s %10s\n" script "stack instr" "register instr" \
+    "stack s" "register s"
+for script in "$BENCH_DIR"/*.lox; do
+    stackCount=$(count "$script")
+    registerCount=$(count --registers "$script")
+    stackTime=$(best_time build/clox "$script")
+    registerTime=$(best_time build/clox --registers "$script")
+    printf "%-20s %14d %14d %10.3f %10.3f\n" "$(basename "$script")" \
+        "$stackCount" "$registerCount" "$stackTime" "$registerTime"
+done
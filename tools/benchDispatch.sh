@@ -0,0 +1,48 @@
+#!/bin/sh
+# Compares the threaded (computed goto) and switch builds of run() on the
+# scripts in bench/. Run from clox/ (`make bench-dispatch`).
+#
+# --opcode-stats counts the instructions each script executes; both dispatch
+# builds execute the same bytecode, so dividing that count by their wall time
+# gives instructions per second.
+
+set -e
+
+BENCH_DIR=${BENCH_DIR:-../bench}
+RUNS=${RUNS:-3}
+
+make -s BUILD_DIR=build/dispatch-goto
+make -s BUILD_DIR=build/dispatch-switch DEFINES=-DNO_COMPUTED_GOTO
+
+now() { date +%s.%N; }
+
+# Best wall time over $RUNS runs.
+best_time() {
+    best=
+    i=0
+    while [ $i -lt "$RUNS" ]; do
+        start=$(now)
+        "$1" "$2" > /dev/null
+        end=$(now)
+        best=$(awk -v s="$start" -v e="$end" -v b="$best" \
+            'BEGIN { t = e - s; print (b == "" || t < b) ? t : b }')
+        i=$((i + 1))
+    done
+    echo "$best"
+}
+
+printf "%-20s %14s %10s %14s %10s %14s\n" script instructions \
+    "goto s" "goto i/s" "switch s" "switch i/s"
+for script in "$BENCH_DIR"/*.lox; do
+    stats=$(mktemp)
+    build/dispatch-goto/clox --opcode-stats="$stats" "$script" > /dev/null
+    count=$(awk '$1 == "\"total\":" { print $2 + 0 }' "$stats")
+    rm -f "$stats"
+    goto=$(best_time build/dispatch-goto/clox "$script")
+    switch=$(best_time build/dispatch-switch/clox "$script")
+    awk -v name="$(basename "$script")" -v n="$count" -v g="$goto" \
+        -v s="$switch" 'BEGIN {
+            printf "%-20s %14d %10.3f %14.0f %10.3f %14.0f\n",
+                name, n, g, n / g, s, n / s
+        }'
+done
@@ -0,0 +1,38 @@
+#!/bin/sh
+# Compares the collector's pauses at several step sizes on a script with a
+# large live heap, bench/gc_pauses.lox unless given another. A step size of
+# 0 runs each full collection at once, the last row marks on the marker
+# thread (--gc-concurrent) at the default step size. Run from clox/
+# (`make bench-pauses`, STEPS="0 500" to pick the step sizes).
+#
+# Pauses are read from --gc-stats, whose percentiles are upper bounds of
+# power of two buckets.
+
+set -e
+
+SCRIPT=${1:-../bench/gc_pauses.lox}
+STEPS=${STEPS:-0 100 1000 10000}
+
+make -s
+
+# Prints a row for the given label and clox options.
+row() {
+    label=$1
+    shift
+    stats=$(build/clox "$@" --gc-stats "$SCRIPT" 2>&1 >/dev/null)
+    echo "$stats" | awk -v step="$label" '
+        $1 == "pauses" { pauses += $NF }
+        $1 == "pause" { total = $3; max = $6; p50 = $9; p99 = $12 }
+        $1 == "heap" { heap = $2 }
+        END {
+            printf "%-8s %8d %10.3f %10.3f %10.3f %10.3f %12d\n", step,
+                pauses, p50, p99, max, total, heap
+        }'
+}
+
+printf "%-8s %8s %10s %10s %10s %10s %12s\n" step pauses "p50 ms" "p99 ms" \
+    "max ms" "total ms" "heap bytes"
+for step in $STEPS; do
+    row "$step" --gc-step="$step"
+done
+row concurrent --gc-concurrent
@@ -0,0 +1,379 @@
+// Micro-benchmarks of the runtime's data structures, apart from the
+// compiler: tables, string interning, object allocation, collections and
+// line lookup. Run from clox/ (`make bench-runtime`, ARGS="--reps=30 table"
+// to pass options).
+//
+// Each benchmark runs WARMUP times untimed, then REPS times timed. A run
+// does SIZE operations on state its setup prepared, so setup costs stay
+// out of the times. Reported are the minimum and the 50th, 90th and 99th
+// percentiles of the runs, in nanoseconds per operation.
+
+// clock_gettime is POSIX, strict -std modes hide it.
+#define _DEFAULT_SOURCE
+
+#include "../clox/chunk.h"
+#include "../clox/memory.h"
+#include "../clox/object.h"
+#include "../clox/table.h"
+#include "../clox/value.h"
+#include "../clox/vm.h"
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#ifndef SIZE
+#define SIZE 200000
+#endif
+
+// Bytes of the chunk get_line looks up lines in.
+#define CHUNK_SIZE 4096
+
+static int warmup = 1;
+static int reps = 10;
+// Threads marking the full collections, see --gc-threads.
+static int gcThreads = 1;
+
+static VM vm;
+static Table table;
+static Chunk chunk;
+// Interned once by keysSetup(): keys[i] for the keys a table holds, and
+// others[i] for keys it doesn't.
+static ObjString** keys;
+static ObjString** others;
+static ObjClass* klass;
+// Results the benchmarks must not be able to drop.
+static volatile int sink;
+
+typedef struct {
+    const char* name;
+    void (*setup)(void);    // Before each run, untimed.
+    void (*run)(void);      // SIZE operations.
+    void (*teardown)(void); // After each run, untimed.
+} Benchmark;
+
+static uint64_t
+nanoseconds()
+{
+    struct timespec time;
+    clock_gettime(CLOCK_MONOTONIC, &time);
+    return (uint64_t)time.tv_sec * 1000000000u + (uint64_t)time.tv_nsec;
+}
+
+static ObjString*
+makeKey(const char* prefix, int i)
+{
+    char key[32];
+    int length = snprintf(key, sizeof(key), "%s%d", prefix, i);
+    return copyString(&vm, key, length);
+}
+
+// A VM of its own per run, collections only when a benchmark asks for one.
+static void
+vmSetup()
+{
+    initVM(&vm);
+    vm.nextGC = SIZE_MAX;
+    vm.nextMinorGC = SIZE_MAX;
+    vm.gcThreads = gcThreads;
+}
+
+static void
+vmTeardown()
+{
+    freeVM(&vm);
+}
+
+static void
+keysSetup()
+{
+    vmSetup();
+    keys = malloc(sizeof(ObjString*) * SIZE);
+    others = malloc(sizeof(ObjString*) * SIZE);
+    if (keys == NULL || others == NULL)
+        exit(1);
+    for (int i = 0; i < SIZE; i++) {
+        keys[i] = makeKey("key", i);
+        others[i] = makeKey("other", i);
+    }
+    initTable(&table);
+}
+
+static void
+keysTeardown()
+{
+    freeTable(&vm, &table);
+    free(keys);
+    free(others);
+    vmTeardown();
+}
+
+static void
+filledSetup()
+{
+    keysSetup();
+    for (int i = 0; i < SIZE; i++)
+        tableSet(&vm, &table, keys[i], NUMBER_VAL(i));
+}
+
+// Every other key deleted, so probes run over tombstones.
+static void
+tombstonesSetup()
+{
+    filledSetup();
+    for (int i = 0; i < SIZE; i += 2)
+        tableDelete(&table, keys[i]);
+}
+
+static void
+tableSetRun()
+{
+    for (int i = 0; i < SIZE; i++)
+        tableSet(&vm, &table, keys[i], NUMBER_VAL(i));
+}
+
+static void
+tableGetHitRun()
+{
+    Value value;
+    for (int i = 0; i < SIZE; i++)
+        sink += tableGet(&table, keys[i], &value);
+}
+
+static void
+tableGetMissRun()
+{
+    Value value;
+    for (int i = 0; i < SIZE; i++)
+        sink += tableGet(&table, others[i], &value);
+}
+
+// Looks up half deleted keys, then puts them back in the tombstones.
+static void
+tableTombstonesRun()
+{
+    Value value;
+    for (int i = 0; i < SIZE / 2; i++)
+        sink += tableGet(&table, keys[i * 2], &value);
+    for (int i = 0; i < SIZE / 2; i++)
+        tableSet(&vm, &table, keys[i * 2], NUMBER_VAL(i));
+}
+
+static void
+tableDeleteRun()
+{
+    for (int i = 0; i < SIZE; i++)
+        sink += tableDelete(&table, keys[i]);
+}
+
+static void
+copyStringNewRun()
+{
+    for (int i = 0; i < SIZE; i++)
+        makeKey("new", i);
+}
+
+// Every string is interned already, copyString() only looks it up.
+static void
+copyStringHitRun()
+{
+    for (int i = 0; i < SIZE; i++)
+        makeKey("key", i);
+}
+
+static void
+classSetup()
+{
+    vmSetup();
+    klass = newClass(&vm, copyString(&vm, "Bench", 5));
+    // Rooted for the collections of collectRun().
+    int slot = globalSlot(&vm, klass->name);
+    vm.globalValues.values[slot] = OBJ_VAL(klass);
+}
+
+static void
+allocateRun()
+{
+    for (int i = 0; i < SIZE; i++)
+        newInstance(&vm, klass);
+}
+
+// Allocates SIZE instances, every fourth one reachable from a global through
+// a chain of fields.
+static void
+allocateHeap()
+{
+    ObjString* next = copyString(&vm, "next", 4);
+    int slot = globalSlot(&vm, next);
+    Value* head = &vm.globalValues.values[slot];
+    for (int i = 0; i < SIZE; i++) {
+        ObjInstance* instance = newInstance(&vm, klass);
+        if (i % 4 == 0) {
+            setField(&vm, instance, next, *head);
+            *head = OBJ_VAL(instance);
+        }
+    }
+}
+
+static void
+heapSetup()
+{
+    classSetup();
+    allocateHeap();
+}
+
+// As many young objects over as many old ones.
+static void
+generationsSetup()
+{
+    heapSetup();
+    collectGarbage(&vm);
+    vm.nextGC = SIZE_MAX;
+    vm.nextMinorGC = SIZE_MAX;
+    allocateHeap();
+}
+
+static void
+collectRun()
+{
+    collectGarbage(&vm);
+}
+
+static void
+collectYoungRun()
+{
+    collectYoung(&vm);
+}
+
+// A line change every four bytes, as in straight-line code. getLine()
+// walks the lines from the start, so the chunk is of a function's size.
+static void
+chunkSetup()
+{
+    vmSetup();
+    initChunk(&chunk);
+    for (int i = 0; i < CHUNK_SIZE; i++)
+        writeChunk(&vm, &chunk, OP_NIL, 1 + i / 4);
+}
+
+static void
+chunkTeardown()
+{
+    freeChunk(&vm, &chunk);
+    vmTeardown();
+}
+
+static void
+getLineRun()
+{
+    for (int i = 0; i < SIZE; i++)
+        sink += getLine(&chunk, (int)((i * 7919u) % CHUNK_SIZE));
+}
+
+static Benchmark benchmarks[] = {
+    { "table_set", keysSetup, tableSetRun, keysTeardown },
+    { "table_get_hit", filledSetup, tableGetHitRun, keysTeardown },
+    { "table_get_miss", filledSetup, tableGetMissRun, keysTeardown },
+    { "table_tombstones", tombstonesSetup, tableTombstonesRun, keysTeardown },
+    { "table_delete", filledSetup, tableDeleteRun, keysTeardown },
+    { "copy_string_new", vmSetup, copyStringNewRun, vmTeardown },
+    { "copy_string_hit", keysSetup, copyStringHitRun, keysTeardown },
+    { "allocate_instance", classSetup, allocateRun, vmTeardown },
+    { "collect_garbage", heapSetup, collectRun, vmTeardown },
+    { "collect_young", generationsSetup, collectYoungRun, vmTeardown },
+    { "get_line", chunkSetup, getLineRun, chunkTeardown },
+};
+
+static int
+compareTimes(const void* a, const void* b)
+{
+    uint64_t left = *(const uint64_t*)a;
+    uint64_t right = *(const uint64_t*)b;
+    return (left > right) - (left < right);
+}
+
+// Nanoseconds per operation of the run at the given percentile.
+static double
+percentile(uint64_t* times, double fraction)
+{
+    int index = (int)(fraction * (reps - 1) + 0.5);
+    return (double)times[index] / SIZE;
+}
+
+static void
+runBenchmark(Benchmark* benchmark)
+{
+    uint64_t* times = malloc(sizeof(uint64_t) * reps);
+    if (times == NULL)
+        exit(1);
+    for (int i = -warmup; i < reps; i++) {
+        benchmark->setup();
+        uint64_t start = nanoseconds();
+        benchmark->run();
+        uint64_t elapsed = nanoseconds() - start;
+        benchmark->teardown();
+        if (i >= 0)
+            times[i] = elapsed;
+    }
+
+    qsort(times, reps, sizeof(uint64_t), compareTimes);
+    printf("%-20s %10.2f %10.2f %10.2f %10.2f\n", benchmark->name,
+           percentile(times, 0), percentile(times, 0.5),
+           percentile(times, 0.9), percentile(times, 0.99));
+    fflush(stdout);
+    free(times);
+}
+
+static void
+usage()
+{
+    fprintf(stderr, "Usage: benchRuntime [--warmup=N] [--reps=N] "
+                    "[--gc-threads=N] [name...]\n"
+                    "Runs the benchmarks whose name starts with one of the "
+                    "given names, or all.\n");
+    exit(64);
+}
+
+int
+main(int argc, const char* argv[])
+{
+    int arg = 1;
+    for (; arg < argc && strncmp(argv[arg], "--", 2) == 0; arg++) {
+        if (strncmp(argv[arg], "--warmup=", 9) == 0) {
+            warmup = atoi(argv[arg] + 9);
+            if (warmup < 0)
+                usage();
+        } else if (strncmp(argv[arg], "--reps=", 7) == 0) {
+            reps = atoi(argv[arg] + 7);
+            if (reps < 1)
+                usage();
+        } else if (strncmp(argv[arg], "--gc-threads=", 13) == 0) {
+            gcThreads = atoi(argv[arg] + 13);
+            if (gcThreads < 1)
+                usage();
+        } else {
+            usage();
+        }
+    }
+
+    printf("%d operations per run, %d runs after %d warmup, ns per "
+           "operation\n",
+           SIZE, reps, warmup);
+    printf("%-20s %10s %10s %10s %10s\n", "benchmark", "min", "p50", "p90",
+           "p99");
+    int count = sizeof(benchmarks) / sizeof(benchmarks[0]);
+    for (int i = 0; i < count; i++) {
+        bool selected = arg == argc;
+        for (int name = arg; name < argc; name++) {
+            if (strncmp(benchmarks[i].name, argv[name],
+                        strlen(argv[name])) == 0)
+                selected = true;
+        }
+        if (selected)
+            runBenchmark(&benchmarks[i]);
+    }
+
+    return 0;
+}